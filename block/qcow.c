@@ -787,6 +787,11 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
+    if (nb_sectors == 0) {
+        /* end of the image, nothing to finish */
+        return 0;
+    }
+
     if (nb_sectors != s->cluster_sectors) {
         ret = -EINVAL;
 
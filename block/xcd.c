@@ -0,0 +1,663 @@
+/*
+ * Block driver for compressed Xbox disc images (xcd)
+ *
+ * An xcd image is a header, the stored blocks and an index table. Each
+ * block of the disc is either deflated, stored as is when it does not
+ * compress, or not stored at all when it is zero, which is what the
+ * padding regions of an XISO turn into. Images are written sequentially
+ * by "qemu-img convert -c -O xcd" and are read-only afterwards.
+ *
+ * Reads decompress on the thread pool, several blocks in parallel, into
+ * a cache of decompressed blocks, and sequential streams are prefetched
+ * in the background so the guest rarely waits on inflate or the disk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "qemu/module.h"
+#include <zlib.h>
+
+#define XCD_MAGIC (('X' << 24) | ('C' << 16) | ('D' << 8) | 0xfb)
+#define XCD_VERSION 1
+
+/* stored blocks start after the header sector */
+#define XCD_DATA_OFFSET 512
+
+#define XCD_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define XCD_MIN_BLOCK_SIZE 4096
+#define XCD_MAX_BLOCK_SIZE (2 * 1024 * 1024)
+
+/* decompressed blocks kept in memory */
+#define XCD_CACHE_SIZE 64
+/* blocks read ahead of a sequential stream */
+#define XCD_PREFETCH_BLOCKS 16
+
+enum {
+    XCD_BLOCK_ZERO = 0,
+    XCD_BLOCK_RAW = 1,
+    XCD_BLOCK_DEFLATE = 2,
+};
+
+typedef struct XCDHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              /* disc size in bytes */
+    uint32_t block_size;
+    uint32_t n_blocks;
+    uint64_t index_offset;      /* 0 until the image is complete */
+} QEMU_PACKED XCDHeader;
+
+typedef struct XCDIndexEntry {
+    uint64_t offset;
+    uint32_t length;            /* stored bytes */
+    uint32_t type;
+} QEMU_PACKED XCDIndexEntry;
+
+typedef struct XCDCacheEntry {
+    uint32_t block;             /* n_blocks if unused */
+    bool loading;
+    uint64_t lru;
+    uint8_t *data;
+} XCDCacheEntry;
+
+typedef struct BDRVXCDState {
+    uint32_t block_size;
+    uint32_t block_sectors;
+    uint32_t n_blocks;
+    XCDIndexEntry *index;       /* host endian */
+
+    XCDCacheEntry cache[XCD_CACHE_SIZE];
+    uint64_t lru_counter;
+    CoQueue load_queue;         /* readers waiting for a block to load */
+
+    /* sequential stream detection */
+    uint32_t next_block;
+    uint32_t prefetch_block;
+    bool prefetching;
+
+    /* set while qemu-img is writing the image */
+    bool writing;
+    uint64_t write_offset;
+} BDRVXCDState;
+
+/* A batch of blocks decompressing on the thread pool */
+typedef struct XCDBatch {
+    Coroutine *co;
+    int pending;
+    bool waiting;
+} XCDBatch;
+
+typedef struct XCDLoad {
+    XCDBatch *batch;
+    XCDCacheEntry *entry;
+    const uint8_t *in;
+    uint32_t in_len;
+    uint32_t out_len;
+    int ret;
+} XCDLoad;
+
+static int xcd_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    const XCDHeader *header = (const void *)buf;
+
+    if (buf_size >= sizeof(*header) &&
+        be32_to_cpu(header->magic) == XCD_MAGIC &&
+        be32_to_cpu(header->version) == XCD_VERSION) {
+        return 100;
+    }
+    return 0;
+}
+
+static int xcd_open(BlockDriverState *bs, QDict *options, int flags)
+{
+    BDRVXCDState *s = bs->opaque;
+    XCDHeader header;
+    uint64_t index_offset, size;
+    int64_t file_size;
+    uint32_t i;
+    int ret;
+
+    ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    if (be32_to_cpu(header.magic) != XCD_MAGIC ||
+        be32_to_cpu(header.version) != XCD_VERSION) {
+        return -EINVAL;
+    }
+
+    size = be64_to_cpu(header.size);
+    s->block_size = be32_to_cpu(header.block_size);
+    s->n_blocks = be32_to_cpu(header.n_blocks);
+    index_offset = be64_to_cpu(header.index_offset);
+
+    if (s->block_size < XCD_MIN_BLOCK_SIZE ||
+        s->block_size > XCD_MAX_BLOCK_SIZE ||
+        (s->block_size & (s->block_size - 1)) ||
+        s->n_blocks != DIV_ROUND_UP(size, s->block_size) ||
+        s->n_blocks > INT32_MAX / sizeof(XCDIndexEntry)) {
+        return -EINVAL;
+    }
+    s->block_sectors = s->block_size / BDRV_SECTOR_SIZE;
+    bs->total_sectors = size / BDRV_SECTOR_SIZE;
+
+    s->index = g_malloc0(s->n_blocks * sizeof(XCDIndexEntry));
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        ret = file_size;
+        goto fail;
+    }
+
+    if (index_offset == 0) {
+        /* still being written, only qemu-img may open it */
+        if (!(flags & BDRV_O_RDWR)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->writing = true;
+        s->write_offset = MAX(file_size, XCD_DATA_OFFSET);
+    } else {
+        bs->read_only = 1;
+
+        ret = bdrv_pread(bs->file, index_offset, s->index,
+                         s->n_blocks * sizeof(XCDIndexEntry));
+        if (ret < 0) {
+            goto fail;
+        }
+        for (i = 0; i < s->n_blocks; i++) {
+            XCDIndexEntry *e = &s->index[i];
+
+            e->offset = be64_to_cpu(e->offset);
+            e->length = be32_to_cpu(e->length);
+            e->type = be32_to_cpu(e->type);
+
+            if (e->type > XCD_BLOCK_DEFLATE ||
+                (e->type == XCD_BLOCK_RAW && e->length != s->block_size) ||
+                e->length > s->block_size ||
+                e->offset > index_offset ||
+                e->length > index_offset - e->offset) {
+                ret = -EINVAL;
+                goto fail;
+            }
+        }
+    }
+
+    for (i = 0; i < XCD_CACHE_SIZE; i++) {
+        s->cache[i].block = s->n_blocks;
+        s->cache[i].data = qemu_blockalign(bs, s->block_size);
+    }
+    qemu_co_queue_init(&s->load_queue);
+    s->next_block = s->n_blocks;
+    return 0;
+
+fail:
+    g_free(s->index);
+    return ret;
+}
+
+static XCDCacheEntry *xcd_cache_find(BDRVXCDState *s, uint32_t block)
+{
+    int i;
+
+    for (i = 0; i < XCD_CACHE_SIZE; i++) {
+        if (s->cache[i].block == block) {
+            return &s->cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Least recently used entry that is not being loaded, or NULL */
+static XCDCacheEntry *xcd_cache_evict(BDRVXCDState *s)
+{
+    XCDCacheEntry *victim = NULL;
+    int i;
+
+    for (i = 0; i < XCD_CACHE_SIZE; i++) {
+        XCDCacheEntry *e = &s->cache[i];
+
+        if (e->loading) {
+            continue;
+        }
+        if (e->block == s->n_blocks) {
+            return e;
+        }
+        if (!victim || e->lru < victim->lru) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/* Runs on a thread pool worker */
+static int xcd_inflate_worker(void *opaque)
+{
+    XCDLoad *l = opaque;
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -12) != Z_OK) {
+        return -EIO;
+    }
+    strm.next_in = (uint8_t *)l->in;
+    strm.avail_in = l->in_len;
+    strm.next_out = l->entry->data;
+    strm.avail_out = l->out_len;
+
+    ret = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END || strm.total_out != l->out_len) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void xcd_inflate_done(void *opaque, int ret)
+{
+    XCDLoad *l = opaque;
+    XCDBatch *batch = l->batch;
+
+    l->ret = ret;
+    if (--batch->pending == 0 && batch->waiting) {
+        qemu_coroutine_enter(batch->co, NULL);
+    }
+}
+
+/*
+ * Load up to 'count' blocks starting at 'first' into the cache. Blocks
+ * that are zero or already cached are skipped. The stored data of the
+ * batch is read in as few requests as possible and then decompressed
+ * in parallel. Returns -EAGAIN if no cache entry was free for the first
+ * block.
+ */
+static int coroutine_fn xcd_load_blocks(BlockDriverState *bs, uint32_t first,
+                                        uint32_t count)
+{
+    BDRVXCDState *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    XCDLoad loads[XCD_CACHE_SIZE];
+    XCDBatch batch = { .co = qemu_coroutine_self() };
+    uint8_t *in = NULL;
+    uint64_t start = 0, end = 0;
+    bool full = false;
+    int i, n = 0;
+    int ret = 0;
+    uint32_t b;
+
+    for (b = first; b < first + count && b < s->n_blocks &&
+         n < XCD_CACHE_SIZE; b++) {
+        XCDIndexEntry *ie = &s->index[b];
+        XCDCacheEntry *e;
+
+        if (ie->type == XCD_BLOCK_ZERO || xcd_cache_find(s, b)) {
+            continue;
+        }
+        /* only extend the batch while the stored data stays contiguous */
+        if (n && ie->offset != end) {
+            break;
+        }
+        e = xcd_cache_evict(s);
+        if (!e) {
+            full = true;
+            break;
+        }
+        e->block = b;
+        e->loading = true;
+        e->lru = ++s->lru_counter;
+
+        if (!n) {
+            start = ie->offset;
+        }
+        end = ie->offset + ie->length;
+        loads[n++] = (XCDLoad) {
+            .batch = &batch,
+            .entry = e,
+            .in_len = ie->length,
+            .out_len = s->block_size,
+        };
+    }
+    if (!n) {
+        return full ? -EAGAIN : 0;
+    }
+
+    in = qemu_blockalign(bs, end - start);
+    ret = bdrv_pread(bs->file, start, in, end - start);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = 0;
+
+    for (i = 0; i < n; i++) {
+        XCDLoad *l = &loads[i];
+
+        l->in = in + (s->index[l->entry->block].offset - start);
+        if (s->index[l->entry->block].type == XCD_BLOCK_RAW) {
+            memcpy(l->entry->data, l->in, s->block_size);
+        } else {
+            batch.pending++;
+            thread_pool_submit_aio(pool, xcd_inflate_worker, l,
+                                   xcd_inflate_done, l);
+        }
+    }
+    if (batch.pending) {
+        batch.waiting = true;
+        qemu_coroutine_yield();
+    }
+
+out:
+    for (i = 0; i < n; i++) {
+        XCDCacheEntry *e = loads[i].entry;
+
+        e->loading = false;
+        if (ret < 0 || loads[i].ret < 0) {
+            e->block = s->n_blocks;
+            ret = ret < 0 ? ret : loads[i].ret;
+        }
+    }
+    qemu_vfree(in);
+    qemu_co_queue_restart_all(&s->load_queue);
+    return ret;
+}
+
+static void coroutine_fn xcd_prefetch_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVXCDState *s = bs->opaque;
+
+    xcd_load_blocks(bs, s->prefetch_block, XCD_PREFETCH_BLOCKS);
+    s->prefetching = false;
+}
+
+static coroutine_fn int xcd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVXCDState *s = bs->opaque;
+    uint32_t first = sector_num / s->block_sectors;
+    uint32_t last = (sector_num + nb_sectors - 1) / s->block_sectors;
+    bool sequential = first == s->next_block || first + 1 == s->next_block;
+    size_t qiov_offset = 0;
+    uint32_t b;
+    int ret;
+
+    s->next_block = last + 1;
+
+    for (b = first; b <= last; b++) {
+        int64_t block_start = (int64_t)b * s->block_sectors;
+        int64_t from = MAX(sector_num, block_start);
+        int64_t to = MIN(sector_num + nb_sectors,
+                         block_start + s->block_sectors);
+        size_t bytes = (to - from) * BDRV_SECTOR_SIZE;
+        XCDCacheEntry *e;
+
+        if (s->index[b].type == XCD_BLOCK_ZERO) {
+            qemu_iovec_memset(qiov, qiov_offset, 0, bytes);
+            qiov_offset += bytes;
+            continue;
+        }
+
+        while (!(e = xcd_cache_find(s, b)) || e->loading) {
+            if (e) {
+                qemu_co_queue_wait(&s->load_queue);
+                continue;
+            }
+            /* a miss loads the rest of the request in one batch */
+            ret = xcd_load_blocks(bs, b, last - b + 1);
+            if (ret == -EAGAIN) {
+                qemu_co_queue_wait(&s->load_queue);
+            } else if (ret < 0) {
+                return ret;
+            }
+        }
+
+        e->lru = ++s->lru_counter;
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            e->data + (from - block_start) * BDRV_SECTOR_SIZE,
+                            bytes);
+        qiov_offset += bytes;
+    }
+
+    if (sequential && !s->prefetching && s->next_block < s->n_blocks) {
+        Coroutine *co = qemu_coroutine_create(xcd_prefetch_entry);
+
+        s->prefetching = true;
+        s->prefetch_block = s->next_block;
+        qemu_coroutine_enter(co, bs);
+    }
+    return 0;
+}
+
+/* Data only goes in through "qemu-img convert -c", one whole block at a
+ * time; there is no way to rewrite a stored block in place. */
+static coroutine_fn int xcd_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    return -ENOTSUP;
+}
+
+static int xcd_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                const uint8_t *buf, int nb_sectors)
+{
+    BDRVXCDState *s = bs->opaque;
+    XCDIndexEntry *e;
+    uint8_t *out_buf;
+    z_stream strm;
+    uint32_t b, i;
+    int ret, out_len;
+
+    if (!s->writing) {
+        return -EACCES;
+    }
+
+    if (nb_sectors == 0) {
+        /* end of the image, write out the index */
+        uint64_t index_offset = s->write_offset;
+        XCDIndexEntry *index = g_malloc(s->n_blocks * sizeof(*index));
+
+        for (i = 0; i < s->n_blocks; i++) {
+            index[i].offset = cpu_to_be64(s->index[i].offset);
+            index[i].length = cpu_to_be32(s->index[i].length);
+            index[i].type = cpu_to_be32(s->index[i].type);
+        }
+        ret = bdrv_pwrite(bs->file, index_offset, index,
+                          s->n_blocks * sizeof(*index));
+        g_free(index);
+        if (ret < 0) {
+            return ret;
+        }
+        index_offset = cpu_to_be64(index_offset);
+        ret = bdrv_pwrite_sync(bs->file, offsetof(XCDHeader, index_offset),
+                               &index_offset, sizeof(index_offset));
+        if (ret < 0) {
+            return ret;
+        }
+        s->writing = false;
+        return 0;
+    }
+
+    if (sector_num % s->block_sectors) {
+        return -EINVAL;
+    }
+    if (nb_sectors != s->block_sectors) {
+        ret = -EINVAL;
+
+        /* Zero-pad last write if image size is not block aligned */
+        if (sector_num + nb_sectors == bs->total_sectors &&
+            nb_sectors < s->block_sectors) {
+            uint8_t *pad_buf = qemu_blockalign(bs, s->block_size);
+            memset(pad_buf, 0, s->block_size);
+            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+            ret = xcd_write_compressed(bs, sector_num,
+                                       pad_buf, s->block_sectors);
+            qemu_vfree(pad_buf);
+        }
+        return ret;
+    }
+
+    b = sector_num / s->block_sectors;
+    e = &s->index[b];
+    out_buf = g_malloc(s->block_size);
+
+    /* same stream parameters as qcow, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    strm.avail_in = s->block_size;
+    strm.next_in = (uint8_t *)buf;
+    strm.avail_out = s->block_size;
+    strm.next_out = out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - out_buf;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= s->block_size) {
+        /* does not compress, store it as is */
+        e->type = XCD_BLOCK_RAW;
+        e->length = s->block_size;
+        ret = bdrv_pwrite(bs->file, s->write_offset, buf, s->block_size);
+    } else {
+        e->type = XCD_BLOCK_DEFLATE;
+        e->length = out_len;
+        ret = bdrv_pwrite(bs->file, s->write_offset, out_buf, out_len);
+    }
+    if (ret < 0) {
+        e->type = XCD_BLOCK_ZERO;
+        goto fail;
+    }
+    e->offset = s->write_offset;
+    s->write_offset += e->length;
+    ret = 0;
+
+fail:
+    g_free(out_buf);
+    return ret;
+}
+
+static int xcd_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVXCDState *s = bs->opaque;
+    bdi->cluster_size = s->block_size;
+    return 0;
+}
+
+static int xcd_create(const char *filename, QEMUOptionParameter *options)
+{
+    XCDHeader header;
+    BlockDriverState *xcd_bs;
+    uint64_t size = 0;
+    uint32_t block_size = XCD_DEFAULT_BLOCK_SIZE;
+    int ret;
+
+    while (options && options->name) {
+        if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
+            size = options->value.n;
+        } else if (!strcmp(options->name, BLOCK_OPT_CLUSTER_SIZE)) {
+            if (options->value.n) {
+                block_size = options->value.n;
+            }
+        }
+        options++;
+    }
+
+    if (block_size < XCD_MIN_BLOCK_SIZE || block_size > XCD_MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1))) {
+        error_report("xcd: cluster size must be a power of two between "
+                     "%d and %d", XCD_MIN_BLOCK_SIZE, XCD_MAX_BLOCK_SIZE);
+        return -EINVAL;
+    }
+    if (DIV_ROUND_UP(size, block_size) > INT32_MAX / sizeof(XCDIndexEntry)) {
+        return -EFBIG;
+    }
+
+    ret = bdrv_create_file(filename, options);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_file_open(&xcd_bs, filename, NULL, BDRV_O_RDWR);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = cpu_to_be32(XCD_MAGIC);
+    header.version = cpu_to_be32(XCD_VERSION);
+    header.size = cpu_to_be64(size);
+    header.block_size = cpu_to_be32(block_size);
+    header.n_blocks = cpu_to_be32(DIV_ROUND_UP(size, block_size));
+
+    ret = bdrv_truncate(xcd_bs, XCD_DATA_OFFSET);
+    if (ret < 0) {
+        goto exit;
+    }
+    ret = bdrv_pwrite(xcd_bs, 0, &header, sizeof(header));
+    if (ret < 0) {
+        goto exit;
+    }
+    ret = 0;
+
+exit:
+    bdrv_delete(xcd_bs);
+    return ret;
+}
+
+static void xcd_close(BlockDriverState *bs)
+{
+    BDRVXCDState *s = bs->opaque;
+    int i;
+
+    while (s->prefetching) {
+        qemu_aio_wait();
+    }
+    for (i = 0; i < XCD_CACHE_SIZE; i++) {
+        qemu_vfree(s->cache[i].data);
+    }
+    g_free(s->index);
+}
+
+static QEMUOptionParameter xcd_create_options[] = {
+    {
+        .name = BLOCK_OPT_SIZE,
+        .type = OPT_SIZE,
+        .help = "Virtual disk size"
+    },
+    {
+        .name = BLOCK_OPT_CLUSTER_SIZE,
+        .type = OPT_SIZE,
+        .help = "Compression block size",
+        .value = { .n = XCD_DEFAULT_BLOCK_SIZE },
+    },
+    { NULL }
+};
+
+static BlockDriver bdrv_xcd = {
+    .format_name            = "xcd",
+    .instance_size          = sizeof(BDRVXCDState),
+    .bdrv_probe             = xcd_probe,
+    .bdrv_open              = xcd_open,
+    .bdrv_close             = xcd_close,
+    .bdrv_create            = xcd_create,
+    .bdrv_co_readv          = xcd_co_readv,
+    .bdrv_co_writev         = xcd_co_writev,
+    .bdrv_write_compressed  = xcd_write_compressed,
+    .bdrv_get_info          = xcd_get_info,
+    .create_options         = xcd_create_options,
+};
+
+static void bdrv_xcd_init(void)
+{
+    bdrv_register(&bdrv_xcd);
+}
+
+block_init(bdrv_xcd_init);
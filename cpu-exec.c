@@ -22,6 +22,7 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "exec/guest-profile.h"
 
 bool qemu_cpu_has_work(CPUState *cpu)
 {
@@ -143,6 +144,9 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
  not_found:
    /* if no translated code available, then translate it now */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
+    /* the new TB is already at the head of the list, and ptb1 may point
+       into a TB that was evicted to make room for it */
+    goto add_jmp_cache;
 
  found:
     /* Move the last found TB to the head of the list */
@@ -151,6 +155,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
         tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
     }
+ add_jmp_cache:
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
@@ -174,6 +179,30 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Called from translated code that ends in an indirect jump.  Returns
+   the host code of the TB for the current CPU state if it is in the
+   jump cache, otherwise the epilogue, which returns to cpu_exec() to
+   look the TB up properly (and translate it if needed).  The jump cache
+   only holds valid TBs, since tb_phys_invalidate() and tb_flush() clear
+   their entries.  Interrupts and exit requests are still seen, as every
+   TB checks tcg_exit_req on entry.  */
+void *tb_lookup_code_ptr(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    tcg_ctx.tb_ctx.tb_indirect_lookups++;
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    tcg_ctx.tb_ctx.tb_indirect_hits++;
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -263,6 +292,7 @@ int cpu_exec(CPUArchState *env)
 #error unsupported target CPU
 #endif
     env->exception_index = -1;
+    guest_profile_cpu_exec(env);
 
     /* prepare setjmp context for exception handling */
     for(;;) {
@@ -597,6 +627,7 @@ int cpu_exec(CPUArchState *env)
 #endif /* DEBUG_DISAS */
                 spin_lock(&tcg_ctx.tb_ctx.tb_lock);
                 tb = tb_find_fast(env);
+                tcg_ctx.tb_ctx.tb_exec_lookups++;
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tcg_ctx.tb_ctx.tb_invalidated_flag) {
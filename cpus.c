@@ -37,6 +37,7 @@
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "exec/guest-profile.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -602,6 +603,8 @@ static void qemu_tcg_init_cpu_signals(void)
     sigemptyset(&set);
     sigaddset(&set, SIG_IPI);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    guest_profile_init_thread();
 }
 
 #else /* _WIN32 */
@@ -630,6 +633,67 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Who takes the global mutex, and for how long.  Everything below is
+ * only written by the thread holding the mutex.  */
+enum {
+    BQL_DEVICE,
+    BQL_IOTHREAD,
+    BQL_VCPU,
+    BQL_NUM
+};
+
+typedef struct BQLStats {
+    uint64_t acquired;
+    uint64_t contended;
+    int64_t wait_ns;
+    int64_t hold_ns;
+} BQLStats;
+
+static BQLStats bql_stats[BQL_NUM];
+static QemuThread bql_holder;
+static bool bql_held;
+static int bql_holder_class;
+static int64_t bql_acquired_at;
+
+static void bql_acquired(int64_t wait_start)
+{
+    int64_t now = get_clock();
+    BQLStats *s;
+
+    qemu_thread_get_self(&bql_holder);
+    bql_held = true;
+    if (qemu_thread_is_self(&io_thread)) {
+        bql_holder_class = BQL_IOTHREAD;
+    } else if (qemu_in_vcpu_thread() ||
+               (tcg_enabled() && first_cpu && first_cpu->thread &&
+                qemu_thread_is_self(first_cpu->thread))) {
+        bql_holder_class = BQL_VCPU;
+    } else {
+        bql_holder_class = BQL_DEVICE;
+    }
+
+    s = &bql_stats[bql_holder_class];
+    s->acquired++;
+    if (wait_start) {
+        s->contended++;
+        s->wait_ns += now - wait_start;
+    }
+    bql_acquired_at = now;
+}
+
+static void bql_releasing(void)
+{
+    bql_stats[bql_holder_class].hold_ns += get_clock() - bql_acquired_at;
+    bql_held = false;
+}
+
+static void qemu_cond_wait_iothread(QemuCond *cond)
+{
+    bql_releasing();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    bql_acquired(0);
+}
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -667,7 +731,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     while (!wi.done) {
         CPUState *self_cpu = current_cpu;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_work_cond);
         current_cpu = self_cpu;
     }
 }
@@ -736,11 +800,11 @@ static void qemu_tcg_wait_io_event(void)
        /* Start accounting real time to the virtual clock if the CPUs
           are idle.  */
         qemu_clock_warp(vm_clock);
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(tcg_halt_cond);
     }
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_io_proceeded_cond);
     }
 
     for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
@@ -751,7 +815,7 @@ static void qemu_tcg_wait_io_event(void)
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
 
     qemu_kvm_eat_signals(cpu);
@@ -767,6 +831,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     current_cpu = cpu;
+    bql_acquired(0);
 
     r = kvm_init_vcpu(cpu);
     if (r < 0) {
@@ -851,12 +916,13 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    bql_acquired(0);
     qemu_for_each_cpu(tcg_signal_cpu_creation, NULL);
     qemu_cond_signal(&qemu_cpu_cond);
 
     /* wait for initial kick-off after machine start */
     while (first_cpu->stopped) {
-        qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(tcg_halt_cond);
 
         /* process any pending work */
         for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
@@ -942,31 +1008,87 @@ bool qemu_cpu_is_self(CPUState *cpu)
     return qemu_thread_is_self(cpu->thread);
 }
 
-static bool qemu_in_vcpu_thread(void)
+bool qemu_in_vcpu_thread(void)
 {
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
-        qemu_mutex_lock(&qemu_global_mutex);
+    int64_t wait_start = 0;
+
+    if (!tcg_enabled() || qemu_in_vcpu_thread()) {
+        /* the TCG thread retaking the lock after a lockless MMIO access
+         * must not kick itself out of the translation block */
+        if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
+            qemu_mutex_lock(&qemu_global_mutex);
+        }
     } else {
         iothread_requesting_mutex = true;
         if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
             qemu_cpu_kick_thread(first_cpu);
             qemu_mutex_lock(&qemu_global_mutex);
         }
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    bql_acquired(wait_start);
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    bql_releasing();
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return bql_held && qemu_thread_is_self(&bql_holder);
+}
+
+void dump_bql_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    static const char *const names[BQL_NUM] = {
+        [BQL_DEVICE] = "device threads",
+        [BQL_IOTHREAD] = "main loop",
+        [BQL_VCPU] = "vCPU threads",
+    };
+    static int64_t last_time;
+    static BQLStats last[BQL_NUM];
+    int64_t now = get_clock();
+    double secs = last_time ? (now - last_time) / 1e9 : 0;
+    int i;
+
+    cpu_fprintf(f, "%-16s %12s %12s %12s %14s\n", "holder", "acquired",
+                "contended", "wait ms", "hold ms");
+    for (i = 0; i < BQL_NUM; i++) {
+        BQLStats *s = &bql_stats[i];
+        cpu_fprintf(f, "%-16s %12" PRIu64 " %12" PRIu64 " %12" PRId64
+                    " %14" PRId64 "\n", names[i], s->acquired, s->contended,
+                    s->wait_ns / SCALE_MS, s->hold_ns / SCALE_MS);
+    }
+
+    /* The interval view is what to compare between runs, e.g. with and
+     * without nv2a's lockless-mmio; the totals include boot.  */
+    if (secs > 0) {
+        cpu_fprintf(f, "\nover the last %.1f s:\n", secs);
+        cpu_fprintf(f, "%-16s %12s %12s %12s %14s\n", "holder", "acquired/s",
+                    "contended/s", "wait %", "hold %");
+        for (i = 0; i < BQL_NUM; i++) {
+            BQLStats *s = &bql_stats[i];
+            cpu_fprintf(f, "%-16s %12.0f %12.0f %12.1f %14.1f\n", names[i],
+                        (s->acquired - last[i].acquired) / secs,
+                        (s->contended - last[i].contended) / secs,
+                        (s->wait_ns - last[i].wait_ns) / (secs * 1e7),
+                        (s->hold_ns - last[i].hold_ns) / (secs * 1e7));
+        }
+    }
+    last_time = now;
+    memcpy(last, bql_stats, sizeof(last));
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu = first_cpu;
@@ -1006,7 +1128,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_pause_cond);
         cpu = first_cpu;
         while (cpu) {
             qemu_cpu_kick(cpu);
@@ -1047,7 +1169,7 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_cond_wait_iothread(&qemu_cpu_cond);
         }
         tcg_cpu_thread = cpu->thread;
     } else {
@@ -1064,7 +1186,7 @@ static void qemu_kvm_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, qemu_kvm_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1076,7 +1198,7 @@ static void qemu_dummy_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, qemu_dummy_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -26,6 +26,7 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "qemu/atomic.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -71,12 +72,25 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
+    env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
+
+    env->tlb_stats.flushes++;
+    env->tlb_stats.last_flush_misses = env->tlb_stats.misses -
+                                       env->tlb_stats.misses_at_flush;
+    env->tlb_stats.misses_at_flush = env->tlb_stats.misses;
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -120,16 +134,25 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
     }
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+
     tb_flush_jmp_cache(env, addr);
+    env->tlb_stats.page_flushes++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
 {
-    cpu_physical_memory_reset_dirty(ram_addr,
-                                    ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+    cpu_physical_memory_reset_dirty(ram_addr, TARGET_PAGE_SIZE,
+                                    DIRTY_MEMORY_CODE);
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -137,7 +160,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 void tlb_unprotect_code_phys(CPUArchState *env, ram_addr_t ram_addr,
                              target_ulong vaddr)
 {
-    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
@@ -145,15 +168,22 @@ static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
     return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
 }
 
+/* Dirty bits can be cleared from device threads (e.g. the NV2A puller)
+   without the iothread lock, while the vCPU refills its TLB.  Only flag
+   the entry if it still holds the mapping we looked at.  The vCPU may
+   still store an entry without TLB_NOTDIRTY after we looked; it then
+   sees the cleared bit in tlb_recheck_dirty and flags the entry itself.  */
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
+    target_ulong addr_write = atomic_read(&tlb_entry->addr_write);
     uintptr_t addr;
 
-    if (tlb_is_dirty_ram(tlb_entry)) {
-        addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
+    if ((addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0) {
+        addr = (addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            atomic_cmpxchg(&tlb_entry->addr_write, addr_write,
+                           addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -200,14 +230,42 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
+        }
+    }
+}
+
+/* Called by the vCPU after storing an entry that may allow direct writes;
+   iotlb is the matching iotlb value.  If a device thread cleared the
+   page's dirty bits before the store became visible it may have missed
+   the entry, so look at the bitmap again and put TLB_NOTDIRTY back.
+   The barrier pairs with the atomic clear of the bitmap in
+   cpu_physical_memory_test_and_clear_dirty.  */
+static void tlb_recheck_dirty(CPUTLBEntry *tlb_entry, hwaddr iotlb)
+{
+    target_ulong addr_write;
+    ram_addr_t ram_addr;
+
+    smp_mb();
+    addr_write = atomic_read(&tlb_entry->addr_write);
+    if ((addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0) {
+        ram_addr = (iotlb + (addr_write & TARGET_PAGE_MASK)) & TARGET_PAGE_MASK;
+        if (!cpu_physical_memory_is_dirty(ram_addr)) {
+            atomic_cmpxchg(&tlb_entry->addr_write, addr_write,
+                           addr_write | TLB_NOTDIRTY);
         }
     }
 }
 
-static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
+static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, hwaddr iotlb,
+                                  target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
+    if (atomic_cmpxchg(&tlb_entry->addr_write, vaddr | TLB_NOTDIRTY,
+                       vaddr) == (vaddr | TLB_NOTDIRTY)) {
+        tlb_recheck_dirty(tlb_entry, iotlb);
     }
 }
 
@@ -221,7 +279,94 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(&env->tlb_table[mmu_idx][i],
+                       env->iotlb[mmu_idx][i], vaddr);
+    }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k],
+                           env->iotlb_v[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+/* Called on a miss in the direct mapped table, before tlb_fill().  If the
+   page is in the victim tlb, swap it with the entry at 'index' and return
+   true.  access_type is 0 for loads, 1 for stores and 2 for code.  */
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    int access_type, target_ulong addr)
+{
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int vidx;
+
+    env->tlb_stats.misses++;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *ve = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp;
+
+        switch (access_type) {
+        case 0:
+            cmp = ve->addr_read;
+            break;
+        case 1:
+            cmp = ve->addr_write;
+            break;
+        default:
+            cmp = ve->addr_code;
+            break;
+        }
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry tmptlb = env->tlb_table[mmu_idx][index];
+            hwaddr tmpiotlb = env->iotlb[mmu_idx][index];
+
+            env->tlb_table[mmu_idx][index] = *ve;
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            *ve = tmptlb;
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+            tlb_recheck_dirty(&env->tlb_table[mmu_idx][index],
+                              env->iotlb[mmu_idx][index]);
+            tlb_recheck_dirty(ve, tmpiotlb);
+            env->tlb_stats.victim_hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void dump_tlb_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+
+    cpu_fprintf(f, "TLB: %d entries, %d victim entries, %d MMU modes\n",
+                CPU_TLB_SIZE, CPU_VTLB_SIZE, NB_MMU_MODES);
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        CPUArchState *env = cpu->env_ptr;
+        CPUTLBStats *st = &env->tlb_stats;
+
+        cpu_fprintf(f, "CPU #%d:\n", cpu->cpu_index);
+        cpu_fprintf(f, "  misses              %" PRIu64 "\n", st->misses);
+        cpu_fprintf(f, "  victim tlb hits     %" PRIu64 " (%d%%)\n",
+                    st->victim_hits,
+                    st->misses ? (int)(st->victim_hits * 100 / st->misses)
+                               : 0);
+        cpu_fprintf(f, "  page walks          %" PRIu64 "\n",
+                    st->misses - st->victim_hits);
+        cpu_fprintf(f, "  full flushes        %" PRIu64 "\n", st->flushes);
+        cpu_fprintf(f, "  page flushes        %" PRIu64 "\n",
+                    st->page_flushes);
+        cpu_fprintf(f, "  misses since flush  %" PRIu64 "\n",
+                    st->misses - st->misses_at_flush);
+        cpu_fprintf(f, "  misses last period  %" PRIu64 "\n",
+                    st->last_flush_misses);
     }
 }
 
@@ -294,8 +439,19 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             prot, &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* do not discard the translation in te, evict it into the victim tlb */
+    if (!tlb_entry_is_empty(te)) {
+        unsigned int vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+        tlb_recheck_dirty(&env->tlb_v_table[mmu_idx][vidx],
+                          env->iotlb_v[mmu_idx][vidx]);
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -322,6 +478,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+    tlb_recheck_dirty(te, env->iotlb[mmu_idx][index]);
 }
 
 /* NOTE: this function can trigger an exception */
@@ -0,0 +1,489 @@
+/*
+ * Guest hot-spot profiler
+ *
+ * Samples the TCG thread at a fixed interval of its CPU time and
+ * attributes each sample to the TB it was executing, which gives a
+ * histogram of guest code addresses for each vCPU.  The hottest blocks
+ * are retranslated with an execution counter.  Host perf can attribute
+ * generated code through a perf map file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <signal.h>
+#include <time.h>
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+#include "exec/guest-profile.h"
+
+#if defined(CONFIG_LINUX) && defined(CONFIG_SIGEV_THREAD_ID)
+#define GUEST_PROFILE_SAMPLING
+#include <ucontext.h>
+#endif
+
+#define GUEST_PROFILE_SLOTS     4096    /* histogram entries per vCPU */
+#define GUEST_PROFILE_PROBES    16
+#define GUEST_PROFILE_HOT       32      /* blocks with an execution counter */
+#define GUEST_PROFILE_INTERVAL  1000    /* default, in microseconds */
+
+typedef struct GuestProfileSlot {
+    uint64_t pc;            /* guest pc + 1, 0 when free */
+    uint64_t samples;
+    uint64_t ns;            /* host CPU time */
+} GuestProfileSlot;
+
+/* Only written by the signal handler, on the TCG thread while it is in
+ * cpu_exec.  The monitor reads it with the BQL held, so the TCG thread
+ * is outside cpu_exec then and the handler leaves it alone. */
+typedef struct GuestProfileCPU {
+    GuestProfileSlot slots[GUEST_PROFILE_SLOTS];
+    uint64_t samples;
+    uint64_t ns;
+    uint64_t other_samples; /* outside translated code */
+} GuestProfileCPU;
+
+static struct {
+    bool running;
+    GuestProfileCPU **cpus; /* by cpu_index */
+    int nb_cpus;
+    int64_t last_ns;        /* thread CPU time at the previous sample */
+#ifdef GUEST_PROFILE_SAMPLING
+    timer_t timer;
+#endif
+    QEMUTimer *tick;
+    /* to convert host CPU time to cycles */
+    int64_t start_ticks, start_clock;
+    int64_t stop_ticks, stop_clock;
+    struct {
+        target_ulong pc;
+        uint64_t count;
+    } hot[GUEST_PROFILE_HOT];
+    int nb_hot;
+    FILE *perf_map;
+    GuestProfileSymbolizer *symbolizer;
+} guest_profile;
+
+bool guest_profile_flush_pending;
+
+void guest_profile_set_symbolizer(GuestProfileSymbolizer *fn)
+{
+    guest_profile.symbolizer = fn;
+}
+
+uint64_t *guest_profile_exec_counter(target_ulong pc)
+{
+    int i;
+
+    if (!guest_profile.running) {
+        return NULL;
+    }
+    for (i = 0; i < guest_profile.nb_hot; i++) {
+        if (guest_profile.hot[i].pc == pc) {
+            return &guest_profile.hot[i].count;
+        }
+    }
+    return NULL;
+}
+
+void guest_profile_tb_generated(TranslationBlock *tb, int code_size)
+{
+    if (guest_profile.perf_map) {
+        fprintf(guest_profile.perf_map, "%" PRIxPTR " %x guest-"
+                TARGET_FMT_lx "\n", (uintptr_t)tb->tc_ptr, code_size, tb->pc);
+    }
+}
+
+#ifdef GUEST_PROFILE_SAMPLING
+
+static uintptr_t guest_profile_host_pc(void *ctx)
+{
+    ucontext_t *uc = ctx;
+
+#if defined(__x86_64__)
+    return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+    return uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+    return uc->uc_mcontext.pc;
+#elif defined(__arm__)
+    return uc->uc_mcontext.arm_pc;
+#else
+    /* everything counts as outside translated code */
+    return 0;
+#endif
+}
+
+static void guest_profile_add(GuestProfileCPU *p, target_ulong pc, int64_t ns)
+{
+    uint64_t key = (uint64_t)pc + 1;
+    unsigned int h = (pc >> 2) * 2654435761u;
+    int i;
+
+    for (i = 0; i < GUEST_PROFILE_PROBES; i++) {
+        GuestProfileSlot *s = &p->slots[(h + i) & (GUEST_PROFILE_SLOTS - 1)];
+        if (s->pc == 0) {
+            s->pc = key;
+        }
+        if (s->pc == key) {
+            s->samples++;
+            s->ns += ns;
+            return;
+        }
+    }
+    /* histogram full around this pc; the sample only counts in the total */
+}
+
+static void guest_profile_sample(int sig, siginfo_t *info, void *ctx)
+{
+    CPUState *cpu = current_cpu;
+    GuestProfileCPU *p;
+    TranslationBlock *tb;
+    struct timespec ts;
+    int64_t now, ns;
+
+    if (!guest_profile.running) {
+        return;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    ns = guest_profile.last_ns ? now - guest_profile.last_ns : 0;
+    guest_profile.last_ns = now;
+
+    if (!cpu || cpu->cpu_index >= guest_profile.nb_cpus) {
+        return;
+    }
+    p = guest_profile.cpus[cpu->cpu_index];
+    p->samples++;
+    p->ns += ns;
+
+    /* The handler runs on the TCG thread, so when it interrupted
+     * generated code nothing is changing the TB array under it. */
+    tb = tb_find_pc(guest_profile_host_pc(ctx));
+    if (!tb) {
+        p->other_samples++;
+        return;
+    }
+    guest_profile_add(p, tb->pc, ns);
+}
+
+void guest_profile_init_thread(void)
+{
+    struct sigaction sigact;
+    sigset_t set;
+
+    memset(&sigact, 0, sizeof(sigact));
+    sigact.sa_sigaction = guest_profile_sample;
+    sigact.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigaction(SIGPROF, &sigact, NULL);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+static bool guest_profile_timer_start(int64_t interval, Error **errp)
+{
+    CPUState *cpu = first_cpu;
+    struct itimerspec its;
+    struct sigevent ev;
+    clockid_t clock;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "The guest profiler needs TCG");
+        return false;
+    }
+    /* all TCG vCPUs run on one thread, sample its CPU time */
+    if (!cpu || !cpu->thread ||
+        pthread_getcpuclockid(cpu->thread->thread, &clock)) {
+        error_setg(errp, "No vCPU thread to sample");
+        return false;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev._sigev_un._tid = cpu->thread_id;
+    ev.sigev_signo = SIGPROF;
+    if (timer_create(clock, &ev, &guest_profile.timer)) {
+        error_setg_errno(errp, errno, "Could not create the sampling timer");
+        return false;
+    }
+
+    its.it_interval.tv_sec = interval / 1000000;
+    its.it_interval.tv_nsec = (interval % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    if (timer_settime(guest_profile.timer, 0, &its, NULL)) {
+        error_setg_errno(errp, errno, "Could not start the sampling timer");
+        timer_delete(guest_profile.timer);
+        return false;
+    }
+    return true;
+}
+
+static void guest_profile_timer_stop(void)
+{
+    timer_delete(guest_profile.timer);
+}
+
+#else
+
+void guest_profile_init_thread(void)
+{
+}
+
+static bool guest_profile_timer_start(int64_t interval, Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return false;
+}
+
+static void guest_profile_timer_stop(void)
+{
+}
+
+#endif
+
+static int guest_profile_cmp_pc(const void *a, const void *b)
+{
+    const GuestProfileSlot *sa = a, *sb = b;
+
+    return sa->pc < sb->pc ? -1 : sa->pc > sb->pc;
+}
+
+static int guest_profile_cmp_samples(const void *a, const void *b)
+{
+    const GuestProfileSlot *sa = a, *sb = b;
+
+    return sa->samples > sb->samples ? -1 : sa->samples < sb->samples;
+}
+
+/* Merge the histograms of all vCPUs, hottest first */
+static GuestProfileSlot *guest_profile_collect(int *count)
+{
+    GuestProfileSlot *all;
+    int i, j, n = 0;
+
+    all = g_new(GuestProfileSlot, guest_profile.nb_cpus * GUEST_PROFILE_SLOTS);
+    for (i = 0; i < guest_profile.nb_cpus; i++) {
+        for (j = 0; j < GUEST_PROFILE_SLOTS; j++) {
+            if (guest_profile.cpus[i]->slots[j].pc) {
+                all[n++] = guest_profile.cpus[i]->slots[j];
+            }
+        }
+    }
+
+    qsort(all, n, sizeof(*all), guest_profile_cmp_pc);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && all[j - 1].pc == all[i].pc) {
+            all[j - 1].samples += all[i].samples;
+            all[j - 1].ns += all[i].ns;
+        } else {
+            all[j++] = all[i];
+        }
+    }
+    qsort(all, j, sizeof(*all), guest_profile_cmp_samples);
+
+    *count = j;
+    return all;
+}
+
+/* Give the hottest blocks an execution counter.  The set only grows, so
+ * TBs are retranslated a few times at the start of a profile at most. */
+static void guest_profile_tick(void *opaque)
+{
+    GuestProfileSlot *all;
+    bool changed = false;
+    int i, j, n;
+
+    all = guest_profile_collect(&n);
+    for (i = 0; i < n && guest_profile.nb_hot < GUEST_PROFILE_HOT; i++) {
+        target_ulong pc = all[i].pc - 1;
+        for (j = 0; j < guest_profile.nb_hot; j++) {
+            if (guest_profile.hot[j].pc == pc) {
+                break;
+            }
+        }
+        if (j == guest_profile.nb_hot) {
+            guest_profile.hot[j].pc = pc;
+            guest_profile.hot[j].count = 0;
+            guest_profile.nb_hot++;
+            changed = true;
+        }
+    }
+    g_free(all);
+
+    if (changed) {
+        guest_profile_flush_pending = true;
+    }
+    qemu_mod_timer(guest_profile.tick, qemu_get_clock_ms(rt_clock) + 1000);
+}
+
+static void guest_profile_open_perf_map(void)
+{
+    TBContext *tb_ctx = &tcg_ctx.tb_ctx;
+    char *filename;
+    uint8_t *end;
+    int i, j;
+
+    /* the file name perf looks for */
+    filename = g_strdup_printf("/tmp/perf-%d.map", getpid());
+    guest_profile.perf_map = fopen(filename, "a");
+    g_free(filename);
+    if (!guest_profile.perf_map) {
+        return;
+    }
+    for (i = 0; i < tb_ctx->nb_regions; i++) {
+        TBRegion *r = &tb_ctx->regions[i];
+        TranslationBlock *tbs = &tb_ctx->tbs[r->first_tb];
+
+        for (j = 0; j < r->nb_tbs; j++) {
+            if (tbs[j].invalid) {
+                continue;
+            }
+            end = j + 1 < r->nb_tbs ? tbs[j + 1].tc_ptr : r->ptr;
+            guest_profile_tb_generated(&tbs[j], end - tbs[j].tc_ptr);
+        }
+    }
+}
+
+void qmp_guest_profile_start(bool has_interval, int64_t interval,
+                             bool has_perf_map, bool perf_map, Error **errp)
+{
+    CPUState *cpu;
+    int i;
+
+    if (guest_profile.running) {
+        error_setg(errp, "The guest profiler is already running");
+        return;
+    }
+    if (!has_interval) {
+        interval = GUEST_PROFILE_INTERVAL;
+    }
+    if (interval < 10 || interval > 1000000) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
+                  "between 10 and 1000000 microseconds");
+        return;
+    }
+
+    for (i = 0; i < guest_profile.nb_cpus; i++) {
+        g_free(guest_profile.cpus[i]);
+    }
+    g_free(guest_profile.cpus);
+    guest_profile.nb_cpus = 0;
+    for (cpu = first_cpu; cpu; cpu = cpu->next_cpu) {
+        guest_profile.nb_cpus = MAX(guest_profile.nb_cpus, cpu->cpu_index + 1);
+    }
+    guest_profile.cpus = g_new(GuestProfileCPU *, guest_profile.nb_cpus);
+    for (i = 0; i < guest_profile.nb_cpus; i++) {
+        guest_profile.cpus[i] = g_new0(GuestProfileCPU, 1);
+    }
+    guest_profile.nb_hot = 0;
+    guest_profile.last_ns = 0;
+
+    if (!guest_profile_timer_start(interval, errp)) {
+        return;
+    }
+    guest_profile.start_ticks = cpu_get_real_ticks();
+    guest_profile.start_clock = get_clock();
+    guest_profile.running = true;
+
+    if (has_perf_map && perf_map) {
+        guest_profile_open_perf_map();
+    }
+    if (!guest_profile.tick) {
+        guest_profile.tick = qemu_new_timer_ms(rt_clock, guest_profile_tick,
+                                               NULL);
+    }
+    qemu_mod_timer(guest_profile.tick, qemu_get_clock_ms(rt_clock) + 1000);
+}
+
+void qmp_guest_profile_stop(Error **errp)
+{
+    if (!guest_profile.running) {
+        error_setg(errp, "The guest profiler is not running");
+        return;
+    }
+    guest_profile_timer_stop();
+    qemu_del_timer(guest_profile.tick);
+    guest_profile.running = false;
+    guest_profile.stop_ticks = cpu_get_real_ticks();
+    guest_profile.stop_clock = get_clock();
+    if (guest_profile.perf_map) {
+        fclose(guest_profile.perf_map);
+        guest_profile.perf_map = NULL;
+    }
+    /* drop the execution counters from the generated code */
+    if (guest_profile.nb_hot) {
+        guest_profile_flush_pending = true;
+    }
+}
+
+GuestProfileInfo *qmp_query_guest_profile(bool has_count, int64_t count,
+                                          Error **errp)
+{
+    GuestProfileInfo *info = g_new0(GuestProfileInfo, 1);
+    GuestProfileEntryList **tail = &info->entries;
+    GuestProfileSlot *all;
+    int64_t ticks, clock;
+    double cycles_per_ns;
+    uint64_t ns = 0;
+    int i, j, n;
+
+    if (!has_count) {
+        count = 20;
+    }
+    info->running = guest_profile.running;
+
+    if (guest_profile.running) {
+        ticks = cpu_get_real_ticks();
+        clock = get_clock();
+    } else {
+        ticks = guest_profile.stop_ticks;
+        clock = guest_profile.stop_clock;
+    }
+    cycles_per_ns = clock > guest_profile.start_clock ?
+        (double)(ticks - guest_profile.start_ticks) /
+        (clock - guest_profile.start_clock) : 0;
+
+    for (i = 0; i < guest_profile.nb_cpus; i++) {
+        GuestProfileCPU *p = guest_profile.cpus[i];
+        info->samples += p->samples;
+        info->jit_samples += p->samples - p->other_samples;
+        ns += p->ns;
+    }
+    info->cycles = ns * cycles_per_ns;
+
+    all = guest_profile_collect(&n);
+    for (i = 0; i < n && i < count; i++) {
+        GuestProfileEntryList *entry = g_new0(GuestProfileEntryList, 1);
+        GuestProfileEntry *e = g_new0(GuestProfileEntry, 1);
+        target_ulong pc = all[i].pc - 1;
+
+        e->address = pc;
+        e->samples = all[i].samples;
+        e->cycles = all[i].ns * cycles_per_ns;
+        for (j = 0; j < guest_profile.nb_hot; j++) {
+            if (guest_profile.hot[j].pc == pc) {
+                e->has_executions = true;
+                e->executions = guest_profile.hot[j].count;
+            }
+        }
+        if (guest_profile.symbolizer && first_cpu) {
+            e->symbol = guest_profile.symbolizer(first_cpu, pc);
+            e->has_symbol = e->symbol != NULL;
+        }
+        entry->value = e;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    g_free(all);
+
+    return info;
+}
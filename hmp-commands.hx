@@ -581,6 +581,55 @@ STEXI
 @findex system_reset
 
 Reset the system.
+ETEXI
+
+    {
+        .name       = "xbox_hdd_reset",
+        .args_type  = "",
+        .params     = "",
+        .help       = "discard the Xbox HDD overlay and reset the system",
+        .mhandler.cmd = hmp_xbox_hdd_reset,
+    },
+
+STEXI
+@item xbox_hdd_reset
+@findex xbox_hdd_reset
+
+Discard everything written to the Xbox HDD overlay and reset the system.
+ETEXI
+
+    {
+        .name       = "guest_profile_start",
+        .args_type  = "perf-map:-p,interval:i?",
+        .params     = "[-p] [interval]",
+        .help       = "start sampling where the guest spends host time; "
+                      "-p writes a perf map for host perf",
+        .mhandler.cmd = hmp_guest_profile_start,
+    },
+
+STEXI
+@item guest_profile_start [-p] [@var{interval}]
+@findex guest_profile_start
+
+Start the guest hot-spot profiler, sampling every @var{interval}
+microseconds of vCPU thread CPU time (1000 by default). With @code{-p},
+also write @file{/tmp/perf-<pid>.map} so that host @command{perf} can
+attribute translated code. See @code{info guest-profile}.
+ETEXI
+
+    {
+        .name       = "guest_profile_stop",
+        .args_type  = "",
+        .params     = "",
+        .help       = "stop the guest hot-spot profiler",
+        .mhandler.cmd = hmp_guest_profile_stop,
+    },
+
+STEXI
+@item guest_profile_stop
+@findex guest_profile_stop
+
+Stop the guest hot-spot profiler. The profile can still be shown.
 ETEXI
 
     {
@@ -1628,7 +1677,20 @@ show virtual to physical memory mappings (i386, SH4, SPARC, PPC, and Xtensa only
 @item info mem
 show the active virtual memory mappings (i386 only)
 @item info jit
-show dynamic compiler info
+show dynamic compiler info: code buffer fill level per region, flush and
+eviction counts and time spent translating, and the rate of TB lookups in
+@code{cpu_exec} since the last @code{info jit}, also as it would be without
+inline lookup of indirect jump targets.  The first @code{info jit} only
+records the starting point for that rate.
+@item info tlb-stats
+show softmmu TLB miss, victim TLB hit and flush counts for each CPU
+@item info smc
+show how many writes to code pages invalidated code, their rate since the
+last @code{info smc}, and the guest code doing the writes
+@item info bql
+show how often the main loop, vCPU and device threads took the global
+mutex, how long they waited for it and how long they held it, in total and
+as rates over the interval since the last @code{info bql}
 @item info numa
 show NUMA information
 @item info kvm
@@ -1675,6 +1737,12 @@ show qdev device model list
 show roms
 @item info tpm
 show the TPM device
+@item info nv2a
+show NV2A graphics statistics
+@item info apu
+show MCPX APU voice processor statistics
+@item info guest-profile [@var{count}]
+show the hottest blocks of guest code found by the guest profiler
 @end table
 ETEXI
 
@@ -697,6 +697,107 @@ void hmp_info_tpm(Monitor *mon, const QDict *qdict)
     qapi_free_TPMInfoList(info_list);
 }
 
+static void hmp_info_nv2a_entry(Monitor *mon, const char *name,
+                                const NV2AStatsEntry *e)
+{
+    monitor_printf(mon, "%s:\n", name);
+    monitor_printf(mon, "  methods=%" PRId64 " pushed_words=%" PRId64
+                   " draws=%" PRId64 "\n",
+                   e->methods, e->pushed_words, e->draws);
+    monitor_printf(mon, "  texture_uploads=%" PRId64
+                   " shader_compiles=%" PRId64 "\n",
+                   e->texture_uploads, e->shader_compiles);
+    monitor_printf(mon, "  surface_uploads=%" PRId64
+                   " surface_downloads=%" PRId64
+                   " cache1_stalls=%" PRId64 "\n",
+                   e->surface_uploads, e->surface_downloads,
+                   e->cache1_stalls);
+    monitor_printf(mon, "  gl=%.3f ms\n", e->gl_ms);
+}
+
+void hmp_info_nv2a(Monitor *mon, const QDict *qdict)
+{
+    NV2AStatsInfo *info;
+    Error *err = NULL;
+
+    info = qmp_query_nv2a_stats(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "frames: %" PRId64 "\n", info->frames);
+    hmp_info_nv2a_entry(mon, "last frame", info->last_frame);
+    hmp_info_nv2a_entry(mon, "total", info->total);
+
+    qapi_free_NV2AStatsInfo(info);
+}
+
+void hmp_info_apu(Monitor *mon, const QDict *qdict)
+{
+    MCPXAPUStatsInfo *info;
+    Error *err = NULL;
+
+    info = qmp_query_mcpx_apu_stats(&err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "frames: %" PRId64 " late_frames: %" PRId64
+                   " underruns: %" PRId64 "\n",
+                   info->frames, info->late_frames, info->underruns);
+    monitor_printf(mon, "apu thread load: %.1f%%\n", info->thread_load);
+    monitor_printf(mon, "last frame: voices=%" PRId64 " dsp=%.3f ms\n",
+                   info->voices, info->dsp_ms);
+    monitor_printf(mon, "total: voices=%" PRId64 " dsp=%.3f ms\n",
+                   info->total_voices, info->total_dsp_ms);
+
+    qapi_free_MCPXAPUStatsInfo(info);
+}
+
+void hmp_info_guest_profile(Monitor *mon, const QDict *qdict)
+{
+    GuestProfileInfo *info;
+    GuestProfileEntryList *entry;
+    Error *err = NULL;
+    int count = qdict_get_try_int(qdict, "count", 20);
+
+    info = qmp_query_guest_profile(true, count, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    monitor_printf(mon, "profiler %s, %" PRId64 " samples (%" PRId64
+                   " in translated code), ~%" PRId64 " host cycles\n",
+                   info->running ? "running" : "stopped", info->samples,
+                   info->jit_samples, info->cycles);
+    if (info->entries) {
+        monitor_printf(mon, "%-18s %10s %6s %16s %12s  %s\n", "address",
+                       "samples", "%", "host cycles", "executions",
+                       "symbol");
+    }
+    for (entry = info->entries; entry; entry = entry->next) {
+        GuestProfileEntry *e = entry->value;
+        char executions[24] = "-";
+
+        if (e->has_executions) {
+            snprintf(executions, sizeof(executions), "%" PRId64,
+                     e->executions);
+        }
+        monitor_printf(mon, "0x%016" PRIx64 " %10" PRId64 " %5.1f%% %16"
+                       PRId64 " %12s  %s\n", e->address, e->samples,
+                       e->samples * 100.0 / info->samples, e->cycles,
+                       executions, e->has_symbol ? e->symbol : "");
+    }
+
+    qapi_free_GuestProfileInfo(info);
+}
+
 void hmp_quit(Monitor *mon, const QDict *qdict)
 {
     monitor_suspend(mon);
@@ -713,6 +814,33 @@ void hmp_system_reset(Monitor *mon, const QDict *qdict)
     qmp_system_reset(NULL);
 }
 
+void hmp_xbox_hdd_reset(Monitor *mon, const QDict *qdict)
+{
+    Error *errp = NULL;
+
+    qmp_xbox_hdd_reset(&errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_guest_profile_start(Monitor *mon, const QDict *qdict)
+{
+    bool perf_map = qdict_get_try_bool(qdict, "perf-map", false);
+    bool has_interval = qdict_haskey(qdict, "interval");
+    int64_t interval = qdict_get_try_int(qdict, "interval", 0);
+    Error *errp = NULL;
+
+    qmp_guest_profile_start(has_interval, interval, true, perf_map, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_guest_profile_stop(Monitor *mon, const QDict *qdict)
+{
+    Error *errp = NULL;
+
+    qmp_guest_profile_stop(&errp);
+    hmp_handle_error(mon, &errp);
+}
+
 void hmp_system_powerdown(Monitor *mon, const QDict *qdict)
 {
     qmp_system_powerdown(NULL);
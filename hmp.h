@@ -37,9 +37,15 @@ void hmp_info_balloon(Monitor *mon, const QDict *qdict);
 void hmp_info_pci(Monitor *mon, const QDict *qdict);
 void hmp_info_block_jobs(Monitor *mon, const QDict *qdict);
 void hmp_info_tpm(Monitor *mon, const QDict *qdict);
+void hmp_info_nv2a(Monitor *mon, const QDict *qdict);
+void hmp_info_apu(Monitor *mon, const QDict *qdict);
+void hmp_info_guest_profile(Monitor *mon, const QDict *qdict);
 void hmp_quit(Monitor *mon, const QDict *qdict);
 void hmp_stop(Monitor *mon, const QDict *qdict);
 void hmp_system_reset(Monitor *mon, const QDict *qdict);
+void hmp_xbox_hdd_reset(Monitor *mon, const QDict *qdict);
+void hmp_guest_profile_start(Monitor *mon, const QDict *qdict);
+void hmp_guest_profile_stop(Monitor *mon, const QDict *qdict);
 void hmp_system_powerdown(Monitor *mon, const QDict *qdict);
 void hmp_cpu(Monitor *mon, const QDict *qdict);
 void hmp_memsave(Monitor *mon, const QDict *qdict);
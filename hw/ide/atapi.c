@@ -162,10 +162,203 @@ void ide_atapi_io_error(IDEState *s, int ret)
     }
 }
 
+static inline uint8_t *cd_cache_slot(IDEATAPICache *c, int lba)
+{
+    return c->buf + (lba % ATAPI_CACHE_SECTORS) * 2048;
+}
+
+static bool cd_cache_lookup(IDEATAPICache *c, int lba, int n)
+{
+    return lba >= c->lba && lba + n <= c->lba + c->valid;
+}
+
+/* Copy a sector out of the cache in the current sector format */
+static bool cd_cache_read(IDEState *s, int lba, uint8_t *buf, int sector_size)
+{
+    IDEATAPICache *c = &s->cd_cache;
+
+    if (!cd_cache_lookup(c, lba, 1)) {
+        return false;
+    }
+    switch (sector_size) {
+    case 2048:
+        memcpy(buf, cd_cache_slot(c, lba), 2048);
+        return true;
+    case 2352:
+        memcpy(buf + 16, cd_cache_slot(c, lba), 2048);
+        cd_data_to_raw(buf, lba);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void ide_atapi_cache_invalidate(IDEState *s)
+{
+    IDEATAPICache *c = &s->cd_cache;
+
+    /* An in-flight read cannot be safely cancelled (the callback may
+     * or may not still run), so its data is just dropped on arrival */
+    if (c->aiocb) {
+        c->discard = true;
+    }
+    c->valid = 0;
+    c->waiting = false;
+    c->seq = 0;
+    c->next_lba = -1;
+}
+
+static void cd_cache_fill_cb(void *opaque, int ret)
+{
+    IDEState *s = opaque;
+    IDEATAPICache *c = &s->cd_cache;
+
+    c->aiocb = NULL;
+    bdrv_acct_done(s->bs, &c->acct);
+
+    if (c->discard) {
+        c->discard = false;
+    } else if (ret < 0) {
+        c->valid = 0;
+        if (c->waiting) {
+            c->waiting = false;
+            s->status &= ~BUSY_STAT;
+            ide_transfer_stop(s);
+            ide_atapi_io_error(s, ret);
+            return;
+        }
+    } else {
+        c->valid += c->pending;
+    }
+
+    if (c->waiting) {
+        c->waiting = false;
+        s->status &= ~BUSY_STAT;
+        ide_atapi_cmd_reply_end(s);
+    }
+}
+
+/* Start reading sectors [lba, end) into the cache, plus read-ahead up
+ * to 'limit'. Sectors below 'keep' may be evicted to make room. */
+static void cd_cache_fill(IDEState *s, int lba, int end, int limit, int keep)
+{
+    IDEATAPICache *c = &s->cd_cache;
+    int total = s->nb_sectors >> 2;
+    int slot, first, n;
+
+    if (c->aiocb) {
+        return;
+    }
+    if (!c->buf) {
+        c->buf = qemu_blockalign(s->bs, ATAPI_CACHE_SECTORS * 2048);
+    }
+
+    if (lba < c->lba || lba > c->lba + c->valid) {
+        /* not contiguous with what we have, start over */
+        c->lba = lba;
+        c->valid = 0;
+    }
+    lba = c->lba + c->valid;
+
+    end = MAX(end, MIN(lba + ATAPI_READAHEAD_SECTORS, limit));
+    end = MIN(end, total);
+    keep = MAX(keep, c->lba);
+    end = MIN(end, keep + ATAPI_CACHE_SECTORS);
+    n = end - lba;
+    if (n <= 0) {
+        return;
+    }
+
+    /* drop what the new sectors overwrite in the ring */
+    first = MAX(c->lba, end - ATAPI_CACHE_SECTORS);
+    c->valid -= first - c->lba;
+    c->lba = first;
+
+    slot = lba % ATAPI_CACHE_SECTORS;
+    c->iov[0].iov_base = cd_cache_slot(c, lba);
+    c->iov[0].iov_len = MIN(n, ATAPI_CACHE_SECTORS - slot) * 2048;
+    c->iov[1].iov_base = c->buf;
+    c->iov[1].iov_len = n * 2048 - c->iov[0].iov_len;
+    qemu_iovec_init_external(&c->qiov, c->iov, c->iov[1].iov_len ? 2 : 1);
+    c->pending = n;
+
+    bdrv_acct_start(s->bs, &c->acct, n * 4 * BDRV_SECTOR_SIZE,
+                    BDRV_ACCT_READ);
+    c->aiocb = bdrv_aio_readv(s->bs, (int64_t)lba << 2, &c->qiov, n * 4,
+                              cd_cache_fill_cb, s);
+}
+
+/* Keep the cache ahead of a PIO transfer. Within a command we read up
+ * to its end, once commands follow each other sequentially we keep
+ * reading past it. */
+static void cd_cache_readahead(IDEState *s)
+{
+    IDEATAPICache *c = &s->cd_cache;
+    int limit = c->seq ? INT_MAX : c->cmd_end;
+    int end = c->lba + c->valid;
+
+    if (!c->aiocb && end < limit && s->lba >= c->lba &&
+        end - s->lba < ATAPI_READAHEAD_SECTORS) {
+        cd_cache_fill(s, end, end, limit, s->lba);
+    }
+}
+
+/* Make sure all sectors of the next DRQ block are cached. Otherwise
+ * start reading them and go busy; the read completion restarts the
+ * transfer. */
+static bool cd_cache_ready(IDEState *s, int size)
+{
+    IDEATAPICache *c = &s->cd_cache;
+    int avail = 0;
+    int n;
+
+    if (s->io_buffer_index < s->cd_sector_size) {
+        avail = s->cd_sector_size - s->io_buffer_index;
+    }
+    if (size <= avail) {
+        return true;
+    }
+    n = DIV_ROUND_UP(size - avail, s->cd_sector_size);
+    if (cd_cache_lookup(c, s->lba, n)) {
+        return true;
+    }
+
+    cd_cache_fill(s, s->lba, s->lba + n, c->seq ? INT_MAX : c->cmd_end,
+                  s->lba);
+    if (!c->aiocb) {
+        /* nothing could be read, let the synchronous path report it */
+        return true;
+    }
+    c->waiting = true;
+    s->status = READY_STAT | SEEK_STAT | BUSY_STAT;
+    return false;
+}
+
+/* Size of the next DRQ data block of a PIO transfer */
+static int ide_atapi_block_size(IDEState *s)
+{
+    int byte_count_limit, size;
+
+    byte_count_limit = s->lcyl | (s->hcyl << 8);
+#ifdef DEBUG_IDE_ATAPI
+    printf("byte_count_limit=%d\n", byte_count_limit);
+#endif
+    if (byte_count_limit == 0xffff)
+        byte_count_limit--;
+    size = s->packet_transfer_size;
+    if (size > byte_count_limit) {
+        /* byte count limit must be even if this case */
+        if (byte_count_limit & 1)
+            byte_count_limit--;
+        size = byte_count_limit;
+    }
+    return size;
+}
+
 /* The whole ATAPI transfer logic is handled in this function */
 void ide_atapi_cmd_reply_end(IDEState *s)
 {
-    int byte_count_limit, size, ret;
+    int size, ret;
 #ifdef DEBUG_IDE_ATAPI
     printf("reply: tx_size=%d elem_tx_size=%d index=%d\n",
            s->packet_transfer_size,
@@ -182,16 +375,24 @@ void ide_atapi_cmd_reply_end(IDEState *s)
         printf("status=0x%x\n", s->status);
 #endif
     } else {
+        if (s->lba != -1 && s->elementary_transfer_size == 0 &&
+            !cd_cache_ready(s, ide_atapi_block_size(s))) {
+            return;
+        }
         /* see if a new sector must be read */
         if (s->lba != -1 && s->io_buffer_index >= s->cd_sector_size) {
-            ret = cd_read_sector(s, s->lba, s->io_buffer, s->cd_sector_size);
-            if (ret < 0) {
-                ide_transfer_stop(s);
-                ide_atapi_io_error(s, ret);
-                return;
+            if (!cd_cache_read(s, s->lba, s->io_buffer, s->cd_sector_size)) {
+                ret = cd_read_sector(s, s->lba, s->io_buffer,
+                                     s->cd_sector_size);
+                if (ret < 0) {
+                    ide_transfer_stop(s);
+                    ide_atapi_io_error(s, ret);
+                    return;
+                }
             }
             s->lba++;
             s->io_buffer_index = 0;
+            cd_cache_readahead(s);
         }
         if (s->elementary_transfer_size > 0) {
             /* there are some data left to transmit in this elementary
@@ -207,19 +408,7 @@ void ide_atapi_cmd_reply_end(IDEState *s)
         } else {
             /* a new transfer is needed */
             s->nsector = (s->nsector & ~7) | ATAPI_INT_REASON_IO;
-            byte_count_limit = s->lcyl | (s->hcyl << 8);
-#ifdef DEBUG_IDE_ATAPI
-            printf("byte_count_limit=%d\n", byte_count_limit);
-#endif
-            if (byte_count_limit == 0xffff)
-                byte_count_limit--;
-            size = s->packet_transfer_size;
-            if (size > byte_count_limit) {
-                /* byte count limit must be even if this case */
-                if (byte_count_limit & 1)
-                    byte_count_limit--;
-                size = byte_count_limit;
-            }
+            size = ide_atapi_block_size(s);
             s->lcyl = size;
             s->hcyl = size >> 8;
             s->elementary_transfer_size = size;
@@ -267,6 +456,12 @@ static void ide_atapi_cmd_reply(IDEState *s, int size, int max_size)
 static void ide_atapi_cmd_read_pio(IDEState *s, int lba, int nb_sectors,
                                    int sector_size)
 {
+    IDEATAPICache *c = &s->cd_cache;
+
+    c->seq = lba == c->next_lba ? c->seq + 1 : 0;
+    c->next_lba = lba + nb_sectors;
+    c->cmd_end = lba + nb_sectors;
+
     s->lba = lba;
     s->packet_transfer_size = nb_sectors * sector_size;
     s->elementary_transfer_size = 0;
@@ -899,6 +899,7 @@ static void ide_cd_change_cb(void *opaque, bool load)
     s->tray_open = !load;
     bdrv_get_geometry(s->bs, &nb_sectors);
     s->nb_sectors = nb_sectors;
+    ide_atapi_cache_invalidate(s);
 
     /*
      * First indicate to the guest that a CD has been removed.  That's
@@ -2022,6 +2023,7 @@ static void ide_reset(IDEState *s)
         bdrv_aio_cancel(s->pio_aiocb);
         s->pio_aiocb = NULL;
     }
+    ide_atapi_cache_invalidate(s);
 
     if (s->drive_kind == IDE_CFATA)
         s->mult_sectors = 0;
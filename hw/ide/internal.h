@@ -338,6 +338,30 @@ enum ide_dma_cmd {
 #define ide_cmd_is_read(s) \
 	((s)->dma_cmd == IDE_DMA_READ)
 
+/* ATAPI PIO sector cache: a ring of 2048 byte sectors holding the run
+ * [lba, lba + valid), filled asynchronously and read ahead of
+ * sequential streams so PIO transfers never wait on the image. */
+#define ATAPI_CACHE_SECTORS 128
+#define ATAPI_READAHEAD_SECTORS 32
+
+typedef struct IDEATAPICache {
+    uint8_t *buf;
+    int lba;
+    int valid;
+    /* the read in flight, always appended at lba + valid */
+    BlockDriverAIOCB *aiocb;
+    struct iovec iov[2];
+    QEMUIOVector qiov;
+    int pending;
+    bool discard;           /* invalidated while the read was in flight */
+    bool waiting;           /* a PIO transfer is stalled on the read */
+    BlockAcctCookie acct;
+    /* sequential stream detection */
+    int cmd_end;            /* end of the current read command */
+    int next_lba;           /* where a sequential follow-up would start */
+    int seq;                /* sequential commands in a row */
+} IDEATAPICache;
+
 /* NOTE: IDEState represents in fact one drive */
 struct IDEState {
     IDEBus *bus;
@@ -387,6 +411,7 @@ struct IDEState {
     int lba;
     int cd_sector_size;
     int atapi_dma; /* true if dma is requested for the packet cmd */
+    IDEATAPICache cd_cache;
     BlockAcctCookie acct;
     BlockDriverAIOCB *pio_aiocb;
     struct iovec iov;
@@ -575,6 +600,7 @@ BlockDriverAIOCB *ide_issue_trim(BlockDriverState *bs,
 /* hw/ide/atapi.c */
 void ide_atapi_cmd(IDEState *s);
 void ide_atapi_cmd_reply_end(IDEState *s);
+void ide_atapi_cache_invalidate(IDEState *s);
 
 /* hw/ide/qdev.c */
 void ide_bus_new(IDEBus *idebus, DeviceState *dev, int bus_id, int max_units);
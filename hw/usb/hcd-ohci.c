@@ -49,6 +49,16 @@
 
 #define OHCI_MAX_PORTS 15
 
+/* Frames without work before the controller stops ticking; one pass
+ * over the 32 entry interrupt table */
+#define OHCI_IDLE_FRAMES 32
+
+/* EDs looked at per interrupt table slot when deciding how long to idle */
+#define OHCI_IDLE_ED_LIMIT 64
+
+/* Endpoints whose NAKed TD is remembered, see ohci_ed_parked() */
+#define OHCI_IDLE_NAK_MAX 8
+
 static int64_t usb_frame_time;
 static int64_t usb_bit_time;
 
@@ -57,6 +67,13 @@ typedef struct OHCIPort {
     uint32_t ctrl;
 } OHCIPort;
 
+/* The TD an endpoint last NAKed, until the device signals new data */
+typedef struct OHCINak {
+    USBEndpoint *ep;
+    uint32_t td;
+    uint32_t ed_flags;
+} OHCINak;
+
 typedef struct {
     USBBus bus;
     qemu_irq irq;
@@ -68,6 +85,20 @@ typedef struct {
     QEMUTimer *eof_timer;
     int64_t sof_time;
 
+    /* Idle frame skipping. Once the lists have had no work other than
+     * NAKing interrupt endpoints for OHCI_IDLE_FRAMES frames, the frame
+     * timer is stopped and the frame number is advanced arithmetically
+     * when it is next observed. idle_max_frames bounds how far a real
+     * frame can be put off, 0 for no bound. With the periodic list
+     * enabled a frame is still run whenever an interrupt table slot with
+     * a live ED comes round, and at least every 32 frames. */
+    bool idle_enabled;
+    uint32_t idle_max_frames;
+    bool idle;
+    bool frame_busy;
+    uint32_t quiet_frames;
+    OHCINak nak[OHCI_IDLE_NAK_MAX];
+
     /* OHCI state */
     /* Control partition */
     uint32_t ctl, status;
@@ -128,6 +159,7 @@ struct ohci_hcca {
 #define ED_WBACK_SIZE   4
 
 static void ohci_bus_stop(OHCIState *ohci);
+static void ohci_idle_exit(OHCIState *ohci);
 static void ohci_async_cancel_device(OHCIState *ohci, USBDevice *dev);
 
 /* Bitfields for the first word of an Endpoint Desciptor.  */
@@ -357,6 +389,55 @@ static void ohci_attach(USBPort *port1)
     }
 }
 
+/* An ED is identified by its function address and endpoint number */
+#define OHCI_ED_ID_MASK (OHCI_ED_FA_MASK | OHCI_ED_EN_MASK)
+
+static void ohci_nak_forget(OHCIState *ohci, USBEndpoint *ep)
+{
+    int i;
+
+    for (i = 0; i < OHCI_IDLE_NAK_MAX; i++) {
+        if (ohci->nak[i].ep == ep) {
+            ohci->nak[i].ep = NULL;
+        }
+    }
+}
+
+static void ohci_nak_forget_device(OHCIState *ohci, USBDevice *dev)
+{
+    int i;
+
+    for (i = 0; i < OHCI_IDLE_NAK_MAX; i++) {
+        if (ohci->nak[i].ep && ohci->nak[i].ep->dev == dev) {
+            ohci->nak[i].ep = NULL;
+        }
+    }
+}
+
+static void ohci_nak_record(OHCIState *ohci, USBEndpoint *ep,
+                            struct ohci_ed *ed, uint32_t td)
+{
+    OHCINak *slot = NULL;
+    int i;
+
+    for (i = 0; i < OHCI_IDLE_NAK_MAX; i++) {
+        if (ohci->nak[i].ep == ep) {
+            slot = &ohci->nak[i];
+            break;
+        }
+        if (!slot && !ohci->nak[i].ep) {
+            slot = &ohci->nak[i];
+        }
+    }
+    if (!slot) {
+        /* Forgetting one only costs idle time */
+        slot = &ohci->nak[ohci->frame_number % OHCI_IDLE_NAK_MAX];
+    }
+    slot->ep = ep;
+    slot->td = td;
+    slot->ed_flags = ed->flags & OHCI_ED_ID_MASK;
+}
+
 static void ohci_detach(USBPort *port1)
 {
     OHCIState *s = port1->opaque;
@@ -364,6 +445,7 @@ static void ohci_detach(USBPort *port1)
     uint32_t old_state = port->ctrl;
 
     ohci_async_cancel_device(s, port1->dev);
+    ohci_nak_forget_device(s, port1->dev);
 
     /* set connect status */
     if (port->ctrl & OHCI_PORT_CCS) {
@@ -387,6 +469,8 @@ static void ohci_wakeup(USBPort *port1)
     OHCIState *s = port1->opaque;
     OHCIPort *port = &s->rhport[port1->index];
     uint32_t intr = 0;
+
+    ohci_idle_exit(s);
     if (port->ctrl & OHCI_PORT_PSS) {
         DPRINTF("usb-ohci: port %d: wakeup\n", port1->index);
         port->ctrl |= OHCI_PORT_PSSC;
@@ -412,6 +496,7 @@ static void ohci_child_detach(USBPort *port1, USBDevice *child)
     OHCIState *s = port1->opaque;
 
     ohci_async_cancel_device(s, child);
+    ohci_nak_forget_device(s, child);
 }
 
 static USBDevice *ohci_find_device(OHCIState *ohci, uint8_t addr)
@@ -477,6 +562,9 @@ static void ohci_reset(void *opaque)
     ohci->fit = 0;
     ohci->frt = 0;
     ohci->frame_number = 0;
+    ohci->idle = false;
+    ohci->quiet_frames = 0;
+    memset(ohci->nak, 0, sizeof(ohci->nak));
     ohci->pstart = 0;
     ohci->lst = OHCI_LS_THRESH;
 
@@ -694,6 +782,7 @@ static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
     DPRINTF("Async packet complete\n");
 #endif
     ohci->async_complete = 1;
+    ohci_idle_exit(ohci);
     ohci_process_lists(ohci, 1);
 }
 
@@ -720,6 +809,7 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
     uint32_t start_offset, next_offset, end_offset = 0;
     uint32_t start_addr, end_addr;
 
+    ohci->frame_busy = true;
     addr = ed->head & OHCI_DPTR_MASK;
 
     if (ohci_read_iso_td(ohci, addr, &iso_td)) {
@@ -969,7 +1059,10 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
     uint32_t addr;
     int flag_r;
     int completion;
+    bool busy = ohci->frame_busy;
 
+    /* Anything but a NAK counts as bus activity for idle detection */
+    ohci->frame_busy = true;
     addr = ed->head & OHCI_DPTR_MASK;
     /* See if this TD has already been submitted to the device.  */
     completion = (addr == ohci->async_td);
@@ -1127,6 +1220,7 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
         td.flags ^= OHCI_TD_T0;
         OHCI_SET_BM(td.flags, TD_CC, OHCI_CC_NOERROR);
         OHCI_SET_BM(td.flags, TD_EC, 0);
+        ohci_nak_forget(ohci, ohci->usb_packet.ep);
 
         if ((dir != OHCI_TD_DIR_IN) && (ret != len)) {
             /* Partial packet transfer: TD not ready to retire yet */
@@ -1148,6 +1242,10 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
                 OHCI_SET_BM(td.flags, TD_CC, OHCI_CC_DEVICENOTRESPONDING);
             case USB_RET_NAK:
                 DPRINTF("usb-ohci: got NAK\n");
+                ohci->frame_busy = busy;
+                if (ret == USB_RET_NAK) {
+                    ohci_nak_record(ohci, ohci->usb_packet.ep, ed, addr);
+                }
                 return 1;
             case USB_RET_STALL:
                 DPRINTF("usb-ohci: got STALL\n");
@@ -1260,6 +1358,154 @@ static void ohci_sof(OHCIState *ohci)
     ohci_set_interrupt(ohci, OHCI_INTR_SF);
 }
 
+/* Account for the frames that went by while idle, up to time t. Nothing
+ * was transferred in them so only the frame number moves. */
+static void ohci_idle_catch_up(OHCIState *ohci, int64_t t)
+{
+    struct ohci_hcca hcca;
+    int64_t n;
+
+    n = (t - ohci->sof_time) / usb_frame_time;
+    if (n <= 0) {
+        return;
+    }
+    ohci->frame_number = (ohci->frame_number + n) & 0xffff;
+    ohci->sof_time += n * usb_frame_time;
+
+    if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
+        fprintf(stderr, "usb-ohci: HCCA read error at %x\n", ohci->hcca);
+        ohci_die(ohci);
+        return;
+    }
+    hcca.frame = cpu_to_le16(ohci->frame_number);
+    if (ohci_put_hcca(ohci, ohci->hcca, &hcca)) {
+        ohci_die(ohci);
+    }
+}
+
+/* Resume ticking, the next frame boundary is at the usual place */
+static void ohci_idle_exit(OHCIState *ohci)
+{
+    if (!ohci->idle) {
+        return;
+    }
+    ohci->idle = false;
+    ohci->quiet_frames = 0;
+    ohci_idle_catch_up(ohci, qemu_get_clock_ns(vm_clock));
+    if (ohci->eof_timer) {
+        qemu_mod_timer(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+    }
+    DPRINTF("usb-ohci: %s: leaving idle at frame %u\n",
+            ohci->name, ohci->frame_number);
+}
+
+/* Is the TD at the head of this ED one that its device NAKed, with no
+ * usb_wakeup() from the device since?  Polling it again would only get
+ * another NAK, so it need not wake the controller. */
+static bool ohci_ed_parked(OHCIState *ohci, struct ohci_ed *ed)
+{
+    uint32_t td = ed->head & OHCI_DPTR_MASK;
+    int i;
+
+    if (td == (ed->tail & OHCI_DPTR_MASK)) {
+        return false;
+    }
+    for (i = 0; i < OHCI_IDLE_NAK_MAX; i++) {
+        if (ohci->nak[i].ep && ohci->nak[i].td == td &&
+            ohci->nak[i].ed_flags == (ed->flags & OHCI_ED_ID_MASK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Does this interrupt table slot hold an ED that needs polling?  The
+ * guest may queue a TD on any ED that is not skipped without telling
+ * us, unless the ED is still parked on a NAKed TD. */
+static bool ohci_intr_slot_live(OHCIState *ohci, uint32_t head)
+{
+    struct ohci_ed ed;
+    uint32_t cur;
+    int n;
+
+    for (cur = head, n = 0; cur && n < OHCI_IDLE_ED_LIMIT; n++) {
+        if (ohci_read_ed(ohci, cur, &ed)) {
+            return true;
+        }
+        if (!(ed.flags & OHCI_ED_K) && !ohci_ed_parked(ohci, &ed)) {
+            return true;
+        }
+        cur = ed.next & OHCI_DPTR_MASK;
+    }
+    return cur != 0;
+}
+
+/* How many frames we may sleep.  A periodic ED is polled every time its
+ * slot in the interrupt table comes round, so wake up for the next slot
+ * with a live ED on it.  Wake at least once per table cycle as well, to
+ * notice EDs the guest linked or unskipped in the meantime. */
+static int ohci_idle_frames(OHCIState *ohci)
+{
+    struct ohci_hcca hcca;
+    int max, j;
+
+    max = ohci->idle_max_frames;
+    if (!(ohci->ctl & OHCI_CTL_PLE)) {
+        return max;
+    }
+    if (!max || max > 32) {
+        max = 32;
+    }
+    if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
+        return 1;
+    }
+    /* The frame after this one services slot frame_number + j
+     * when woken j + 1 frames from now. */
+    for (j = 0; j + 1 < max; j++) {
+        int n = (ohci->frame_number + j) & 0x1f;
+        if (ohci_intr_slot_live(ohci, le32_to_cpu(hcca.intr[n]))) {
+            break;
+        }
+    }
+    return j + 1;
+}
+
+/* Stop the frame timer if the lists have been quiet for long enough.
+ * Not while the guest wants SOF interrupts, it counts them. */
+static void ohci_idle_check(OHCIState *ohci)
+{
+    int frames;
+
+    if (ohci->frame_busy || ohci->async_td || ohci->done ||
+        ohci->done_count != 7) {
+        ohci->quiet_frames = 0;
+        return;
+    }
+    if (ohci->quiet_frames < OHCI_IDLE_FRAMES) {
+        ohci->quiet_frames++;
+        return;
+    }
+    if (!ohci->idle_enabled || (ohci->intr & OHCI_INTR_SF)) {
+        return;
+    }
+
+    frames = ohci_idle_frames(ohci);
+    if (frames == 1) {
+        /* Something is polled every frame, nothing to gain */
+        return;
+    }
+
+    ohci->idle = true;
+    if (frames) {
+        qemu_mod_timer(ohci->eof_timer,
+                       ohci->sof_time + frames * usb_frame_time);
+    } else {
+        qemu_del_timer(ohci->eof_timer);
+    }
+    DPRINTF("usb-ohci: %s: idle at frame %u for %d frames\n",
+            ohci->name, ohci->frame_number, frames);
+}
+
 /* Process Control and Bulk lists.  */
 static void ohci_process_lists(OHCIState *ohci, int completion)
 {
@@ -1271,6 +1517,8 @@ static void ohci_process_lists(OHCIState *ohci, int completion)
         if (!ohci_service_ed_list(ohci, ohci->ctrl_head, completion)) {
             ohci->ctrl_cur = 0;
             ohci->status &= ~OHCI_STATUS_CLF;
+        } else {
+            ohci->frame_busy = true;
         }
     }
 
@@ -1278,6 +1526,8 @@ static void ohci_process_lists(OHCIState *ohci, int completion)
         if (!ohci_service_ed_list(ohci, ohci->bulk_head, completion)) {
             ohci->bulk_cur = 0;
             ohci->status &= ~OHCI_STATUS_BLF;
+        } else {
+            ohci->frame_busy = true;
         }
     }
 }
@@ -1288,12 +1538,21 @@ static void ohci_frame_boundary(void *opaque)
     OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
 
+    /* Woken by the idle bound, skip to the frame that is ending now */
+    if (ohci->idle) {
+        ohci_idle_catch_up(ohci,
+                           qemu_get_clock_ns(vm_clock) - usb_frame_time);
+        ohci->idle = false;
+    }
+
     if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
         fprintf(stderr, "usb-ohci: HCCA read error at %x\n", ohci->hcca);
         ohci_die(ohci);
         return;
     }
 
+    ohci->frame_busy = false;
+
     /* Process all the lists at the end of the frame */
     if (ohci->ctl & OHCI_CTL_PLE) {
         int n;
@@ -1345,7 +1604,10 @@ static void ohci_frame_boundary(void *opaque)
     /* Writeback HCCA */
     if (ohci_put_hcca(ohci, ohci->hcca, &hcca)) {
         ohci_die(ohci);
+        return;
     }
+
+    ohci_idle_check(ohci);
 }
 
 /* Start sending SOF tokens across the USB bus, lists are processed in
@@ -1376,6 +1638,8 @@ static void ohci_bus_stop(OHCIState *ohci)
     if (ohci->eof_timer)
         qemu_del_timer(ohci->eof_timer);
     ohci->eof_timer = NULL;
+    ohci->idle = false;
+    ohci->quiet_frames = 0;
 }
 
 /* Sets a flag in a port status register but only set it if the port is
@@ -1640,10 +1904,16 @@ static uint64_t ohci_mem_read(void *opaque,
             break;
 
         case 14: /* HcFmRemaining */
+            if (ohci->idle) {
+                ohci_idle_catch_up(ohci, qemu_get_clock_ns(vm_clock));
+            }
             retval = ohci_get_frame_remaining(ohci);
             break;
 
         case 15: /* HcFmNumber */
+            if (ohci->idle) {
+                ohci_idle_catch_up(ohci, qemu_get_clock_ns(vm_clock));
+            }
             retval = ohci->frame_number;
             break;
 
@@ -1706,6 +1976,10 @@ static void ohci_mem_write(void *opaque,
         return;
     }
 
+    /* The guest may be queueing work or changing state the idle
+     * decision depended on */
+    ohci_idle_exit(ohci);
+
     if (addr >= 0x54 && addr < 0x54 + ohci->num_ports * 4) {
         /* HcRhPortStatus */
         ohci_port_set_status(ohci, (addr - 0x54) >> 2, val);
@@ -1845,7 +2119,18 @@ static USBPortOps ohci_port_ops = {
     .complete = ohci_async_complete_packet,
 };
 
+static void ohci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep,
+                                 unsigned int stream)
+{
+    OHCIState *ohci = container_of(bus, OHCIState, bus);
+
+    /* A device has data for a NAKing endpoint, poll it next frame */
+    ohci_nak_forget(ohci, ep);
+    ohci_idle_exit(ohci);
+}
+
 static USBBusOps ohci_bus_ops = {
+    .wakeup_endpoint = ohci_wakeup_endpoint,
 };
 
 static int usb_ohci_init(OHCIState *ohci, DeviceState *dev,
@@ -1983,6 +2268,9 @@ static Property ohci_pci_properties[] = {
     DEFINE_PROP_STRING("masterbus", OHCIPCIState, masterbus),
     DEFINE_PROP_UINT32("num-ports", OHCIPCIState, num_ports, 3),
     DEFINE_PROP_UINT32("firstport", OHCIPCIState, firstport, 0),
+    DEFINE_PROP_BOOL("idle", OHCIPCIState, state.idle_enabled, true),
+    DEFINE_PROP_UINT32("idle-max-frames", OHCIPCIState,
+                       state.idle_max_frames, 128),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -2011,6 +2299,9 @@ static const TypeInfo ohci_pci_info = {
 static Property ohci_sysbus_properties[] = {
     DEFINE_PROP_UINT32("num-ports", OHCISysBusState, num_ports, 3),
     DEFINE_PROP_DMAADDR("dma-offset", OHCISysBusState, dma_offset, 3),
+    DEFINE_PROP_BOOL("idle", OHCISysBusState, ohci.idle_enabled, true),
+    DEFINE_PROP_UINT32("idle-max-frames", OHCISysBusState,
+                       ohci.idle_max_frames, 128),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -17,6 +17,10 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #include "hw/hw.h"
 #include "hw/boards.h"
 #include "hw/ide.h"
@@ -126,6 +130,46 @@ type_init(chihiro_register_types)
 #define COMMUNICATION_SECTORS    0x10000
 #define SECTOR_SIZE              512
 
+/* limited by the size of the board ram, which we emulate as 128M for now */
+#define FILESYSTEM_SIZE          (128 * 1024 * 1024)
+
+/* Map the filesystem image copy-on-write over an anonymous mapping the
+ * size of the board ram. Pages are faulted in from the page cache when
+ * the guest touches them, and instances running the same game share
+ * them until written. Returns NULL if the image can't be mapped. */
+static void *chihiro_map_filesystem(const char *filename, size_t size,
+                                    size_t file_size)
+{
+#ifndef _WIN32
+    void *base, *p;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (file_size) {
+        p = mmap(base, file_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (p == MAP_FAILED) {
+            munmap(base, size);
+            base = NULL;
+        }
+    }
+    close(fd);
+    return base;
+#else
+    return NULL;
+#endif
+}
+
 static void chihiro_ide_interface_init(const char *rom_file,
                                        const char *filesystem_file)
 {
@@ -147,10 +191,30 @@ static void chihiro_ide_interface_init(const char *rom_file,
                                 (uint64_t)ROM_START * SECTOR_SIZE, rom);
 
 
-    /* limited by the size of the board ram, which we emulate as 128M for now */
+    int filesystem_size = 0;
+    void *filesystem_ptr = NULL;
+    if (filesystem_file) {
+        filesystem_size = get_image_size(filesystem_file);
+        if (filesystem_size < 0 || filesystem_size > FILESYSTEM_SIZE) {
+            fprintf(stderr, "chihiro: can't use mediaboard filesystem "
+                            "'%s'\n", filesystem_file);
+            exit(1);
+        }
+        filesystem_ptr = chihiro_map_filesystem(filesystem_file,
+                                                FILESYSTEM_SIZE,
+                                                filesystem_size);
+    }
+
     filesystem = g_malloc(sizeof(*filesystem));
-    memory_region_init_ram(filesystem, NULL, "chihiro.interface.filesystem",
-                           128 * 1024 * 1024);
+    if (filesystem_ptr) {
+        memory_region_init_ram_ptr(filesystem, NULL,
+                                   "chihiro.interface.filesystem",
+                                   FILESYSTEM_SIZE, filesystem_ptr);
+    } else {
+        memory_region_init_ram(filesystem, NULL,
+                               "chihiro.interface.filesystem",
+                               FILESYSTEM_SIZE);
+    }
     memory_region_add_subregion(interface,
                                 (uint64_t)FILESYSTEM_START * SECTOR_SIZE,
                                 filesystem);
@@ -177,15 +241,11 @@ static void chihiro_ide_interface_init(const char *rom_file,
     }
 
 
-    if (filesystem_file) {
-        assert(access(filesystem_file, R_OK) == 0);
-
-        int filesystem_size = get_image_size(filesystem_file);
-        assert(filesystem_size < memory_region_size(filesystem));
-
+    if (filesystem_file && !filesystem_ptr) {
+        /* no mmap, fall back to reading it all in */
         fd = open(filesystem_file, O_RDONLY | O_BINARY);
         assert(fd != -1);
-        rc = read(fd, memory_region_get_ram_ptr(rom), filesystem_size);
+        rc = read(fd, memory_region_get_ram_ptr(filesystem), filesystem_size);
         assert(rc == filesystem_size);
         close(fd);
     }
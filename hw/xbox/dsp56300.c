@@ -0,0 +1,1881 @@
+/*
+ * MCPX DSP56300 emulation
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "qemu/osdep.h"
+#include "hw/xbox/dsp56300.h"
+
+// #define DEBUG_DSP
+#ifdef DEBUG_DSP
+# define DSP_DPRINTF(format, ...)     printf(format, ## __VA_ARGS__)
+#else
+# define DSP_DPRINTF(format, ...)     do { } while (0)
+#endif
+
+/* status register */
+#define SR_C                (1 << 0)
+#define SR_V                (1 << 1)
+#define SR_Z                (1 << 2)
+#define SR_N                (1 << 3)
+#define SR_U                (1 << 4)
+#define SR_E                (1 << 5)
+#define SR_L                (1 << 6)
+#define SR_LF               (1 << 15)
+
+#define SR_RESET            0xC00300
+
+#define ACC_MASK            ((1ULL << 56) - 1)
+
+/* register numbers, as in the 6 bit instruction fields */
+#define REG_X0              0x04
+#define REG_X1              0x05
+#define REG_Y0              0x06
+#define REG_Y1              0x07
+#define REG_A0              0x08
+#define REG_B0              0x09
+#define REG_A2              0x0A
+#define REG_B2              0x0B
+#define REG_A1              0x0C
+#define REG_B1              0x0D
+#define REG_A               0x0E
+#define REG_B               0x0F
+#define REG_R0              0x10
+#define REG_N0              0x18
+#define REG_M0              0x20
+#define REG_EP              0x2A
+#define REG_VBA             0x30
+#define REG_SC              0x31
+#define REG_SZ              0x38
+#define REG_SR              0x39
+#define REG_OMR             0x3A
+#define REG_SP              0x3B
+#define REG_SSH             0x3C
+#define REG_SSL             0x3D
+#define REG_LA              0x3E
+#define REG_LC              0x3F
+/* 48 bit ALU sources X1:X0 and Y1:Y0 */
+#define REG_X               0x40
+#define REG_Y               0x41
+
+/* addressing modes beyond MMM */
+#define EA_ABS              8
+#define EA_IMM              9
+
+enum {
+    MOVE_NONE,
+    MOVE_IMM,
+    MOVE_REG,
+    MOVE_UPDATE,
+    MOVE_MEM,
+    MOVE_L,
+    MOVE_XY,
+    MOVE_XR,
+    MOVE_RY,
+};
+
+/* DSPInsn.flags */
+#define MUL_ROUND           (1 << 0)
+#define MUL_ACC             (1 << 1)
+#define MUL_NEG             (1 << 2)
+
+#define BIT_SET             (1 << 0)
+#define BIT_JUMP            (1 << 1)
+
+#define IMM_ADD             0
+#define IMM_SUB             1
+#define IMM_CMP             2
+#define IMM_AND             3
+#define IMM_OR              4
+#define IMM_EOR             5
+
+static inline int32_t sext24(uint32_t v)
+{
+    return (int32_t)(v << 8) >> 8;
+}
+
+static inline int64_t sext56(uint64_t v)
+{
+    return (int64_t)(v << 8) >> 8;
+}
+
+static inline int64_t *dsp_acc(DSPState *s, unsigned int d)
+{
+    return d ? &s->b : &s->a;
+}
+
+/* Read an accumulator as 48 bits, saturating when the extension is in
+ * use */
+static uint64_t dsp_limit48(DSPState *s, int64_t a)
+{
+    if (a > 0x7FFFFFFFFFFFLL) {
+        s->sr |= SR_L;
+        return 0x7FFFFFFFFFFFULL;
+    }
+    if (a < -0x800000000000LL) {
+        s->sr |= SR_L;
+        return 0x800000000000ULL;
+    }
+    return a & 0xFFFFFFFFFFFFULL;
+}
+
+static void dsp_push(DSPState *s, uint32_t h, uint32_t l)
+{
+    s->sp = (s->sp + 1) % DSP_STACK_SIZE;
+    s->ssh[s->sp] = h;
+    s->ssl[s->sp] = l;
+}
+
+static void dsp_pop(DSPState *s, uint32_t *h, uint32_t *l)
+{
+    *h = s->ssh[s->sp];
+    *l = s->ssl[s->sp];
+    s->sp = (s->sp + DSP_STACK_SIZE - 1) % DSP_STACK_SIZE;
+}
+
+static uint32_t dsp_read_reg(DSPState *s, unsigned int reg)
+{
+    uint32_t h, l;
+
+    /* X0, X1, Y0 and Y1 are adjacent in DSPState */
+    if (likely(reg - REG_X0 < 4)) {
+        return (&s->x0)[reg - REG_X0];
+    }
+
+    switch (reg) {
+    case REG_X0: return s->x0;
+    case REG_X1: return s->x1;
+    case REG_Y0: return s->y0;
+    case REG_Y1: return s->y1;
+    case REG_A0: return s->a & 0xFFFFFF;
+    case REG_B0: return s->b & 0xFFFFFF;
+    case REG_A2: return (s->a >> 48) & 0xFFFFFF;
+    case REG_B2: return (s->b >> 48) & 0xFFFFFF;
+    case REG_A1: return (s->a >> 24) & 0xFFFFFF;
+    case REG_B1: return (s->b >> 24) & 0xFFFFFF;
+    case REG_A: return dsp_limit48(s, s->a) >> 24;
+    case REG_B: return dsp_limit48(s, s->b) >> 24;
+    case REG_R0 ... REG_R0 + 7: return s->r[reg - REG_R0];
+    case REG_N0 ... REG_N0 + 7: return s->n[reg - REG_N0];
+    case REG_M0 ... REG_M0 + 7: return s->m[reg - REG_M0];
+    case REG_EP: return s->ep;
+    case REG_VBA: return s->vba;
+    case REG_SC: return s->sc;
+    case REG_SZ: return s->sz;
+    case REG_SR: return s->sr;
+    case REG_OMR: return s->omr;
+    case REG_SP: return s->sp;
+    case REG_SSH:
+        dsp_pop(s, &h, &l);
+        return h;
+    case REG_SSL: return s->ssl[s->sp];
+    case REG_LA: return s->la;
+    case REG_LC: return s->lc;
+    default:
+        DSP_DPRINTF("dsp: read of unknown register 0x%x\n", reg);
+        return 0;
+    }
+}
+
+static void dsp_write_reg(DSPState *s, unsigned int reg, uint32_t v)
+{
+    v &= 0xFFFFFF;
+
+    if (likely(reg - REG_X0 < 4)) {
+        (&s->x0)[reg - REG_X0] = v;
+        return;
+    }
+
+    switch (reg) {
+    case REG_X0: s->x0 = v; break;
+    case REG_X1: s->x1 = v; break;
+    case REG_Y0: s->y0 = v; break;
+    case REG_Y1: s->y1 = v; break;
+    case REG_A0: s->a = (s->a & ~0xFFFFFFLL) | v; break;
+    case REG_B0: s->b = (s->b & ~0xFFFFFFLL) | v; break;
+    case REG_A2: s->a = sext56((s->a & 0xFFFFFFFFFFFFLL)
+                               | (uint64_t)(v & 0xFF) << 48); break;
+    case REG_B2: s->b = sext56((s->b & 0xFFFFFFFFFFFFLL)
+                               | (uint64_t)(v & 0xFF) << 48); break;
+    case REG_A1: s->a = sext56((s->a & ~(0xFFFFFFLL << 24) & ACC_MASK)
+                               | (uint64_t)v << 24); break;
+    case REG_B1: s->b = sext56((s->b & ~(0xFFFFFFLL << 24) & ACC_MASK)
+                               | (uint64_t)v << 24); break;
+    case REG_A: s->a = (int64_t)sext24(v) << 24; break;
+    case REG_B: s->b = (int64_t)sext24(v) << 24; break;
+    case REG_R0 ... REG_R0 + 7: s->r[reg - REG_R0] = v; break;
+    case REG_N0 ... REG_N0 + 7: s->n[reg - REG_N0] = v; break;
+    case REG_M0 ... REG_M0 + 7: s->m[reg - REG_M0] = v; break;
+    case REG_EP: s->ep = v; break;
+    case REG_VBA: s->vba = v; break;
+    case REG_SC: s->sc = v; break;
+    case REG_SZ: s->sz = v; break;
+    case REG_SR: s->sr = v; break;
+    case REG_OMR: s->omr = v; break;
+    case REG_SP: s->sp = v % DSP_STACK_SIZE; break;
+    case REG_SSH: dsp_push(s, v, s->ssl[(s->sp + 1) % DSP_STACK_SIZE]); break;
+    case REG_SSL: s->ssl[s->sp] = v; break;
+    case REG_LA: s->la = v; break;
+    case REG_LC: s->lc = v; break;
+    default:
+        DSP_DPRINTF("dsp: write of unknown register 0x%x\n", reg);
+        break;
+    }
+}
+
+/* 56 bit ALU operand */
+static int64_t dsp_read_src(DSPState *s, unsigned int reg)
+{
+    switch (reg) {
+    case REG_A: return s->a;
+    case REG_B: return s->b;
+    case REG_X: return (int64_t)sext24(s->x1) << 24 | s->x0;
+    case REG_Y: return (int64_t)sext24(s->y1) << 24 | s->y0;
+    default: return (int64_t)sext24(dsp_read_reg(s, reg)) << 24;
+    }
+}
+
+static uint32_t dsp_mem_read(DSPState *s, int space, uint32_t addr)
+{
+    switch (space) {
+    case DSP_SPACE_X:
+        return addr < DSP_X_SIZE ? s->x[addr] : 0;
+    case DSP_SPACE_Y:
+        return addr < DSP_Y_SIZE ? s->y[addr] : 0;
+    default:
+        return addr < DSP_P_SIZE ? s->p[addr] : 0;
+    }
+}
+
+static void dsp_mem_write(DSPState *s, int space, uint32_t addr, uint32_t v)
+{
+    v &= 0xFFFFFF;
+    switch (space) {
+    case DSP_SPACE_X:
+        if (addr < DSP_X_SIZE) {
+            s->x[addr] = v;
+        }
+        break;
+    case DSP_SPACE_Y:
+        if (addr < DSP_Y_SIZE) {
+            s->y[addr] = v;
+        }
+        break;
+    default:
+        if (addr < DSP_P_SIZE) {
+            s->p[addr] = v;
+            /* the word may also be the extension of the previous insn */
+            s->pcache[addr].fn = NULL;
+            if (addr > 0) {
+                s->pcache[addr - 1].fn = NULL;
+            }
+        }
+        break;
+    }
+}
+
+static uint32_t bitrev24(uint32_t v)
+{
+    uint32_t r = 0;
+    int i;
+    for (i = 0; i < 24; i++) {
+        r = (r << 1) | ((v >> i) & 1);
+    }
+    return r;
+}
+
+/* Address register arithmetic under the modifier register */
+static uint32_t dsp_agu(DSPState *s, unsigned int rn, int32_t delta)
+{
+    uint32_t r = s->r[rn];
+    uint32_t m = s->m[rn];
+
+    if (m == 0xFFFFFF) {
+        return (r + delta) & 0xFFFFFF;
+    }
+    if (m == 0) {
+        /* reverse carry */
+        return bitrev24((bitrev24(r) + bitrev24(delta & 0xFFFFFF))
+                        & 0xFFFFFF);
+    }
+    if (m <= 0x7FFF) {
+        uint32_t size = m + 1;
+        uint32_t mask = 1;
+        while (mask < size) {
+            mask <<= 1;
+        }
+        mask -= 1;
+
+        if (delta > (int32_t)size || delta < -(int32_t)size) {
+            return (r + delta) & 0xFFFFFF;
+        }
+        uint32_t base = r & ~mask;
+        int32_t offset = (int32_t)(r - base) + delta;
+        if (offset < 0) {
+            offset += size;
+        } else if (offset >= (int32_t)size) {
+            offset -= size;
+        }
+        return base + offset;
+    }
+    return (r + delta) & 0xFFFFFF;
+}
+
+static uint32_t dsp_ea(DSPState *s, const DSPInsn *insn,
+                       unsigned int mode, unsigned int rn)
+{
+    uint32_t addr;
+
+    switch (mode) {
+    case 0:
+        addr = s->r[rn];
+        s->r[rn] = dsp_agu(s, rn, -sext24(s->n[rn]));
+        break;
+    case 1:
+        addr = s->r[rn];
+        s->r[rn] = dsp_agu(s, rn, sext24(s->n[rn]));
+        break;
+    case 2:
+        addr = s->r[rn];
+        s->r[rn] = dsp_agu(s, rn, -1);
+        break;
+    case 3:
+        addr = s->r[rn];
+        s->r[rn] = dsp_agu(s, rn, 1);
+        break;
+    case 4:
+        addr = s->r[rn];
+        break;
+    case 5:
+        addr = dsp_agu(s, rn, sext24(s->n[rn]));
+        break;
+    case 7:
+        s->r[rn] = dsp_agu(s, rn, -1);
+        addr = s->r[rn];
+        break;
+    default:
+        addr = insn->imm;
+        break;
+    }
+    return addr;
+}
+
+static bool dsp_cond(DSPState *s, unsigned int cc)
+{
+    uint32_t sr = s->sr;
+    bool c = sr & SR_C, v = sr & SR_V, z = sr & SR_Z, n = sr & SR_N;
+    bool u = sr & SR_U, e = sr & SR_E, l = sr & SR_L;
+    bool r;
+
+    switch (cc & 7) {
+    case 0: r = !c; break;                     /* CC */
+    case 1: r = !(n ^ v); break;               /* GE */
+    case 2: r = !z; break;                     /* NE */
+    case 3: r = !n; break;                     /* PL */
+    case 4: r = !(z || (!u && !e)); break;     /* NN */
+    case 5: r = !e; break;                     /* EC */
+    case 6: r = !l; break;                     /* LC */
+    default: r = !(z || (n ^ v)); break;       /* GT */
+    }
+    return (cc & 8) ? !r : r;
+}
+
+static void dsp_ccr_nzeu(DSPState *s, int64_t a)
+{
+    uint32_t sr = s->sr & ~(SR_N | SR_Z | SR_E | SR_U);
+    int64_t top = a >> 47;
+
+    if (a < 0) {
+        sr |= SR_N;
+    }
+    if (a == 0) {
+        sr |= SR_Z;
+    }
+    if (top != 0 && top != -1) {
+        sr |= SR_E;
+    } else if (((a >> 46) & 1) == (top & 1)) {
+        sr |= SR_U;
+    }
+    s->sr = sr;
+}
+
+static int64_t dsp_add56(DSPState *s, int64_t a, int64_t b, bool sub)
+{
+    uint64_t ua = a & ACC_MASK, ub = b & ACC_MASK, r;
+    bool c, v;
+
+    if (sub) {
+        r = ua - ub;
+        c = ua < ub;
+        v = (((ua ^ ub) & (ua ^ r)) >> 55) & 1;
+    } else {
+        r = ua + ub;
+        c = (r >> 56) & 1;
+        v = ((~(ua ^ ub) & (ua ^ r)) >> 55) & 1;
+    }
+
+    int64_t res = sext56(r & ACC_MASK);
+    s->sr &= ~(SR_C | SR_V);
+    if (c) {
+        s->sr |= SR_C;
+    }
+    if (v) {
+        s->sr |= SR_V | SR_L;
+    }
+    dsp_ccr_nzeu(s, res);
+    return res;
+}
+
+/* convergent rounding to A1 */
+static int64_t dsp_round(int64_t a)
+{
+    int64_t r = a + 0x800000;
+    if ((a & 0xFFFFFF) == 0x800000) {
+        r &= ~0x1000000LL;
+    }
+    return sext56((r & ~0xFFFFFFLL) & ACC_MASK);
+}
+
+/* logical operations work on A1 */
+static void dsp_set_a1(DSPState *s, unsigned int d, uint32_t v)
+{
+    int64_t *acc = dsp_acc(s, d);
+    v &= 0xFFFFFF;
+    *acc = sext56((*acc & ~(0xFFFFFFLL << 24) & ACC_MASK)
+                  | (uint64_t)v << 24);
+    s->sr &= ~(SR_N | SR_Z | SR_V);
+    if (v & 0x800000) {
+        s->sr |= SR_N;
+    }
+    if (!v) {
+        s->sr |= SR_Z;
+    }
+}
+
+static uint32_t dsp_get_a1(DSPState *s, unsigned int d)
+{
+    return (*dsp_acc(s, d) >> 24) & 0xFFFFFF;
+}
+
+
+/* data ALU operations */
+
+static void dsp_alu_add(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc, dsp_read_src(s, insn->s1), false);
+}
+
+static void dsp_alu_sub(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc, dsp_read_src(s, insn->s1), true);
+}
+
+static void dsp_alu_cmp(DSPState *s, const DSPInsn *insn)
+{
+    dsp_add56(s, *dsp_acc(s, insn->d), dsp_read_src(s, insn->s1), true);
+}
+
+static void dsp_alu_cmpm(DSPState *s, const DSPInsn *insn)
+{
+    int64_t a = *dsp_acc(s, insn->d), b = dsp_read_src(s, insn->s1);
+    dsp_add56(s, a < 0 ? -a : a, b < 0 ? -b : b, true);
+}
+
+static void dsp_alu_tfr(DSPState *s, const DSPInsn *insn)
+{
+    *dsp_acc(s, insn->d) = dsp_read_src(s, insn->s1);
+}
+
+static void dsp_alu_addr(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc >> 1, dsp_read_src(s, insn->s1), false);
+}
+
+static void dsp_alu_subr(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc >> 1, dsp_read_src(s, insn->s1), true);
+}
+
+static void dsp_alu_addl(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc * 2, dsp_read_src(s, insn->s1), false);
+}
+
+static void dsp_alu_subl(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc * 2, dsp_read_src(s, insn->s1), true);
+}
+
+static void dsp_alu_adc(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    int64_t c = (s->sr & SR_C) ? 1 : 0;
+    *acc = dsp_add56(s, *acc, dsp_read_src(s, insn->s1) + c, false);
+}
+
+static void dsp_alu_sbc(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    int64_t c = (s->sr & SR_C) ? 1 : 0;
+    *acc = dsp_add56(s, *acc, dsp_read_src(s, insn->s1) + c, true);
+}
+
+static void dsp_alu_tst(DSPState *s, const DSPInsn *insn)
+{
+    s->sr &= ~SR_V;
+    dsp_ccr_nzeu(s, *dsp_acc(s, insn->d));
+}
+
+static void dsp_alu_clr(DSPState *s, const DSPInsn *insn)
+{
+    *dsp_acc(s, insn->d) = 0;
+    s->sr = (s->sr & ~(SR_N | SR_E | SR_V)) | SR_Z | SR_U;
+}
+
+static void dsp_alu_rnd(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_round(*acc);
+    dsp_ccr_nzeu(s, *acc);
+}
+
+static void dsp_alu_abs(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    if (*acc < 0) {
+        *acc = dsp_add56(s, 0, *acc, true);
+    } else {
+        dsp_ccr_nzeu(s, *acc);
+    }
+}
+
+static void dsp_alu_neg(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    uint32_t c = s->sr & SR_C;
+    *acc = dsp_add56(s, 0, *acc, true);
+    s->sr = (s->sr & ~SR_C) | c;
+}
+
+static void dsp_alu_asl(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    int64_t r = sext56(((uint64_t)*acc << 1) & ACC_MASK);
+    s->sr &= ~(SR_C | SR_V);
+    if (*acc & (1LL << 55)) {
+        s->sr |= SR_C;
+    }
+    if ((r ^ *acc) < 0) {
+        s->sr |= SR_V | SR_L;
+    }
+    *acc = r;
+    dsp_ccr_nzeu(s, r);
+}
+
+static void dsp_alu_asr(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    s->sr &= ~(SR_C | SR_V);
+    if (*acc & 1) {
+        s->sr |= SR_C;
+    }
+    *acc >>= 1;
+    dsp_ccr_nzeu(s, *acc);
+}
+
+static void dsp_alu_lsl(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t v = dsp_get_a1(s, insn->d);
+    dsp_set_a1(s, insn->d, v << 1);
+    s->sr = (s->sr & ~SR_C) | ((v >> 23) & 1);
+}
+
+static void dsp_alu_lsr(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t v = dsp_get_a1(s, insn->d);
+    dsp_set_a1(s, insn->d, v >> 1);
+    s->sr = (s->sr & ~SR_C) | (v & 1);
+}
+
+static void dsp_alu_rol(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t v = dsp_get_a1(s, insn->d);
+    dsp_set_a1(s, insn->d, (v << 1) | (s->sr & SR_C));
+    s->sr = (s->sr & ~SR_C) | ((v >> 23) & 1);
+}
+
+static void dsp_alu_ror(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t v = dsp_get_a1(s, insn->d);
+    dsp_set_a1(s, insn->d, (v >> 1) | ((s->sr & SR_C) << 23));
+    s->sr = (s->sr & ~SR_C) | (v & 1);
+}
+
+static void dsp_alu_not(DSPState *s, const DSPInsn *insn)
+{
+    dsp_set_a1(s, insn->d, ~dsp_get_a1(s, insn->d));
+}
+
+static void dsp_alu_and(DSPState *s, const DSPInsn *insn)
+{
+    dsp_set_a1(s, insn->d,
+               dsp_get_a1(s, insn->d) & dsp_read_reg(s, insn->s1));
+}
+
+static void dsp_alu_or(DSPState *s, const DSPInsn *insn)
+{
+    dsp_set_a1(s, insn->d,
+               dsp_get_a1(s, insn->d) | dsp_read_reg(s, insn->s1));
+}
+
+static void dsp_alu_eor(DSPState *s, const DSPInsn *insn)
+{
+    dsp_set_a1(s, insn->d,
+               dsp_get_a1(s, insn->d) ^ dsp_read_reg(s, insn->s1));
+}
+
+static void dsp_alu_max(DSPState *s, const DSPInsn *insn)
+{
+    int64_t a = s->a, b = s->b;
+    if (insn->flags) {
+        /* MAXM */
+        a = a < 0 ? -a : a;
+        b = b < 0 ? -b : b;
+    }
+    if (b - a <= 0) {
+        s->b = s->a;
+        s->sr &= ~SR_C;
+    } else {
+        s->sr |= SR_C;
+    }
+}
+
+static void dsp_alu_mul(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    int64_t p = (int64_t)sext24(dsp_read_reg(s, insn->s1))
+                    * sext24(dsp_read_reg(s, insn->s2)) * 2;
+    uint32_t c = s->sr & SR_C;
+    int64_t r;
+
+    if (insn->flags & MUL_NEG) {
+        p = -p;
+    }
+    if (insn->flags & MUL_ACC) {
+        r = dsp_add56(s, *acc, p, false);
+    } else {
+        r = p;
+        s->sr &= ~SR_V;
+        dsp_ccr_nzeu(s, r);
+    }
+    if (insn->flags & MUL_ROUND) {
+        r = dsp_round(r);
+        dsp_ccr_nzeu(s, r);
+    }
+    s->sr = (s->sr & ~SR_C) | c;
+    *acc = r;
+}
+
+
+/* parallel moves */
+
+static uint64_t dsp_read_l(DSPState *s, unsigned int lll)
+{
+    switch (lll) {
+    case 0: return s->a & 0xFFFFFFFFFFFFULL;
+    case 1: return s->b & 0xFFFFFFFFFFFFULL;
+    case 2: return (uint64_t)s->x1 << 24 | s->x0;
+    case 3: return (uint64_t)s->y1 << 24 | s->y0;
+    case 4: return dsp_limit48(s, s->a);
+    case 5: return dsp_limit48(s, s->b);
+    case 6: return (dsp_limit48(s, s->a) & ~0xFFFFFFULL)
+                   | dsp_limit48(s, s->b) >> 24;
+    default: return (dsp_limit48(s, s->b) & ~0xFFFFFFULL)
+                    | dsp_limit48(s, s->a) >> 24;
+    }
+}
+
+static void dsp_write_l(DSPState *s, unsigned int lll, uint64_t v)
+{
+    uint32_t hi = (v >> 24) & 0xFFFFFF, lo = v & 0xFFFFFF;
+
+    switch (lll) {
+    case 0:
+        s->a = sext56((s->a & ~0xFFFFFFFFFFFFLL & ACC_MASK) | v);
+        break;
+    case 1:
+        s->b = sext56((s->b & ~0xFFFFFFFFFFFFLL & ACC_MASK) | v);
+        break;
+    case 2: s->x1 = hi; s->x0 = lo; break;
+    case 3: s->y1 = hi; s->y0 = lo; break;
+    case 4: s->a = (int64_t)(v << 16) >> 16; break;
+    case 5: s->b = (int64_t)(v << 16) >> 16; break;
+    case 6:
+        dsp_write_reg(s, REG_A, hi);
+        dsp_write_reg(s, REG_B, lo);
+        break;
+    default:
+        dsp_write_reg(s, REG_B, hi);
+        dsp_write_reg(s, REG_A, lo);
+        break;
+    }
+}
+
+static void dsp_parallel(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    uint32_t addr = 0, addr2 = 0, v = 0, v2 = 0;
+    uint64_t lv = 0;
+
+    /* sources are sampled before the ALU operation */
+    switch (m->type) {
+    case MOVE_IMM:
+        v = insn->imm;
+        break;
+    case MOVE_REG:
+        v = dsp_read_reg(s, m->src2);
+        break;
+    case MOVE_UPDATE:
+        dsp_ea(s, insn, m->mode, m->rn);
+        break;
+    case MOVE_MEM:
+        if (m->mode == EA_IMM) {
+            v = insn->imm;
+            break;
+        }
+        addr = dsp_ea(s, insn, m->mode, m->rn);
+        v = m->write ? dsp_read_reg(s, m->reg)
+                     : dsp_mem_read(s, m->space, addr);
+        break;
+    case MOVE_L:
+        addr = dsp_ea(s, insn, m->mode, m->rn);
+        if (m->write) {
+            lv = dsp_read_l(s, m->reg);
+        } else {
+            lv = (uint64_t)dsp_mem_read(s, DSP_SPACE_X, addr) << 24
+                 | dsp_mem_read(s, DSP_SPACE_Y, addr);
+        }
+        break;
+    case MOVE_XY:
+        addr = dsp_ea(s, insn, m->mode, m->rn);
+        addr2 = dsp_ea(s, insn, m->mode2, m->rn2);
+        v = m->write ? dsp_read_reg(s, m->reg)
+                     : dsp_mem_read(s, DSP_SPACE_X, addr);
+        v2 = m->write2 ? dsp_read_reg(s, m->reg2)
+                       : dsp_mem_read(s, DSP_SPACE_Y, addr2);
+        break;
+    case MOVE_XR:
+        if (m->mode == EA_IMM) {
+            v = insn->imm;
+        } else {
+            addr = dsp_ea(s, insn, m->mode, m->rn);
+            v = m->write ? dsp_read_reg(s, m->reg)
+                         : dsp_mem_read(s, DSP_SPACE_X, addr);
+        }
+        v2 = dsp_read_reg(s, m->src2);
+        break;
+    case MOVE_RY:
+        v = dsp_read_reg(s, m->src2);
+        if (m->mode2 == EA_IMM) {
+            v2 = insn->imm;
+        } else {
+            addr2 = dsp_ea(s, insn, m->mode2, m->rn2);
+            v2 = m->write2 ? dsp_read_reg(s, m->reg2)
+                           : dsp_mem_read(s, DSP_SPACE_Y, addr2);
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (insn->alu) {
+        insn->alu(s, insn);
+    }
+
+    switch (m->type) {
+    case MOVE_IMM:
+    case MOVE_REG:
+        dsp_write_reg(s, m->reg, v);
+        break;
+    case MOVE_MEM:
+        if (m->write) {
+            dsp_mem_write(s, m->space, addr, v);
+        } else {
+            dsp_write_reg(s, m->reg, v);
+        }
+        break;
+    case MOVE_L:
+        if (m->write) {
+            dsp_mem_write(s, DSP_SPACE_X, addr, lv >> 24);
+            dsp_mem_write(s, DSP_SPACE_Y, addr, lv);
+        } else {
+            dsp_write_l(s, m->reg, lv);
+        }
+        break;
+    case MOVE_XY:
+        if (m->write) {
+            dsp_mem_write(s, DSP_SPACE_X, addr, v);
+        } else {
+            dsp_write_reg(s, m->reg, v);
+        }
+        if (m->write2) {
+            dsp_mem_write(s, DSP_SPACE_Y, addr2, v2);
+        } else {
+            dsp_write_reg(s, m->reg2, v2);
+        }
+        break;
+    case MOVE_XR:
+        if (m->write) {
+            dsp_mem_write(s, DSP_SPACE_X, addr, v);
+        } else {
+            dsp_write_reg(s, m->reg, v);
+        }
+        dsp_write_reg(s, m->dst2, v2);
+        break;
+    case MOVE_RY:
+        dsp_write_reg(s, m->dst2, v);
+        if (m->write2) {
+            dsp_mem_write(s, DSP_SPACE_Y, addr2, v2);
+        } else {
+            dsp_write_reg(s, m->reg2, v2);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+/* XY moves are the common case in effect loops; keep them off the
+ * generic path */
+static void dsp_parallel_xy(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    uint32_t addr = dsp_ea(s, insn, m->mode, m->rn);
+    uint32_t addr2 = dsp_ea(s, insn, m->mode2, m->rn2);
+    uint32_t v, v2;
+
+    if (m->write) {
+        v = dsp_read_reg(s, m->reg);
+    } else {
+        v = likely(addr < DSP_X_SIZE) ? s->x[addr] : 0;
+    }
+    if (m->write2) {
+        v2 = dsp_read_reg(s, m->reg2);
+    } else {
+        v2 = likely(addr2 < DSP_Y_SIZE) ? s->y[addr2] : 0;
+    }
+
+    if (insn->alu) {
+        insn->alu(s, insn);
+    }
+
+    if (m->write) {
+        dsp_mem_write(s, DSP_SPACE_X, addr, v);
+    } else {
+        dsp_write_reg(s, m->reg, v);
+    }
+    if (m->write2) {
+        dsp_mem_write(s, DSP_SPACE_Y, addr2, v2);
+    } else {
+        dsp_write_reg(s, m->reg2, v2);
+    }
+}
+
+/* ALU operation alone */
+static void dsp_parallel_none(DSPState *s, const DSPInsn *insn)
+{
+    insn->alu(s, insn);
+}
+
+
+/* instructions without a parallel move */
+
+static const DSPInsn *dsp_fetch(DSPState *s, uint32_t pc);
+
+static void dsp_illegal(DSPState *s, const DSPInsn *insn)
+{
+    DSP_DPRINTF("dsp: illegal instruction 0x%06x at 0x%04x\n",
+                insn->opcode, s->pc - insn->words);
+    s->illegal_opcode = insn->opcode;
+    s->stopped = true;
+}
+
+static void dsp_nop(DSPState *s, const DSPInsn *insn)
+{
+}
+
+static void dsp_stop(DSPState *s, const DSPInsn *insn)
+{
+    s->stopped = true;
+}
+
+static void dsp_wait(DSPState *s, const DSPInsn *insn)
+{
+    s->waiting = true;
+}
+
+static void dsp_rts(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t sr;
+    dsp_pop(s, &s->pc, &sr);
+}
+
+static void dsp_rti(DSPState *s, const DSPInsn *insn)
+{
+    dsp_pop(s, &s->pc, &s->sr);
+}
+
+static void dsp_loop_pop(DSPState *s)
+{
+    uint32_t pc, sr;
+    dsp_pop(s, &pc, &sr);
+    s->sr = (s->sr & ~SR_LF) | (sr & SR_LF);
+    dsp_pop(s, &s->la, &s->lc);
+}
+
+static void dsp_enddo(DSPState *s, const DSPInsn *insn)
+{
+    dsp_loop_pop(s);
+}
+
+static void dsp_incdec(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    *acc = dsp_add56(s, *acc, 1, insn->flags);
+}
+
+static void dsp_andi_ori(DSPState *s, const DSPInsn *insn)
+{
+    static const unsigned int shift[4] = { 8, 0, 0, 8 };
+    uint32_t *reg = (insn->d & 2) ? &s->omr : &s->sr;
+    uint32_t mask = 0xFF << shift[insn->d];
+    uint32_t imm = insn->imm << shift[insn->d];
+
+    if (insn->flags) {
+        *reg |= imm;
+    } else {
+        *reg &= imm | ~mask;
+    }
+}
+
+static void dsp_alu_imm(DSPState *s, const DSPInsn *insn)
+{
+    int64_t *acc = dsp_acc(s, insn->d);
+    int64_t imm = (int64_t)sext24(insn->imm) << 24;
+
+    switch (insn->flags) {
+    case IMM_ADD: *acc = dsp_add56(s, *acc, imm, false); break;
+    case IMM_SUB: *acc = dsp_add56(s, *acc, imm, true); break;
+    case IMM_CMP: dsp_add56(s, *acc, imm, true); break;
+    case IMM_AND: dsp_set_a1(s, insn->d, dsp_get_a1(s, insn->d) & insn->imm);
+        break;
+    case IMM_OR: dsp_set_a1(s, insn->d, dsp_get_a1(s, insn->d) | insn->imm);
+        break;
+    default: dsp_set_a1(s, insn->d, dsp_get_a1(s, insn->d) ^ insn->imm);
+        break;
+    }
+}
+
+static void dsp_shift_imm(DSPState *s, const DSPInsn *insn)
+{
+    int64_t src = *dsp_acc(s, insn->s1);
+    unsigned int count = insn->imm;
+    int64_t r;
+
+    s->sr &= ~(SR_C | SR_V);
+    if (!count) {
+        r = src;
+    } else if (insn->flags) {
+        /* ASL */
+        if (count <= 56 && ((uint64_t)src >> (56 - count)) & 1) {
+            s->sr |= SR_C;
+        }
+        r = sext56(((uint64_t)src << count) & ACC_MASK);
+        if ((r >> count) != src) {
+            s->sr |= SR_V | SR_L;
+        }
+    } else {
+        if ((src >> (count - 1)) & 1) {
+            s->sr |= SR_C;
+        }
+        r = src >> count;
+    }
+    *dsp_acc(s, insn->d) = r;
+    dsp_ccr_nzeu(s, r);
+}
+
+static void dsp_tcc(DSPState *s, const DSPInsn *insn)
+{
+    if (dsp_cond(s, insn->cc)) {
+        *dsp_acc(s, insn->d) = dsp_read_src(s, insn->s1);
+        if (insn->flags) {
+            s->r[insn->s2 & 7] = s->r[insn->s2 >> 4];
+        }
+    }
+}
+
+static void dsp_movec_reg(DSPState *s, const DSPInsn *insn)
+{
+    dsp_write_reg(s, insn->d, dsp_read_reg(s, insn->s1));
+}
+
+static void dsp_movec_mem(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    if (m->mode == EA_IMM) {
+        dsp_write_reg(s, m->reg, insn->imm);
+        return;
+    }
+    uint32_t addr = dsp_ea(s, insn, m->mode, m->rn);
+    if (m->write) {
+        dsp_mem_write(s, m->space, addr, dsp_read_reg(s, m->reg));
+    } else {
+        dsp_write_reg(s, m->reg, dsp_mem_read(s, m->space, addr));
+    }
+}
+
+static void dsp_lua(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t r = s->r[insn->move.rn];
+    dsp_ea(s, insn, insn->move.mode, insn->move.rn);
+    uint32_t updated = s->r[insn->move.rn];
+    s->r[insn->move.rn] = r;
+    dsp_write_reg(s, insn->d, updated);
+}
+
+static void dsp_do(DSPState *s, uint32_t count, uint32_t la)
+{
+    dsp_push(s, s->la, s->lc);
+    dsp_push(s, s->pc, s->sr);
+    s->la = la;
+    s->lc = count ? count : 0x10000;
+    s->sr |= SR_LF;
+}
+
+static void dsp_rep(DSPState *s, uint32_t count)
+{
+    uint32_t pc = s->pc;
+    const DSPInsn *insn = dsp_fetch(s, pc);
+
+    if (!count) {
+        count = 0x10000;
+    }
+    while (count--) {
+        s->pc = pc + insn->words;
+        insn->fn(s, insn);
+        s->cycles += insn->cycles;
+    }
+}
+
+/* loop count from an immediate, memory or a register */
+static uint32_t dsp_count_operand(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    switch (m->type) {
+    case MOVE_IMM:
+        return insn->s2 << 8 | insn->s1;
+    case MOVE_REG:
+        return dsp_read_reg(s, m->reg);
+    default:
+        return dsp_mem_read(s, m->space, dsp_ea(s, insn, m->mode, m->rn));
+    }
+}
+
+static void dsp_do_insn(DSPState *s, const DSPInsn *insn)
+{
+    dsp_do(s, dsp_count_operand(s, insn), insn->ext);
+}
+
+static void dsp_rep_insn(DSPState *s, const DSPInsn *insn)
+{
+    dsp_rep(s, dsp_count_operand(s, insn));
+}
+
+static void dsp_movem(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    uint32_t addr = dsp_ea(s, insn, m->mode, m->rn);
+    if (m->write) {
+        dsp_mem_write(s, DSP_SPACE_P, addr, dsp_read_reg(s, m->reg));
+    } else {
+        dsp_write_reg(s, m->reg, dsp_mem_read(s, DSP_SPACE_P, addr));
+    }
+}
+
+static void dsp_jmp(DSPState *s, const DSPInsn *insn)
+{
+    s->pc = insn->imm;
+}
+
+static void dsp_jmp_ea(DSPState *s, const DSPInsn *insn)
+{
+    s->pc = dsp_ea(s, insn, insn->move.mode, insn->move.rn);
+}
+
+static void dsp_jcc(DSPState *s, const DSPInsn *insn)
+{
+    if (dsp_cond(s, insn->cc)) {
+        s->pc = insn->imm;
+    }
+}
+
+static void dsp_jcc_ea(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t addr = dsp_ea(s, insn, insn->move.mode, insn->move.rn);
+    if (dsp_cond(s, insn->cc)) {
+        s->pc = addr;
+    }
+}
+
+static void dsp_jsr(DSPState *s, const DSPInsn *insn)
+{
+    dsp_push(s, s->pc, s->sr);
+    s->pc = insn->imm;
+}
+
+static void dsp_jsr_ea(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t addr = dsp_ea(s, insn, insn->move.mode, insn->move.rn);
+    dsp_push(s, s->pc, s->sr);
+    s->pc = addr;
+}
+
+static void dsp_jscc(DSPState *s, const DSPInsn *insn)
+{
+    if (dsp_cond(s, insn->cc)) {
+        dsp_jsr(s, insn);
+    }
+}
+
+static void dsp_jscc_ea(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t addr = dsp_ea(s, insn, insn->move.mode, insn->move.rn);
+    if (dsp_cond(s, insn->cc)) {
+        dsp_push(s, s->pc, s->sr);
+        s->pc = addr;
+    }
+}
+
+/* BCLR, BSET, JCLR and JSET on a bit of v. Returns the new value. */
+static uint32_t dsp_bit_op(DSPState *s, const DSPInsn *insn, uint32_t v)
+{
+    bool bit = (v >> insn->s1) & 1;
+
+    s->sr = (s->sr & ~SR_C) | (bit ? SR_C : 0);
+    if (insn->flags & BIT_JUMP) {
+        if (bit == !!(insn->flags & BIT_SET)) {
+            s->pc = insn->ext;
+        }
+        return v;
+    }
+    if (insn->flags & BIT_SET) {
+        return v | (1 << insn->s1);
+    }
+    return v & ~(1 << insn->s1);
+}
+
+static void dsp_bit_mem(DSPState *s, const DSPInsn *insn)
+{
+    const DSPMove *m = &insn->move;
+    uint32_t addr = dsp_ea(s, insn, m->mode, m->rn);
+    uint32_t v = dsp_mem_read(s, m->space, addr);
+    uint32_t r = dsp_bit_op(s, insn, v);
+    if (!(insn->flags & BIT_JUMP)) {
+        dsp_mem_write(s, m->space, addr, r);
+    }
+}
+
+static void dsp_bit_reg(DSPState *s, const DSPInsn *insn)
+{
+    uint32_t v = dsp_read_reg(s, insn->d);
+    uint32_t r = dsp_bit_op(s, insn, v);
+    if (!(insn->flags & BIT_JUMP)) {
+        dsp_write_reg(s, insn->d, r);
+    }
+}
+
+
+/* decoder */
+
+/* Decode a 6 bit MMMRRR effective address. The absolute and immediate
+ * forms take the extension word. */
+static bool dsp_decode_ea(DSPInsn *insn, unsigned int ea,
+                          uint8_t *mode, uint8_t *rn)
+{
+    *mode = (ea >> 3) & 7;
+    *rn = ea & 7;
+    if (*mode == 6) {
+        if (*rn == 0) {
+            *mode = EA_ABS;
+        } else if (*rn == 4) {
+            *mode = EA_IMM;
+        } else {
+            return false;
+        }
+        insn->imm = insn->ext;
+        insn->words = 2;
+    }
+    return true;
+}
+
+static bool dsp_valid_reg(unsigned int reg)
+{
+    return reg >= REG_X0 && reg < REG_M0 + 8;
+}
+
+/* ADD, SUB, ... operands: JJJ selects the source */
+static unsigned int dsp_decode_jjj(unsigned int jjj, unsigned int d)
+{
+    static const uint8_t regs[8] = {
+        0, 0, REG_X, REG_Y, REG_X0, REG_Y0, REG_X1, REG_Y1
+    };
+    if (jjj <= 1) {
+        return d ? REG_A : REG_B;
+    }
+    return regs[jjj];
+}
+
+static void dsp_decode_alu(DSPInsn *insn, unsigned int op)
+{
+    static const uint8_t qqq[8][2] = {
+        { REG_X0, REG_X0 }, { REG_Y0, REG_Y0 },
+        { REG_X1, REG_X0 }, { REG_Y1, REG_Y0 },
+        { REG_X0, REG_Y1 }, { REG_Y0, REG_X0 },
+        { REG_X1, REG_Y0 }, { REG_Y1, REG_X1 },
+    };
+    static const uint8_t logic_regs[4] = { REG_X0, REG_Y0, REG_X1, REG_Y1 };
+    unsigned int d = (op >> 3) & 1;
+    unsigned int jjj = (op >> 4) & 7;
+
+    insn->d = d;
+    insn->alu = NULL;
+
+    if (op & 0x80) {
+        static const uint8_t mul_flags[4] = {
+            0, MUL_ROUND, MUL_ACC, MUL_ACC | MUL_ROUND
+        };
+        insn->s1 = qqq[jjj][0];
+        insn->s2 = qqq[jjj][1];
+        insn->flags = mul_flags[op & 3] | ((op & 4) ? MUL_NEG : 0);
+        insn->alu = dsp_alu_mul;
+        return;
+    }
+
+    insn->s1 = dsp_decode_jjj(jjj, d);
+    switch (op & 7) {
+    case 0:
+        if (jjj == 0) {
+            /* plain move; 0x08 is undefined */
+            if (d) {
+                insn->fn = dsp_illegal;
+            }
+        } else {
+            insn->alu = dsp_alu_add;
+        }
+        break;
+    case 1:
+        if (jjj == 1) {
+            insn->alu = dsp_alu_rnd;
+        } else if (jjj == 2 || jjj == 3) {
+            insn->alu = dsp_alu_adc;
+        } else {
+            insn->alu = dsp_alu_tfr;
+        }
+        break;
+    case 4:
+        if (jjj == 0) {
+            insn->fn = dsp_illegal;
+        } else {
+            insn->alu = dsp_alu_sub;
+        }
+        break;
+    case 5:
+        if (jjj == 1) {
+            /* MAX A,B is 0x1D, MAXM A,B 0x15 */
+            insn->flags = !d;
+            insn->alu = dsp_alu_max;
+        } else if (jjj == 2 || jjj == 3) {
+            insn->alu = dsp_alu_sbc;
+        } else {
+            insn->alu = dsp_alu_cmp;
+        }
+        break;
+    case 7:
+        if (jjj == 1) {
+            insn->alu = dsp_alu_not;
+        } else if (jjj == 2) {
+            insn->alu = dsp_alu_ror;
+        } else if (jjj == 3) {
+            insn->alu = dsp_alu_rol;
+        } else {
+            insn->alu = dsp_alu_cmpm;
+        }
+        break;
+    default:
+        if (jjj >= 4) {
+            static const DSPInsnFn logic[8] = {
+                [2] = dsp_alu_or, [3] = dsp_alu_eor, [6] = dsp_alu_and,
+            };
+            insn->s1 = logic_regs[jjj & 3];
+            insn->alu = logic[op & 7];
+        } else {
+            static const DSPInsnFn single[4][8] = {
+                { [2] = dsp_alu_addr, [3] = dsp_alu_tst,
+                  [6] = dsp_alu_subr },
+                { [2] = dsp_alu_addl, [3] = dsp_alu_clr,
+                  [6] = dsp_alu_subl },
+                { [2] = dsp_alu_asr, [3] = dsp_alu_lsr,
+                  [6] = dsp_alu_abs },
+                { [2] = dsp_alu_asl, [3] = dsp_alu_lsl,
+                  [6] = dsp_alu_neg },
+            };
+            insn->alu = single[jjj][op & 7];
+        }
+        if (!insn->alu) {
+            insn->fn = dsp_illegal;
+        }
+        break;
+    }
+}
+
+static void dsp_decode_parallel(DSPInsn *insn, uint32_t op)
+{
+    DSPMove *m = &insn->move;
+    static const uint8_t xy_x_regs[4] = { REG_X0, REG_X1, REG_A, REG_B };
+    static const uint8_t xy_y_regs[4] = { REG_Y0, REG_Y1, REG_A, REG_B };
+    /* restricted XY addressing: (Rn), (Rn)+Nn, (Rn)-, (Rn)+ */
+    static const uint8_t xy_modes[4] = { 4, 1, 2, 3 };
+
+    insn->fn = dsp_parallel;
+    dsp_decode_alu(insn, op & 0xFF);
+
+    if (op & 0x800000) {
+        /* 1wmm eeff WrrM MRRR: XY memory move */
+        m->type = MOVE_XY;
+        m->reg = xy_x_regs[(op >> 18) & 3];
+        m->write = !((op >> 15) & 1);
+        m->mode = xy_modes[(op >> 11) & 3];
+        m->rn = (op >> 8) & 7;
+        m->reg2 = xy_y_regs[(op >> 16) & 3];
+        m->write2 = !((op >> 22) & 1);
+        m->mode2 = xy_modes[(op >> 20) & 3];
+        m->rn2 = ((op >> 13) & 3) + (m->rn >= 4 ? 0 : 4);
+        if (insn->fn == dsp_parallel) {
+            insn->fn = dsp_parallel_xy;
+        }
+    } else if ((op & 0xF00000) == 0x400000 && !(op & 0x040000)) {
+        /* 0100 L0LL W1MM MRRR: long move */
+        m->type = MOVE_L;
+        m->reg = ((op >> 17) & 4) | ((op >> 16) & 3);
+        m->write = !((op >> 15) & 1);
+        if (op & 0x4000) {
+            if (!dsp_decode_ea(insn, (op >> 8) & 0x3F, &m->mode, &m->rn)
+                || m->mode == EA_IMM) {
+                insn->fn = dsp_illegal;
+            }
+        } else {
+            m->mode = EA_ABS;
+            insn->imm = (op >> 8) & 0x3F;
+        }
+    } else if (op & 0x400000) {
+        /* 01dd sddd W1MM MRRR: X or Y memory move */
+        m->type = MOVE_MEM;
+        m->reg = ((op >> 17) & 0x18) | ((op >> 16) & 7);
+        m->space = (op >> 19) & 1;
+        m->write = !((op >> 15) & 1);
+        if (op & 0x4000) {
+            if (!dsp_decode_ea(insn, (op >> 8) & 0x3F, &m->mode, &m->rn)
+                || (m->mode == EA_IMM && m->write)) {
+                insn->fn = dsp_illegal;
+            }
+        } else {
+            m->mode = EA_ABS;
+            insn->imm = (op >> 8) & 0x3F;
+        }
+        if (!dsp_valid_reg(m->reg)) {
+            insn->fn = dsp_illegal;
+        }
+    } else if ((op & 0xF00000) == 0x100000) {
+        uint8_t mode, rn;
+        if (!dsp_decode_ea(insn, (op >> 8) & 0x3F, &mode, &rn)) {
+            insn->fn = dsp_illegal;
+        }
+        if (!(op & 0x4000)) {
+            /* 0001 ffdF W0MM MRRR: X:ea and S,Y0/Y1 */
+            m->type = MOVE_XR;
+            m->reg = xy_x_regs[(op >> 18) & 3];
+            m->write = !((op >> 15) & 1);
+            m->mode = mode;
+            m->rn = rn;
+            m->src2 = (op & 0x20000) ? REG_B : REG_A;
+            m->dst2 = (op & 0x10000) ? REG_Y1 : REG_Y0;
+        } else {
+            /* 0001 deff W1MM MRRR: S,X0/X1 and Y:ea */
+            m->type = MOVE_RY;
+            m->src2 = (op & 0x80000) ? REG_B : REG_A;
+            m->dst2 = (op & 0x40000) ? REG_X1 : REG_X0;
+            m->reg2 = xy_y_regs[(op >> 16) & 3];
+            m->write2 = !((op >> 15) & 1);
+            m->mode2 = mode;
+            m->rn2 = rn;
+        }
+        if (mode == EA_IMM && !(op & 0x8000)) {
+            insn->fn = dsp_illegal;
+        }
+    } else if ((op >> 8) == 0x2000) {
+        m->type = MOVE_NONE;
+        if (insn->fn == dsp_parallel && insn->alu) {
+            insn->fn = dsp_parallel_none;
+        }
+    } else if ((op >> 13) == 0x102) {
+        /* 0010 0000 010M MRRR: address register update */
+        static const uint8_t update_modes[4] = { 0, 1, 2, 3 };
+        m->type = MOVE_UPDATE;
+        m->mode = update_modes[(op >> 11) & 3];
+        m->rn = (op >> 8) & 7;
+    } else if ((op & 0xFC0000) == 0x200000) {
+        /* 0010 00ee eeed dddd: register to register */
+        m->type = MOVE_REG;
+        m->src2 = (op >> 13) & 0x1F;
+        m->reg = (op >> 8) & 0x1F;
+        if (!dsp_valid_reg(m->src2) || !dsp_valid_reg(m->reg)) {
+            insn->fn = dsp_illegal;
+        }
+    } else {
+        /* 001d dddd iiii iiii: immediate short */
+        uint32_t imm = (op >> 8) & 0xFF;
+        m->type = MOVE_IMM;
+        m->reg = (op >> 16) & 0x1F;
+        if ((m->reg >= REG_X0 && m->reg <= REG_Y1)
+            || (m->reg >= REG_A1 && m->reg <= REG_B)) {
+            /* fractional: left aligned */
+            insn->imm = imm << 16;
+        } else {
+            insn->imm = imm;
+        }
+        if (!dsp_valid_reg(m->reg)) {
+            insn->fn = dsp_illegal;
+        }
+    }
+}
+
+static void dsp_decode_nonparallel(DSPInsn *insn, uint32_t pc, uint32_t op)
+{
+    DSPMove *m = &insn->move;
+    unsigned int low = op & 0xFF;
+    unsigned int mid = (op >> 8) & 0xFF;
+
+    switch (op >> 16) {
+    case 0x00:
+        switch (op) {
+        case 0x000000: insn->fn = dsp_nop; return;
+        case 0x000004: insn->fn = dsp_rti; return;
+        case 0x00000C: insn->fn = dsp_rts; return;
+        case 0x000084: insn->fn = dsp_nop; return;      /* RESET */
+        case 0x000086: insn->fn = dsp_wait; return;
+        case 0x000087: insn->fn = dsp_stop; return;
+        case 0x00008C: insn->fn = dsp_enddo; return;
+        case 0x000008: case 0x000009:
+        case 0x00000A: case 0x00000B:
+            insn->fn = dsp_incdec;
+            insn->d = op & 1;
+            insn->flags = (op >> 1) & 1;
+            return;
+        }
+        if ((low & 0xBC) == 0xB8) {
+            insn->fn = dsp_andi_ori;
+            insn->d = low & 3;
+            insn->imm = mid;
+            insn->flags = (low >> 6) & 1;
+        }
+        return;
+    case 0x01:
+        if ((mid & 0xC0) == 0x40 && (low & 0x80) && !(low & 0x30)) {
+            static const int8_t ops[8] = {
+                IMM_ADD, -1, IMM_OR, IMM_EOR, IMM_SUB, IMM_CMP, IMM_AND, -1
+            };
+            if (ops[low & 7] < 0) {
+                return;
+            }
+            insn->fn = dsp_alu_imm;
+            insn->d = (low >> 3) & 1;
+            insn->flags = ops[low & 7];
+            if (low & 0x40) {
+                if (mid != 0x40) {
+                    insn->fn = NULL;
+                    return;
+                }
+                insn->imm = insn->ext;
+                insn->words = 2;
+            } else {
+                insn->imm = mid & 0x3F;
+            }
+        }
+        return;
+    case 0x02:
+    case 0x03:
+        /* Tcc S1,D1 [S2,D2] */
+        if ((mid & 0x08) || (low & 0x80)
+            || ((op >> 16) == 0x02 && (low & 0x07))) {
+            return;
+        }
+        insn->fn = dsp_tcc;
+        insn->cc = (mid >> 4) & 0xF;
+        insn->d = (low >> 3) & 1;
+        insn->s1 = ((low >> 4) & 7) == 0 ? (insn->d ? REG_A : REG_B)
+                                         : dsp_decode_jjj(low >> 4 & 7,
+                                                          insn->d);
+        if ((op >> 16) == 0x03) {
+            insn->flags = 1;
+            insn->s2 = (mid & 7) << 4 | (low & 7);
+        }
+        return;
+    case 0x04:
+        if ((low & 0xE0) == 0xA0 && (mid & 0x40)) {
+            /* MOVEC S1,D2 / S2,D1 */
+            unsigned int ctrl = 0x20 | (low & 0x1F);
+            unsigned int reg = mid & 0x3F;
+            insn->fn = dsp_movec_reg;
+            insn->d = (mid & 0x80) ? ctrl : reg;
+            insn->s1 = (mid & 0x80) ? reg : ctrl;
+        } else if ((mid & 0xE0) == 0x40 && (low & 0xF0) == 0x10) {
+            /* LUA ea,D */
+            static const uint8_t lua_modes[4] = { 0, 1, 2, 3 };
+            insn->fn = dsp_lua;
+            m->mode = lua_modes[(mid >> 3) & 3];
+            m->rn = mid & 7;
+            insn->d = ((low & 8) ? REG_N0 : REG_R0) + (low & 7);
+        }
+        return;
+    case 0x05:
+        if ((low & 0xE0) == 0xA0) {
+            /* MOVEC #xx,D1 */
+            insn->fn = dsp_movec_mem;
+            m->mode = EA_IMM;
+            m->reg = 0x20 | (low & 0x1F);
+            insn->imm = mid;
+        } else if ((low & 0xA0) == 0x20) {
+            /* MOVEC [X|Y]:ea / [X|Y]:aa */
+            insn->fn = dsp_movec_mem;
+            m->reg = 0x20 | (low & 0x1F);
+            m->space = (low >> 6) & 1;
+            m->write = !(mid & 0x80);
+            if (mid & 0x40) {
+                if (!dsp_decode_ea(insn, mid & 0x3F, &m->mode, &m->rn)
+                    || (m->mode == EA_IMM && m->write)) {
+                    insn->fn = NULL;
+                }
+            } else {
+                m->mode = EA_ABS;
+                insn->imm = mid & 0x3F;
+            }
+        }
+        return;
+    case 0x06:
+        if (low & 0x80) {
+            /* DO/DOR/REP #xxx */
+            m->type = MOVE_IMM;
+            insn->s1 = mid;
+            insn->s2 = low & 0xF;
+            switch ((low >> 4) & 7) {
+            case 0:
+                insn->fn = dsp_do_insn;
+                insn->words = 2;
+                break;
+            case 1:
+                insn->fn = dsp_do_insn;
+                insn->words = 2;
+                insn->ext = (pc + insn->ext) & 0xFFFFFF;
+                break;
+            case 2:
+                insn->fn = dsp_rep_insn;
+                break;
+            }
+            return;
+        }
+        if ((low & 0x9F) != 0) {
+            return;
+        }
+        insn->fn = (low & 0x20) ? dsp_rep_insn : dsp_do_insn;
+        insn->words = (low & 0x20) ? 1 : 2;
+        switch (mid >> 6) {
+        case 0:
+            m->type = MOVE_MEM;
+            m->mode = EA_ABS;
+            m->space = (low >> 6) & 1;
+            insn->imm = mid & 0x3F;
+            break;
+        case 1:
+            m->type = MOVE_MEM;
+            m->space = (low >> 6) & 1;
+            m->mode = (mid >> 3) & 7;
+            m->rn = mid & 7;
+            if (m->mode == 6) {
+                insn->fn = NULL;
+            }
+            break;
+        case 3:
+            m->type = MOVE_REG;
+            m->reg = mid & 0x3F;
+            break;
+        default:
+            insn->fn = NULL;
+            break;
+        }
+        return;
+    case 0x07:
+        /* MOVEM */
+        if ((low & 0x40) || ((mid & 0x40) == 0) != ((low & 0x80) == 0)) {
+            return;
+        }
+        insn->fn = dsp_movem;
+        m->reg = low & 0x3F;
+        m->write = !(mid & 0x80);
+        if (mid & 0x40) {
+            if (!dsp_decode_ea(insn, mid & 0x3F, &m->mode, &m->rn)
+                || m->mode == EA_IMM) {
+                insn->fn = NULL;
+            }
+        } else {
+            m->mode = EA_ABS;
+            insn->imm = mid & 0x3F;
+        }
+        return;
+    case 0x0A:
+    case 0x0B:
+        if ((mid & 0xC0) == 0xC0 && (low & 0x80)) {
+            /* JMP/Jcc/JSR/JScc ea */
+            bool jsr = (op >> 16) == 0x0B;
+            if (!dsp_decode_ea(insn, mid & 0x3F, &m->mode, &m->rn)
+                || m->mode == EA_IMM) {
+                return;
+            }
+            if (low == 0x80) {
+                insn->fn = jsr ? dsp_jsr_ea : dsp_jmp_ea;
+            } else if ((low & 0xF0) == 0xA0) {
+                insn->fn = jsr ? dsp_jscc_ea : dsp_jcc_ea;
+                insn->cc = low & 0xF;
+            }
+            return;
+        }
+        if ((op >> 16) == 0x0B) {
+            return;
+        }
+        insn->s1 = low & 0x1F;
+        insn->flags = (low & 0x20) ? BIT_SET : 0;
+        if ((mid & 0xC0) == 0xC0) {
+            /* bit operations on a register */
+            insn->d = mid & 0x3F;
+            if ((low & 0xC0) == 0x00) {
+                insn->flags |= BIT_JUMP;
+                insn->words = 2;
+            } else if ((low & 0xC0) != 0x40) {
+                return;
+            }
+            insn->fn = dsp_bit_reg;
+            return;
+        }
+        m->space = (low >> 6) & 1;
+        if (low & 0x80) {
+            insn->flags |= BIT_JUMP;
+        }
+        switch (mid >> 6) {
+        case 0:
+            m->mode = EA_ABS;
+            insn->imm = mid & 0x3F;
+            break;
+        case 1:
+            if (!dsp_decode_ea(insn, mid & 0x3F, &m->mode, &m->rn)
+                || m->mode == EA_IMM
+                || (m->mode == EA_ABS && (insn->flags & BIT_JUMP))) {
+                return;
+            }
+            break;
+        default:
+            /* peripheral space */
+            m->mode = EA_ABS;
+            insn->imm = 0xFFFFC0 + (mid & 0x3F);
+            break;
+        }
+        if (insn->flags & BIT_JUMP) {
+            insn->words = 2;
+        }
+        insn->fn = dsp_bit_mem;
+        return;
+    case 0x0C:
+        if ((mid & 0xF0) == 0x00) {
+            insn->fn = dsp_jmp;
+            insn->imm = op & 0xFFF;
+        } else if (mid == 0x1C || mid == 0x1D) {
+            /* ASR/ASL #ii,S,D */
+            insn->fn = dsp_shift_imm;
+            insn->flags = mid & 1;
+            insn->s1 = (low >> 7) & 1;
+            insn->d = low & 1;
+            insn->imm = (low >> 1) & 0x3F;
+        }
+        return;
+    case 0x0D:
+        if ((mid & 0xF0) == 0x00) {
+            insn->fn = dsp_jsr;
+            insn->imm = op & 0xFFF;
+        } else if (mid == 0x10) {
+            /* Bcc/BRA/BSR xxxx */
+            insn->words = 2;
+            insn->imm = (pc + insn->ext) & 0xFFFFFF;
+            if ((low & 0xF0) == 0x40) {
+                insn->fn = dsp_jcc;
+                insn->cc = low & 0xF;
+            } else if (low == 0xC0) {
+                insn->fn = dsp_jmp;
+            } else if (low == 0x80) {
+                insn->fn = dsp_jsr;
+            }
+        }
+        return;
+    case 0x0E:
+        insn->fn = dsp_jcc;
+        insn->cc = (mid >> 4) & 0xF;
+        insn->imm = op & 0xFFF;
+        return;
+    case 0x0F:
+        insn->fn = dsp_jscc;
+        insn->cc = (mid >> 4) & 0xF;
+        insn->imm = op & 0xFFF;
+        return;
+    default:
+        return;
+    }
+}
+
+static void dsp_decode(DSPState *s, uint32_t pc, DSPInsn *insn)
+{
+    uint32_t op = s->p[pc];
+
+    memset(insn, 0, sizeof(*insn));
+    insn->opcode = op;
+    insn->ext = pc + 1 < DSP_P_SIZE ? s->p[pc + 1] : 0;
+    insn->words = 1;
+
+    if (op & 0xF00000) {
+        dsp_decode_parallel(insn, op);
+    } else {
+        dsp_decode_nonparallel(insn, pc, op);
+    }
+    if (!insn->fn) {
+        insn->fn = dsp_illegal;
+    }
+    insn->cycles = insn->words;
+}
+
+static const DSPInsn *dsp_fetch(DSPState *s, uint32_t pc)
+{
+    static const DSPInsn out_of_range = {
+        .fn = dsp_illegal,
+        .words = 1,
+        .cycles = 1,
+    };
+    if (unlikely(pc >= DSP_P_SIZE)) {
+        return &out_of_range;
+    }
+    DSPInsn *insn = &s->pcache[pc];
+    if (unlikely(!insn->fn)) {
+        dsp_decode(s, pc, insn);
+    }
+    return insn;
+}
+
+int dsp56300_run(DSPState *s, int cycles)
+{
+    uint64_t start = s->cycles;
+    uint64_t end = start + cycles;
+
+    s->waiting = false;
+    while (!s->stopped && !s->waiting && s->cycles < end) {
+        uint32_t pc = s->pc;
+        const DSPInsn *insn = dsp_fetch(s, pc);
+
+        s->pc = pc + insn->words;
+        s->cycles += insn->cycles;
+        insn->fn(s, insn);
+
+        /* hardware DO loop: the last word of the body is at LA */
+        if (unlikely(s->sr & SR_LF) && pc + insn->words - 1 == s->la) {
+            if (s->lc > 1) {
+                s->lc--;
+                s->pc = s->ssh[s->sp];
+            } else {
+                dsp_loop_pop(s);
+            }
+        }
+    }
+    return s->cycles - start;
+}
+
+uint32_t dsp56300_read_memory(DSPState *s, int space, uint32_t addr)
+{
+    return dsp_mem_read(s, space, addr);
+}
+
+void dsp56300_write_memory(DSPState *s, int space, uint32_t addr,
+                           uint32_t value)
+{
+    dsp_mem_write(s, space, addr, value);
+}
+
+void dsp56300_reset(DSPState *s)
+{
+    int i;
+
+    s->x0 = s->x1 = s->y0 = s->y1 = 0;
+    s->a = s->b = 0;
+    for (i = 0; i < 8; i++) {
+        s->r[i] = 0;
+        s->n[i] = 0;
+        s->m[i] = 0xFFFFFF;
+    }
+    s->pc = 0;
+    s->sr = SR_RESET;
+    s->omr = 0;
+    s->sp = 0;
+    s->la = s->lc = 0;
+    s->vba = s->sc = s->sz = s->ep = 0;
+    s->waiting = false;
+    s->stopped = false;
+    s->illegal_opcode = 0;
+}
+
+void dsp56300_copy_state(DSPState *dst, const DSPState *src)
+{
+    memcpy(dst, src, offsetof(DSPState, pcache));
+    memset(dst->pcache, 0, sizeof(dst->pcache));
+}
+
+void dsp56300_init(DSPState *s)
+{
+    memset(s, 0, sizeof(*s));
+    dsp56300_reset(s);
+}
@@ -0,0 +1,106 @@
+/*
+ * MCPX DSP56300 emulation
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_DSP56300_H
+#define HW_DSP56300_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Memory sizes, in 24 bit words. X memory includes the GP mix buffer. */
+#define DSP_X_SIZE 0x1800
+#define DSP_Y_SIZE 0x0800
+#define DSP_P_SIZE 0x1000
+
+#define DSP_SPACE_X 0
+#define DSP_SPACE_Y 1
+#define DSP_SPACE_P 2
+
+#define DSP_STACK_SIZE 16
+
+typedef struct DSPState DSPState;
+typedef struct DSPInsn DSPInsn;
+
+typedef void (*DSPInsnFn)(DSPState *s, const DSPInsn *insn);
+
+/* A parallel data move, decoded from bits 23:8 of an instruction */
+typedef struct DSPMove {
+    uint8_t type;
+    uint8_t write;          /* register -> memory */
+    uint8_t space;
+    uint8_t reg;
+    uint8_t mode, rn;       /* effective address: MMM, RRR */
+    /* second half of XY, X:R and R:Y moves */
+    uint8_t write2;
+    uint8_t reg2;
+    uint8_t mode2, rn2;
+    uint8_t src2, dst2;     /* register to register half */
+} DSPMove;
+
+/* A pre-decoded instruction. P memory is decoded lazily into a cache
+ * of these and executed by calling fn directly; writes to P memory
+ * drop the affected entries. */
+struct DSPInsn {
+    DSPInsnFn fn;
+    DSPInsnFn alu;          /* data ALU operation of a parallel insn */
+    DSPMove move;
+    uint32_t opcode;
+    uint32_t ext;           /* extension word, if words == 2 */
+    uint32_t imm;
+    uint8_t words;
+    uint8_t cycles;
+    uint8_t d, s1, s2;
+    uint8_t cc;
+    uint8_t flags;
+};
+
+struct DSPState {
+    /* registers */
+    uint32_t x0, x1, y0, y1;
+    int64_t a, b;           /* 56 bit, sign extended */
+    uint32_t r[8], n[8], m[8];
+    uint32_t pc, sr, omr, sp, la, lc, vba, sc, sz, ep;
+    uint32_t ssh[DSP_STACK_SIZE], ssl[DSP_STACK_SIZE];
+
+    uint32_t x[DSP_X_SIZE];
+    uint32_t y[DSP_Y_SIZE];
+    uint32_t p[DSP_P_SIZE];
+
+    /* set by WAIT until the next run, by STOP until reset */
+    bool waiting;
+    bool stopped;
+
+    uint64_t cycles;
+    uint32_t illegal_opcode;
+
+    DSPInsn pcache[DSP_P_SIZE];
+};
+
+void dsp56300_init(DSPState *s);
+void dsp56300_reset(DSPState *s);
+/* Copy registers and memory, dropping dst's decoded instructions */
+void dsp56300_copy_state(DSPState *dst, const DSPState *src);
+
+uint32_t dsp56300_read_memory(DSPState *s, int space, uint32_t addr);
+void dsp56300_write_memory(DSPState *s, int space, uint32_t addr,
+                           uint32_t value);
+
+/* Run until WAIT, STOP or the cycle budget is used up. Returns the
+ * number of cycles executed. */
+int dsp56300_run(DSPState *s, int cycles);
+
+#endif
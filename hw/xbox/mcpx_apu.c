@@ -16,9 +16,22 @@
  * You should have received a copy of the GNU General Public License
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
+#include <math.h>
+
 #include "hw/hw.h"
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
+#include "audio/audio.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/main-loop.h"
+#include "sysemu/sysemu.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+#include "hw/xbox/mcpx_apu.h"
+#include "hw/xbox/dsp56300.h"
 
 
 #define NV_PAPU_ISTS                                     0x00001000
@@ -47,6 +60,7 @@
 #   define NV_PAPU_SECTL_XCNTMODE                           0x00000018
 #       define NV_PAPU_SECTL_XCNTMODE_OFF                       0
 #define NV_PAPU_VPVADDR                                  0x0000202C
+#define NV_PAPU_VPSGEADDR                                0x00002030
 #define NV_PAPU_TVL2D                                    0x00002054
 #define NV_PAPU_CVL2D                                    0x00002058
 #define NV_PAPU_NVL2D                                    0x0000205C
@@ -85,14 +99,122 @@ static const struct {
 
 /* voice structure */
 #define NV_PAVS_SIZE                                     0x00000080
+#define NV_PAVS_VOICE_CFG_VBIN                           0x00000000
+#   define NV_PAVS_VOICE_CFG_VBIN_V0BIN                     (0x1F << 0)
+#   define NV_PAVS_VOICE_CFG_VBIN_V1BIN                     (0x1F << 5)
+#   define NV_PAVS_VOICE_CFG_VBIN_V2BIN                     (0x1F << 10)
+#   define NV_PAVS_VOICE_CFG_VBIN_V3BIN                     (0x1F << 16)
+#   define NV_PAVS_VOICE_CFG_VBIN_V4BIN                     (0x1F << 21)
+#   define NV_PAVS_VOICE_CFG_VBIN_V5BIN                     (0x1F << 26)
+#define NV_PAVS_VOICE_CFG_FMT                            0x00000004
+#   define NV_PAVS_VOICE_CFG_FMT_V6BIN                      (0x1F << 0)
+#   define NV_PAVS_VOICE_CFG_FMT_V7BIN                      (0x1F << 5)
+#   define NV_PAVS_VOICE_CFG_FMT_DATA_TYPE                  (1 << 24)
+#   define NV_PAVS_VOICE_CFG_FMT_LOOP                       (1 << 25)
+#   define NV_PAVS_VOICE_CFG_FMT_STEREO                     (1 << 27)
+#   define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE             (0x3 << 30)
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B8          0
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B16         1
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM       2
+#       define NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_B32         3
+#define NV_PAVS_VOICE_CFG_ENV0                           0x00000008
+#   define NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE             0x00000FFF
+#   define NV_PAVS_VOICE_CFG_ENV0_EA_DELAYTIME              0x00FFF000
+#define NV_PAVS_VOICE_CFG_ENVA                           0x0000000C
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE              0x00000FFF
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME               0x00FFF000
+#   define NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL           0xFF000000
+#define NV_PAVS_VOICE_CFG_MISC                           0x00000018
+#   define NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE            0x00000FFF
+#define NV_PAVS_VOICE_CUR_PSL_START                      0x00000020
+#   define NV_PAVS_VOICE_CUR_PSL_START_BA                   0x00FFFFFF
+#define NV_PAVS_VOICE_CUR_PSH_SAMPLE                     0x00000024
+#   define NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO                 0x00FFFFFF
+#define NV_PAVS_VOICE_CUR_VOLA                           0x00000030
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0              0x0000000F
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME0                   0x0000FFF0
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0              0x000F0000
+#   define NV_PAVS_VOICE_CUR_VOLA_VOLUME1                   0xFFF00000
+#define NV_PAVS_VOICE_CUR_VOLB                           0x00000034
+#   define NV_PAVS_VOICE_CUR_VOLB_VOLUME6_B7_4              0x0000000F
+#   define NV_PAVS_VOICE_CUR_VOLB_VOLUME2                   0x0000FFF0
+#   define NV_PAVS_VOICE_CUR_VOLB_VOLUME7_B7_4              0x000F0000
+#   define NV_PAVS_VOICE_CUR_VOLB_VOLUME3                   0xFFF00000
+#define NV_PAVS_VOICE_CUR_VOLC                           0x00000038
+#   define NV_PAVS_VOICE_CUR_VOLC_VOLUME6_B11_8             0x0000000F
+#   define NV_PAVS_VOICE_CUR_VOLC_VOLUME4                   0x0000FFF0
+#   define NV_PAVS_VOICE_CUR_VOLC_VOLUME7_B11_8             0x000F0000
+#   define NV_PAVS_VOICE_CUR_VOLC_VOLUME5                   0xFFF00000
+#define NV_PAVS_VOICE_CUR_ECNT                           0x00000048
+#   define NV_PAVS_VOICE_CUR_ECNT_EACOUNT                   0x0000FFFF
 #define NV_PAVS_VOICE_PAR_STATE                          0x00000054
+#   define NV_PAVS_VOICE_PAR_STATE_PAUSED                   (1 << 18)
 #   define NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE             (1 << 21)
+#   define NV_PAVS_VOICE_PAR_STATE_EACUR                    (0xF << 28)
+#       define NV_PAVS_EACUR_OFF                                0
+#       define NV_PAVS_EACUR_DELAY                              1
+#       define NV_PAVS_EACUR_ATTACK                             2
+#       define NV_PAVS_EACUR_HOLD                               3
+#       define NV_PAVS_EACUR_DECAY                              4
+#       define NV_PAVS_EACUR_SUSTAIN                            5
+#       define NV_PAVS_EACUR_RELEASE                            6
+#       define NV_PAVS_EACUR_FORCE_RELEASE                      7
+#define NV_PAVS_VOICE_PAR_OFFSET                         0x00000058
+#   define NV_PAVS_VOICE_PAR_OFFSET_CBO                     0x00FFFFFF
+#   define NV_PAVS_VOICE_PAR_OFFSET_EALVL                   0xFF000000
+#define NV_PAVS_VOICE_PAR_NEXT                           0x0000005C
+#   define NV_PAVS_VOICE_PAR_NEXT_EBO                       0x00FFFFFF
 #define NV_PAVS_VOICE_TAR_PITCH_LINK                     0x0000007c
 #   define NV_PAVS_VOICE_TAR_PITCH_LINK_NEXT_VOICE_HANDLE   0x0000FFFF
+#   define NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH               0xFFFF0000
+
+/* GP DSP memories as seen through the GP aperture, one word per dword */
+#define NV_PAPU_GPXMEM                                   0x00000000
+#define NV_PAPU_GPMIXBUF                                 0x00005000
+#define NV_PAPU_GPYMEM                                   0x00006000
+#define NV_PAPU_GPPMEM                                   0x0000A000
+#define NV_PAPU_GPRST                                    0x0000FFFC
+#   define NV_PAPU_GPRST_GPRST                              (1 << 0)
+#   define NV_PAPU_GPRST_GPDSPRST                           (1 << 2)
 
 
 
 #define MCPX_HW_MAX_VOICES 256
+#define MCPX_HW_NUM_BINS 32
+
+/* The voice processor runs at 48kHz. Each setup engine frame (10ms)
+ * produces VP_FRAME_SAMPLES; envelopes step every VP_SUBFRAME_SAMPLES. */
+#define VP_SAMPLE_RATE 48000
+#define VP_FRAME_SAMPLES 480
+#define VP_SUBFRAME_SAMPLES 32
+#define VP_SUBFRAMES (VP_FRAME_SAMPLES / VP_SUBFRAME_SAMPLES)
+#define VP_OUT_FRAMES (VP_FRAME_SAMPLES * 8)
+
+/* voice buffers are scattered over 4K pages through the SGE table */
+#define VP_SGE_PAGE_SIZE 4096
+
+#define VP_ADPCM_BLOCK_BYTES 36
+#define VP_ADPCM_BLOCK_SAMPLES 64
+
+/* The GP DSP runs at 160MHz and mixes one subframe per pass, reading
+ * the VP bins from its X memory mix buffer (bin-major, 32 samples per
+ * bin) and leaving its output in bins 0 and 1. */
+#define GP_CLOCK 160000000
+#define GP_SUBFRAME_CYCLES (GP_CLOCK / (VP_SAMPLE_RATE / VP_SUBFRAME_SAMPLES))
+#define GP_MIXBUF_BASE (NV_PAPU_GPMIXBUF / 4)
+/* gp.lock is dropped after this many DSP cycles, so guest accesses to
+ * the GP aperture wait for one batch rather than a whole subframe */
+#define GP_BATCH_CYCLES 1024
+
+/* The APU thread sets up a frame whenever less than SE_QUEUE_FRAMES of
+ * audio are queued for the backend, or every 10ms without a backend. */
+#define SE_FRAME_MS 10
+#define SE_QUEUE_FRAMES 2
+#define SE_LOAD_WINDOW_NS (1000 * SCALE_MS)
+
+/* PIO methods queued for the APU thread; PIO_FREE reports 4 bytes per
+ * free slot, so an empty queue reads 0x80 */
+#define FE_MAILBOX_SIZE 32
 
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> (ffs(mask)-1))
@@ -113,24 +235,167 @@ static const struct {
 #endif
 
 
+/* A voice as snapshotted by the setup engine for one frame. A VP
+ * worker only touches its own jobs and guest sample data; the results
+ * are written back to voice memory by the next se_frame(). */
+typedef struct VPVoiceJob {
+    uint16_t handle;
+    uint32_t fmt;
+    uint8_t bins[8];
+    uint16_t volume[8];
+    uint32_t env0, enva, misc;
+    uint32_t ba, lbo, cbo, ebo;
+    int16_t pitch;
+
+    uint32_t state;
+    uint32_t eacur;
+    uint32_t eacount;
+    float env;
+    bool ended;
+} VPVoiceJob;
+
+typedef struct VPWorker {
+    QemuThread thread;
+    struct MCPXAPUState *d;
+    unsigned int index;
+
+    /* per-worker partial mix, summed when the frame completes */
+    float bins[MCPX_HW_NUM_BINS][VP_FRAME_SAMPLES];
+    uint32_t bins_used;
+    float voice[2][VP_FRAME_SAMPLES];
+
+    /* guest page last looked up through the SGE table */
+    uint32_t page_index;
+    const uint8_t *page;
+
+    /* last decoded ADPCM block of the current voice */
+    int64_t adpcm_block;
+    int16_t adpcm[2][VP_ADPCM_BLOCK_SAMPLES];
+} VPWorker;
+
 typedef struct MCPXAPUState {
     PCIDevice dev;
 
     MemoryRegion mmio;
 
-    /* Setup Engine */
+    /* guest RAM, for sample fetches from the VP workers. Comes in as
+     * the "ram" property so it is set before the threads start. */
+    void *ram_opaque;
+    MemoryRegion *ram;
+    uint8_t *ram_ptr;
+
+    /* Protects regs and the voice lists. Taken by the MMIO handlers
+     * inside the iothread lock and by the APU thread without it; the
+     * APU thread raises interrupts through irq_bh. */
+    QemuMutex lock;
+    QEMUBH *irq_bh;
+    bool irq_dirty;
+
+    /* Setup Engine, run on the APU thread */
     struct {
-        QEMUTimer *frame_timer;
+        QemuThread thread;
+        QemuSemaphore kick;
+        bool quit;
+        bool vm_running;
+        VMChangeStateEntry *vm_state;
+        int64_t last_frame;
+
+        /* busy time over the current load window */
+        int64_t window_start;
+        int64_t window_busy;
+        double load;
     } se;
 
+    /* Front End method mailbox. vp_write fills it without taking any
+     * lock (the iothread lock serialises producers); it is drained
+     * with d->lock held. */
+    struct {
+        struct {
+            uint32_t method;
+            uint32_t argument;
+        } cmds[FE_MAILBOX_SIZE];
+        unsigned int head;
+        unsigned int tail;
+    } fe;
+
     /* Voice Processor */
     struct {
         MemoryRegion mmio;
+
+        /* host mapping of the voice array at VPVADDR, NULL if it
+         * isn't plain RAM */
+        MemoryRegionSection voices_section;
+        uint8_t *voices;
+
+        uint32_t num_threads;
+        VPWorker *workers;
+        /* VPSGEADDR for the frame being processed; the workers don't
+         * look at regs, which belong to d->lock */
+        uint32_t sge_addr;
+        /* unimplemented stream voices are only reported once */
+        bool stream_voice_logged;
+
+        /* protects the dispatch state and stats. The jobs, phases and
+         * mix belong to the workers while a frame is pending. */
+        QemuMutex lock;
+        QemuCond work_cond;
+        uint64_t generation;
+        unsigned int pending;
+        bool quit;
+        bool results_ready;
+        bool results_stale;
+        int64_t frame_start;
+
+        VPVoiceJob jobs[MCPX_HW_MAX_VOICES];
+        unsigned int num_jobs;
+        /* fractional sample position, owned by whoever holds the job */
+        struct {
+            float frac;
+            uint32_t cbo;
+        } phase[MCPX_HW_MAX_VOICES];
+
+        float mix[MCPX_HW_NUM_BINS][VP_FRAME_SAMPLES];
+
+        struct {
+            uint64_t frames;
+            uint64_t voices;
+            uint64_t total_voices;
+            int64_t dsp_ns;
+            int64_t total_dsp_ns;
+            uint64_t late_frames;
+        } stats;
+
+        /* output ring, drained by the audio backend */
+        QemuMutex out_lock;
+        int16_t out[VP_OUT_FRAMES][2];
+        unsigned int out_read;
+        unsigned int out_count;
+        bool out_playing;
+        uint64_t underruns;
+
+        QEMUSoundCard card;
+        SWVoiceOut *audio_voice;
     } vp;
 
     /* Global Processor */
     struct {
         MemoryRegion mmio;
+
+        /* protects the DSP and rst; held by the GP thread while the
+         * DSP runs, dropped every GP_BATCH_CYCLES */
+        QemuMutex lock;
+        DSPState *dsp;
+        uint32_t rst;
+        /* copies of the two above for vmstate, taken under the lock */
+        DSPState *saved_dsp;
+        uint32_t saved_rst;
+
+        /* frame handoff from the VP, protected by vp.lock */
+        QemuThread thread;
+        QemuCond cond;
+        bool busy;
+        bool quit;
+        float input[MCPX_HW_NUM_BINS][VP_FRAME_SAMPLES];
     } gp;
 
     uint32_t regs[0x20000];
@@ -141,15 +406,84 @@ typedef struct MCPXAPUState {
 #define MCPX_APU_DEVICE(obj) \
     OBJECT_CHECK(MCPXAPUState, (obj), "mcpx-apu")
 
+#define MCPX_VOICES_SIZE (MCPX_HW_MAX_VOICES * NV_PAVS_SIZE)
+
+static void voices_unmap(MCPXAPUState *d)
+{
+    if (d->vp.voices) {
+        /* writes are marked dirty as they happen */
+        cpu_physical_memory_unmap(d->vp.voices, MCPX_VOICES_SIZE, 1, 0);
+        d->vp.voices = NULL;
+    }
+    if (d->vp.voices_section.mr) {
+        memory_region_unref(d->vp.voices_section.mr);
+        d->vp.voices_section.mr = NULL;
+    }
+}
+
+/* Map the voice array once rather than dispatching every field access.
+ * Called whenever VPVADDR changes. */
+static void voices_remap(MCPXAPUState *d)
+{
+    hwaddr addr = d->regs[NV_PAPU_VPVADDR];
+    hwaddr len = MCPX_VOICES_SIZE;
+
+    voices_unmap(d);
+
+    d->vp.voices_section = memory_region_find(get_system_memory(),
+                                              addr, MCPX_VOICES_SIZE);
+    if (!d->vp.voices_section.mr) {
+        return;
+    }
+    if (int128_get64(d->vp.voices_section.size) != MCPX_VOICES_SIZE
+        || !memory_region_is_ram(d->vp.voices_section.mr)) {
+        voices_unmap(d);
+        return;
+    }
+
+    d->vp.voices = cpu_physical_memory_map(addr, &len, 1);
+    if (d->vp.voices && len != MCPX_VOICES_SIZE) {
+        cpu_physical_memory_unmap(d->vp.voices, len, 1, 0);
+        d->vp.voices = NULL;
+    }
+    if (!d->vp.voices) {
+        voices_unmap(d);
+    }
+}
+
+/* The voice array is only accessed through its RAM mapping: these run
+ * on the APU thread, which must not dispatch memory accesses. Called
+ * with d->lock held. */
+static bool voice_valid(MCPXAPUState *d, unsigned int voice_handle)
+{
+    if (voice_handle >= MCPX_HW_MAX_VOICES) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "mcpx apu: voice handle 0x%x out of range\n",
+                      voice_handle);
+        return false;
+    }
+    if (!d->vp.voices) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "mcpx apu: voice array at 0x%x is not in RAM\n",
+                      d->regs[NV_PAPU_VPVADDR]);
+        return false;
+    }
+    return true;
+}
+
 static uint32_t voice_get_mask(MCPXAPUState *d,
                                unsigned int voice_handle,
                                hwaddr offset,
                                uint32_t mask)
 {
-    assert(voice_handle != 0xFFFF);
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR]
-                    + voice_handle * NV_PAVS_SIZE;
-    return (ldl_le_phys(voice + offset) & mask) >> (ffs(mask)-1);
+    hwaddr voice = voice_handle * NV_PAVS_SIZE;
+    uint32_t v;
+
+    if (!voice_valid(d, voice_handle)) {
+        return 0;
+    }
+    v = ldl_le_p(d->vp.voices + voice + offset);
+    return (v & mask) >> (ffs(mask)-1);
 }
 static void voice_set_mask(MCPXAPUState *d,
                            unsigned int voice_handle,
@@ -157,18 +491,50 @@ static void voice_set_mask(MCPXAPUState *d,
                            uint32_t mask,
                            uint32_t val)
 {
-    assert(voice_handle != 0xFFFF);
-    hwaddr voice = d->regs[NV_PAPU_VPVADDR]
-                    + voice_handle * NV_PAVS_SIZE;
-    uint32_t v = ldl_le_phys(voice + offset) & ~mask;
-    stl_le_phys(voice + offset,
-                v | ((val << (ffs(mask)-1)) & mask));
+    hwaddr voice = voice_handle * NV_PAVS_SIZE;
+    uint8_t *p;
+
+    if (!voice_valid(d, voice_handle)) {
+        return;
+    }
+    p = d->vp.voices + voice + offset;
+    stl_le_p(p, (ldl_le_p(p) & ~mask)
+                  | ((val << (ffs(mask)-1)) & mask));
+    memory_region_set_dirty(d->vp.voices_section.mr,
+                            d->vp.voices_section.offset_within_region
+                                + voice + offset, 4);
+}
+
+/* the setup engine only needs to tick while a voice list has voices */
+static bool voice_lists_empty(MCPXAPUState *d)
+{
+    int list;
+    for (list = 0; list < 3; list++) {
+        if (d->regs[voice_list_regs[list].top] != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool se_enabled(MCPXAPUState *d)
+{
+    return ((d->regs[NV_PAPU_SECTL] & NV_PAPU_SECTL_XCNTMODE) >> 3)
+               != NV_PAPU_SECTL_XCNTMODE_OFF
+        && !voice_lists_empty(d);
+}
+
+static void se_kick(MCPXAPUState *d)
+{
+    qemu_sem_post(&d->se.kick);
 }
 
 
 
+/* Called with the iothread lock and d->lock held */
 static void update_irq(MCPXAPUState *d)
 {
+    d->irq_dirty = false;
     if ((d->regs[NV_PAPU_IEN] & NV_PAPU_ISTS_GINTSTS)
         && ((d->regs[NV_PAPU_ISTS] & ~NV_PAPU_ISTS_GINTSTS)
               & d->regs[NV_PAPU_IEN])) {
@@ -189,6 +555,7 @@ static uint64_t mcpx_apu_read(void *opaque,
     MCPXAPUState *d = opaque;
 
     uint64_t r = 0;
+    qemu_mutex_lock(&d->lock);
     switch (addr) {
     default:
         if (addr < 0x20000) {
@@ -196,6 +563,7 @@ static uint64_t mcpx_apu_read(void *opaque,
         }
         break;
     }
+    qemu_mutex_unlock(&d->lock);
 
     MCPX_DPRINTF("mcpx apu: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
@@ -207,6 +575,7 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->lock);
     switch (addr) {
     case NV_PAPU_ISTS:
         /* the bits of the interrupts to clear are wrtten */
@@ -214,18 +583,26 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
         update_irq(d);
         break;
     case NV_PAPU_SECTL:
-        if ( ((val & NV_PAPU_SECTL_XCNTMODE) >> 3)
-                == NV_PAPU_SECTL_XCNTMODE_OFF) {
-            qemu_del_timer(d->se.frame_timer);
-        } else {
-            qemu_mod_timer(d->se.frame_timer, qemu_get_clock_ms(vm_clock) + 10);
-        }
         d->regs[addr] = val;
+        se_kick(d);
+        break;
+    case NV_PAPU_VPVADDR:
+        d->regs[addr] = val;
+        voices_remap(d);
+        break;
+    case NV_PAPU_TVL2D:
+    case NV_PAPU_TVL3D:
+    case NV_PAPU_TVLMP:
+        d->regs[addr] = val;
+        se_kick(d);
         break;
     case NV_PAPU_FEMEMDATA:
         /* 'magic write'
          * This value is expected to be written to FEMEMADDR on completion of
-         * something to do with notifies. Just do it now :/ */
+         * something to do with notifies. Just do it now :/
+         * Only here, on the vcpu with the iothread lock held; the APU
+         * thread never writes guest memory through the dispatcher. */
+        assert(qemu_mutex_iothread_locked());
         stl_le_phys(d->regs[NV_PAPU_FEMEMADDR], val);
         d->regs[addr] = val;
         break;
@@ -235,6 +612,7 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
         }
         break;
     }
+    qemu_mutex_unlock(&d->lock);
 }
 static const MemoryRegionOps mcpx_apu_mmio_ops = {
     .read = mcpx_apu_read,
@@ -242,6 +620,7 @@ static const MemoryRegionOps mcpx_apu_mmio_ops = {
 };
 
 
+/* Called with d->lock held */
 static void fe_method(MCPXAPUState *d,
                       uint32_t method, uint32_t argument)
 {
@@ -258,6 +637,9 @@ static void fe_method(MCPXAPUState *d,
         break;
     case NV1BA0_PIO_VOICE_ON:
         selected_handle = argument & NV1BA0_PIO_VOICE_ON_HANDLE;
+        if (!voice_valid(d, selected_handle)) {
+            break;
+        }
         list = GET_MASK(d->regs[NV_PAPU_FEAV], NV_PAPU_FEAV_LST);
         if (list != NV1BA0_PIO_SET_ANTECEDENT_VOICE_LIST_INHERIT) {
             /* voice is added to the top of the selected list */
@@ -267,11 +649,14 @@ static void fe_method(MCPXAPUState *d,
                 NV_PAVS_VOICE_TAR_PITCH_LINK_NEXT_VOICE_HANDLE,
                 d->regs[top_reg]);
             d->regs[top_reg] = selected_handle;
+            se_kick(d);
         } else {
             unsigned int antecedent_voice =
                 GET_MASK(d->regs[NV_PAPU_FEAV], NV_PAPU_FEAV_VALUE);
             /* voice is added after the antecedent voice */
-            assert(antecedent_voice != 0xFFFF);
+            if (!voice_valid(d, antecedent_voice)) {
+                break;
+            }
 
             uint32_t next_handle = voice_get_mask(d, antecedent_voice,
                 NV_PAVS_VOICE_TAR_PITCH_LINK,
@@ -310,9 +695,10 @@ static void fe_method(MCPXAPUState *d,
             d->regs[NV_PAPU_FECTL] |= NV_PAPU_FECTL_FETRAPREASON_REQUESTED;
 
             d->regs[NV_PAPU_ISTS] |= NV_PAPU_ISTS_FETINTSTS;
-            update_irq(d);
+            d->irq_dirty = true;
         } else {
-            assert(false);
+            qemu_log_mask(LOG_UNIMP, "mcpx apu: idle voice 0x%x without "
+                          "SE2FE_IDLE_VOICE trap\n", argument);
         }
         break;
     default:
@@ -322,15 +708,65 @@ static void fe_method(MCPXAPUState *d,
 }
 
 
+static void mcpx_apu_irq_bh(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->lock);
+    if (d->irq_dirty) {
+        update_irq(d);
+    }
+    qemu_mutex_unlock(&d->lock);
+}
+
+/* Run the queued methods. Called with d->lock held. */
+static void fe_drain(MCPXAPUState *d)
+{
+    unsigned int tail = d->fe.tail;
+
+    while (tail != atomic_read(&d->fe.head)) {
+        smp_rmb();
+        fe_method(d, d->fe.cmds[tail % FE_MAILBOX_SIZE].method,
+                  d->fe.cmds[tail % FE_MAILBOX_SIZE].argument);
+        tail++;
+        /* the slot may be reused once tail moves past it */
+        atomic_mb_set(&d->fe.tail, tail);
+    }
+}
+
+/* Called from vp_write with the iothread lock held */
+static void fe_queue_method(MCPXAPUState *d,
+                            uint32_t method, uint32_t argument)
+{
+    unsigned int head = d->fe.head;
+
+    if (head - atomic_read(&d->fe.tail) == FE_MAILBOX_SIZE) {
+        /* the guest didn't wait for PIO_FREE; run the queue here */
+        qemu_mutex_lock(&d->lock);
+        fe_drain(d);
+        if (d->irq_dirty) {
+            update_irq(d);
+        }
+        qemu_mutex_unlock(&d->lock);
+    }
+
+    d->fe.cmds[head % FE_MAILBOX_SIZE].method = method;
+    d->fe.cmds[head % FE_MAILBOX_SIZE].argument = argument;
+    smp_wmb();
+    atomic_set(&d->fe.head, head + 1);
+    se_kick(d);
+}
+
 static uint64_t vp_read(void *opaque,
                         hwaddr addr, unsigned int size)
 {
+    MCPXAPUState *d = opaque;
+
     MCPX_DPRINTF("mcpx apu VP: read [0x%llx]\n", addr);
     switch (addr) {
     case NV1BA0_PIO_FREE:
-        /* we don't simulate the queue for now,
-         * pretend to always be empty */
-        return 0x80;
+        return 4 * (FE_MAILBOX_SIZE
+                    - (d->fe.head - atomic_read(&d->fe.tail)));
     default:
         break;
     }
@@ -348,8 +784,7 @@ static void vp_write(void *opaque, hwaddr addr,
     case NV1BA0_PIO_VOICE_ON:
     case NV1BA0_PIO_VOICE_OFF:
     case NV1BA0_PIO_SET_CURRENT_VOICE:
-        /* TODO: these should instead be queueing up fe commands */
-        fe_method(d, addr, val);
+        fe_queue_method(d, addr, val);
         break;
     default:
         break;
@@ -362,16 +797,70 @@ static const MemoryRegionOps vp_ops = {
 
 
 /* Global Processor - programmable DSP */
+
+static bool gp_running(MCPXAPUState *d)
+{
+    return (d->gp.rst & NV_PAPU_GPRST_GPRST)
+        && (d->gp.rst & NV_PAPU_GPRST_GPDSPRST);
+}
+
+/* Map a GP aperture offset to a DSP memory space and word address */
+static bool gp_decode_addr(hwaddr addr, int *space, uint32_t *word)
+{
+    if (addr < NV_PAPU_GPYMEM) {
+        *space = DSP_SPACE_X;
+        *word = (addr - NV_PAPU_GPXMEM) / 4;
+    } else if (addr < NV_PAPU_GPYMEM + DSP_Y_SIZE * 4) {
+        *space = DSP_SPACE_Y;
+        *word = (addr - NV_PAPU_GPYMEM) / 4;
+    } else if (addr >= NV_PAPU_GPPMEM
+               && addr < NV_PAPU_GPPMEM + DSP_P_SIZE * 4) {
+        *space = DSP_SPACE_P;
+        *word = (addr - NV_PAPU_GPPMEM) / 4;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static uint64_t gp_read(void *opaque,
                         hwaddr addr, unsigned int size)
 {
-    MCPX_DPRINTF("mcpx apu GP: read [0x%llx]\n", addr);
-    return 0;
+    MCPXAPUState *d = opaque;
+    uint64_t r = 0;
+    uint32_t word;
+    int space;
+
+    qemu_mutex_lock(&d->gp.lock);
+    if (addr == NV_PAPU_GPRST) {
+        r = d->gp.rst;
+    } else if (gp_decode_addr(addr, &space, &word)) {
+        r = dsp56300_read_memory(d->gp.dsp, space, word);
+    }
+    qemu_mutex_unlock(&d->gp.lock);
+
+    MCPX_DPRINTF("mcpx apu GP: read [0x%llx] -> 0x%llx\n", addr, r);
+    return r;
 }
 static void gp_write(void *opaque, hwaddr addr,
                      uint64_t val, unsigned int size)
 {
+    MCPXAPUState *d = opaque;
+    uint32_t word;
+    int space;
+
     MCPX_DPRINTF("mcpx apu GP: [0x%llx] = 0x%llx\n", addr, val);
+
+    qemu_mutex_lock(&d->gp.lock);
+    if (addr == NV_PAPU_GPRST) {
+        d->gp.rst = val;
+        if (!(val & NV_PAPU_GPRST_GPRST) || !(val & NV_PAPU_GPRST_GPDSPRST)) {
+            dsp56300_reset(d->gp.dsp);
+        }
+    } else if (gp_decode_addr(addr, &space, &word)) {
+        dsp56300_write_memory(d->gp.dsp, space, word, val);
+    }
+    qemu_mutex_unlock(&d->gp.lock);
 }
 static const MemoryRegionOps gp_ops = {
     .read = gp_read,
@@ -379,12 +868,747 @@ static const MemoryRegionOps gp_ops = {
 };
 
 
-/* TODO: this should be on a thread so it waits on the voice lock */
-static void se_frame(void *opaque)
+/* voice processor */
+
+static float vp_attenuation[4096];
+
+static const int16_t ima_step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static void vp_init_tables(void)
+{
+    int i;
+    /* volumes are attenuations in 1/64 dB; the largest means silence */
+    for (i = 0; i < 4095; i++) {
+        vp_attenuation[i] = powf(10.0f, -i / (64.0f * 20.0f));
+    }
+    vp_attenuation[4095] = 0.0f;
+}
+
+/* Look up the host address of a voice buffer page through the SGE
+ * table. Returns NULL when the entry or the page is outside RAM. */
+static const uint8_t *vp_sge_page(VPWorker *w, uint32_t page_index)
+{
+    MCPXAPUState *d = w->d;
+    uint64_t ram_size = memory_region_size(d->ram);
+
+    if (w->page && w->page_index == page_index) {
+        return w->page;
+    }
+
+    uint64_t entry = (uint64_t)d->vp.sge_addr + page_index * 8;
+    if (entry + 4 > ram_size) {
+        return NULL;
+    }
+    uint64_t page = ldl_le_p(d->ram_ptr + entry) & ~(VP_SGE_PAGE_SIZE - 1);
+    if (page + VP_SGE_PAGE_SIZE > ram_size) {
+        return NULL;
+    }
+
+    w->page_index = page_index;
+    w->page = d->ram_ptr + page;
+    return w->page;
+}
+
+/* Copy voice buffer bytes which may straddle pages; missing pages read
+ * as silence. */
+static void vp_read_buffer(VPWorker *w, uint32_t addr,
+                           uint8_t *buf, size_t len)
+{
+    while (len) {
+        uint32_t offset = addr % VP_SGE_PAGE_SIZE;
+        size_t chunk = MIN(len, VP_SGE_PAGE_SIZE - offset);
+        const uint8_t *page = vp_sge_page(w, addr / VP_SGE_PAGE_SIZE);
+        if (page) {
+            memcpy(buf, page + offset, chunk);
+        } else {
+            memset(buf, 0, chunk);
+        }
+        addr += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+static int16_t ima_decode_nibble(int *predictor, int *index,
+                                 unsigned int nibble)
+{
+    int step = ima_step_table[*index];
+    int diff = step >> 3;
+    if (nibble & 1) diff += step >> 2;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 4) diff += step;
+    if (nibble & 8) diff = -diff;
+
+    *predictor = MAX(-32768, MIN(32767, *predictor + diff));
+    *index = MAX(0, MIN(88, *index + ima_index_table[nibble]));
+    return *predictor;
+}
+
+/* Xbox ADPCM: per channel a 4 byte header (initial sample, step index)
+ * followed by 32 bytes of nibbles, interleaved between channels every
+ * 4 bytes. The header sample plus 63 nibbles give 64 samples. */
+static void vp_decode_adpcm_block(VPWorker *w, const VPVoiceJob *job,
+                                  uint32_t block)
+{
+    unsigned int channels = (job->fmt & NV_PAVS_VOICE_CFG_FMT_STEREO) ? 2 : 1;
+    uint8_t data[VP_ADPCM_BLOCK_BYTES * 2];
+    unsigned int c, i;
+
+    if (w->adpcm_block == block) {
+        return;
+    }
+    vp_read_buffer(w, job->ba + block * VP_ADPCM_BLOCK_BYTES * channels,
+            data, VP_ADPCM_BLOCK_BYTES * channels);
+
+    for (c = 0; c < channels; c++) {
+        const uint8_t *header = data + c * 4;
+        int predictor = (int16_t)lduw_le_p(header);
+        int index = MIN(header[2], 88);
+        int16_t *out = w->adpcm[c];
+
+        out[0] = predictor;
+        for (i = 1; i < VP_ADPCM_BLOCK_SAMPLES; i++) {
+            unsigned int n = i - 1;
+            unsigned int byte = channels * 4 + (n / 8) * 4 * channels
+                                + c * 4 + (n % 8) / 2;
+            unsigned int nibble = (data[byte] >> ((n & 1) * 4)) & 0xF;
+            out[i] = ima_decode_nibble(&predictor, &index, nibble);
+        }
+    }
+    w->adpcm_block = block;
+}
+
+static void vp_fetch(VPWorker *w, const VPVoiceJob *job, uint32_t pos,
+                     float out[2])
+{
+    bool stereo = job->fmt & NV_PAVS_VOICE_CFG_FMT_STEREO;
+    unsigned int container = GET_MASK(job->fmt,
+                                      NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
+    unsigned int channels = stereo ? 2 : 1;
+    unsigned int c;
+
+    if (container == NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM) {
+        vp_decode_adpcm_block(w, job, pos / VP_ADPCM_BLOCK_SAMPLES);
+        for (c = 0; c < channels; c++) {
+            out[c] = w->adpcm[c][pos % VP_ADPCM_BLOCK_SAMPLES] / 32768.0f;
+        }
+    } else {
+        static const unsigned int container_bytes[4] = { 1, 2, 0, 4 };
+        unsigned int size = container_bytes[container];
+        uint32_t addr = job->ba + pos * size * channels;
+        /* sample frames never straddle a page */
+        const uint8_t *page = vp_sge_page(w, addr / VP_SGE_PAGE_SIZE);
+        const uint8_t *p = page ? page + addr % VP_SGE_PAGE_SIZE : NULL;
+
+        for (c = 0; c < channels; c++) {
+            if (!p) {
+                out[c] = 0.0f;
+            } else if (size == 1) {
+                out[c] = (p[c] - 128) / 128.0f;
+            } else if (size == 2) {
+                out[c] = (int16_t)lduw_le_p(p + c * 2) / 32768.0f;
+            } else {
+                out[c] = (int32_t)ldl_le_p(p + c * 4) / 2147483648.0f;
+            }
+        }
+    }
+    if (!stereo) {
+        out[1] = out[0];
+    }
+}
+
+/* Step to the next sample frame. Returns false when a voice that does
+ * not loop runs off the end of its buffer. */
+static bool vp_advance(const VPVoiceJob *job, uint32_t *pos)
+{
+    if (*pos >= job->ebo) {
+        if (!(job->fmt & NV_PAVS_VOICE_CFG_FMT_LOOP)) {
+            return false;
+        }
+        *pos = job->lbo;
+    } else {
+        (*pos)++;
+    }
+    return true;
+}
+
+/* Advance the amplitude envelope by one subframe and return its level.
+ * Times and rates count subframes; a zero rate is immediate. */
+static float vp_envelope_step(VPVoiceJob *job)
+{
+    uint32_t delay = GET_MASK(job->env0, NV_PAVS_VOICE_CFG_ENV0_EA_DELAYTIME);
+    uint32_t attack = GET_MASK(job->env0,
+                               NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE);
+    uint32_t hold = GET_MASK(job->enva, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME);
+    uint32_t decay = GET_MASK(job->enva, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
+    float sustain = GET_MASK(job->enva,
+                             NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL) / 255.0f;
+    uint32_t release = GET_MASK(job->misc,
+                                NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE);
+
+    switch (job->eacur) {
+    case NV_PAVS_EACUR_OFF:
+        return 1.0f;
+    case NV_PAVS_EACUR_DELAY:
+        job->env = 0.0f;
+        if (++job->eacount >= delay) {
+            job->eacur = NV_PAVS_EACUR_ATTACK;
+            job->eacount = 0;
+        }
+        break;
+    case NV_PAVS_EACUR_ATTACK:
+        if (++job->eacount >= attack) {
+            job->env = 1.0f;
+            job->eacur = NV_PAVS_EACUR_HOLD;
+            job->eacount = 0;
+        } else {
+            job->env = (float)job->eacount / attack;
+        }
+        break;
+    case NV_PAVS_EACUR_HOLD:
+        job->env = 1.0f;
+        if (++job->eacount >= hold) {
+            job->eacur = NV_PAVS_EACUR_DECAY;
+            job->eacount = 0;
+        }
+        break;
+    case NV_PAVS_EACUR_DECAY:
+        if (++job->eacount >= decay) {
+            job->env = sustain;
+            job->eacur = NV_PAVS_EACUR_SUSTAIN;
+            job->eacount = 0;
+        } else {
+            job->env = 1.0f - (1.0f - sustain) * job->eacount / decay;
+        }
+        break;
+    case NV_PAVS_EACUR_SUSTAIN:
+        job->env = sustain;
+        break;
+    case NV_PAVS_EACUR_RELEASE:
+    case NV_PAVS_EACUR_FORCE_RELEASE:
+        job->env = release ? job->env - 1.0f / release : 0.0f;
+        if (job->env <= 0.0f) {
+            job->env = 0.0f;
+            job->ended = true;
+        }
+        break;
+    default:
+        break;
+    }
+    return job->env;
+}
+
+static void vp_mix_add(float *dst, const float *src, float gain,
+                       unsigned int n)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 4 <= n; i += 4) {
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), s));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+static float *vp_worker_bin(VPWorker *w, unsigned int bin)
+{
+    if (!(w->bins_used & (1U << bin))) {
+        memset(w->bins[bin], 0, sizeof(w->bins[bin]));
+        w->bins_used |= 1U << bin;
+    }
+    return w->bins[bin];
+}
+
+/* Resample one voice for the frame and mix it into the worker's bins */
+static void vp_process_voice(VPWorker *w, VPVoiceJob *job)
+{
+    MCPXAPUState *d = w->d;
+    bool stereo = job->fmt & NV_PAVS_VOICE_CFG_FMT_STEREO;
+    float step = exp2f(job->pitch / 4096.0f);
+    float frac = d->vp.phase[job->handle].frac;
+    uint32_t loaded = UINT32_MAX;
+    float cur[2] = { 0, 0 }, next[2] = { 0, 0 };
+    unsigned int n = 0;
+    unsigned int sub, i, k;
+
+    w->adpcm_block = -1;
+
+    if (d->vp.phase[job->handle].cbo != job->cbo) {
+        /* the guest moved the voice */
+        frac = 0.0f;
+    }
+
+    for (sub = 0; sub < VP_SUBFRAMES && !job->ended; sub++) {
+        float gain = vp_envelope_step(job);
+        for (i = 0; i < VP_SUBFRAME_SAMPLES && !job->ended; i++, n++) {
+            if (loaded != job->cbo) {
+                uint32_t pos = job->cbo;
+                vp_fetch(w, job, pos, cur);
+                if (vp_advance(job, &pos)) {
+                    vp_fetch(w, job, pos, next);
+                } else {
+                    next[0] = cur[0];
+                    next[1] = cur[1];
+                }
+                loaded = job->cbo;
+            }
+            w->voice[0][n] = (cur[0] + (next[0] - cur[0]) * frac) * gain;
+            w->voice[1][n] = (cur[1] + (next[1] - cur[1]) * frac) * gain;
+
+            frac += step;
+            while (frac >= 1.0f) {
+                frac -= 1.0f;
+                if (!vp_advance(job, &job->cbo)) {
+                    job->ended = true;
+                    break;
+                }
+            }
+        }
+    }
+    for (; n < VP_FRAME_SAMPLES; n++) {
+        w->voice[0][n] = w->voice[1][n] = 0.0f;
+    }
+
+    d->vp.phase[job->handle].frac = frac;
+    d->vp.phase[job->handle].cbo = job->cbo;
+
+    /* mono voices feed all eight bins; stereo voices send the left
+     * channel to the even ones and the right to the odd ones */
+    for (k = 0; k < 8; k++) {
+        float att = vp_attenuation[job->volume[k]];
+        if (att == 0.0f) {
+            continue;
+        }
+        vp_mix_add(vp_worker_bin(w, job->bins[k]),
+                   w->voice[stereo ? (k & 1) : 0], att, VP_FRAME_SAMPLES);
+    }
+}
+
+static void vp_push_output(MCPXAPUState *d, const float *l, const float *r)
+{
+    int16_t frame[VP_FRAME_SAMPLES][2];
+    unsigned int i = 0;
+
+#ifdef __SSE2__
+    __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 4 <= VP_FRAME_SAMPLES; i += 4) {
+        __m128i li = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(l + i), scale));
+        __m128i ri = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(r + i), scale));
+        /* interleave, then saturate to 16 bit */
+        __m128i out = _mm_packs_epi32(_mm_unpacklo_epi32(li, ri),
+                                      _mm_unpackhi_epi32(li, ri));
+        _mm_storeu_si128((__m128i *)frame[i], out);
+    }
+#endif
+    for (; i < VP_FRAME_SAMPLES; i++) {
+        frame[i][0] = MAX(-32768, MIN(32767, lrintf(l[i] * 32767.0f)));
+        frame[i][1] = MAX(-32768, MIN(32767, lrintf(r[i] * 32767.0f)));
+    }
+
+    qemu_mutex_lock(&d->vp.out_lock);
+    for (i = 0; i < VP_FRAME_SAMPLES; i++) {
+        if (d->vp.out_count == VP_OUT_FRAMES) {
+            /* the backend fell behind; drop the oldest audio */
+            d->vp.out_read = (d->vp.out_read + 1) % VP_OUT_FRAMES;
+            d->vp.out_count--;
+        }
+        unsigned int w = (d->vp.out_read + d->vp.out_count) % VP_OUT_FRAMES;
+        d->vp.out[w][0] = frame[i][0];
+        d->vp.out[w][1] = frame[i][1];
+        d->vp.out_count++;
+    }
+    d->vp.out_playing = true;
+    qemu_mutex_unlock(&d->vp.out_lock);
+
+    /* the APU thread may be waiting for this frame to land */
+    se_kick(d);
+}
+
+/* Called with vp.lock held by the last worker to finish a frame */
+static void vp_finish_frame(MCPXAPUState *d)
+{
+    unsigned int t, b;
+
+    memset(d->vp.mix, 0, sizeof(d->vp.mix));
+    for (t = 0; t < d->vp.num_threads; t++) {
+        VPWorker *w = &d->vp.workers[t];
+        for (b = 0; b < MCPX_HW_NUM_BINS; b++) {
+            if (w->bins_used & (1U << b)) {
+                vp_mix_add(d->vp.mix[b], w->bins[b], 1.0f, VP_FRAME_SAMPLES);
+            }
+        }
+    }
+
+    /* hand the bins to the GP if its program is running, otherwise
+     * output the first two directly */
+    qemu_mutex_lock(&d->gp.lock);
+    bool gp = gp_running(d);
+    qemu_mutex_unlock(&d->gp.lock);
+    if (!gp) {
+        vp_push_output(d, d->vp.mix[0], d->vp.mix[1]);
+    } else if (d->gp.busy) {
+        /* the GP is still on the previous frame; drop this one */
+        d->vp.stats.late_frames++;
+    } else {
+        memcpy(d->gp.input, d->vp.mix, sizeof(d->gp.input));
+        d->gp.busy = true;
+        qemu_cond_signal(&d->gp.cond);
+    }
+
+    int64_t dsp_ns = get_clock() - d->vp.frame_start;
+    d->vp.stats.frames++;
+    d->vp.stats.voices = d->vp.num_jobs;
+    d->vp.stats.total_voices += d->vp.num_jobs;
+    d->vp.stats.dsp_ns = dsp_ns;
+    d->vp.stats.total_dsp_ns += dsp_ns;
+
+    d->vp.results_ready = !d->vp.results_stale;
+    d->vp.results_stale = false;
+}
+
+static void *vp_worker_thread(void *opaque)
+{
+    VPWorker *w = opaque;
+    MCPXAPUState *d = w->d;
+    uint64_t seen = 0;
+
+    qemu_mutex_lock(&d->vp.lock);
+    while (true) {
+        while (!d->vp.quit && seen == d->vp.generation) {
+            qemu_cond_wait(&d->vp.work_cond, &d->vp.lock);
+        }
+        if (d->vp.quit) {
+            break;
+        }
+        seen = d->vp.generation;
+
+        /* each worker takes a contiguous share of the jobs */
+        unsigned int first = w->index * d->vp.num_jobs / d->vp.num_threads;
+        unsigned int last = (w->index + 1) * d->vp.num_jobs
+                                / d->vp.num_threads;
+        qemu_mutex_unlock(&d->vp.lock);
+
+        unsigned int i;
+        w->bins_used = 0;
+        w->page = NULL;
+        for (i = first; i < last; i++) {
+            vp_process_voice(w, &d->vp.jobs[i]);
+        }
+
+        qemu_mutex_lock(&d->vp.lock);
+        if (--d->vp.pending == 0) {
+            vp_finish_frame(d);
+        }
+    }
+    qemu_mutex_unlock(&d->vp.lock);
+    return NULL;
+}
+
+/* Run one subframe of the GP program over the mix buffer.  Called with
+ * gp.lock held; the lock is dropped between batches of DSP cycles. */
+static void gp_run_subframe(MCPXAPUState *d, unsigned int sub,
+                            float out[2][VP_FRAME_SAMPLES])
+{
+    DSPState *dsp = d->gp.dsp;
+    uint32_t *mixbuf = &dsp->x[GP_MIXBUF_BASE];
+    unsigned int b, i, base = sub * VP_SUBFRAME_SAMPLES;
+    int left = GP_SUBFRAME_CYCLES;
+
+    for (b = 0; b < MCPX_HW_NUM_BINS; b++) {
+        const float *in = &d->gp.input[b][base];
+        for (i = 0; i < VP_SUBFRAME_SAMPLES; i++) {
+            int32_t v = lrintf(in[i] * 8388607.0f);
+            v = MAX(-8388608, MIN(8388607, v));
+            mixbuf[b * VP_SUBFRAME_SAMPLES + i] = v & 0xFFFFFF;
+        }
+    }
+
+    /* the program WAITs once it has mixed the subframe */
+    while (left > 0) {
+        left -= dsp56300_run(dsp, MIN(left, GP_BATCH_CYCLES));
+        if (dsp->waiting || dsp->stopped) {
+            break;
+        }
+        qemu_mutex_unlock(&d->gp.lock);
+        qemu_mutex_lock(&d->gp.lock);
+        if (!gp_running(d)) {
+            /* the guest reset the GP meanwhile */
+            for (b = 0; b < 2; b++) {
+                memset(&out[b][base], 0, VP_SUBFRAME_SAMPLES * sizeof(float));
+            }
+            return;
+        }
+    }
+
+    for (b = 0; b < 2; b++) {
+        for (i = 0; i < VP_SUBFRAME_SAMPLES; i++) {
+            int32_t v = (int32_t)(mixbuf[b * VP_SUBFRAME_SAMPLES + i] << 8);
+            out[b][base + i] = (v >> 8) / 8388608.0f;
+        }
+    }
+}
+
+static void *gp_thread(void *opaque)
 {
     MCPXAPUState *d = opaque;
-    qemu_mod_timer(d->se.frame_timer, qemu_get_clock_ms(vm_clock) + 10);
+    float out[2][VP_FRAME_SAMPLES];
+    unsigned int sub;
+
+    qemu_mutex_lock(&d->vp.lock);
+    while (true) {
+        while (!d->gp.quit && !d->gp.busy) {
+            qemu_cond_wait(&d->gp.cond, &d->vp.lock);
+        }
+        if (d->gp.quit) {
+            break;
+        }
+        qemu_mutex_unlock(&d->vp.lock);
+
+        for (sub = 0; sub < VP_SUBFRAMES; sub++) {
+            qemu_mutex_lock(&d->gp.lock);
+            if (gp_running(d)) {
+                gp_run_subframe(d, sub, out);
+            } else {
+                memset(out, 0, sizeof(out));
+            }
+            qemu_mutex_unlock(&d->gp.lock);
+        }
+        vp_push_output(d, out[0], out[1]);
+
+        qemu_mutex_lock(&d->vp.lock);
+        d->gp.busy = false;
+    }
+    qemu_mutex_unlock(&d->vp.lock);
+    return NULL;
+}
+
+static void vp_audio_callback(void *opaque, int free)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->vp.out_lock);
+    while (free >= 4 && d->vp.out_count) {
+        unsigned int frames = MIN(d->vp.out_count,
+                                  VP_OUT_FRAMES - d->vp.out_read);
+        frames = MIN(frames, free / 4);
+        int written = AUD_write(d->vp.audio_voice,
+                                d->vp.out[d->vp.out_read], frames * 4);
+        if (written < 4) {
+            break;
+        }
+        frames = written / 4;
+        d->vp.out_read = (d->vp.out_read + frames) % VP_OUT_FRAMES;
+        d->vp.out_count -= frames;
+        free -= frames * 4;
+    }
+    if (free >= 4 && !d->vp.out_count && d->vp.out_playing) {
+        d->vp.underruns++;
+        d->vp.out_playing = false;
+    }
+    bool low = d->vp.out_count < SE_QUEUE_FRAMES * VP_FRAME_SAMPLES;
+    qemu_mutex_unlock(&d->vp.out_lock);
+
+    if (low) {
+        se_kick(d);
+    }
+}
+
+/* Snapshot an active buffer voice for the VP workers */
+static void vp_queue_voice(MCPXAPUState *d, unsigned int v)
+{
+    VPVoiceJob *job = &d->vp.jobs[d->vp.num_jobs];
+    uint32_t vbin, vola, volb, volc;
+
+    job->handle = v;
+    vbin = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, 0xFFFFFFFF);
+    job->fmt = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, 0xFFFFFFFF);
+    job->bins[0] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V0BIN);
+    job->bins[1] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V1BIN);
+    job->bins[2] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V2BIN);
+    job->bins[3] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V3BIN);
+    job->bins[4] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V4BIN);
+    job->bins[5] = GET_MASK(vbin, NV_PAVS_VOICE_CFG_VBIN_V5BIN);
+    job->bins[6] = GET_MASK(job->fmt, NV_PAVS_VOICE_CFG_FMT_V6BIN);
+    job->bins[7] = GET_MASK(job->fmt, NV_PAVS_VOICE_CFG_FMT_V7BIN);
+
+    vola = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_VOLA, 0xFFFFFFFF);
+    volb = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_VOLB, 0xFFFFFFFF);
+    volc = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_VOLC, 0xFFFFFFFF);
+    job->volume[0] = GET_MASK(vola, NV_PAVS_VOICE_CUR_VOLA_VOLUME0);
+    job->volume[1] = GET_MASK(vola, NV_PAVS_VOICE_CUR_VOLA_VOLUME1);
+    job->volume[2] = GET_MASK(volb, NV_PAVS_VOICE_CUR_VOLB_VOLUME2);
+    job->volume[3] = GET_MASK(volb, NV_PAVS_VOICE_CUR_VOLB_VOLUME3);
+    job->volume[4] = GET_MASK(volc, NV_PAVS_VOICE_CUR_VOLC_VOLUME4);
+    job->volume[5] = GET_MASK(volc, NV_PAVS_VOICE_CUR_VOLC_VOLUME5);
+    job->volume[6] = GET_MASK(vola, NV_PAVS_VOICE_CUR_VOLA_VOLUME6_B3_0)
+        | GET_MASK(volb, NV_PAVS_VOICE_CUR_VOLB_VOLUME6_B7_4) << 4
+        | GET_MASK(volc, NV_PAVS_VOICE_CUR_VOLC_VOLUME6_B11_8) << 8;
+    job->volume[7] = GET_MASK(vola, NV_PAVS_VOICE_CUR_VOLA_VOLUME7_B3_0)
+        | GET_MASK(volb, NV_PAVS_VOICE_CUR_VOLB_VOLUME7_B7_4) << 4
+        | GET_MASK(volc, NV_PAVS_VOICE_CUR_VOLC_VOLUME7_B11_8) << 8;
+
+    job->env0 = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_ENV0, 0xFFFFFFFF);
+    job->enva = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_ENVA, 0xFFFFFFFF);
+    job->misc = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_MISC, 0xFFFFFFFF);
+
+    job->ba = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSL_START,
+                             NV_PAVS_VOICE_CUR_PSL_START_BA);
+    job->lbo = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSH_SAMPLE,
+                              NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO);
+    job->cbo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
+                              NV_PAVS_VOICE_PAR_OFFSET_CBO);
+    job->ebo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_NEXT,
+                              NV_PAVS_VOICE_PAR_NEXT_EBO);
+    job->pitch = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_PITCH_LINK,
+                                NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
+
+    job->state = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE, 0xFFFFFFFF);
+    job->eacur = GET_MASK(job->state, NV_PAVS_VOICE_PAR_STATE_EACUR);
+    job->eacount = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT,
+                                  NV_PAVS_VOICE_CUR_ECNT_EACOUNT);
+    job->env = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
+                              NV_PAVS_VOICE_PAR_OFFSET_EALVL) / 255.0f;
+    job->ended = false;
+
+    d->vp.num_jobs++;
+}
+
+/* Write the results of the last frame back to voice memory. Voices the
+ * guest has stopped in the meantime are left alone. */
+static void vp_writeback(MCPXAPUState *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < d->vp.num_jobs; i++) {
+        VPVoiceJob *job = &d->vp.jobs[i];
+        unsigned int v = job->handle;
+
+        if (!voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
+                            NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE)) {
+            continue;
+        }
+        voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
+                       NV_PAVS_VOICE_PAR_OFFSET_CBO, job->cbo);
+        voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
+                       NV_PAVS_VOICE_PAR_OFFSET_EALVL,
+                       lrintf(job->env * 255.0f));
+        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT,
+                       NV_PAVS_VOICE_CUR_ECNT_EACOUNT, job->eacount);
+        voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
+                       NV_PAVS_VOICE_PAR_STATE_EACUR, job->eacur);
+        if (job->ended) {
+            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
+                           NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
+        }
+    }
+    d->vp.num_jobs = 0;
+}
+
+static void vp_start(MCPXAPUState *d)
+{
+    struct audsettings as = {
+        .freq = VP_SAMPLE_RATE,
+        .nchannels = 2,
+        .fmt = AUD_FMT_S16,
+        .endianness = 0,
+    };
+    unsigned int i;
+
+    vp_init_tables();
+
+    d->vp.num_threads = MAX(1, MIN(d->vp.num_threads, 16));
+    qemu_mutex_init(&d->vp.lock);
+    qemu_cond_init(&d->vp.work_cond);
+    qemu_mutex_init(&d->vp.out_lock);
+
+    d->vp.workers = g_new0(VPWorker, d->vp.num_threads);
+    for (i = 0; i < d->vp.num_threads; i++) {
+        VPWorker *w = &d->vp.workers[i];
+        w->d = d;
+        w->index = i;
+        qemu_thread_create(&w->thread, vp_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    qemu_cond_init(&d->gp.cond);
+    qemu_thread_create(&d->gp.thread, gp_thread, d, QEMU_THREAD_JOINABLE);
+
+    AUD_register_card("mcpx-apu", &d->vp.card);
+    d->vp.audio_voice = AUD_open_out(&d->vp.card, NULL, "mcpx-apu.out", d,
+                                     vp_audio_callback, &as);
+    if (d->vp.audio_voice) {
+        AUD_set_active_out(d->vp.audio_voice, 1);
+    }
+}
+
+static void vp_stop(MCPXAPUState *d)
+{
+    unsigned int i;
+
+    qemu_mutex_lock(&d->vp.lock);
+    d->vp.quit = true;
+    d->gp.quit = true;
+    qemu_cond_broadcast(&d->vp.work_cond);
+    qemu_cond_signal(&d->gp.cond);
+    qemu_mutex_unlock(&d->vp.lock);
+
+    qemu_thread_join(&d->gp.thread);
+
+    for (i = 0; i < d->vp.num_threads; i++) {
+        qemu_thread_join(&d->vp.workers[i].thread);
+    }
+    g_free(d->vp.workers);
+    d->vp.workers = NULL;
+
+    if (d->vp.audio_voice) {
+        AUD_close_out(&d->vp.card, d->vp.audio_voice);
+        d->vp.audio_voice = NULL;
+    }
+    AUD_remove_card(&d->vp.card);
+}
+
+/* Called with d->lock held */
+static void se_frame(MCPXAPUState *d)
+{
     MCPX_DPRINTF("mcpx frame ping\n");
+
+    qemu_mutex_lock(&d->vp.lock);
+    if (d->vp.pending) {
+        /* the workers are still busy with the last frame */
+        d->vp.stats.late_frames++;
+        qemu_mutex_unlock(&d->vp.lock);
+        return;
+    }
+    bool results_ready = d->vp.results_ready;
+    d->vp.results_ready = false;
+    qemu_mutex_unlock(&d->vp.lock);
+
+    /* The workers are idle until the next dispatch, so the jobs can be
+     * touched without the lock. */
+    if (results_ready) {
+        vp_writeback(d);
+    }
+    d->vp.num_jobs = 0;
+
     int list;
     for (list=0; list < 3; list++) {
         hwaddr top, current, next;
@@ -394,6 +1618,11 @@ static void se_frame(void *opaque)
 
         d->regs[current] = d->regs[top];
         while (d->regs[current] != 0xFFFF) {
+            if (!voice_valid(d, d->regs[current])) {
+                /* drop the rest of the list for this frame */
+                d->regs[current] = 0xFFFF;
+                break;
+            }
             d->regs[next] = voice_get_mask(d, d->regs[current],
                 NV_PAVS_VOICE_TAR_PITCH_LINK,
                 NV_PAVS_VOICE_TAR_PITCH_LINK_NEXT_VOICE_HANDLE);
@@ -402,10 +1631,117 @@ static void se_frame(void *opaque)
                     NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE)) {
                 MCPX_DPRINTF("voice %d not active...!\n", d->regs[current]);
                 fe_method(d, SE2FE_IDLE_VOICE, d->regs[current]);
+            } else if (voice_get_mask(d, d->regs[current],
+                           NV_PAVS_VOICE_CFG_FMT,
+                           NV_PAVS_VOICE_CFG_FMT_DATA_TYPE)) {
+                /* stream voices are fed through the SSL/FIFO path,
+                 * which isn't emulated; they stay silent */
+                if (!d->vp.stream_voice_logged) {
+                    qemu_log_mask(LOG_UNIMP, "mcpx apu: stream voice %u "
+                                  "not played\n", d->regs[current]);
+                    d->vp.stream_voice_logged = true;
+                }
+            } else if (d->ram_ptr
+                       && d->vp.num_jobs < MCPX_HW_MAX_VOICES
+                       && !voice_get_mask(d, d->regs[current],
+                              NV_PAVS_VOICE_PAR_STATE,
+                              NV_PAVS_VOICE_PAR_STATE_PAUSED)) {
+                vp_queue_voice(d, d->regs[current]);
             }
             d->regs[current] = d->regs[next];
         }
     }
+
+    qemu_mutex_lock(&d->vp.lock);
+    d->vp.sge_addr = d->regs[NV_PAPU_VPSGEADDR];
+    d->vp.frame_start = get_clock();
+    d->vp.pending = d->vp.num_threads;
+    d->vp.generation++;
+    qemu_cond_broadcast(&d->vp.work_cond);
+    qemu_mutex_unlock(&d->vp.lock);
+}
+
+/* Called with d->lock held */
+static bool se_frame_due(MCPXAPUState *d, int64_t now)
+{
+    bool busy;
+    unsigned int queued;
+
+    if (!d->se.vm_running || !se_enabled(d)) {
+        return false;
+    }
+    if (!d->vp.audio_voice) {
+        return now - d->se.last_frame >= SE_FRAME_MS * SCALE_MS;
+    }
+
+    /* paced by the backend: keep SE_QUEUE_FRAMES ahead of it */
+    qemu_mutex_lock(&d->vp.lock);
+    busy = d->vp.pending || d->gp.busy;
+    qemu_mutex_unlock(&d->vp.lock);
+    if (busy) {
+        return false;
+    }
+    qemu_mutex_lock(&d->vp.out_lock);
+    queued = d->vp.out_count;
+    qemu_mutex_unlock(&d->vp.out_lock);
+    return queued < SE_QUEUE_FRAMES * VP_FRAME_SAMPLES;
+}
+
+static void *se_thread(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->lock);
+    d->se.window_start = get_clock();
+    while (!d->se.quit) {
+        /* with nothing to set up only a kick can make a frame due */
+        bool idle = !d->se.vm_running || !se_enabled(d);
+
+        qemu_mutex_unlock(&d->lock);
+        if (idle) {
+            qemu_sem_wait(&d->se.kick);
+        } else {
+            qemu_sem_timedwait(&d->se.kick, SE_FRAME_MS);
+        }
+        int64_t start = get_clock();
+        qemu_mutex_lock(&d->lock);
+
+        fe_drain(d);
+        if (se_frame_due(d, start)) {
+            d->se.last_frame = start;
+            se_frame(d);
+        } else if (!se_enabled(d)) {
+            /* running dry from here on is not an underrun */
+            qemu_mutex_lock(&d->vp.out_lock);
+            d->vp.out_playing = false;
+            qemu_mutex_unlock(&d->vp.out_lock);
+        }
+        if (d->irq_dirty) {
+            qemu_bh_schedule(d->irq_bh);
+        }
+
+        int64_t now = get_clock();
+        d->se.window_busy += now - start;
+        if (now - d->se.window_start >= SE_LOAD_WINDOW_NS) {
+            d->se.load = 100.0 * d->se.window_busy
+                             / (now - d->se.window_start);
+            d->se.window_start = now;
+            d->se.window_busy = 0;
+        }
+    }
+    qemu_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+static void mcpx_apu_vm_state_change(void *opaque, int running,
+                                     RunState state)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->lock);
+    d->se.vm_running = running;
+    qemu_mutex_unlock(&d->lock);
+    se_kick(d);
 }
 
 
@@ -426,12 +1762,198 @@ static int mcpx_apu_initfn(PCIDevice *dev)
 
     pci_register_bar(&d->dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->mmio);
 
+    d->ram = d->ram_opaque;
+    if (d->ram) {
+        d->ram_ptr = memory_region_get_ram_ptr(d->ram);
+    }
+
+    qemu_mutex_init(&d->gp.lock);
+    d->gp.dsp = g_malloc(sizeof(DSPState));
+    dsp56300_init(d->gp.dsp);
+    d->gp.saved_dsp = g_malloc0(sizeof(DSPState));
+
+
+    qemu_mutex_init(&d->lock);
+    qemu_sem_init(&d->se.kick, 0);
+    d->irq_bh = qemu_bh_new(mcpx_apu_irq_bh, d);
+
+    vp_start(d);
 
-    d->se.frame_timer = qemu_new_timer_ms(vm_clock, se_frame, d);
+    d->se.vm_running = runstate_is_running();
+    d->se.vm_state = qemu_add_vm_change_state_handler(
+        mcpx_apu_vm_state_change, d);
+    qemu_thread_create(&d->se.thread, se_thread, d, QEMU_THREAD_JOINABLE);
 
     return 0;
 }
 
+static void mcpx_apu_exitfn(PCIDevice *dev)
+{
+    MCPXAPUState *d = MCPX_APU_DEVICE(dev);
+
+    qemu_mutex_lock(&d->lock);
+    d->se.quit = true;
+    qemu_mutex_unlock(&d->lock);
+    se_kick(d);
+    qemu_thread_join(&d->se.thread);
+    qemu_del_vm_change_state_handler(d->se.vm_state);
+
+    vp_stop(d);
+    voices_unmap(d);
+    g_free(d->gp.dsp);
+    g_free(d->gp.saved_dsp);
+    qemu_bh_delete(d->irq_bh);
+}
+
+static void mcpx_apu_pre_save(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    /* queued methods aren't part of the saved state; run them now */
+    qemu_mutex_lock(&d->lock);
+    fe_drain(d);
+    if (d->irq_dirty) {
+        update_irq(d);
+    }
+    qemu_mutex_unlock(&d->lock);
+}
+
+static int mcpx_apu_post_load(void *opaque, int version_id)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->lock);
+    d->fe.tail = d->fe.head;
+    voices_remap(d);
+    qemu_mutex_unlock(&d->lock);
+    /* the voice lists may not be empty any more */
+    se_kick(d);
+
+    /* results of a frame still in flight belong to the old state */
+    qemu_mutex_lock(&d->vp.lock);
+    d->vp.results_ready = false;
+    d->vp.results_stale = d->vp.pending != 0;
+    qemu_mutex_unlock(&d->vp.lock);
+    return 0;
+}
+
+static const VMStateDescription vmstate_dsp56300 = {
+    .name = "dsp56300",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(x0, DSPState),
+        VMSTATE_UINT32(x1, DSPState),
+        VMSTATE_UINT32(y0, DSPState),
+        VMSTATE_UINT32(y1, DSPState),
+        VMSTATE_INT64(a, DSPState),
+        VMSTATE_INT64(b, DSPState),
+        VMSTATE_UINT32_ARRAY(r, DSPState, 8),
+        VMSTATE_UINT32_ARRAY(n, DSPState, 8),
+        VMSTATE_UINT32_ARRAY(m, DSPState, 8),
+        VMSTATE_UINT32(pc, DSPState),
+        VMSTATE_UINT32(sr, DSPState),
+        VMSTATE_UINT32(omr, DSPState),
+        VMSTATE_UINT32(sp, DSPState),
+        VMSTATE_UINT32(la, DSPState),
+        VMSTATE_UINT32(lc, DSPState),
+        VMSTATE_UINT32(vba, DSPState),
+        VMSTATE_UINT32(sc, DSPState),
+        VMSTATE_UINT32(sz, DSPState),
+        VMSTATE_UINT32(ep, DSPState),
+        VMSTATE_UINT32_ARRAY(ssh, DSPState, DSP_STACK_SIZE),
+        VMSTATE_UINT32_ARRAY(ssl, DSPState, DSP_STACK_SIZE),
+        VMSTATE_UINT32_ARRAY(x, DSPState, DSP_X_SIZE),
+        VMSTATE_UINT32_ARRAY(y, DSPState, DSP_Y_SIZE),
+        VMSTATE_UINT32_ARRAY(p, DSPState, DSP_P_SIZE),
+        VMSTATE_BOOL(waiting, DSPState),
+        VMSTATE_BOOL(stopped, DSPState),
+        VMSTATE_UINT64(cycles, DSPState),
+        VMSTATE_UINT32(illegal_opcode, DSPState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+/* The GP thread may be running the DSP, so the state goes through
+ * saved_dsp, copied under gp.lock on either side. */
+static void mcpx_apu_gp_pre_save(void *opaque)
+{
+    MCPXAPUState *d = opaque;
+
+    qemu_mutex_lock(&d->gp.lock);
+    dsp56300_copy_state(d->gp.saved_dsp, d->gp.dsp);
+    d->gp.saved_rst = d->gp.rst;
+    qemu_mutex_unlock(&d->gp.lock);
+}
+
+static int mcpx_apu_gp_post_load(void *opaque, int version_id)
+{
+    MCPXAPUState *d = opaque;
+    DSPState *s = d->gp.saved_dsp;
+
+    if (s->sp >= DSP_STACK_SIZE) {
+        return -EINVAL;
+    }
+    qemu_mutex_lock(&d->gp.lock);
+    dsp56300_copy_state(d->gp.dsp, s);
+    d->gp.rst = d->gp.saved_rst;
+    qemu_mutex_unlock(&d->gp.lock);
+    return 0;
+}
+
+/* The DSP program is always worth keeping; streams from before this
+ * subsection just leave the GP in reset. */
+static bool mcpx_apu_gp_needed(void *opaque)
+{
+    return true;
+}
+
+static const VMStateDescription vmstate_mcpx_apu_gp = {
+    .name = "mcpx-apu/gp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .pre_save = mcpx_apu_gp_pre_save,
+    .post_load = mcpx_apu_gp_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(gp.saved_rst, MCPXAPUState),
+        VMSTATE_STRUCT_POINTER(gp.saved_dsp, MCPXAPUState, vmstate_dsp56300,
+                               DSPState *),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+/* The voice lists themselves live in guest memory; only their heads
+ * need saving here. */
+static const VMStateDescription vmstate_mcpx_apu = {
+    .name = "mcpx-apu",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .minimum_version_id_old = 2,
+    .pre_save = mcpx_apu_pre_save,
+    .post_load = mcpx_apu_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(dev, MCPXAPUState),
+        VMSTATE_UINT32_ARRAY(regs, MCPXAPUState, 0x20000),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_mcpx_apu_gp,
+            .needed = mcpx_apu_gp_needed,
+        }, {
+            /* empty */
+        }
+    }
+};
+
+static Property mcpx_apu_properties[] = {
+    DEFINE_PROP_UINT32("vp-threads", MCPXAPUState, vp.num_threads, 2),
+    DEFINE_PROP_PTR("ram", MCPXAPUState, ram_opaque),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void mcpx_apu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -442,8 +1964,11 @@ static void mcpx_apu_class_init(ObjectClass *klass, void *data)
     k->revision = 210;
     k->class_id = PCI_CLASS_MULTIMEDIA_AUDIO;
     k->init = mcpx_apu_initfn;
+    k->exit = mcpx_apu_exitfn;
 
     dc->desc = "MCPX Audio Processing Unit";
+    dc->vmsd = &vmstate_mcpx_apu;
+    dc->props = mcpx_apu_properties;
 }
 
 static const TypeInfo mcpx_apu_info = {
@@ -457,4 +1982,41 @@ static void mcpx_apu_register(void)
 {
     type_register_static(&mcpx_apu_info);
 }
-type_init(mcpx_apu_register);
\ No newline at end of file
+type_init(mcpx_apu_register);
+
+void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
+{
+    PCIDevice *dev = pci_create(bus, devfn, "mcpx-apu");
+    qdev_prop_set_ptr(&dev->qdev, "ram", ram);
+    qdev_init_nofail(&dev->qdev);
+}
+
+MCPXAPUStatsInfo *qmp_query_mcpx_apu_stats(Error **errp)
+{
+    Object *obj = object_resolve_path_type("", "mcpx-apu", NULL);
+    if (!obj) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, "mcpx-apu");
+        return NULL;
+    }
+    MCPXAPUState *d = MCPX_APU_DEVICE(obj);
+
+    MCPXAPUStatsInfo *info = g_malloc0(sizeof(*info));
+    qemu_mutex_lock(&d->vp.lock);
+    info->frames = d->vp.stats.frames;
+    info->voices = d->vp.stats.voices;
+    info->total_voices = d->vp.stats.total_voices;
+    info->dsp_ms = d->vp.stats.dsp_ns / (double)SCALE_MS;
+    info->total_dsp_ms = d->vp.stats.total_dsp_ns / (double)SCALE_MS;
+    info->late_frames = d->vp.stats.late_frames;
+    qemu_mutex_unlock(&d->vp.lock);
+
+    qemu_mutex_lock(&d->vp.out_lock);
+    info->underruns = d->vp.underruns;
+    qemu_mutex_unlock(&d->vp.out_lock);
+
+    qemu_mutex_lock(&d->lock);
+    info->thread_load = d->se.load;
+    qemu_mutex_unlock(&d->lock);
+
+    return info;
+}
@@ -23,10 +23,16 @@
 #include "ui/console.h"
 #include "hw/display/vga.h"
 #include "hw/display/vga_int.h"
+#include "ui/pixel_ops.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "sysemu/sysemu.h"
 #include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
 #include "gl/gloffscreen.h"
+#include "trace.h"
 
 #include "hw/xbox/swizzle.h"
 #include "hw/xbox/u_format_r11g11b10f.h"
@@ -35,7 +41,7 @@
 
 #include "hw/xbox/nv2a.h"
 
-#define DEBUG_NV2A
+//#define DEBUG_NV2A
 #ifdef DEBUG_NV2A
 # define NV2A_DPRINTF(format, ...)       printf("nv2a: " format, ## __VA_ARGS__)
 #else
@@ -376,6 +382,7 @@
 #   define NV_PVIDEO_FORMAT_COLOR                             0x00030000
 #       define NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8             1
 #   define NV_PVIDEO_FORMAT_DISPLAY                            (1 << 20)
+#define NV_PVIDEO_COLOR_KEY                              0x00000B00
 
 
 #define NV_PTIMER_INTR_0                                 0x00000100
@@ -1030,6 +1037,22 @@ typedef struct Cache1State {
     QemuCond cache_cond;
     int cache_size;
     QSIMPLEQ_HEAD(, CacheEntry) cache;
+
+    /* Set while the VM is stopped. The puller parks between commands
+     * and writes back the color surface once, then signals halt_cond.
+     * Protected by cache_lock. */
+    bool halted;
+    bool halt_flushed;
+    bool flip_stalled;
+    QemuCond halt_cond;
+
+    /* Copies of the bitfields and pull_enabled for vmstate */
+    struct {
+        uint32_t method;
+        uint32_t subchannel;
+        uint32_t method_count;
+        bool pull_enabled;
+    } vmstate;
 } Cache1State;
 
 typedef struct ChannelControl {
@@ -1038,11 +1061,38 @@ typedef struct ChannelControl {
     uint32_t ref;
 } ChannelControl;
 
+/* Emulator-side statistics. All fields are uint64_t counters.
+ * Both the vcpu (the pusher, from MMIO writes) and the puller thread
+ * update them, so updates are atomic adds rather than relying on each
+ * field having a single writer.  The monitor reads them with
+ * atomic_read. */
+typedef struct NV2AStats {
+    uint64_t methods;
+    uint64_t pushed_words;
+    uint64_t draws;
+    uint64_t texture_uploads;
+    uint64_t shader_compiles;
+    uint64_t surface_uploads;
+    uint64_t surface_downloads;
+    uint64_t cache1_stalls;
+    uint64_t gl_ns;
+} NV2AStats;
+
+#define NV2A_STATS_FIELDS (sizeof(NV2AStats) / sizeof(uint64_t))
+
+#define NV2A_STAT_ADD(d, field, n)                                   \
+    atomic_add(&(d)->stats.total.field, (n))
+
+#define NV2A_STAT_INC(d, field) NV2A_STAT_ADD(d, field, 1)
+
 
 
 typedef struct NV2AState {
     PCIDevice dev;
     qemu_irq irq;
+    QEMUBH *irq_bh;
+    /* dispatch PFIFO, PGRAPH and USER without the global mutex */
+    bool lockless_mmio;
 
     VGACommonState vga;
     GraphicHwOps hw_ops;
@@ -1057,6 +1107,8 @@ typedef struct NV2AState {
 
     MemoryRegion block_mmio[NV_NUM_BLOCKS];
 
+    VMChangeStateEntry *vm_state_entry;
+
     struct {
         uint32_t pending_interrupts;
         uint32_t enabled_interrupts;
@@ -1122,6 +1174,13 @@ typedef struct NV2AState {
         ChannelControl channel_control[NV2A_NUM_CHANNELS];
     } user;
 
+    struct {
+        uint64_t frames;
+        NV2AStats total;
+        NV2AStats frame_start;
+        NV2AStats last_frame;
+    } stats;
+
 } NV2AState;
 
 
@@ -1130,11 +1189,8 @@ typedef struct NV2AState {
 
 static void reg_log_read(int block, hwaddr addr, uint64_t val);
 static void reg_log_write(int block, hwaddr addr, uint64_t val);
-static void pgraph_method_log(unsigned int subchannel,
-                              unsigned int graphics_class,
-                              unsigned int method, uint32_t parameter);
 
-static void update_irq(NV2AState *d)
+static void update_irq_locked(NV2AState *d)
 {
     /* PFIFO */
     if (d->pfifo.pending_interrupts & d->pfifo.enabled_interrupts) {
@@ -1164,6 +1220,44 @@ static void update_irq(NV2AState *d)
     }
 }
 
+static void nv2a_irq_bh(void *opaque)
+{
+    update_irq_locked(opaque);
+}
+
+/* The interrupt line may only be driven with the global lock held.
+ * Lockless MMIO handlers run on the vcpu thread, which retakes the lock
+ * without having to kick anybody.  The puller must never wait for the
+ * vcpu to drop it, so it hands the update to the main loop instead. */
+static void update_irq(NV2AState *d)
+{
+    if (qemu_mutex_iothread_locked()) {
+        update_irq_locked(d);
+    } else if (qemu_in_vcpu_thread()) {
+        qemu_mutex_lock_iothread();
+        update_irq_locked(d);
+        qemu_mutex_unlock_iothread();
+    } else {
+        qemu_bh_schedule(d->irq_bh);
+    }
+}
+
+/* Called from the puller on a flip */
+static void nv2a_stats_frame_end(NV2AState *d)
+{
+    int i;
+    uint64_t *total = (uint64_t *)&d->stats.total;
+    uint64_t *start = (uint64_t *)&d->stats.frame_start;
+    uint64_t *last = (uint64_t *)&d->stats.last_frame;
+
+    for (i = 0; i < NV2A_STATS_FIELDS; i++) {
+        uint64_t now = atomic_read(&total[i]);
+        atomic_set(&last[i], now - start[i]);
+        start[i] = now;
+    }
+    atomic_set(&d->stats.frames, d->stats.frames + 1);
+}
+
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 {
     uint32_t hash = 0;
@@ -1457,15 +1551,11 @@ static void pgraph_bind_textures(NV2AState *d)
         }
 
 
-        NV2A_DPRINTF(" texture %d is format 0x%x, (r %d, %d or %d, %d; %d),"
-                        " filter %x %x, levels %d-%d %d bias %d\n",
-                     i, color_format,
-                     rect_width, rect_height,
-                     1 << log_width, 1 << log_height,
-                     pitch,
-                     min_filter, mag_filter,
-                     min_mipmap_level, max_mipmap_level, levels,
-                     lod_bias);
+        trace_nv2a_pgraph_bind_texture(i, color_format,
+                                       rect_width, rect_height,
+                                       1 << log_width, 1 << log_height,
+                                       pitch, levels,
+                                       pg->texture_dirty[i]);
 
         assert(color_format
                 < sizeof(kelvin_color_format_map)/sizeof(ColorFormatInfo));
@@ -1499,6 +1589,8 @@ static void pgraph_bind_textures(NV2AState *d)
 
         if (!pg->texture_dirty[i]) continue;
 
+        NV2A_STAT_INC(d, texture_uploads);
+
         glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER,
             kelvin_texture_min_filter_map[min_filter]);
         glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER,
@@ -1516,7 +1608,7 @@ static void pgraph_bind_textures(NV2AState *d)
         assert(offset < dma_len);
         texture_data += offset;
 
-        NV2A_DPRINTF(" - 0x%tx\n", texture_data - d->vram_ptr);
+        trace_nv2a_pgraph_upload_texture(i, texture_data - d->vram_ptr);
 
         if (f.linear) {
             /* Can't handle retarded strides */
@@ -1838,9 +1930,12 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
         }
 
         gpointer cached_shader = g_hash_table_lookup(pg->shader_cache, &state);
+        trace_nv2a_pgraph_shader_cache_lookup(cached_shader != NULL);
         if (cached_shader) {
             pg->gl_program = (GLuint)cached_shader;
         } else {
+            NV2A_STAT_INC(container_of(pg, NV2AState, pgraph),
+                          shader_compiles);
             pg->gl_program = generate_shaders(state);
 
             /* cache it */
@@ -2015,6 +2110,8 @@ static void pgraph_update_surface(NV2AState *d, bool upload)
              * copy it into the opengl renderbuffer */
             assert(!d->pgraph.surface_color.draw_dirty);
 
+            int64_t gl_start = get_clock();
+
             assert(d->pgraph.surface_color.pitch % bytes_per_pixel == 0);
 
             if (swizzle) {
@@ -2048,27 +2145,27 @@ static void pgraph_update_surface(NV2AState *d, bool upload)
             glPixelStorei(GL_UNPACK_ROW_LENGTH, rl);
             glPixelStorei(GL_UNPACK_ALIGNMENT, pa);
 
-            uint8_t *out = color_data + d->pgraph.surface_color.offset + 64;
-            NV2A_DPRINTF("upload_surface 0x%llx - 0x%llx, "
-                          "(0x%llx - 0x%llx, %d %d, %d %d, %d) - %x %x %x %x\n",
-                color_dma.address, color_dma.address + color_dma.limit,
+            NV2A_STAT_INC(d, surface_uploads);
+            NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
+
+            trace_nv2a_pgraph_surface_upload(
                 color_dma.address + d->pgraph.surface_color.offset,
-                color_dma.address + d->pgraph.surface_color.pitch * height,
-                d->pgraph.surface_clip_x, d->pgraph.surface_clip_y,
-                d->pgraph.surface_clip_width, d->pgraph.surface_clip_height,
-                d->pgraph.surface_color.pitch,
-                out[0], out[1], out[2], out[3]);
+                width, height, d->pgraph.surface_color.pitch, swizzle);
         }
 
         if (!upload && d->pgraph.surface_color.draw_dirty) {
             /* read the opengl renderbuffer into the surface */
 
+            int64_t gl_start = get_clock();
             glo_readpixels(gl_format, gl_type,
                            bytes_per_pixel, d->pgraph.surface_color.pitch,
                            width, height,
                            buf);
             assert(glGetError() == GL_NO_ERROR);
 
+            NV2A_STAT_INC(d, surface_downloads);
+            NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
+
             if (swizzle) {
                 swizzle_rect(buf,
                              width, height,
@@ -2083,19 +2180,20 @@ static void pgraph_update_surface(NV2AState *d, bool upload)
                                            d->pgraph.surface_color.pitch
                                                 * height,
                                            DIRTY_MEMORY_VGA);
+            /* written through a host pointer, so migration has to be
+             * told explicitly */
+            memory_region_set_client_dirty(d->vram,
+                                           color_dma.address
+                                                + d->pgraph.surface_color.offset,
+                                           d->pgraph.surface_color.pitch
+                                                * height,
+                                           DIRTY_MEMORY_MIGRATION);
 
             d->pgraph.surface_color.draw_dirty = false;
 
-            uint8_t *out = color_data + d->pgraph.surface_color.offset + 64;
-            NV2A_DPRINTF("read_surface 0x%llx - 0x%llx, "
-                          "(0x%llx - 0x%llx, %d %d, %d %d, %d) - %x %x %x %x\n",
-                color_dma.address, color_dma.address + color_dma.limit,
+            trace_nv2a_pgraph_surface_download(
                 color_dma.address + d->pgraph.surface_color.offset,
-                color_dma.address + d->pgraph.surface_color.pitch * d->pgraph.surface_clip_height,
-                d->pgraph.surface_clip_x, d->pgraph.surface_clip_y,
-                d->pgraph.surface_clip_width, d->pgraph.surface_clip_height,
-                d->pgraph.surface_color.pitch,
-                out[0], out[1], out[2], out[3]);
+                width, height, d->pgraph.surface_color.pitch, swizzle);
         }
 
         if (swizzle) {
@@ -2200,6 +2298,49 @@ static void pgraph_destroy(PGRAPHState *pg)
     glo_context_destroy(pg->gl_context);
 }
 
+/* Called on the puller with the pgraph lock held, before it blocks
+ * waiting for the guest.  The guest cannot make progress while the VM is
+ * stopped, so write back the surface from here rather than at the next
+ * command boundary. */
+static void pgraph_halt_flush(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    Cache1State *cache1 = &d->pfifo.cache1;
+
+    qemu_mutex_lock(&cache1->cache_lock);
+    if (cache1->halted && !cache1->halt_flushed) {
+        qemu_mutex_unlock(&cache1->cache_lock);
+        glo_set_current(pg->gl_context);
+        pgraph_update_surface(d, false);
+        qemu_mutex_lock(&cache1->cache_lock);
+        cache1->halt_flushed = true;
+        qemu_cond_broadcast(&cache1->halt_cond);
+    }
+    qemu_mutex_unlock(&cache1->cache_lock);
+}
+
+static void pgraph_wait_interrupt(NV2AState *d, uint32_t mask)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    while (pg->pending_interrupts & mask) {
+        pgraph_halt_flush(d);
+        qemu_cond_wait(&pg->interrupt_cond, &pg->lock);
+    }
+}
+
+/* The surface was written back before a flip stall, so a stop needs no
+ * flush while the puller sits there. */
+static void pfifo_set_flip_stalled(NV2AState *d, bool stalled)
+{
+    Cache1State *cache1 = &d->pfifo.cache1;
+
+    qemu_mutex_lock(&cache1->cache_lock);
+    cache1->flip_stalled = stalled;
+    qemu_cond_broadcast(&cache1->halt_cond);
+    qemu_mutex_unlock(&cache1->cache_lock);
+}
+
 static void pgraph_method(NV2AState *d,
                           unsigned int subchannel,
                           unsigned int method,
@@ -2227,8 +2368,9 @@ static void pgraph_method(NV2AState *d,
     KelvinState *kelvin = &object->data.kelvin;
 
 
-
-    pgraph_method_log(subchannel, object->graphics_class, method, parameter);
+    trace_nv2a_pgraph_method(subchannel, object->graphics_class,
+                             method, parameter);
+    NV2A_STAT_INC(d, methods);
 
     glo_set_current(pg->gl_context);
 
@@ -2239,6 +2381,7 @@ static void pgraph_method(NV2AState *d,
         //qemu_mutex_lock_iothread();
         load_graphics_object(d, parameter, object);
         //qemu_mutex_unlock_iothread();
+        trace_nv2a_pgraph_method_done(subchannel, method);
         return;
     }
 
@@ -2358,29 +2501,29 @@ static void pgraph_method(NV2AState *d,
             pg->trapped_data[0] = parameter;
             pg->notify_source = NV_PGRAPH_NSOURCE_NOTIFICATION; /* TODO: check this */
             pg->pending_interrupts |= NV_PGRAPH_INTR_NOTIFY;
-
-            qemu_mutex_unlock(&pg->lock);
-            qemu_mutex_lock_iothread();
             update_irq(d);
-            qemu_mutex_lock(&pg->lock);
-            qemu_mutex_unlock_iothread();
 
-            while (pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY) {
-                qemu_cond_wait(&pg->interrupt_cond, &pg->lock);
-            }
+            NV2A_STAT_INC(d, cache1_stalls);
+            pgraph_wait_interrupt(d, NV_PGRAPH_INTR_NOTIFY);
         }
         break;
     
-    case NV097_WAIT_FOR_IDLE:
+    case NV097_WAIT_FOR_IDLE: {
+        int64_t gl_start = get_clock();
         glFinish();
+        NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
         pgraph_update_surface(d, false);
         break;
+    }
 
     case NV097_FLIP_STALL:
         pgraph_update_surface(d, false);
+        nv2a_stats_frame_end(d);
 
         qemu_mutex_unlock(&pg->lock);
+        pfifo_set_flip_stalled(d, true);
         qemu_sem_wait(&pg->read_3d);
+        pfifo_set_flip_stalled(d, false);
         qemu_mutex_lock(&pg->lock);
         break;
     
@@ -2677,6 +2820,12 @@ static void pgraph_method(NV2AState *d,
     case NV097_SET_BEGIN_END:
         if (parameter == NV097_SET_BEGIN_END_OP_END) {
 
+            trace_nv2a_pgraph_draw_end(pg->inline_buffer_length,
+                                       pg->inline_array_length,
+                                       pg->inline_elements_length);
+
+            int64_t gl_start = get_clock();
+
             if (pg->inline_buffer_length) {
                 glEnableVertexAttribArray(NV2A_VERTEX_ATTR_POSITION);
                 glVertexAttribPointer(NV2A_VERTEX_ATTR_POSITION,
@@ -2727,16 +2876,29 @@ static void pgraph_method(NV2AState *d,
                 assert(false);
             }*/
             assert(glGetError() == GL_NO_ERROR);
+
+            NV2A_STAT_INC(d, draws);
+            NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
         } else {
             assert(parameter <= NV097_SET_BEGIN_END_OP_POLYGON);
 
+            trace_nv2a_pgraph_draw_begin(parameter);
+
             pgraph_update_surface(d, true);
+            trace_nv2a_pgraph_draw_bound_surface();
+
+            int64_t gl_start = get_clock();
 
             pgraph_bind_shaders(pg);
+            trace_nv2a_pgraph_draw_bound_shaders();
 
             pgraph_bind_textures(d);
+            trace_nv2a_pgraph_draw_bound_textures();
+
             pgraph_bind_vertex_attributes(d);
+            trace_nv2a_pgraph_draw_bound_attributes();
 
+            NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
 
 
             pg->gl_primitive_mode = kelvin_primitive_map[parameter];
@@ -2816,9 +2978,12 @@ static void pgraph_method(NV2AState *d,
         unsigned int count = GET_MASK(parameter, NV097_DRAW_ARRAYS_COUNT)+1;
 
 
+        int64_t gl_start = get_clock();
         pgraph_bind_converted_vertex_attributes(d, false, start + count);
         glDrawArrays(pg->gl_primitive_mode, start, count);
 
+        NV2A_STAT_INC(d, draws);
+        NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
         break;
     }
     case NV097_INLINE_ARRAY:
@@ -2904,7 +3069,9 @@ static void pgraph_method(NV2AState *d,
         NV2A_DPRINTF("------------------CLEAR 0x%x %d,%d - %d,%d  %x---------------\n",
             parameter, xmin, ymin, xmax, ymax, d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE]);
 
+        int64_t gl_start = get_clock();
         glClear(gl_mask);
+        NV2A_STAT_ADD(d, gl_ns, get_clock() - gl_start);
 
         glDisable(GL_SCISSOR_TEST);
 
@@ -2981,6 +3148,7 @@ static void pgraph_method(NV2AState *d,
     }
     qemu_mutex_unlock(&d->pgraph.lock);
 
+    trace_nv2a_pgraph_method_done(subchannel, method);
 }
 
 
@@ -2990,33 +3158,40 @@ static void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
     qemu_mutex_lock(&d->pgraph.lock);
     valid = d->pgraph.channel_valid && d->pgraph.channel_id == channel_id;
     if (!valid) {
+        trace_nv2a_pgraph_context_switch(channel_id);
+        NV2A_STAT_INC(d, cache1_stalls);
+
         d->pgraph.trapped_channel_id = channel_id;
-    }
-    qemu_mutex_unlock(&d->pgraph.lock);
-    if (!valid) {
-        NV2A_DPRINTF("puller needs to switch to ch %d\n", channel_id);
-        
-        qemu_mutex_lock_iothread();
         d->pgraph.pending_interrupts |= NV_PGRAPH_INTR_CONTEXT_SWITCH;
         update_irq(d);
-        qemu_mutex_unlock_iothread();
 
-        qemu_mutex_lock(&d->pgraph.lock);
-        while (d->pgraph.pending_interrupts & NV_PGRAPH_INTR_CONTEXT_SWITCH) {
-            qemu_cond_wait(&d->pgraph.interrupt_cond, &d->pgraph.lock);
-        }
-        qemu_mutex_unlock(&d->pgraph.lock);
+        pgraph_wait_interrupt(d, NV_PGRAPH_INTR_CONTEXT_SWITCH);
     }
+    qemu_mutex_unlock(&d->pgraph.lock);
 }
 
 static void pgraph_wait_fifo_access(NV2AState *d) {
     qemu_mutex_lock(&d->pgraph.lock);
+    if (!d->pgraph.fifo_access) {
+        NV2A_STAT_INC(d, cache1_stalls);
+    }
     while (!d->pgraph.fifo_access) {
+        pgraph_halt_flush(d);
         qemu_cond_wait(&d->pgraph.fifo_access_cond, &d->pgraph.lock);
     }
     qemu_mutex_unlock(&d->pgraph.lock);
 }
 
+/* write back whatever has been rendered but not yet read out of GL,
+ * so guest memory is complete while the VM is stopped */
+static void pgraph_flush_surface(NV2AState *d)
+{
+    qemu_mutex_lock(&d->pgraph.lock);
+    glo_set_current(d->pgraph.gl_context);
+    pgraph_update_surface(d, false);
+    qemu_mutex_unlock(&d->pgraph.lock);
+}
+
 static void *pfifo_puller_thread(void *arg)
 {
     NV2AState *d = arg;
@@ -3033,7 +3208,16 @@ static void *pfifo_puller_thread(void *arg)
         qemu_mutex_unlock(&state->pull_lock);
 
         qemu_mutex_lock(&state->cache_lock);
-        while (QSIMPLEQ_EMPTY(&state->cache)) {
+        while (QSIMPLEQ_EMPTY(&state->cache) || state->halted) {
+            if (state->halted && !state->halt_flushed) {
+                qemu_mutex_unlock(&state->cache_lock);
+                pgraph_flush_surface(d);
+                qemu_mutex_lock(&state->cache_lock);
+                state->halt_flushed = true;
+                qemu_cond_broadcast(&state->halt_cond);
+                continue;
+            }
+
             qemu_cond_wait(&state->cache_cond, &state->cache_lock);
 
             /* we could have been woken up to tell us we should die */
@@ -3048,6 +3232,8 @@ static void *pfifo_puller_thread(void *arg)
         command = QSIMPLEQ_FIRST(&state->cache);
         QSIMPLEQ_REMOVE_HEAD(&state->cache, entry);
         state->cache_size--;
+        trace_nv2a_pfifo_pull(command->subchannel, command->method,
+                              command->parameter, state->cache_size);
         qemu_mutex_unlock(&state->cache_lock);
 
         if (command->method == 0) {
@@ -3116,8 +3302,36 @@ static void *pfifo_puller_thread(void *arg)
     return NULL;
 }
 
+static void pfifo_set_pull_enabled(NV2AState *d, bool enabled)
+{
+    Cache1State *state = &d->pfifo.cache1;
+
+    qemu_mutex_lock(&state->pull_lock);
+    if (enabled && !state->pull_enabled) {
+        state->pull_enabled = true;
+
+        /* fire up puller thread */
+        qemu_thread_create(&d->pfifo.puller_thread,
+                           pfifo_puller_thread,
+                           d, QEMU_THREAD_DETACHED);
+    } else if (!enabled && state->pull_enabled) {
+        state->pull_enabled = false;
+
+        /* the puller thread should die, wake it up. */
+        qemu_cond_broadcast(&state->cache_cond);
+    }
+    qemu_mutex_unlock(&state->pull_lock);
+}
+
 /* pusher should be fine to run from a mimo handler
- * whenever's it's convenient */
+ * whenever's it's convenient
+ *
+ * The pusher state in cache1 and user.channel_control has no lock of its
+ * own.  It is only touched from PFIFO and USER MMIO, which run without
+ * the global mutex, so this relies on there being a single vcpu thread
+ * (both machines set max_cpus = 1).  vmstate and reset only run with the
+ * vcpu stopped.  The puller only sees what the pusher hands over in the
+ * cache, under cache_lock. */
 static void pfifo_run_pusher(NV2AState *d) {
     uint8_t channel_id;
     ChannelControl *control;
@@ -3149,8 +3363,8 @@ static void pfifo_run_pusher(NV2AState *d) {
 
     dma = nv_dma_map(d, state->dma_instance, &dma_len);
 
-    NV2A_DPRINTF("DMA pusher: max 0x%llx, 0x%llx - 0x%llx\n",
-                 dma_len, control->dma_get, control->dma_put);
+    trace_nv2a_pfifo_pusher_run(channel_id, dma_len,
+                                control->dma_get, control->dma_put);
 
     /* based on the convenient pseudocode in envytools */
     while (control->dma_get != control->dma_put) {
@@ -3162,6 +3376,7 @@ static void pfifo_run_pusher(NV2AState *d) {
 
         word = le32_to_cpupu((uint32_t*)(dma + control->dma_get));
         control->dma_get += 4;
+        NV2A_STAT_INC(d, pushed_words);
 
         if (state->method_count) {
             /* data word of methods command */
@@ -3175,6 +3390,9 @@ static void pfifo_run_pusher(NV2AState *d) {
             qemu_mutex_lock(&state->cache_lock);
             QSIMPLEQ_INSERT_TAIL(&state->cache, command, entry);
             state->cache_size++;
+            trace_nv2a_pfifo_push(channel_id, command->subchannel,
+                                  command->method, command->parameter,
+                                  state->cache_size);
             qemu_cond_signal(&state->cache_cond);
             qemu_mutex_unlock(&state->cache_lock);
 
@@ -3191,12 +3409,14 @@ static void pfifo_run_pusher(NV2AState *d) {
                 /* old jump */
                 state->get_jmp_shadow = control->dma_get;
                 control->dma_get = word & 0x1fffffff;
-                NV2A_DPRINTF("pb OLD_JMP 0x%llx\n", control->dma_get);
+                trace_nv2a_pfifo_pusher_jump(channel_id, "old jump",
+                                             control->dma_get);
             } else if ((word & 3) == 1) {
                 /* jump */
                 state->get_jmp_shadow = control->dma_get;
                 control->dma_get = word & 0xfffffffc;
-                NV2A_DPRINTF("pb JMP 0x%llx\n", control->dma_get);
+                trace_nv2a_pfifo_pusher_jump(channel_id, "jump",
+                                             control->dma_get);
             } else if ((word & 3) == 2) {
                 /* call */
                 if (state->subroutine_active) {
@@ -3206,7 +3426,8 @@ static void pfifo_run_pusher(NV2AState *d) {
                 state->subroutine_return = control->dma_get;
                 state->subroutine_active = true;
                 control->dma_get = word & 0xfffffffc;
-                NV2A_DPRINTF("pb CALL 0x%llx\n", control->dma_get);
+                trace_nv2a_pfifo_pusher_jump(channel_id, "call",
+                                             control->dma_get);
             } else if (word == 0x00020000) {
                 /* return */
                 if (!state->subroutine_active) {
@@ -3215,7 +3436,8 @@ static void pfifo_run_pusher(NV2AState *d) {
                 }
                 control->dma_get = state->subroutine_return;
                 state->subroutine_active = false;
-                NV2A_DPRINTF("pb RET 0x%llx\n", control->dma_get);
+                trace_nv2a_pfifo_pusher_jump(channel_id, "return",
+                                             control->dma_get);
             } else if ((word & 0xe0030003) == 0) {
                 /* increasing methods */
                 state->method = word & 0x1fff;
@@ -3231,8 +3453,8 @@ static void pfifo_run_pusher(NV2AState *d) {
                 state->method_nonincreasing = true;
                 state->dcount = 0;
             } else {
-                NV2A_DPRINTF("pb reserved cmd 0x%llx - 0x%x\n",
-                             control->dma_get, word);
+                trace_nv2a_pfifo_pusher_reserved(channel_id,
+                                                 control->dma_get, word);
                 state->error = NV_PFIFO_CACHE1_DMA_STATE_ERROR_RESERVED_CMD;
                 break;
             }
@@ -3240,7 +3462,7 @@ static void pfifo_run_pusher(NV2AState *d) {
     }
 
     if (state->error) {
-        NV2A_DPRINTF("pb error: %d\n", state->error);
+        trace_nv2a_pfifo_pusher_error(channel_id, state->error);
         assert(false);
 
         state->dma_push_suspended = true;
@@ -3547,23 +3769,7 @@ static void pfifo_write(void *opaque, hwaddr addr,
             (val & NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE);
         break;
     case NV_PFIFO_CACHE1_PULL0:
-        qemu_mutex_lock(&d->pfifo.cache1.pull_lock);
-        if ((val & NV_PFIFO_CACHE1_PULL0_ACCESS)
-             && !d->pfifo.cache1.pull_enabled) {
-            d->pfifo.cache1.pull_enabled = true;
-
-            /* fire up puller thread */
-            qemu_thread_create(&d->pfifo.puller_thread,
-                               pfifo_puller_thread,
-                               d, QEMU_THREAD_DETACHED);
-        } else if (!(val & NV_PFIFO_CACHE1_PULL0_ACCESS)
-                     && d->pfifo.cache1.pull_enabled) {
-            d->pfifo.cache1.pull_enabled = false;
-
-            /* the puller thread should die, wake it up. */
-            qemu_cond_broadcast(&d->pfifo.cache1.cache_cond);
-        }
-        qemu_mutex_unlock(&d->pfifo.cache1.pull_lock);
+        pfifo_set_pull_enabled(d, val & NV_PFIFO_CACHE1_PULL0_ACCESS);
         break;
     case NV_PFIFO_CACHE1_ENGINE:
         qemu_mutex_lock(&d->pfifo.cache1.pull_lock);
@@ -4106,7 +4312,7 @@ static uint64_t pramdac_read(void *opaque,
     /* Surprisingly, QEMU doesn't handle unaligned access for you properly */
     r >>= 32 - 8 * size - 8 * (addr & 3);
 
-    NV2A_DPRINTF("PRAMDAC: read %d [0x%llx] -> %llx\n", size, addr, r);
+    reg_log_read(NV_PRAMDAC, addr, r);
     return r;
 }
 static void pramdac_write(void *opaque, hwaddr addr,
@@ -4254,6 +4460,9 @@ typedef struct NV2ABlockInfo {
     hwaddr offset;
     uint64_t size;
     MemoryRegionOps ops;
+    /* handlers do their own locking, see update_irq() and
+     * pfifo_run_pusher() */
+    bool lockless;
 } NV2ABlockInfo;
 
 static const struct NV2ABlockInfo blocktable[] = {
@@ -4283,6 +4492,7 @@ static const struct NV2ABlockInfo blocktable[] = {
             .read = pfifo_read,
             .write = pfifo_write,
         },
+        .lockless = true,
     },
     [ NV_PRMA ]  = {
         .name = "PRMA",
@@ -4382,6 +4592,7 @@ static const struct NV2ABlockInfo blocktable[] = {
             .read = pgraph_read,
             .write = pgraph_write,
         },
+        .lockless = true,
     },
     [ NV_PCRTC ]  = {
         .name = "PCRTC",
@@ -4436,98 +4647,161 @@ static const struct NV2ABlockInfo blocktable[] = {
             .read = user_read,
             .write = user_write,
         },
+        .lockless = true,
     },
 };
 
-static const char* nv2a_reg_names[] = {};
-static const char* nv2a_method_names[] = {};
+/* Not every block index has an entry in blocktable */
+static const char *reg_block_name(int block)
+{
+    return blocktable[block].name ? blocktable[block].name : "?";
+}
+
+static void reg_log_read(int block, hwaddr addr, uint64_t val)
+{
+    trace_nv2a_reg_read(reg_block_name(block), addr, val);
+}
 
-static void reg_log_read(int block, hwaddr addr, uint64_t val) {
-    if (blocktable[block].name) {
-        hwaddr naddr = blocktable[block].offset + addr;
-        if (naddr < sizeof(nv2a_reg_names)/sizeof(const char*)
-                && nv2a_reg_names[naddr]) {
-            NV2A_DPRINTF("%s: read [%s] -> 0x%" PRIx64 "\n",
-                    blocktable[block].name, nv2a_reg_names[naddr], val);
-        } else {
-            NV2A_DPRINTF("%s: read [" TARGET_FMT_plx "] -> 0x%" PRIx64 "\n",
-                    blocktable[block].name, addr, val);
-        }
-    } else {
-        NV2A_DPRINTF("(%d?): read [" TARGET_FMT_plx "] -> 0x%" PRIx64 "\n",
-                block, addr, val);
-    }
+static void reg_log_write(int block, hwaddr addr, uint64_t val)
+{
+    trace_nv2a_reg_write(reg_block_name(block), addr, val);
 }
 
-static void reg_log_write(int block, hwaddr addr, uint64_t val) {
-    if (blocktable[block].name) {
-        hwaddr naddr = blocktable[block].offset + addr;
-        if (naddr < sizeof(nv2a_reg_names)/sizeof(const char*)
-                && nv2a_reg_names[naddr]) {
-            NV2A_DPRINTF("%s: [%s] = 0x%" PRIx64 "\n",
-                    blocktable[block].name, nv2a_reg_names[naddr], val);
-        } else {
-            NV2A_DPRINTF("%s: [" TARGET_FMT_plx "] = 0x%" PRIx64 "\n",
-                    blocktable[block].name, addr, val);
-        }
-    } else {
-        NV2A_DPRINTF("(%d?): [" TARGET_FMT_plx "] = 0x%" PRIx64 "\n",
-                block, addr, val);
-    }
+static uint8_t cliptobyte(int x)
+{
+    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
 }
-static void pgraph_method_log(unsigned int subchannel,
-                              unsigned int graphics_class,
-                              unsigned int method, uint32_t parameter) {
-    static unsigned int last = 0;
-    static unsigned int count = 0;
-    if (last == 0x1800 && method != last) {
-        NV2A_DPRINTF("pgraph method (%d) 0x%x * %d\n",
-                        subchannel, last, count);  
+
+/* Convert @count CR8YB8CB8YA8 (YUY2) pixels to 0x00RRGGBB.
+ * @src must point at the start of a pixel pair. */
+static void convert_yuy2_to_xrgb(const uint8_t *src, uint32_t *dst, int count)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i luma_mask = _mm_set1_epi16(0x00FF);
+    const __m128i luma_bias = _mm_set1_epi16(16);
+    const __m128i chroma_bias = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(128);
+    /* coefficient pairs for _mm_madd_epi16 on interleaved operands */
+    const __m128i k_r = _mm_set_epi16(409, 298, 409, 298,
+                                      409, 298, 409, 298);
+    const __m128i k_g = _mm_set_epi16(-100, 298, -100, 298,
+                                      -100, 298, -100, 298);
+    const __m128i k_g_cr = _mm_set_epi16(0, -208, 0, -208,
+                                         0, -208, 0, -208);
+    const __m128i k_b = _mm_set_epi16(516, 298, 516, 298,
+                                      516, 298, 516, 298);
+
+    for (; x + 8 <= count; x += 8) {
+        __m128i yuyv = _mm_loadu_si128((const __m128i *)(src + x * 2));
+
+        __m128i c = _mm_sub_epi16(_mm_and_si128(yuyv, luma_mask), luma_bias);
+        __m128i uv = _mm_sub_epi16(_mm_srli_epi16(yuyv, 8), chroma_bias);
+        __m128i d = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)),
+            _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i e = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)),
+            _MM_SHUFFLE(3, 3, 1, 1));
+
+        __m128i ce_lo = _mm_unpacklo_epi16(c, e);
+        __m128i ce_hi = _mm_unpackhi_epi16(c, e);
+        __m128i cd_lo = _mm_unpacklo_epi16(c, d);
+        __m128i cd_hi = _mm_unpackhi_epi16(c, d);
+        __m128i e0_lo = _mm_unpacklo_epi16(e, zero);
+        __m128i e0_hi = _mm_unpackhi_epi16(e, zero);
+
+        __m128i r_lo = _mm_madd_epi16(ce_lo, k_r);
+        __m128i r_hi = _mm_madd_epi16(ce_hi, k_r);
+        __m128i g_lo = _mm_add_epi32(_mm_madd_epi16(cd_lo, k_g),
+                                     _mm_madd_epi16(e0_lo, k_g_cr));
+        __m128i g_hi = _mm_add_epi32(_mm_madd_epi16(cd_hi, k_g),
+                                     _mm_madd_epi16(e0_hi, k_g_cr));
+        __m128i b_lo = _mm_madd_epi16(cd_lo, k_b);
+        __m128i b_hi = _mm_madd_epi16(cd_hi, k_b);
+
+        __m128i r = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(r_lo, round), 8),
+            _mm_srai_epi32(_mm_add_epi32(r_hi, round), 8));
+        __m128i g = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(g_lo, round), 8),
+            _mm_srai_epi32(_mm_add_epi32(g_hi, round), 8));
+        __m128i b = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(b_lo, round), 8),
+            _mm_srai_epi32(_mm_add_epi32(b_hi, round), 8));
+
+        /* saturate to bytes: b0..b7 r0..r7 and g0..g7 */
+        __m128i br8 = _mm_packus_epi16(b, r);
+        __m128i g8 = _mm_packus_epi16(g, zero);
+        __m128i bg = _mm_unpacklo_epi8(br8, g8);
+        __m128i r0 = _mm_unpackhi_epi8(br8, zero);
+
+        _mm_storeu_si128((__m128i *)(dst + x), _mm_unpacklo_epi16(bg, r0));
+        _mm_storeu_si128((__m128i *)(dst + x + 4),
+                         _mm_unpackhi_epi16(bg, r0));
     }
-    if (method != 0x1800) {
-        const char* method_name = NULL;
-        unsigned int nmethod = 0;
-        switch (graphics_class) {
-            case NV_KELVIN_PRIMITIVE:
-                nmethod = method | (0x5c << 16);
-                break;
-            case NV_CONTEXT_SURFACES_2D:
-                nmethod = method | (0x6d << 16);
-                break;
-            default:
-                break;
-        }
-        if (nmethod != 0
-            && nmethod < sizeof(nv2a_method_names)/sizeof(const char*)) {
-            method_name = nv2a_method_names[nmethod];
-        }
-        if (method_name) {
-            NV2A_DPRINTF("pgraph method (%d): %s (0x%x)\n",
-                     subchannel, method_name, parameter);
+#endif
+
+    for (; x < count; x++) {
+        int c, d, e;
+        c = (int)src[x * 2] - 16;
+        if (x % 2) {
+            d = (int)src[x * 2 - 1] - 128;
+            e = (int)src[x * 2 + 1] - 128;
         } else {
-            NV2A_DPRINTF("pgraph method (%d): 0x%x -> 0x%04x (0x%x)\n",
-                     subchannel, graphics_class, method, parameter);
+            d = (int)src[x * 2 + 1] - 128;
+            e = (int)src[x * 2 + 3] - 128;
         }
+        int r, g, b;
+        r = cliptobyte((298 * c + 409 * e + 128) >> 8);
+        g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
+        b = cliptobyte((298 * c + 516 * d + 128) >> 8);
 
+        dst[x] = (r << 16) | (g << 8) | b;
     }
-    if (method == last) { count++; }
-    else {count = 0; }
-    last = method;
 }
 
-static uint8_t cliptobyte(int x)
+/* the overlay only shows where the framebuffer holds the colour key */
+static inline bool pvideo_color_key_match(const uint8_t *fb_line, int fb_bpp,
+                                          int x, uint32_t key)
 {
-    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
+    switch (fb_bpp) {
+    case 8:
+        return fb_line[x] == (key & 0xFF);
+    case 15:
+    case 16:
+        return lduw_le_p(fb_line + x * 2) == (key & 0xFFFF);
+    case 32:
+        return (ldl_le_p(fb_line + x * 4) & 0xFFFFFF) == (key & 0xFFFFFF);
+    default:
+        return false;
+    }
 }
 
+#define PVIDEO_R(rgb) (((rgb) >> 16) & 0xFF)
+#define PVIDEO_G(rgb) (((rgb) >> 8) & 0xFF)
+#define PVIDEO_B(rgb) ((rgb) & 0xFF)
+
+#define PVIDEO_STORE_LINE(type, pixel) do {                                  \
+        type *out = (type *)line + out_x;                                    \
+        for (x = 0; x < width; x++) {                                        \
+            if (key_line && !pvideo_color_key_match(key_line, key_bpp,       \
+                                                    out_x + x, key)) {       \
+                continue;                                                    \
+            }                                                                \
+            uint32_t rgb = row[row_start + (((uint64_t)x * ds_dx) >> 20)];   \
+            out[x] = (pixel);                                                \
+        }                                                                    \
+    } while (0)
+
 static void nv2a_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y)
 {
-    NV2A_DPRINTF("nv2a_overlay_draw_line\n");
-
     NV2AState *d = container_of(vga, NV2AState, vga);
     DisplaySurface *surface = qemu_console_surface(d->vga.con);
 
-    int surf_bpp = surface_bytes_per_pixel(surface);
+    int surf_depth = surface_bits_per_pixel(surface);
     int surf_width = surface_width(surface);
 
     if (!(d->pvideo.regs[NV_PVIDEO_BUFFER] & NV_PVIDEO_BUFFER_0_USE)) return;
@@ -4542,8 +4816,6 @@ static void nv2a_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y)
                              NV_PVIDEO_SIZE_IN_HEIGHT);
     int in_s = GET_MASK(d->pvideo.regs[NV_PVIDEO_POINT_IN],
                         NV_PVIDEO_POINT_IN_S);
-    int in_t = GET_MASK(d->pvideo.regs[NV_PVIDEO_POINT_IN],
-                        NV_PVIDEO_POINT_IN_T);
     int in_pitch = GET_MASK(d->pvideo.regs[NV_PVIDEO_FORMAT],
                             NV_PVIDEO_FORMAT_PITCH);
     int in_color = GET_MASK(d->pvideo.regs[NV_PVIDEO_FORMAT],
@@ -4561,54 +4833,95 @@ static void nv2a_overlay_draw_line(VGACommonState *vga, uint8_t *line, int y)
     int out_y = GET_MASK(d->pvideo.regs[NV_PVIDEO_POINT_OUT],
                          NV_PVIDEO_POINT_OUT_Y);
 
+    /* source pixels per output pixel, 12.20 fixed point */
+    uint32_t ds_dx = d->pvideo.regs[NV_PVIDEO_DS_DX];
+    uint32_t dt_dy = d->pvideo.regs[NV_PVIDEO_DT_DY];
+    if (ds_dx == 0) ds_dx = 1 << 20;
+    if (dt_dy == 0) dt_dy = 1 << 20;
 
-    if (y < out_y || y >= out_y + out_height) return;
 
-    // TODO: scaling, color keys
+    if (y < out_y || y >= out_y + out_height) return;
+    if (out_x >= surf_width || in_s >= in_width) return;
 
-    int in_y = y - out_y;
+    int in_y = ((uint64_t)(y - out_y) * dt_dy) >> 20;
     if (in_y >= in_height) return;
 
     assert(offset + in_pitch * (in_y + 1) <= limit);
     uint8_t *in_line = d->vram_ptr + base + offset + in_pitch * in_y;
 
-    int x;
-    for (x=0; x<out_width; x++) {
-        int ox = out_x + x;
-        if (ox >= surf_width) break;
-        int ix = in_s + x;
-        if (ix >= in_width) break;
-
-        // YUY2 to RGB
-        int c, d, e;
-        c = (int)in_line[ix * 2] - 16;
-        if (ix % 2) {
-            d = (int)in_line[ix * 2 - 1] - 128;
-            e = (int)in_line[ix * 2 + 1] - 128;
-        } else {
-            d = (int)in_line[ix * 2 + 1] - 128;
-            e = (int)in_line[ix * 2 + 3] - 128;
+    int width = MIN(out_width, surf_width - out_x);
+    width = MIN(width, DIV_ROUND_UP((uint64_t)(in_width - in_s) << 20,
+                                    ds_dx));
+    if (width <= 0) return;
+
+    const uint8_t *key_line = NULL;
+    int key_bpp = 0;
+    uint32_t key = d->pvideo.regs[NV_PVIDEO_COLOR_KEY];
+    if (d->pvideo.regs[NV_PVIDEO_FORMAT] & NV_PVIDEO_FORMAT_DISPLAY) {
+        uint32_t line_offset, start_addr, line_compare;
+        vga->get_offsets(vga, &line_offset, &start_addr, &line_compare);
+        key_bpp = vga->get_bpp(vga);
+        /* the CRTC registers are guest controlled: don't key against
+         * a framebuffer line that runs past the end of VRAM */
+        uint64_t key_start = (uint64_t)start_addr * 4
+                             + (uint64_t)line_offset * y;
+        uint64_t key_end = key_start + (uint64_t)(out_x + width)
+                                       * DIV_ROUND_UP(key_bpp, 8);
+        if (key_end <= memory_region_size(d->vram)) {
+            key_line = d->vram_ptr + key_start;
         }
-        int r, g, b;
-        r = cliptobyte((298 * c + 409 * e + 128) >> 8);
-        g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
-        b = cliptobyte((298 * c + 516 * d + 128) >> 8);
+        /* pvideo_color_key_match() can't compare other depths (0 while
+         * the CRTC is not in a graphics mode, or 24); rather than hide
+         * the whole overlay, show it unkeyed */
+        if (key_bpp != 8 && key_bpp != 15 && key_bpp != 16
+            && key_bpp != 32) {
+            key_line = NULL;
+        }
+    }
 
-        unsigned int pixel = vga->rgb_to_pixel(r, g, b);
-        switch (surf_bpp) {
-        case 1:
-            ((uint8_t*)line)[ox] = pixel;
-            break;
-        case 2:
-            ((uint16_t*)line)[ox] = pixel;
-            break;
-        case 4:
-            ((uint32_t*)line)[ox] = pixel;
-            break;
-        default:
-            assert(false);
-            break;
+    /* unscaled and unkeyed into xRGB: convert straight into the line */
+    if (ds_dx == 1 << 20 && !key_line && (in_s % 2) == 0
+        && surf_depth == 32 && !is_surface_bgr(surface)) {
+        convert_yuy2_to_xrgb(in_line + in_s * 2,
+                             (uint32_t *)line + out_x, width);
+        return;
+    }
+
+    /* convert the source span once, then sample and pack it */
+    uint32_t row[NV_PVIDEO_SIZE_IN_WIDTH + 1];
+    int first = in_s & ~1;
+    int last = in_s + (((uint64_t)(width - 1) * ds_dx) >> 20);
+    int row_start = in_s - first;
+    convert_yuy2_to_xrgb(in_line + first * 2, row, last - first + 1);
+
+    int x;
+    switch (surf_depth) {
+    case 8:
+        PVIDEO_STORE_LINE(uint8_t, rgb_to_pixel8(PVIDEO_R(rgb), PVIDEO_G(rgb),
+                                                 PVIDEO_B(rgb)));
+        break;
+    case 15:
+        PVIDEO_STORE_LINE(uint16_t, rgb_to_pixel15(PVIDEO_R(rgb),
+                                                   PVIDEO_G(rgb),
+                                                   PVIDEO_B(rgb)));
+        break;
+    case 16:
+        PVIDEO_STORE_LINE(uint16_t, rgb_to_pixel16(PVIDEO_R(rgb),
+                                                   PVIDEO_G(rgb),
+                                                   PVIDEO_B(rgb)));
+        break;
+    case 32:
+        if (is_surface_bgr(surface)) {
+            PVIDEO_STORE_LINE(uint32_t, rgb_to_pixel32bgr(PVIDEO_R(rgb),
+                                                          PVIDEO_G(rgb),
+                                                          PVIDEO_B(rgb)));
+        } else {
+            PVIDEO_STORE_LINE(uint32_t, rgb);
         }
+        break;
+    default:
+        assert(false);
+        break;
     }
 }
 
@@ -4654,6 +4967,541 @@ static void nv2a_vga_gfx_update(void *opaque)
     update_irq(d);
 }
 
+/* On a stop, wait for the puller to write back the color surface, so
+ * that guest RAM is complete before migration or savevm finish it off.
+ * The vcpus are already paused, so pull_enabled cannot change here. */
+static void nv2a_vm_state_change(void *opaque, int running, RunState state)
+{
+    NV2AState *d = opaque;
+    Cache1State *cache1 = &d->pfifo.cache1;
+    bool pulling;
+
+    qemu_mutex_lock(&cache1->cache_lock);
+    cache1->halted = !running;
+    cache1->halt_flushed = false;
+    qemu_cond_broadcast(&cache1->cache_cond);
+    qemu_mutex_unlock(&cache1->cache_lock);
+
+    if (running) {
+        return;
+    }
+
+    /* the puller may be waiting for the guest */
+    qemu_mutex_lock(&d->pgraph.lock);
+    qemu_cond_broadcast(&d->pgraph.interrupt_cond);
+    qemu_cond_broadcast(&d->pgraph.fifo_access_cond);
+    qemu_mutex_unlock(&d->pgraph.lock);
+
+    qemu_mutex_lock(&cache1->pull_lock);
+    pulling = cache1->pull_enabled;
+    qemu_mutex_unlock(&cache1->pull_lock);
+
+    if (pulling) {
+        qemu_mutex_lock(&cache1->cache_lock);
+        while (!cache1->halt_flushed && !cache1->flip_stalled) {
+            qemu_cond_wait(&cache1->halt_cond, &cache1->cache_lock);
+        }
+        qemu_mutex_unlock(&cache1->cache_lock);
+    }
+}
+
+static void put_cache1_queue(QEMUFile *f, void *pv, size_t size)
+{
+    Cache1State *state = container_of(pv, Cache1State, cache);
+    CacheEntry *command;
+
+    qemu_mutex_lock(&state->cache_lock);
+    qemu_put_be32(f, state->cache_size);
+    QSIMPLEQ_FOREACH(command, &state->cache, entry) {
+        qemu_put_be16(f, command->method);
+        qemu_put_byte(f, command->subchannel);
+        qemu_put_byte(f, command->nonincreasing);
+        qemu_put_be32(f, command->parameter);
+    }
+    qemu_mutex_unlock(&state->cache_lock);
+}
+
+static int get_cache1_queue(QEMUFile *f, void *pv, size_t size)
+{
+    Cache1State *state = container_of(pv, Cache1State, cache);
+    CacheEntry *command;
+    uint32_t i, count;
+
+    qemu_mutex_lock(&state->cache_lock);
+    while (!QSIMPLEQ_EMPTY(&state->cache)) {
+        command = QSIMPLEQ_FIRST(&state->cache);
+        QSIMPLEQ_REMOVE_HEAD(&state->cache, entry);
+        g_free(command);
+    }
+
+    count = qemu_get_be32(f);
+    for (i = 0; i < count; i++) {
+        command = g_malloc0(sizeof(CacheEntry));
+        command->method = qemu_get_be16(f);
+        command->subchannel = qemu_get_byte(f);
+        command->nonincreasing = qemu_get_byte(f);
+        command->parameter = qemu_get_be32(f);
+        QSIMPLEQ_INSERT_TAIL(&state->cache, command, entry);
+    }
+    state->cache_size = count;
+    qemu_mutex_unlock(&state->cache_lock);
+
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_cache1_queue = {
+    .name = "nv2a_cache1_queue",
+    .get  = get_cache1_queue,
+    .put  = put_cache1_queue,
+};
+
+static void nv2a_cache1_pre_save(void *opaque)
+{
+    Cache1State *state = opaque;
+
+    state->vmstate.method = state->method;
+    state->vmstate.subchannel = state->subchannel;
+    state->vmstate.method_count = state->method_count;
+
+    qemu_mutex_lock(&state->pull_lock);
+    state->vmstate.pull_enabled = state->pull_enabled;
+    qemu_mutex_unlock(&state->pull_lock);
+}
+
+static int nv2a_cache1_post_load(void *opaque, int version_id)
+{
+    Cache1State *state = opaque;
+
+    state->method = state->vmstate.method;
+    state->subchannel = state->vmstate.subchannel;
+    state->method_count = state->vmstate.method_count;
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_nv2a_cache1 = {
+    .name = "nv2a/cache1",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .pre_save = nv2a_cache1_pre_save,
+    .post_load = nv2a_cache1_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(channel_id, Cache1State),
+        VMSTATE_UINT32(mode, Cache1State),
+        VMSTATE_BOOL(push_enabled, Cache1State),
+        VMSTATE_BOOL(dma_push_enabled, Cache1State),
+        VMSTATE_BOOL(dma_push_suspended, Cache1State),
+        VMSTATE_UINT64(dma_instance, Cache1State),
+        VMSTATE_BOOL(method_nonincreasing, Cache1State),
+        VMSTATE_UINT32(vmstate.method, Cache1State),
+        VMSTATE_UINT32(vmstate.subchannel, Cache1State),
+        VMSTATE_UINT32(vmstate.method_count, Cache1State),
+        VMSTATE_UINT32(dcount, Cache1State),
+        VMSTATE_BOOL(subroutine_active, Cache1State),
+        VMSTATE_UINT64(subroutine_return, Cache1State),
+        VMSTATE_UINT64(get_jmp_shadow, Cache1State),
+        VMSTATE_UINT32(rsvd_shadow, Cache1State),
+        VMSTATE_UINT32(data_shadow, Cache1State),
+        VMSTATE_UINT32(error, Cache1State),
+        VMSTATE_BOOL(vmstate.pull_enabled, Cache1State),
+        VMSTATE_UINT32_ARRAY(bound_engines, Cache1State,
+                             NV2A_NUM_SUBCHANNELS),
+        VMSTATE_UINT32(last_engine, Cache1State),
+        {
+            .name         = "cache",
+            .version_id   = 0,
+            .size         = 0,
+            .info         = &vmstate_info_cache1_queue,
+            .flags        = VMS_SINGLE,
+            .offset       = offsetof(Cache1State, cache),
+        },
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_surface = {
+    .name = "nv2a/surface",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(pitch, Surface),
+        VMSTATE_UINT32(format, Surface),
+        VMSTATE_UINT64(offset, Surface),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_graphics_context = {
+    .name = "nv2a/graphics_context",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(channel_3d, GraphicsContext),
+        VMSTATE_UINT32(subchannel, GraphicsContext),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_context_surfaces_2d = {
+    .name = "nv2a/context_surfaces_2d",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_image_source, ContextSurfaces2DState),
+        VMSTATE_UINT64(dma_image_dest, ContextSurfaces2DState),
+        VMSTATE_UINT32(color_format, ContextSurfaces2DState),
+        VMSTATE_UINT32(source_pitch, ContextSurfaces2DState),
+        VMSTATE_UINT32(dest_pitch, ContextSurfaces2DState),
+        VMSTATE_UINT64(source_offset, ContextSurfaces2DState),
+        VMSTATE_UINT64(dest_offset, ContextSurfaces2DState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_image_blit = {
+    .name = "nv2a/image_blit",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(context_surfaces, ImageBlitState),
+        VMSTATE_UINT32(operation, ImageBlitState),
+        VMSTATE_UINT32(in_x, ImageBlitState),
+        VMSTATE_UINT32(in_y, ImageBlitState),
+        VMSTATE_UINT32(out_x, ImageBlitState),
+        VMSTATE_UINT32(out_y, ImageBlitState),
+        VMSTATE_UINT32(width, ImageBlitState),
+        VMSTATE_UINT32(height, ImageBlitState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_kelvin = {
+    .name = "nv2a/kelvin",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_notifies, KelvinState),
+        VMSTATE_UINT64(dma_state, KelvinState),
+        VMSTATE_UINT64(dma_semaphore, KelvinState),
+        VMSTATE_UINT32(semaphore_offset, KelvinState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static bool graphics_subchannel_is_context_surfaces_2d(void *opaque,
+                                                       int version_id)
+{
+    GraphicsSubchannel *subchannel = opaque;
+    return subchannel->object.graphics_class == NV_CONTEXT_SURFACES_2D;
+}
+
+static bool graphics_subchannel_is_image_blit(void *opaque, int version_id)
+{
+    GraphicsSubchannel *subchannel = opaque;
+    return subchannel->object.graphics_class == NV_IMAGE_BLIT;
+}
+
+static bool graphics_subchannel_is_kelvin(void *opaque, int version_id)
+{
+    GraphicsSubchannel *subchannel = opaque;
+    return subchannel->object.graphics_class == NV_KELVIN_PRIMITIVE;
+}
+
+static const VMStateDescription vmstate_nv2a_graphics_subchannel = {
+    .name = "nv2a/graphics_subchannel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(object_instance, GraphicsSubchannel),
+        VMSTATE_UINT8(object.graphics_class, GraphicsSubchannel),
+        VMSTATE_STRUCT_TEST(object.data.context_surfaces_2d,
+                            GraphicsSubchannel,
+                            graphics_subchannel_is_context_surfaces_2d, 0,
+                            vmstate_nv2a_context_surfaces_2d,
+                            ContextSurfaces2DState),
+        VMSTATE_STRUCT_TEST(object.data.image_blit, GraphicsSubchannel,
+                            graphics_subchannel_is_image_blit, 0,
+                            vmstate_nv2a_image_blit, ImageBlitState),
+        VMSTATE_STRUCT_TEST(object.data.kelvin, GraphicsSubchannel,
+                            graphics_subchannel_is_kelvin, 0,
+                            vmstate_nv2a_kelvin, KelvinState),
+        VMSTATE_UINT32_ARRAY(object_cache, GraphicsSubchannel, 5),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_vertex_shader_constant = {
+    .name = "nv2a/vertex_shader_constant",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(data, VertexShaderConstant, 4),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_vertex_attribute = {
+    .name = "nv2a/vertex_attribute",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(dma_select, VertexAttribute),
+        VMSTATE_UINT64(offset, VertexAttribute),
+        VMSTATE_UINT32(inline_array_offset, VertexAttribute),
+        VMSTATE_UINT32(inline_value, VertexAttribute),
+        VMSTATE_UINT32(format, VertexAttribute),
+        VMSTATE_UINT32(size, VertexAttribute),
+        VMSTATE_UINT32(count, VertexAttribute),
+        VMSTATE_UINT32(stride, VertexAttribute),
+        VMSTATE_BOOL(needs_conversion, VertexAttribute),
+        VMSTATE_UINT32(converted_size, VertexAttribute),
+        VMSTATE_UINT32(converted_count, VertexAttribute),
+        VMSTATE_UINT32(gl_type, VertexAttribute),
+        VMSTATE_UINT8(gl_normalize, VertexAttribute),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_inline_vertex = {
+    .name = "nv2a/inline_vertex",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(position, InlineVertexBufferEntry, 4),
+        VMSTATE_UINT32(diffuse, InlineVertexBufferEntry),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+/* The batch lengths have to be checked as they are read: vmstate loads
+ * the arrays they size before post_load gets to look at them.  A full
+ * batch is rejected too, pgraph_method asserts there is room for one
+ * more entry. */
+static int get_nv2a_batch_length(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t *v = pv;
+    uint32_t length = qemu_get_be32(f);
+
+    if (length >= NV2A_MAX_BATCH_LENGTH) {
+        return -EINVAL;
+    }
+    *v = length;
+    return 0;
+}
+
+static void put_nv2a_batch_length(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t *v = pv;
+    qemu_put_be32s(f, v);
+}
+
+static const VMStateInfo vmstate_info_nv2a_batch_length = {
+    .name = "nv2a_batch_length",
+    .get  = get_nv2a_batch_length,
+    .put  = put_nv2a_batch_length,
+};
+
+#define VMSTATE_NV2A_BATCH_LENGTH(_field)                                    \
+    VMSTATE_SINGLE(_field, PGRAPHState, 0,                                   \
+                   vmstate_info_nv2a_batch_length, uint32_t)
+
+/* only the used part of the inline batch buffers is saved */
+#define VMSTATE_NV2A_BATCH(_field, _length) {                                \
+    .name       = (stringify(_field)),                                       \
+    .num_offset = vmstate_offset_value(PGRAPHState, _length, uint32_t),      \
+    .info       = &vmstate_info_uint32,                                      \
+    .size       = sizeof(uint32_t),                                          \
+    .flags      = VMS_VARRAY_UINT32,                                         \
+    .offset     = vmstate_offset_array(PGRAPHState, _field, uint32_t,        \
+                                       NV2A_MAX_BATCH_LENGTH),               \
+}
+
+static const VMStateDescription vmstate_nv2a_pgraph = {
+    .name = "nv2a/pgraph",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(pending_interrupts, PGRAPHState),
+        VMSTATE_UINT32(enabled_interrupts, PGRAPHState),
+        VMSTATE_UINT64(context_table, PGRAPHState),
+        VMSTATE_UINT64(context_address, PGRAPHState),
+        VMSTATE_UINT32(trapped_method, PGRAPHState),
+        VMSTATE_UINT32(trapped_subchannel, PGRAPHState),
+        VMSTATE_UINT32(trapped_channel_id, PGRAPHState),
+        VMSTATE_UINT32_ARRAY(trapped_data, PGRAPHState, 2),
+        VMSTATE_UINT32(notify_source, PGRAPHState),
+        VMSTATE_BOOL(fifo_access, PGRAPHState),
+        VMSTATE_UINT32(channel_id, PGRAPHState),
+        VMSTATE_BOOL(channel_valid, PGRAPHState),
+        VMSTATE_STRUCT_ARRAY(context, PGRAPHState, NV2A_NUM_CHANNELS, 0,
+                             vmstate_nv2a_graphics_context, GraphicsContext),
+        VMSTATE_UINT64(dma_color, PGRAPHState),
+        VMSTATE_UINT64(dma_zeta, PGRAPHState),
+        VMSTATE_STRUCT(surface_color, PGRAPHState, 0,
+                       vmstate_nv2a_surface, Surface),
+        VMSTATE_STRUCT(surface_zeta, PGRAPHState, 0,
+                       vmstate_nv2a_surface, Surface),
+        VMSTATE_UINT32(surface_log_width, PGRAPHState),
+        VMSTATE_UINT32(surface_log_height, PGRAPHState),
+        VMSTATE_UINT32(surface_type, PGRAPHState),
+        VMSTATE_UINT32(surface_clip_x, PGRAPHState),
+        VMSTATE_UINT32(surface_clip_y, PGRAPHState),
+        VMSTATE_UINT32(surface_clip_width, PGRAPHState),
+        VMSTATE_UINT32(surface_clip_height, PGRAPHState),
+        VMSTATE_UINT32(color_mask, PGRAPHState),
+        VMSTATE_UINT64(dma_a, PGRAPHState),
+        VMSTATE_UINT64(dma_b, PGRAPHState),
+        VMSTATE_BUFFER_UNSAFE(composite_matrix, PGRAPHState, 0,
+                              sizeof(float) * 16),
+        VMSTATE_STRUCT_ARRAY(subchannel_data, PGRAPHState,
+                             NV2A_NUM_SUBCHANNELS, 0,
+                             vmstate_nv2a_graphics_subchannel,
+                             GraphicsSubchannel),
+        VMSTATE_UINT64(dma_vertex_a, PGRAPHState),
+        VMSTATE_UINT64(dma_vertex_b, PGRAPHState),
+        VMSTATE_UINT32(gl_primitive_mode, PGRAPHState),
+        VMSTATE_BOOL(enable_vertex_program_write, PGRAPHState),
+        VMSTATE_UINT32(program_start, PGRAPHState),
+        VMSTATE_UINT32(program_load, PGRAPHState),
+        VMSTATE_UINT32_ARRAY(program_data, PGRAPHState,
+                             NV2A_MAX_TRANSFORM_PROGRAM_LENGTH),
+        VMSTATE_UINT32(constant_load_slot, PGRAPHState),
+        VMSTATE_STRUCT_ARRAY(constants, PGRAPHState,
+                             NV2A_VERTEXSHADER_CONSTANTS, 0,
+                             vmstate_nv2a_vertex_shader_constant,
+                             VertexShaderConstant),
+        VMSTATE_STRUCT_ARRAY(vertex_attributes, PGRAPHState,
+                             NV2A_VERTEXSHADER_ATTRIBUTES, 0,
+                             vmstate_nv2a_vertex_attribute,
+                             VertexAttribute),
+        VMSTATE_NV2A_BATCH_LENGTH(inline_array_length),
+        VMSTATE_NV2A_BATCH(inline_array, inline_array_length),
+        VMSTATE_NV2A_BATCH_LENGTH(inline_elements_length),
+        VMSTATE_NV2A_BATCH(inline_elements, inline_elements_length),
+        VMSTATE_NV2A_BATCH_LENGTH(inline_buffer_length),
+        VMSTATE_STRUCT_VARRAY_UINT32(inline_buffer, PGRAPHState,
+                                     inline_buffer_length, 0,
+                                     vmstate_nv2a_inline_vertex,
+                                     InlineVertexBufferEntry),
+        VMSTATE_UINT32_ARRAY(regs, PGRAPHState, 0x2000),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_nv2a_channel_control = {
+    .name = "nv2a/channel_control",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_put, ChannelControl),
+        VMSTATE_UINT64(dma_get, ChannelControl),
+        VMSTATE_UINT32(ref, ChannelControl),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static int nv2a_post_load(void *opaque, int version_id)
+{
+    NV2AState *d = opaque;
+    PGRAPHState *pg = &d->pgraph;
+    int i;
+
+    /* GL objects are not part of the snapshot. Throw away what is
+     * cached and let the next draw rebuild it from guest memory. */
+    qemu_mutex_lock(&pg->lock);
+    pg->surface_color.draw_dirty = false;
+    pg->surface_zeta.draw_dirty = false;
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        pg->texture_dirty[i] = true;
+    }
+    pg->shaders_dirty = true;
+    for (i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
+        pg->constants[i].dirty = true;
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        pg->vertex_attributes[i].converted_elements = 0;
+    }
+
+    /* a puller blocked on the old state has to re-check */
+    qemu_cond_broadcast(&pg->interrupt_cond);
+    qemu_cond_broadcast(&pg->fifo_access_cond);
+    qemu_mutex_unlock(&pg->lock);
+
+    /* re-upload surfaces on the next draw and redraw the display */
+    memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+
+    pfifo_set_pull_enabled(d, d->pfifo.cache1.vmstate.pull_enabled);
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_nv2a = {
+    .name = "nv2a",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .post_load = nv2a_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(dev, NV2AState),
+        VMSTATE_STRUCT(vga, NV2AState, 0, vmstate_vga_common, VGACommonState),
+
+        VMSTATE_UINT32(pmc.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pmc.enabled_interrupts, NV2AState),
+
+        VMSTATE_UINT32(pfifo.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pfifo.enabled_interrupts, NV2AState),
+        VMSTATE_UINT64(pfifo.ramht_address, NV2AState),
+        VMSTATE_UINT32(pfifo.ramht_size, NV2AState),
+        VMSTATE_UINT32(pfifo.ramht_search, NV2AState),
+        VMSTATE_UINT64(pfifo.ramfc_address1, NV2AState),
+        VMSTATE_UINT64(pfifo.ramfc_address2, NV2AState),
+        VMSTATE_UINT32(pfifo.ramfc_size, NV2AState),
+        VMSTATE_UINT32(pfifo.channel_modes, NV2AState),
+        VMSTATE_UINT32(pfifo.channels_pending_push, NV2AState),
+        VMSTATE_STRUCT(pfifo.cache1, NV2AState, 0,
+                       vmstate_nv2a_cache1, Cache1State),
+
+        VMSTATE_UINT32_ARRAY(pvideo.regs, NV2AState, 0x1000),
+
+        VMSTATE_UINT32(ptimer.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(ptimer.enabled_interrupts, NV2AState),
+        VMSTATE_UINT32(ptimer.numerator, NV2AState),
+        VMSTATE_UINT32(ptimer.denominator, NV2AState),
+        VMSTATE_UINT32(ptimer.alarm_time, NV2AState),
+
+        VMSTATE_UINT32_ARRAY(pfb.regs, NV2AState, 0x1000),
+
+        VMSTATE_STRUCT(pgraph, NV2AState, 0,
+                       vmstate_nv2a_pgraph, PGRAPHState),
+
+        VMSTATE_UINT32(pcrtc.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pcrtc.enabled_interrupts, NV2AState),
+        VMSTATE_UINT64(pcrtc.start, NV2AState),
+
+        VMSTATE_UINT32(pramdac.core_clock_coeff, NV2AState),
+        VMSTATE_UINT64(pramdac.core_clock_freq, NV2AState),
+        VMSTATE_UINT32(pramdac.memory_clock_coeff, NV2AState),
+        VMSTATE_UINT32(pramdac.video_clock_coeff, NV2AState),
+
+        VMSTATE_STRUCT_ARRAY(user.channel_control, NV2AState,
+                             NV2A_NUM_CHANNELS, 0,
+                             vmstate_nv2a_channel_control, ChannelControl),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
 {
     /* xbox is UMA - vram *is* ram */
@@ -4667,6 +5515,7 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
 
     /* RAMIN - should be in vram somewhere, but not quite sure where atm */
     memory_region_init_ram(&d->ramin, OBJECT(d), "nv2a-ramin", 0x100000);
+    vmstate_register_ram(&d->ramin, DEVICE(d));
     /* memory_region_init_alias(&d->ramin, "nv2a-ramin", &d->vram,
                          memory_region_size(&d->vram) - 0x100000,
                          0x100000); */
@@ -4728,6 +5577,9 @@ static int nv2a_initfn(PCIDevice *dev)
         memory_region_init_io(&d->block_mmio[i], OBJECT(dev),
                               &blocktable[i].ops, d,
                               blocktable[i].name, blocktable[i].size);
+        if (blocktable[i].lockless && d->lockless_mmio) {
+            memory_region_clear_global_locking(&d->block_mmio[i]);
+        }
         memory_region_add_subregion(&d->mmio, blocktable[i].offset,
                                     &d->block_mmio[i]);
     }
@@ -4736,10 +5588,17 @@ static int nv2a_initfn(PCIDevice *dev)
     qemu_mutex_init(&d->pfifo.cache1.pull_lock);
     qemu_mutex_init(&d->pfifo.cache1.cache_lock);
     qemu_cond_init(&d->pfifo.cache1.cache_cond);
+    qemu_cond_init(&d->pfifo.cache1.halt_cond);
     QSIMPLEQ_INIT(&d->pfifo.cache1.cache);
+    d->pfifo.cache1.halted = !runstate_is_running();
 
     pgraph_init(&d->pgraph);
 
+    d->irq_bh = qemu_bh_new(nv2a_irq_bh, d);
+
+    d->vm_state_entry =
+        qemu_add_vm_change_state_handler(nv2a_vm_state_change, d);
+
     return 0;
 }
 
@@ -4748,13 +5607,22 @@ static void nv2a_exitfn(PCIDevice *dev)
     NV2AState *d;
     d = NV2A_DEVICE(dev);
 
+    qemu_del_vm_change_state_handler(d->vm_state_entry);
+    qemu_bh_delete(d->irq_bh);
+
     qemu_mutex_destroy(&d->pfifo.cache1.pull_lock);
     qemu_mutex_destroy(&d->pfifo.cache1.cache_lock);
     qemu_cond_destroy(&d->pfifo.cache1.cache_cond);
+    qemu_cond_destroy(&d->pfifo.cache1.halt_cond);
 
     pgraph_destroy(&d->pgraph);
 }
 
+static Property nv2a_properties[] = {
+    DEFINE_PROP_BOOL("lockless-mmio", NV2AState, lockless_mmio, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nv2a_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -4768,6 +5636,8 @@ static void nv2a_class_init(ObjectClass *klass, void *data)
     k->exit = nv2a_exitfn;
 
     dc->desc = "GeForce NV2A Integrated Graphics";
+    dc->vmsd = &vmstate_nv2a;
+    dc->props = nv2a_properties;
 }
 
 static const TypeInfo nv2a_info = {
@@ -4792,4 +5662,39 @@ void nv2a_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     PCIDevice *dev = pci_create_simple(bus, devfn, "nv2a");
     NV2AState *d = NV2A_DEVICE(dev);
     nv2a_init_memory(d, ram);
-}
\ No newline at end of file
+}
+
+
+static NV2AStatsEntry *nv2a_stats_entry(const NV2AStats *stats)
+{
+    NV2AStatsEntry *e = g_malloc0(sizeof(*e));
+
+    e->methods = atomic_read(&stats->methods);
+    e->pushed_words = atomic_read(&stats->pushed_words);
+    e->draws = atomic_read(&stats->draws);
+    e->texture_uploads = atomic_read(&stats->texture_uploads);
+    e->shader_compiles = atomic_read(&stats->shader_compiles);
+    e->surface_uploads = atomic_read(&stats->surface_uploads);
+    e->surface_downloads = atomic_read(&stats->surface_downloads);
+    e->cache1_stalls = atomic_read(&stats->cache1_stalls);
+    e->gl_ms = atomic_read(&stats->gl_ns) / (double)SCALE_MS;
+
+    return e;
+}
+
+NV2AStatsInfo *qmp_query_nv2a_stats(Error **errp)
+{
+    Object *obj = object_resolve_path_type("", "nv2a", NULL);
+    if (!obj) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, "nv2a");
+        return NULL;
+    }
+    NV2AState *d = NV2A_DEVICE(obj);
+
+    NV2AStatsInfo *info = g_malloc0(sizeof(*info));
+    info->frames = atomic_read(&d->stats.frames);
+    info->last_frame = nv2a_stats_entry(&d->stats.last_frame);
+    info->total = nv2a_stats_entry(&d->stats.total);
+
+    return info;
+}
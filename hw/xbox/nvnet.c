@@ -19,11 +19,101 @@
 #include "hw/hw.h"
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
+#include "net/net.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
+#include "trace.h"
 
 
 #define IOPORT_SIZE 0x8
 #define MMIO_SIZE 0x400
 
+#define GET_MASK(v, mask) (((v) & (mask)) >> (ffs(mask)-1))
+
+
+#define NvRegIrqStatus                                   0x000
+#define NvRegIrqMask                                     0x004
+#   define NVREG_IRQ_RX                                     0x0002
+#   define NVREG_IRQ_RX_NOBUF                               0x0004
+#   define NVREG_IRQ_TX_ERR                                 0x0008
+#   define NVREG_IRQ_TX2                                    0x0010
+#   define NVREG_IRQ_TIMER                                  0x0020
+#   define NVREG_IRQ_LINK                                   0x0040
+#   define NVREG_IRQ_TX1                                    0x0100
+#   define NVREG_IRQSTAT_MASK                               0x01FF
+#define NvRegPollingInterval                             0x00C
+#define NvRegMisc1                                       0x080
+#define NvRegTransmitterControl                          0x084
+#   define NVREG_XMITCTL_START                              0x01
+#define NvRegTransmitterStatus                           0x088
+#   define NVREG_XMITSTAT_BUSY                              0x01
+#define NvRegPacketFilterFlags                           0x08C
+#   define NVREG_PFF_PROMISC                                0x80
+#   define NVREG_PFF_MYADDR                                 0x20
+#define NvRegOffloadConfig                               0x090
+#define NvRegReceiverControl                             0x094
+#   define NVREG_RCVCTL_START                               0x01
+#define NvRegReceiverStatus                              0x098
+#   define NVREG_RCVSTAT_BUSY                               0x01
+#define NvRegMacAddrA                                    0x0A8
+#define NvRegMacAddrB                                    0x0AC
+#define NvRegMulticastAddrA                              0x0B0
+#define NvRegMulticastAddrB                              0x0B4
+#define NvRegMulticastMaskA                              0x0B8
+#define NvRegMulticastMaskB                              0x0BC
+#define NvRegTxRingPhysAddr                              0x100
+#define NvRegRxRingPhysAddr                              0x104
+#define NvRegRingSizes                                   0x108
+#   define NVREG_RINGSZ_TX                                  0x0000FFFF
+#   define NVREG_RINGSZ_RX                                  0xFFFF0000
+#define NvRegLinkSpeed                                   0x110
+#define NvRegTxRxControl                                 0x144
+#   define NVREG_TXRXCTL_KICK                               0x0001
+#   define NVREG_TXRXCTL_IDLE                               0x0008
+#   define NVREG_TXRXCTL_RESET                              0x0010
+#define NvRegMIIStatus                                   0x180
+#   define NVREG_MIISTAT_LINKCHANGE                         0x0008
+#define NvRegAdapterControl                              0x188
+#define NvRegMIISpeed                                    0x18C
+#define NvRegMIIControl                                  0x190
+#   define NVREG_MIICTL_INUSE                               0x10000
+#   define NVREG_MIICTL_WRITE                               0x08000
+#   define NVREG_MIICTL_ADDR                                0x003E0
+#   define NVREG_MIICTL_REG                                 0x0001F
+#define NvRegMIIData                                     0x194
+#define NvRegPowerState                                  0x26C
+
+/* descriptors are a buffer address and a flags/length word */
+#define NV_DESC_SIZE 8
+#define NV_DESC_LEN                                      0x0000FFFF
+#define NV_TX_LASTPACKET                                 (1 << 16)
+#define NV_TX_FORCED_INTERRUPT                           (1 << 24)
+#define NV_TX_ERROR                                      (1 << 30)
+#define NV_TX_VALID                                      (1 << 31)
+#define NV_RX_DESCRIPTORVALID                            (1 << 16)
+#define NV_RX_ERROR                                      (1 << 30)
+#define NV_RX_AVAIL                                      (1 << 31)
+
+/* PHY registers */
+#define MII_BMCR                                         0x00
+#define MII_BMSR                                         0x01
+#   define MII_BMSR_LINK_ST                                 0x0004
+#define MII_PHYID1                                       0x02
+#define MII_PHYID2                                       0x03
+#define MII_ANAR                                         0x04
+#define MII_ANLPAR                                       0x05
+
+#define NVNET_MAX_TX_FRAGS 16
+#define NVNET_MAX_PACKET 0x10000
+
+/* the guest returns RX buffers without telling the NIC, so while it
+ * is out of buffers the ring is polled like the hardware does */
+#define NVNET_RX_POLL_NS (1000 * 1000)
+
+/* packet interrupts are held for up to irq-delay-us, or until
+ * irq-packets packets have completed */
+#define NVNET_PACKET_IRQS (NVREG_IRQ_RX | NVREG_IRQ_TX1 | NVREG_IRQ_TX2)
+
 
 //#define DEBUG
 #ifdef DEBUG
@@ -34,27 +124,502 @@
 
 typedef struct NVNetState {
     PCIDevice dev;
+    NICState *nic;
+    NICConf conf;
+
     MemoryRegion mmio, io;
+
+    uint32_t regs[MMIO_SIZE / 4];
+    uint16_t phy_regs[32];
+
+    uint32_t tx_index;
+    uint32_t rx_index;
+
+    /* The packet being sent. Its buffers are mapped straight into
+     * tx_iov and stay mapped until the backend is done with them;
+     * tx_bounce is only used when a buffer can't be mapped. */
+    bool tx_inflight;
+    struct iovec tx_iov[NVNET_MAX_TX_FRAGS];
+    int tx_iovcnt;
+    bool tx_bounced;
+    unsigned int tx_descs;
+    bool tx_force_irq;
+    uint8_t *tx_bounce;
+
+    QEMUTimer *rx_poll_timer;
+
+    /* interrupt moderation */
+    uint32_t irq_delay_us;
+    uint32_t irq_packets;
+    QEMUTimer *irq_timer;
+    bool irq_held;
+    uint32_t irq_held_packets;
 } NVNetState;
 
 #define NVNET_DEVICE(obj) \
     OBJECT_CHECK(NVNetState, (obj), "nvnet")
 
+#define NVNET_REG(s, r) ((s)->regs[(r) / 4])
+
+
+static void nvnet_update_irq(NVNetState *s)
+{
+    uint32_t pending = NVNET_REG(s, NvRegIrqStatus)
+                           & NVNET_REG(s, NvRegIrqMask);
+    if (s->irq_held) {
+        pending &= ~NVNET_PACKET_IRQS;
+    }
+    trace_nvnet_irq(NVNET_REG(s, NvRegIrqStatus), pending != 0);
+    qemu_set_irq(s->dev.irq[0], pending != 0);
+}
+
+/* Raise a non-packet interrupt, releasing any held packet interrupts */
+static void nvnet_raise(NVNetState *s, uint32_t bits)
+{
+    NVNET_REG(s, NvRegIrqStatus) |= bits;
+    s->irq_held = false;
+    s->irq_held_packets = 0;
+    qemu_del_timer(s->irq_timer);
+    nvnet_update_irq(s);
+}
+
+static void nvnet_packet_done(NVNetState *s, uint32_t bits, bool force)
+{
+    if (force || !s->irq_delay_us
+        || ++s->irq_held_packets >= s->irq_packets) {
+        nvnet_raise(s, bits);
+        return;
+    }
+    NVNET_REG(s, NvRegIrqStatus) |= bits;
+    if (!s->irq_held) {
+        s->irq_held = true;
+        qemu_mod_timer(s->irq_timer, qemu_get_clock_ns(vm_clock)
+                                         + s->irq_delay_us * SCALE_US);
+    }
+}
+
+static void nvnet_irq_timer(void *opaque)
+{
+    NVNetState *s = opaque;
+    nvnet_raise(s, 0);
+}
+
+
+static hwaddr nvnet_tx_desc(NVNetState *s, uint32_t index)
+{
+    uint32_t size = GET_MASK(NVNET_REG(s, NvRegRingSizes), NVREG_RINGSZ_TX)
+                        + 1;
+    return NVNET_REG(s, NvRegTxRingPhysAddr)
+        + (index % size) * NV_DESC_SIZE;
+}
+
+static hwaddr nvnet_rx_desc(NVNetState *s, uint32_t index)
+{
+    uint32_t size = GET_MASK(NVNET_REG(s, NvRegRingSizes), NVREG_RINGSZ_RX)
+                        + 1;
+    return NVNET_REG(s, NvRegRxRingPhysAddr)
+        + (index % size) * NV_DESC_SIZE;
+}
+
+static void nvnet_tx_unmap(NVNetState *s)
+{
+    int i;
+
+    if (!s->tx_bounced) {
+        for (i = 0; i < s->tx_iovcnt; i++) {
+            cpu_physical_memory_unmap(s->tx_iov[i].iov_base,
+                                      s->tx_iov[i].iov_len, 0,
+                                      s->tx_iov[i].iov_len);
+        }
+    }
+    s->tx_iovcnt = 0;
+    s->tx_bounced = false;
+}
+
+/* Gather the packet starting at tx_index into tx_iov, either mapping
+ * each buffer or copying them all into tx_bounce. Returns 1 once the
+ * whole packet is gathered, 0 if the guest hasn't finished queueing
+ * it and -1 if a buffer couldn't be mapped. */
+static int nvnet_tx_gather_pass(NVNetState *s, bool bounce)
+{
+    uint32_t size = GET_MASK(NVNET_REG(s, NvRegRingSizes), NVREG_RINGSZ_TX)
+                        + 1;
+    size_t total = 0;
+    unsigned int n;
+
+    s->tx_iovcnt = 0;
+    s->tx_bounced = bounce;
+    s->tx_force_irq = false;
+
+    for (n = 0; n < size; n++) {
+        hwaddr desc = nvnet_tx_desc(s, s->tx_index + n);
+        uint32_t flaglen = ldl_le_phys(desc + 4);
+        hwaddr buf = ldl_le_phys(desc);
+        hwaddr len = (flaglen & NV_DESC_LEN) + 1;
+
+        if (!(flaglen & NV_TX_VALID)) {
+            break;
+        }
+        s->tx_force_irq |= !!(flaglen & NV_TX_FORCED_INTERRUPT);
+
+        if (bounce) {
+            len = MIN(len, NVNET_MAX_PACKET - total);
+            cpu_physical_memory_read(buf, s->tx_bounce + total, len);
+        } else {
+            hwaddr mapped = len;
+            void *p = NULL;
+            if (s->tx_iovcnt < NVNET_MAX_TX_FRAGS) {
+                p = cpu_physical_memory_map(buf, &mapped, 0);
+            }
+            if (!p || mapped != len) {
+                if (p) {
+                    cpu_physical_memory_unmap(p, mapped, 0, 0);
+                }
+                nvnet_tx_unmap(s);
+                return -1;
+            }
+            s->tx_iov[s->tx_iovcnt].iov_base = p;
+            s->tx_iov[s->tx_iovcnt].iov_len = len;
+            s->tx_iovcnt++;
+        }
+        total += len;
+
+        if (flaglen & NV_TX_LASTPACKET) {
+            s->tx_descs = n + 1;
+            if (bounce) {
+                s->tx_iov[0].iov_base = s->tx_bounce;
+                s->tx_iov[0].iov_len = total;
+                s->tx_iovcnt = 1;
+            }
+            return 1;
+        }
+    }
+
+    nvnet_tx_unmap(s);
+    return 0;
+}
+
+static bool nvnet_tx_gather(NVNetState *s)
+{
+    int ret = nvnet_tx_gather_pass(s, false);
+    if (ret < 0) {
+        ret = nvnet_tx_gather_pass(s, true);
+    }
+    return ret > 0;
+}
+
+static void nvnet_tx_complete(NVNetState *s)
+{
+    unsigned int n;
+
+    nvnet_tx_unmap(s);
+    for (n = 0; n < s->tx_descs; n++) {
+        hwaddr desc = nvnet_tx_desc(s, s->tx_index + n);
+        uint32_t flaglen = ldl_le_phys(desc + 4);
+        stl_le_phys(desc + 4, flaglen & ~(NV_TX_VALID | NV_TX_ERROR));
+    }
+    s->tx_index += s->tx_descs;
+    s->tx_inflight = false;
+
+    nvnet_packet_done(s, NVREG_IRQ_TX1 | NVREG_IRQ_TX2, s->tx_force_irq);
+}
+
+static void nvnet_tx(NVNetState *s);
+
+static void nvnet_tx_done(NetClientState *nc, ssize_t len)
+{
+    NVNetState *s = qemu_get_nic_opaque(nc);
+
+    nvnet_tx_complete(s);
+    nvnet_tx(s);
+}
+
+static void nvnet_tx(NVNetState *s)
+{
+    while (!s->tx_inflight
+           && (NVNET_REG(s, NvRegTransmitterControl) & NVREG_XMITCTL_START)
+           && nvnet_tx_gather(s)) {
+        trace_nvnet_tx(iov_size(s->tx_iov, s->tx_iovcnt), s->tx_iovcnt,
+                       s->tx_bounced);
+        s->tx_inflight = true;
+        if (qemu_sendv_packet_async(qemu_get_queue(s->nic), s->tx_iov,
+                                    s->tx_iovcnt, nvnet_tx_done) == 0) {
+            /* queued by the backend; nvnet_tx_done carries on */
+            return;
+        }
+        nvnet_tx_complete(s);
+    }
+}
+
+
+static bool nvnet_rx_filter(NVNetState *s, const uint8_t *dst)
+{
+    static const uint8_t broadcast[6] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    uint32_t pff = NVNET_REG(s, NvRegPacketFilterFlags);
+    uint64_t addr = ldl_le_p(dst) | (uint64_t)lduw_le_p(dst + 4) << 32;
+
+    if ((pff & NVREG_PFF_PROMISC) || !memcmp(dst, broadcast, 6)) {
+        return true;
+    }
+    if (dst[0] & 1) {
+        uint64_t mc = NVNET_REG(s, NvRegMulticastAddrA)
+            | (uint64_t)(NVNET_REG(s, NvRegMulticastAddrB) & 0xFFFF) << 32;
+        uint64_t mask = NVNET_REG(s, NvRegMulticastMaskA)
+            | (uint64_t)(NVNET_REG(s, NvRegMulticastMaskB) & 0xFFFF) << 32;
+        return ((addr ^ mc) & mask) == 0;
+    }
+    if (pff & NVREG_PFF_MYADDR) {
+        uint64_t mac = NVNET_REG(s, NvRegMacAddrA)
+            | (uint64_t)(NVNET_REG(s, NvRegMacAddrB) & 0xFFFF) << 32;
+        return addr == mac;
+    }
+    return true;
+}
+
+static bool nvnet_rx_ready(NVNetState *s)
+{
+    return (NVNET_REG(s, NvRegReceiverControl) & NVREG_RCVCTL_START)
+        && (ldl_le_phys(nvnet_rx_desc(s, s->rx_index) + 4) & NV_RX_AVAIL);
+}
+
+static int nvnet_can_receive(NetClientState *nc)
+{
+    NVNetState *s = qemu_get_nic_opaque(nc);
+
+    if (nvnet_rx_ready(s)) {
+        return 1;
+    }
+    if (NVNET_REG(s, NvRegReceiverControl) & NVREG_RCVCTL_START) {
+        qemu_mod_timer(s->rx_poll_timer,
+                       qemu_get_clock_ns(vm_clock) + NVNET_RX_POLL_NS);
+    }
+    return 0;
+}
+
+/* Each call fills one descriptor. Packets that arrive while the ring
+ * is full are queued by the net layer and delivered back to back once
+ * the guest returns buffers, under a single moderated interrupt. */
+static ssize_t nvnet_receive_iov(NetClientState *nc,
+                                 const struct iovec *iov, int iovcnt)
+{
+    NVNetState *s = qemu_get_nic_opaque(nc);
+    size_t size = iov_size(iov, iovcnt);
+    uint8_t dst[6];
+
+    if (size < sizeof(dst)) {
+        return size;
+    }
+    iov_to_buf(iov, iovcnt, 0, dst, sizeof(dst));
+    if (!nvnet_rx_filter(s, dst)) {
+        return size;
+    }
+
+    if (!nvnet_rx_ready(s)) {
+        nvnet_raise(s, NVREG_IRQ_RX_NOBUF);
+        return 0;
+    }
+
+    hwaddr desc = nvnet_rx_desc(s, s->rx_index);
+    uint32_t flaglen = ldl_le_phys(desc + 4);
+    hwaddr buf = ldl_le_phys(desc);
+    hwaddr len = MIN(size, flaglen & NV_DESC_LEN);
+    hwaddr mapped = len;
+    uint32_t status = NV_RX_DESCRIPTORVALID;
+
+    void *p = cpu_physical_memory_map(buf, &mapped, 1);
+    if (p && mapped == len) {
+        iov_to_buf(iov, iovcnt, 0, p, len);
+        cpu_physical_memory_unmap(p, mapped, 1, len);
+    } else {
+        size_t off = 0;
+        int i;
+        if (p) {
+            cpu_physical_memory_unmap(p, mapped, 1, 0);
+        }
+        for (i = 0; i < iovcnt && off < len; i++) {
+            size_t n = MIN(iov[i].iov_len, len - off);
+            cpu_physical_memory_write(buf + off, iov[i].iov_base, n);
+            off += n;
+        }
+    }
+    if (len < size) {
+        status |= NV_RX_ERROR;
+    }
+    stl_le_phys(desc + 4, status | len);
+    s->rx_index++;
+
+    trace_nvnet_rx(size);
+    nvnet_packet_done(s, NVREG_IRQ_RX, false);
+    return size;
+}
+
+static ssize_t nvnet_receive(NetClientState *nc,
+                             const uint8_t *buf, size_t size)
+{
+    const struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+    return nvnet_receive_iov(nc, &iov, 1);
+}
+
+static void nvnet_rx_poll(void *opaque)
+{
+    NVNetState *s = opaque;
+
+    if (nvnet_rx_ready(s)) {
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    } else if (NVNET_REG(s, NvRegReceiverControl) & NVREG_RCVCTL_START) {
+        qemu_mod_timer(s->rx_poll_timer,
+                       qemu_get_clock_ns(vm_clock) + NVNET_RX_POLL_NS);
+    }
+}
+
+static void nvnet_set_link_status(NetClientState *nc)
+{
+    NVNetState *s = qemu_get_nic_opaque(nc);
+
+    if (nc->link_down) {
+        s->phy_regs[MII_BMSR] &= ~MII_BMSR_LINK_ST;
+    } else {
+        s->phy_regs[MII_BMSR] |= MII_BMSR_LINK_ST;
+    }
+    NVNET_REG(s, NvRegMIIStatus) |= NVREG_MIISTAT_LINKCHANGE;
+    nvnet_raise(s, NVREG_IRQ_LINK);
+}
+
+static void nvnet_cleanup(NetClientState *nc)
+{
+    NVNetState *s = qemu_get_nic_opaque(nc);
+
+    s->nic = NULL;
+}
+
+static NetClientInfo net_nvnet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_NIC,
+    .size = sizeof(NICState),
+    .can_receive = nvnet_can_receive,
+    .receive = nvnet_receive,
+    .receive_iov = nvnet_receive_iov,
+    .cleanup = nvnet_cleanup,
+    .link_status_changed = nvnet_set_link_status,
+};
+
+
+static void nvnet_mii(NVNetState *s, uint32_t ctl)
+{
+    unsigned int reg = ctl & NVREG_MIICTL_REG;
+
+    if (ctl & NVREG_MIICTL_WRITE) {
+        if (reg != MII_BMSR && reg != MII_PHYID1 && reg != MII_PHYID2) {
+            s->phy_regs[reg] = NVNET_REG(s, NvRegMIIData);
+        }
+    } else {
+        NVNET_REG(s, NvRegMIIData) = s->phy_regs[reg];
+    }
+    /* transactions complete immediately */
+    NVNET_REG(s, NvRegMIIControl) = ctl & ~NVREG_MIICTL_INUSE;
+}
+
+static void nvnet_reset_rings(NVNetState *s)
+{
+    if (s->tx_inflight) {
+        qemu_purge_queued_packets(qemu_get_queue(s->nic));
+        nvnet_tx_unmap(s);
+        s->tx_inflight = false;
+    }
+    s->tx_index = 0;
+    s->rx_index = 0;
+}
 
 static uint64_t nvnet_mmio_read(void *opaque,
                                 hwaddr addr, unsigned int size)
 {
-    NVNET_DPRINTF("nvnet MMIO: read [0x%llx]\n", addr);
-    return 0;
+    NVNetState *s = opaque;
+    uint64_t r = 0;
+
+    switch (addr) {
+    case NvRegTransmitterStatus:
+        r = s->tx_inflight ? NVREG_XMITSTAT_BUSY : 0;
+        break;
+    case NvRegReceiverStatus:
+        r = (NVNET_REG(s, NvRegReceiverControl) & NVREG_RCVCTL_START)
+                ? NVREG_RCVSTAT_BUSY : 0;
+        break;
+    case NvRegTxRxControl:
+        r = (NVNET_REG(s, addr) & ~NVREG_TXRXCTL_KICK)
+                | (s->tx_inflight ? 0 : NVREG_TXRXCTL_IDLE);
+        break;
+    default:
+        if (addr < MMIO_SIZE) {
+            r = NVNET_REG(s, addr & ~3) >> ((addr & 3) * 8);
+        }
+        break;
+    }
+
+    NVNET_DPRINTF("nvnet MMIO: read [0x%llx] -> 0x%llx\n", addr, r);
+    return r;
 }
 static void nvnet_mmio_write(void *opaque, hwaddr addr,
                              uint64_t val, unsigned int size)
 {
+    NVNetState *s = opaque;
+
     NVNET_DPRINTF("nvnet MMIO: [0x%llx] = 0x%llx\n", addr, val);
+
+    switch (addr) {
+    case NvRegIrqStatus:
+        NVNET_REG(s, addr) &= ~val;
+        nvnet_update_irq(s);
+        /* an acknowledged RX interrupt usually means buffers are back */
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+        break;
+    case NvRegIrqMask:
+        NVNET_REG(s, addr) = val;
+        nvnet_update_irq(s);
+        break;
+    case NvRegMIIStatus:
+        NVNET_REG(s, addr) &= ~val;
+        break;
+    case NvRegMIIControl:
+        nvnet_mii(s, val);
+        break;
+    case NvRegTransmitterControl:
+        NVNET_REG(s, addr) = val;
+        nvnet_tx(s);
+        break;
+    case NvRegReceiverControl:
+        NVNET_REG(s, addr) = val;
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+        break;
+    case NvRegTxRingPhysAddr:
+    case NvRegRxRingPhysAddr:
+    case NvRegRingSizes:
+        NVNET_REG(s, addr) = val;
+        nvnet_reset_rings(s);
+        break;
+    case NvRegTxRxControl:
+        NVNET_REG(s, addr) = val;
+        if (val & NVREG_TXRXCTL_RESET) {
+            nvnet_reset_rings(s);
+        } else if (val & NVREG_TXRXCTL_KICK) {
+            nvnet_tx(s);
+        }
+        break;
+    default:
+        if (addr < MMIO_SIZE && size == 4) {
+            NVNET_REG(s, addr) = val;
+        }
+        break;
+    }
 }
 static const MemoryRegionOps nvnet_mmio_ops = {
     .read = nvnet_mmio_read,
     .write = nvnet_mmio_write,
+    .valid.min_access_size = 1,
+    .valid.max_access_size = 4,
 };
 
 
@@ -74,6 +639,36 @@ static const MemoryRegionOps nvnet_io_ops = {
 	.write = nvnet_io_write,
 };
 
+static void nvnet_reset(DeviceState *dev)
+{
+    NVNetState *s = NVNET_DEVICE(dev);
+    const uint8_t *mac = s->conf.macaddr.a;
+
+    nvnet_reset_rings(s);
+    memset(s->regs, 0, sizeof(s->regs));
+    qemu_del_timer(s->irq_timer);
+    qemu_del_timer(s->rx_poll_timer);
+    s->irq_held = false;
+    s->irq_held_packets = 0;
+
+    NVNET_REG(s, NvRegMacAddrA) = mac[0] | mac[1] << 8
+                                      | mac[2] << 16 | mac[3] << 24;
+    NVNET_REG(s, NvRegMacAddrB) = mac[4] | mac[5] << 8;
+
+    memset(s->phy_regs, 0, sizeof(s->phy_regs));
+    s->phy_regs[MII_BMCR] = 0x3100;     /* autoneg, 100Mbit, full duplex */
+    s->phy_regs[MII_BMSR] = 0x782D;
+    s->phy_regs[MII_PHYID1] = 0x0141;
+    s->phy_regs[MII_PHYID2] = 0x0CC2;
+    s->phy_regs[MII_ANAR] = 0x01E1;
+    s->phy_regs[MII_ANLPAR] = 0x45E1;
+    if (s->nic && qemu_get_queue(s->nic)->link_down) {
+        s->phy_regs[MII_BMSR] &= ~MII_BMSR_LINK_ST;
+    }
+
+    qemu_set_irq(s->dev.irq[0], 0);
+}
+
 static int nvnet_initfn(PCIDevice *dev)
 {
     NVNetState *d = NVNET_DEVICE(dev);
@@ -86,9 +681,83 @@ static int nvnet_initfn(PCIDevice *dev)
                           &nvnet_io_ops, d, "nvnet-io", IOPORT_SIZE);
     pci_register_bar(&d->dev, 1, PCI_BASE_ADDRESS_SPACE_IO, &d->io);
 
+    qemu_macaddr_default_if_unset(&d->conf.macaddr);
+    d->nic = qemu_new_nic(&net_nvnet_info, &d->conf,
+                          object_get_typename(OBJECT(dev)),
+                          DEVICE(dev)->id, d);
+    qemu_format_nic_info_str(qemu_get_queue(d->nic), d->conf.macaddr.a);
+
+    d->tx_bounce = g_malloc(NVNET_MAX_PACKET);
+    d->irq_timer = qemu_new_timer_ns(vm_clock, nvnet_irq_timer, d);
+    d->rx_poll_timer = qemu_new_timer_ns(vm_clock, nvnet_rx_poll, d);
+    d->irq_packets = MAX(1, d->irq_packets);
+
     return 0;
 }
 
+static void nvnet_exitfn(PCIDevice *dev)
+{
+    NVNetState *d = NVNET_DEVICE(dev);
+
+    nvnet_reset_rings(d);
+    qemu_del_timer(d->irq_timer);
+    qemu_free_timer(d->irq_timer);
+    qemu_del_timer(d->rx_poll_timer);
+    qemu_free_timer(d->rx_poll_timer);
+    g_free(d->tx_bounce);
+    memory_region_destroy(&d->mmio);
+    memory_region_destroy(&d->io);
+    qemu_del_nic(d->nic);
+}
+
+static void nvnet_pre_save(void *opaque)
+{
+    NVNetState *d = opaque;
+
+    /* a packet still with the backend is sent again after loading */
+    if (d->tx_inflight) {
+        qemu_purge_queued_packets(qemu_get_queue(d->nic));
+        nvnet_tx_unmap(d);
+        d->tx_inflight = false;
+    }
+}
+
+static int nvnet_post_load(void *opaque, int version_id)
+{
+    NVNetState *d = opaque;
+
+    nvnet_update_irq(d);
+    nvnet_tx(d);
+    return 0;
+}
+
+static const VMStateDescription vmstate_nvnet = {
+    .name = "nvnet",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .minimum_version_id_old = 2,
+    .pre_save = nvnet_pre_save,
+    .post_load = nvnet_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(dev, NVNetState),
+        VMSTATE_UINT32_ARRAY(regs, NVNetState, MMIO_SIZE / 4),
+        VMSTATE_UINT16_ARRAY(phy_regs, NVNetState, 32),
+        VMSTATE_UINT32(tx_index, NVNetState),
+        VMSTATE_UINT32(rx_index, NVNetState),
+        VMSTATE_TIMER(irq_timer, NVNetState),
+        VMSTATE_BOOL(irq_held, NVNetState),
+        VMSTATE_UINT32(irq_held_packets, NVNetState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static Property nvnet_properties[] = {
+    DEFINE_NIC_PROPERTIES(NVNetState, conf),
+    DEFINE_PROP_UINT32("irq-delay-us", NVNetState, irq_delay_us, 100),
+    DEFINE_PROP_UINT32("irq-packets", NVNetState, irq_packets, 16),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nvnet_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -99,8 +768,12 @@ static void nvnet_class_init(ObjectClass *klass, void *data)
     k->revision = 210;
     k->class_id = PCI_CLASS_NETWORK_ETHERNET;
     k->init = nvnet_initfn;
+    k->exit = nvnet_exitfn;
 
     dc->desc = "nForce Ethernet Controller";
+    dc->reset = nvnet_reset;
+    dc->vmsd = &vmstate_nvnet;
+    dc->props = nvnet_properties;
 }
 
 static const TypeInfo nvnet_info = {
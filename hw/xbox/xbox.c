@@ -30,17 +30,24 @@
 #include "hw/timer/i8254.h"
 #include "hw/audio/pcspk.h"
 #include "sysemu/sysemu.h"
+#include "net/net.h"
 #include "hw/cpu/icc_bus.h"
 #include "hw/sysbus.h"
 #include "hw/i2c/smbus.h"
 #include "sysemu/blockdev.h"
+#include "block/block_int.h"
 #include "hw/loader.h"
 #include "exec/address-spaces.h"
+#include "qemu/config-file.h"
+#include "qemu/error-report.h"
+#include "qmp-commands.h"
 
 #include "hw/xbox/xbox_pci.h"
 #include "hw/xbox/nv2a.h"
+#include "hw/xbox/mcpx_apu.h"
 
 #include "hw/xbox/xbox.h"
+#include "exec/guest-profile.h"
 
 /* mostly from pc_memory_init */
 static void xbox_memory_init(MemoryRegion *system_memory,
@@ -115,6 +122,239 @@ bios_error:
                                 bios);
     */
 
+    /* The BIOS, and the kernel it decompresses to 0x10000 (phys), are
+     * the same on every boot. Let -machine tb_cache keep their
+     * translations; they are checked against the guest code anyway. */
+    tb_cache_add_region(memory_region_get_ram_addr(bios), bios_size);
+    tb_cache_add_region(memory_region_get_ram_addr(ram) + 0x10000,
+                        0x200000 - 0x10000);
+}
+
+/* HDD overlays. With hdd_base, the primary IDE disk is a throwaway
+ * qcow2 overlay on top of a read-only base image, so any number of
+ * instances can share one pristine HDD. xbox-hdd-reset swaps in a fresh
+ * overlay during a machine reset. */
+typedef struct XboxHDD {
+    const char *base;
+    const char *overlay_dir;
+    bool discard_cache;
+    BlockDriverState *pending;  /* overlay to swap in on the next reset */
+} XboxHDD;
+
+static XboxHDD xbox_hdd;
+
+/* FATX cache partitions X, Y and Z, in sectors */
+static const struct {
+    int64_t start;
+    int count;
+} xbox_cache_partitions[] = {
+    { 0x00080000 / BDRV_SECTOR_SIZE, 0x2ee00000 / BDRV_SECTOR_SIZE },
+    { 0x2ee80000 / BDRV_SECTOR_SIZE, 0x2ee00000 / BDRV_SECTOR_SIZE },
+    { 0x5dc80000 / BDRV_SECTOR_SIZE, 0x2ee00000 / BDRV_SECTOR_SIZE },
+};
+
+static char *xbox_hdd_overlay_create(Error **errp)
+{
+    Error *local_err = NULL;
+    char *filename = NULL;
+    int fd;
+
+    if (xbox_hdd.overlay_dir) {
+        filename = g_build_filename(xbox_hdd.overlay_dir,
+                                    "xbox-hdd-XXXXXX", NULL);
+        fd = g_mkstemp(filename);
+    } else {
+        fd = g_file_open_tmp("xbox-hdd-XXXXXX", &filename, NULL);
+    }
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "Could not create the HDD overlay");
+        g_free(filename);
+        return NULL;
+    }
+    close(fd);
+
+    bdrv_img_create(filename, "qcow2", xbox_hdd.base, NULL, NULL, -1, 0,
+                    &local_err, true);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        unlink(filename);
+        g_free(filename);
+        return NULL;
+    }
+    return filename;
+}
+
+static void xbox_hdd_reset(void *opaque)
+{
+    DriveInfo *dinfo = drive_get(IF_IDE, 0, 0);
+    int i;
+
+    if (!dinfo) {
+        return;
+    }
+
+    if (xbox_hdd.pending) {
+        /* the old overlay goes away with pending after the swap */
+        bdrv_drain_all();
+        bdrv_swap(xbox_hdd.pending, dinfo->bdrv);
+        bdrv_delete(xbox_hdd.pending);
+        xbox_hdd.pending = NULL;
+    }
+
+    if (xbox_hdd.discard_cache) {
+        for (i = 0; i < ARRAY_SIZE(xbox_cache_partitions); i++) {
+            bdrv_discard(dinfo->bdrv, xbox_cache_partitions[i].start,
+                         xbox_cache_partitions[i].count);
+        }
+    }
+}
+
+void qmp_xbox_hdd_reset(Error **errp)
+{
+    DriveInfo *dinfo = drive_get(IF_IDE, 0, 0);
+    BlockDriverState *bs;
+    char *filename;
+    int ret;
+
+    if (!xbox_hdd.base || !dinfo) {
+        error_setg(errp, "The Xbox HDD has no overlay");
+        return;
+    }
+
+    filename = xbox_hdd_overlay_create(errp);
+    if (!filename) {
+        return;
+    }
+
+    bs = bdrv_new("");
+    ret = bdrv_open(bs, filename, NULL, bdrv_get_flags(dinfo->bdrv),
+                    bdrv_find_format("qcow2"));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not open HDD overlay '%s'",
+                         filename);
+        bdrv_delete(bs);
+        unlink(filename);
+        g_free(filename);
+        return;
+    }
+    bs->is_temporary = 1;
+    g_free(filename);
+
+    if (xbox_hdd.pending) {
+        bdrv_delete(xbox_hdd.pending);
+    }
+    xbox_hdd.pending = bs;
+    qemu_system_reset_request();
+}
+
+static void xbox_hdd_init(void)
+{
+    QemuOpts *machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    DriveInfo *dinfo;
+    QemuOpts *opts;
+    Error *err = NULL;
+    char *filename;
+
+    if (machine_opts) {
+        xbox_hdd.base = qemu_opt_get(machine_opts, "hdd_base");
+        xbox_hdd.overlay_dir = qemu_opt_get(machine_opts, "hdd_overlay_dir");
+        xbox_hdd.discard_cache = qemu_opt_get_bool(machine_opts,
+                                                   "hdd_discard_cache",
+                                                   false);
+    }
+
+    if (xbox_hdd.base) {
+        if (drive_get(IF_IDE, 0, 0)) {
+            fprintf(stderr, "xbox: hdd_base needs to be attached "
+                            "to IDE device 0 but it's already in use.\n");
+            exit(1);
+        }
+
+        filename = xbox_hdd_overlay_create(&err);
+        if (!filename) {
+            error_report("xbox: %s", error_get_pretty(err));
+            exit(1);
+        }
+        /* the overlay is thrown away, don't bother flushing it */
+        opts = drive_add(IF_IDE, 0, filename,
+                         "media=disk,format=qcow2,cache=unsafe,discard=unmap");
+        dinfo = opts ? drive_init(opts, IF_IDE) : NULL;
+        if (!dinfo) {
+            unlink(filename);
+            exit(1);
+        }
+        dinfo->bdrv->is_temporary = 1;
+        g_free(filename);
+    }
+
+    dinfo = drive_get(IF_IDE, 0, 0);
+    if (xbox_hdd.discard_cache && dinfo &&
+        !(bdrv_get_flags(dinfo->bdrv) & BDRV_O_UNMAP)) {
+        error_report("xbox: hdd_discard_cache needs discard=unmap on the HDD");
+    }
+
+    qemu_register_reset(xbox_hdd_reset, NULL);
+}
+
+/* Name guest code addresses for the guest profiler: the kernel image,
+ * or a section of the XBE whose headers the kernel maps at 0x10000. */
+#define XBE_BASE            0x00010000
+#define XBE_MAGIC           0x48454258 /* "XBEH" */
+#define XBE_NUM_SECTIONS    0x11c
+#define XBE_SECTION_HEADERS 0x120
+#define XBE_SECTION_SIZE    0x38
+#define XBOX_KERNEL_BASE    0x80010000
+
+static char *xbox_symbolize(CPUState *cpu, uint64_t addr)
+{
+    uint8_t hdr[XBE_SECTION_HEADERS + 4];
+    uint8_t sec[0x18];
+    char name[32];
+    uint32_t nt, start, size, sections, count, i;
+
+    if (addr >= XBOX_KERNEL_BASE) {
+        /* PE image: e_lfanew, then SizeOfImage in the optional header */
+        if (cpu_memory_rw_debug(cpu, XBOX_KERNEL_BASE, hdr, 0x40, 0) ||
+            lduw_le_p(hdr) != 0x5a4d) {
+            return NULL;
+        }
+        nt = ldl_le_p(hdr + 0x3c);
+        if (cpu_memory_rw_debug(cpu, XBOX_KERNEL_BASE + nt + 0x50,
+                                hdr, 4, 0)) {
+            return NULL;
+        }
+        size = ldl_le_p(hdr);
+        if (addr - XBOX_KERNEL_BASE >= size) {
+            return NULL;
+        }
+        return g_strdup_printf("xboxkrnl+0x%" PRIx64,
+                               addr - XBOX_KERNEL_BASE);
+    }
+
+    if (cpu_memory_rw_debug(cpu, XBE_BASE, hdr, sizeof(hdr), 0) ||
+        ldl_le_p(hdr) != XBE_MAGIC) {
+        return NULL;
+    }
+    count = ldl_le_p(hdr + XBE_NUM_SECTIONS);
+    sections = ldl_le_p(hdr + XBE_SECTION_HEADERS);
+    for (i = 0; i < count && i < 256; i++) {
+        if (cpu_memory_rw_debug(cpu, sections + i * XBE_SECTION_SIZE,
+                                sec, sizeof(sec), 0)) {
+            return NULL;
+        }
+        start = ldl_le_p(sec + 0x04);
+        size = ldl_le_p(sec + 0x08);
+        if (addr < start || addr - start >= size) {
+            continue;
+        }
+        if (cpu_memory_rw_debug(cpu, ldl_le_p(sec + 0x14),
+                                (uint8_t *)name, sizeof(name), 0)) {
+            return NULL;
+        }
+        name[sizeof(name) - 1] = '\0';
+        return g_strdup_printf("%s+0x%" PRIx64, name, addr - start);
+    }
+    return NULL;
 }
 
 /* mostly from pc_init1 */
@@ -126,6 +366,8 @@ void xbox_init_common(QEMUMachineInitArgs *args,
     ram_addr_t ram_size = args->ram_size;
     const char *cpu_model = args->cpu_model;
     const char *boot_device = args->boot_device;
+    QemuOpts *machine_opts;
+    const char *tb_cache;
 
     PCIBus *host_bus;
     ISABus *isa_bus;
@@ -154,6 +396,14 @@ void xbox_init_common(QEMUMachineInitArgs *args,
 
     pc_cpus_init(cpu_model, icc_bridge);
 
+    machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    tb_cache = machine_opts ? qemu_opt_get(machine_opts, "tb_cache") : NULL;
+    if (tb_cache) {
+        /* translations depend on the CPUID features */
+        tb_cache_init(tb_cache, cpu_model ? cpu_model : "default");
+    }
+    guest_profile_set_symbolizer(xbox_symbolize);
+
     pci_memory = g_new(MemoryRegion, 1);
     memory_region_init(pci_memory, NULL, "pci", INT64_MAX);
 
@@ -197,6 +447,7 @@ void xbox_init_common(QEMUMachineInitArgs *args,
      * piix3's ide be right for now, maybe
      */
     DriveInfo *hd[MAX_IDE_BUS * MAX_IDE_DEVS];
+    xbox_hdd_init();
     ide_drive_get(hd, MAX_IDE_BUS);
     ide_dev = pci_piix3_ide_init(host_bus, hd, PCI_DEVFN(9, 0));
 
@@ -235,10 +486,15 @@ void xbox_init_common(QEMUMachineInitArgs *args,
     qdev_init_nofail(&usb0->qdev);
 
     /* Ethernet! */
-    PCIDevice *nvnet = pci_create_simple(host_bus, PCI_DEVFN(4, 0), "nvnet");
+    PCIDevice *nvnet = pci_create(host_bus, PCI_DEVFN(4, 0), "nvnet");
+    if (nd_table[0].used) {
+        qemu_check_nic_model(&nd_table[0], "nvnet");
+        qdev_set_nic_properties(&nvnet->qdev, &nd_table[0]);
+    }
+    qdev_init_nofail(&nvnet->qdev);
 
     /* APU! */
-    PCIDevice *apu = pci_create_simple(host_bus, PCI_DEVFN(5, 0), "mcpx-apu");
+    mcpx_apu_init(host_bus, PCI_DEVFN(5, 0), ram_memory);
 
     /* ACI! */
     PCIDevice *aci = pci_create_simple(host_bus, PCI_DEVFN(6, 0), "mcpx-aci");
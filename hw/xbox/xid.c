@@ -21,6 +21,9 @@
 #include "ui/console.h"
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
+#include "qemu/timer.h"
+#include "qapi/visitor.h"
+#include "trace.h"
 
 //#define DEBUG_XID
 #ifdef DEBUG_XID
@@ -77,6 +80,14 @@ typedef struct USBXIDState {
 
     QEMUPutKbdEntry *kbd_entry;
     XIDGamepadReport in_state;
+    /* in_state has changed since the guest last read it */
+    bool in_dirty;
+
+    /* latency probe: host input event to guest report delivery */
+    int64_t event_ns;       /* oldest undelivered event, 0 if none */
+    int64_t reports;
+    int64_t latency_total_ns;
+    int64_t latency_max_ns;
 } USBXIDState;
 
 static const USBDescIface desc_iface_xbox_gamepad = {
@@ -189,6 +200,7 @@ static void xbox_gamepad_keyboard_event(void *opaque, int keycode)
 
     DPRINTF("xid keyboard_event %x - %d %d %d\n", keycode, code, button, up);
 
+    XIDGamepadReport old = s->in_state;
     uint16_t mask;
     switch (button) {
     case GAMEPAD_A ... GAMEPAD_RIGHT_TRIGGER:
@@ -202,12 +214,25 @@ static void xbox_gamepad_keyboard_event(void *opaque, int keycode)
     default:
         break;
     }
+
+    if (memcmp(&old, &s->in_state, sizeof(old))) {
+        s->in_dirty = true;
+        if (!s->event_ns) {
+            s->event_ns = get_clock();
+        }
+        usb_wakeup(s->intr, 0);
+    }
 }
 
 
 static void usb_xid_handle_reset(USBDevice *dev)
 {
+    USBXIDState *s = DO_UPCAST(USBXIDState, dev, dev);
+
     DPRINTF("xid reset\n");
+
+    /* the first poll after a reset gets the current state */
+    s->in_dirty = true;
 }
 
 static void usb_xid_handle_control(USBDevice *dev, USBPacket *p,
@@ -269,7 +294,21 @@ static void usb_xid_handle_data(USBDevice *dev, USBPacket *p)
     switch (p->pid) {
     case USB_TOKEN_IN:
         if (p->ep->nr == 2) {
+            if (!s->in_dirty) {
+                p->status = USB_RET_NAK;
+                return;
+            }
             usb_packet_copy(p, &s->in_state, s->in_state.bLength);
+            s->in_dirty = false;
+
+            if (s->event_ns) {
+                int64_t latency = get_clock() - s->event_ns;
+                s->event_ns = 0;
+                s->reports++;
+                s->latency_total_ns += latency;
+                s->latency_max_ns = MAX(s->latency_max_ns, latency);
+                trace_xid_report_latency(latency);
+            }
         } else {
             assert(false);
         }
@@ -296,6 +335,34 @@ static void usb_xid_class_initfn(ObjectClass *klass, void *data)
     uc->handle_attach  = usb_desc_attach;
 }
 
+static void usb_xid_get_latency(Object *obj, Visitor *v, void *opaque,
+                                const char *name, Error **errp)
+{
+    USBXIDState *s = DO_UPCAST(USBXIDState, dev, USB_DEVICE(obj));
+    int64_t value;
+
+    if (!strcmp(name, "reports")) {
+        value = s->reports;
+    } else if (!strcmp(name, "report-latency-max-ns")) {
+        value = s->latency_max_ns;
+    } else {
+        value = s->reports ? s->latency_total_ns / s->reports : 0;
+    }
+    visit_type_int(v, &value, name, errp);
+}
+
+static void usb_xid_add_latency_props(USBXIDState *s)
+{
+    Object *obj = OBJECT(s);
+
+    object_property_add(obj, "reports", "int", usb_xid_get_latency,
+                        NULL, NULL, NULL, NULL);
+    object_property_add(obj, "report-latency-avg-ns", "int",
+                        usb_xid_get_latency, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "report-latency-max-ns", "int",
+                        usb_xid_get_latency, NULL, NULL, NULL, NULL);
+}
+
 static int usb_xbox_gamepad_initfn(USBDevice *dev)
 {
     USBXIDState *s = DO_UPCAST(USBXIDState, dev, dev);
@@ -305,6 +372,8 @@ static int usb_xbox_gamepad_initfn(USBDevice *dev)
     s->in_state.bLength = sizeof(s->in_state);
     s->kbd_entry = qemu_add_kbd_event_handler(xbox_gamepad_keyboard_event, s);
     s->xid_desc = &desc_xid_xbox_gamepad;
+    s->in_dirty = true;
+    usb_xid_add_latency_props(s);
 
     return 0;
 }
@@ -460,8 +460,9 @@ typedef struct RAMBlock {
 
 typedef struct RAMList {
     QemuMutex mutex;
-    /* Protected by the iothread lock.  */
-    uint8_t *phys_dirty;
+    /* One bit per page for each DIRTY_MEMORY_* client.  Updated with
+     * atomic ops, so readers need not hold the iothread lock.  */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
     RAMBlock *mru_block;
     /* Protected by the ramlist lock.  */
     QTAILQ_HEAD(, RAMBlock) blocks;
@@ -483,6 +484,8 @@ extern int mem_prealloc;
 #define TLB_MMIO        (1 << 5)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_smc_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tlb_stats(FILE *f, fprintf_function cpu_fprintf);
 ram_addr_t last_ram_offset(void);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
@@ -72,8 +72,18 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+/* The TLB index mask is built into generated code, so the size is fixed
+   at compile time.  It can be raised from the build (e.g.
+   --extra-cflags=-DCPU_TLB_BITS=10) for guests with large working sets,
+   as far as the TCG backend allows; "info tlb-stats" shows whether that
+   is worth it.  */
+#ifndef CPU_TLB_BITS
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* Fully associative victim TLB, searched before walking the page
+   tables on a miss in the direct mapped table.  */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -103,12 +113,27 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+/* Only lookups that leave the inline fast path are seen here; hits in
+   generated code are not counted.  */
+typedef struct CPUTLBStats {
+    uint64_t misses;            /* misses in the direct mapped table */
+    uint64_t victim_hits;       /* ... that were found in the victim TLB */
+    uint64_t flushes;
+    uint64_t page_flushes;
+    uint64_t misses_at_flush;   /* misses before the last full flush */
+    uint64_t last_flush_misses; /* misses between the last two flushes */
+} CPUTLBStats;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    unsigned int vtlb_index;                                            \
+    CPUTLBStats tlb_stats;
 
 #else
 
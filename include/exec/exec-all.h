@@ -88,6 +88,7 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
 void cpu_exec_init(CPUArchState *env);
+void *tb_lookup_code_ptr(CPUArchState *env);
 void QEMU_NORETURN cpu_loop_exit(CPUArchState *env1);
 int page_unprotect(target_ulong address, uintptr_t pc, void *puc);
 void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
@@ -101,6 +102,8 @@ void tlb_flush(CPUArchState *env, int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+bool tlb_victim_hit(CPUArchState *env, int mmu_idx, int index,
+                    int access_type, target_ulong addr);
 void tb_invalidate_phys_addr(hwaddr addr);
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
@@ -142,6 +145,8 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    bool invalid;       /* removed by tb_phys_invalidate() */
+    bool persist;       /* generated for the persistent TB cache */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -166,23 +171,60 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* execution counter incremented on TB entry, for the guest profiler */
+    uint64_t *exec_count;
 };
 
 #include "exec/spinlock.h"
 
 typedef struct TBContext TBContext;
 
+/* The code buffer is split into regions that are filled in turn.  When
+   the last one is full, the oldest region is evicted instead of flushing
+   the whole buffer.  Each region owns a slice of tbs[].  */
+#define TB_REGIONS_MAX 8
+
+typedef struct TBRegion {
+    uint8_t *start;
+    uint8_t *ptr;               /* end of the code generated so far */
+    uint8_t *limit;             /* no TB may start at or after this */
+    int first_tb;               /* index of the region's slice of tbs[] */
+    int nb_tbs;
+    unsigned int generation;    /* value of tb_generation when started */
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
     TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
     int nb_tbs;
+
+    TBRegion regions[TB_REGIONS_MAX];
+    int nb_regions;
+    int cur_region;
+    int region_max_blocks;
+    size_t region_size;
+    unsigned int tb_generation;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_region_evict_count;
     int tb_phys_invalidate_count;
+    uint64_t tb_translations;       /* TBs generated, from the cache or not */
+    uint64_t tb_translate_ns;       /* time spent generating them */
+    uint64_t tb_exec_lookups;       /* TB lookups in cpu_exec() */
+    uint64_t tb_indirect_lookups;   /* lookups from indirect jumps */
+    uint64_t tb_indirect_hits;
+    /* counters as of the previous "info jit", for its interval rates */
+    int64_t jit_info_time;
+    uint64_t jit_info_exec_lookups;
+    uint64_t jit_info_indirect_hits;
+    uint64_t smc_writes;            /* writes trapped on code pages */
+    uint64_t smc_line_skips;        /* ... that missed every code line */
+    uint64_t smc_byte_skips;        /* ... that missed the code bytes */
+    uint64_t smc_invalidations;     /* ... that invalidated TBs */
 
     int tb_invalidated_flag;
 };
@@ -210,6 +252,8 @@ static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+/* the TB containing host code address tc_ptr, or NULL */
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 #if defined(USE_DIRECT_JUMP)
 
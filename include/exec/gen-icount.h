@@ -21,6 +21,19 @@ static inline void gen_tb_start(void)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tcg_ctx.tb_exec_count) {
+        TCGv_ptr ptr = tcg_const_ptr(tcg_ctx.tb_exec_count);
+        TCGv_i64 n = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(n, ptr, 0);
+        tcg_gen_addi_i64(n, n, 1);
+        tcg_gen_st_i64(n, ptr, 0);
+        tcg_temp_free_i64(n);
+        tcg_temp_free_ptr(ptr);
+        /* the counter's address cannot be relocated */
+        tcg_ctx.persist_failed = true;
+    }
+
     if (!use_icount)
         return;
 
@@ -0,0 +1,54 @@
+/*
+ * Guest hot-spot profiler
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef GUEST_PROFILE_H
+#define GUEST_PROFILE_H
+
+#include "qom/cpu.h"
+
+/* Return a name for a guest code address, or NULL; the caller frees it */
+typedef char *GuestProfileSymbolizer(CPUState *cpu, uint64_t addr);
+
+void guest_profile_set_symbolizer(GuestProfileSymbolizer *fn);
+
+#ifdef CONFIG_SOFTMMU
+
+/* set when the hot block selection changed and TBs need retranslating */
+extern bool guest_profile_flush_pending;
+
+/* install the sampling signal handler; called on the TCG thread */
+void guest_profile_init_thread(void);
+
+uint64_t *guest_profile_exec_counter(target_ulong pc);
+void guest_profile_tb_generated(TranslationBlock *tb, int code_size);
+
+static inline void guest_profile_cpu_exec(CPUArchState *env)
+{
+    if (unlikely(guest_profile_flush_pending)) {
+        guest_profile_flush_pending = false;
+        tb_flush(env);
+    }
+}
+
+#else
+
+static inline uint64_t *guest_profile_exec_counter(target_ulong pc)
+{
+    return NULL;
+}
+
+static inline void guest_profile_tb_generated(TranslationBlock *tb,
+                                              int code_size)
+{
+}
+
+static inline void guest_profile_cpu_exec(CPUArchState *env)
+{
+}
+
+#endif
+
+#endif
@@ -21,6 +21,8 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
+#include "qemu/bitmap.h"
+#include "qemu/atomic.h"
 
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -40,85 +42,87 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+#define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
+#define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
 
-static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
+static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
+                                                 ram_addr_t length,
+                                                 unsigned client)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
-}
+    unsigned long end, page, next;
 
-/* read dirty bit (return 0 or 1) */
-static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
-{
-    return cpu_physical_memory_get_dirty_flags(addr) == 0xff;
-}
+    assert(client < DIRTY_MEMORY_NUM);
 
-static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
-                                                ram_addr_t length,
-                                                int dirty_flags)
-{
-    int ret = 0;
-    ram_addr_t addr, end;
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+    next = find_next_bit(ram_list.dirty_memory[client], end, page);
 
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        ret |= cpu_physical_memory_get_dirty_flags(addr) & dirty_flags;
-    }
-    return ret;
+    return next < end;
 }
 
-static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
-                                                      int dirty_flags)
+static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    assert(client < DIRTY_MEMORY_NUM);
+    return test_bit(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
 }
 
-static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
+/* true if the page is dirty for every client, i.e. writes to it can go
+ * straight to RAM without passing through notdirty_mem_write */
+static inline bool cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    cpu_physical_memory_set_dirty_flags(addr, 0xff);
+    unsigned client;
+
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (!cpu_physical_memory_get_dirty_flag(addr, client)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-static inline int cpu_physical_memory_clear_dirty_flags(ram_addr_t addr,
-                                                        int dirty_flags)
+static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
+                                                      unsigned client)
 {
-    int mask = ~dirty_flags;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
 
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] &= mask;
+    assert(client < DIRTY_MEMORY_NUM);
+    if (!test_bit(page, ram_list.dirty_memory[client])) {
+        atomic_or(&ram_list.dirty_memory[client][BIT_WORD(page)],
+                  BIT_MASK(page));
+    }
 }
 
+/* Mark a range dirty for every client in the DIRTY_CLIENTS_* mask @mask */
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
                                                        ram_addr_t length,
-                                                       int dirty_flags)
+                                                       uint8_t mask)
 {
-    ram_addr_t addr, end;
-
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_set_dirty_flags(addr, dirty_flags);
+    unsigned long end, page;
+    unsigned client;
+
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+    for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+        if (mask & (1 << client)) {
+            bitmap_set_atomic(ram_list.dirty_memory[client], page,
+                              end - page);
+        }
     }
-    xen_modified_memory(addr, length);
+    xen_modified_memory(start, length);
 }
 
-static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        ram_addr_t length,
-                                                        int dirty_flags)
-{
-    ram_addr_t addr, end;
+bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
+                                              ram_addr_t length,
+                                              unsigned client);
 
-    end = TARGET_PAGE_ALIGN(start + length);
-    start &= TARGET_PAGE_MASK;
-    for (addr = start; addr < end; addr += TARGET_PAGE_SIZE) {
-        cpu_physical_memory_clear_dirty_flags(addr, dirty_flags);
-    }
+static inline void cpu_physical_memory_reset_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client)
+{
+    cpu_physical_memory_test_and_clear_dirty(start, length, client);
 }
 
-void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags);
-
 #endif
 
 #endif
@@ -33,14 +33,6 @@
 typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
- */
-#define DIRTY_MEMORY_VGA       0
-#define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
-#define DIRTY_MEMORY_NV2A      4
-
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
     CPUWriteMemoryFunc *write[3];
@@ -152,6 +144,7 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool global_locking;
     MemoryRegion *alias;
     hwaddr alias_offset;
     unsigned priority;
@@ -593,7 +586,9 @@ void memory_region_set_client_dirty(MemoryRegion *mr, hwaddr addr,
  *
  * Checks whether a range of bytes has been written to since the last
  * call to memory_region_reset_dirty() with the same @client.  Dirty logging
- * must be enabled.
+ * must be enabled.  The test and the clear are atomic with respect to
+ * concurrent writers, so device threads may call this without the
+ * iothread lock.
  *
  * @mr: the memory region being queried.
  * @addr: the address (relative to the start of the region) being queried.
@@ -716,6 +711,24 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Declares that access processing does
+ *                                     not depend on the QEMU global lock.
+ *
+ * By clearing this property, guest accesses from TCG to the memory region
+ * are dispatched with the QEMU global lock released, so the main loop and
+ * device threads can make progress while the access is handled.  The device
+ * model implementing the access handlers is then responsible for
+ * synchronizing with its own threads, and must take the global lock itself
+ * before touching state that it protects (interrupt lines, timers, ...).
+ * In particular the handlers must not access guest memory through
+ * address_space_rw() or cpu_physical_memory_*(), whose dirty tracking
+ * invalidates translated code, nor touch the CPU state.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -22,6 +22,7 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
 #include "exec/memory.h"
 
 #define DATA_SIZE (1 << SHIFT)
@@ -73,7 +74,27 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     }
 
     env->mem_io_vaddr = addr;
-    io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+    /* Regions without global locking are dispatched with the iothread
+     * mutex dropped, in the middle of a TB.  The window covers only the
+     * device callback: mr and physaddr were resolved above, and nothing
+     * here touches the TLB or the TB afterwards.  Other threads may still
+     * change this CPU's translation state while it is open, e.g.
+     * tcg_commit() flushing the TLB on a memory map change, or a DMA
+     * write reaching tb_invalidate_phys_page_range() through
+     * invalidate_and_set_dirty().  All of them do so under the iothread
+     * mutex, so they are finished by the time we retake it and before the
+     * generated code looks at the TLB or its own jump targets again.  DMA
+     * invalidation never invalidates the current TB with
+     * is_cpu_write_access set, so the TB we return into stays valid.
+     * The callback itself must not touch guest RAM through the memory
+     * API or the CPU state; see memory_region_clear_global_locking().  */
+    if (mr->global_locking) {
+        io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+    } else {
+        qemu_mutex_unlock_iothread();
+        io_mem_read(mr, physaddr, &val, 1 << SHIFT);
+        qemu_mutex_lock_iothread();
+    }
     return val;
 }
 
@@ -130,7 +151,9 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, READ_ACCESS_TYPE, addr)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -182,7 +205,9 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, READ_ACCESS_TYPE, addr)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -211,7 +236,14 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 
     env->mem_io_vaddr = addr;
     env->mem_io_pc = retaddr;
-    io_mem_write(mr, physaddr, val, 1 << SHIFT);
+    /* See io_read for why the unlocked window is safe.  */
+    if (mr->global_locking) {
+        io_mem_write(mr, physaddr, val, 1 << SHIFT);
+    } else {
+        qemu_mutex_unlock_iothread();
+        io_mem_write(mr, physaddr, val, 1 << SHIFT);
+        qemu_mutex_lock_iothread();
+    }
 }
 
 void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
@@ -262,7 +294,9 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, 1, addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -312,7 +346,9 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index, 1, addr)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
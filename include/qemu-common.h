@@ -276,6 +276,12 @@ typedef struct PCIHostDeviceAddress {
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
 
+/* Save translations of guest code in the given ram_addr_t ranges to
+   'path' on exit and reuse them on the next run.  'fingerprint' names
+   anything besides the QEMU binary that the translations depend on.  */
+void tb_cache_init(const char *path, const char *fingerprint);
+void tb_cache_add_region(uint64_t start, uint64_t size);
+
 void cpu_exec_init_all(void);
 
 /* CPU save/load.  */
@@ -36,6 +36,8 @@
  * bitmap_full(src, nbits)			Are all bits set in *src?
  * bitmap_set(dst, pos, nbits)			Set specified bit area
  * bitmap_clear(dst, pos, nbits)		Clear specified bit area
+ * bitmap_set_atomic(dst, pos, nbits)		Set specified bit area, SMP-safe
+ * bitmap_test_and_clear_atomic(dst, pos, nbits)	Clear area, return if any was set
  * bitmap_find_next_zero_area(buf, len, pos, n, mask)	Find bit free area
  */
 
@@ -213,6 +215,17 @@ static inline int bitmap_intersects(const unsigned long *src1,
 
 void bitmap_set(unsigned long *map, int i, int len);
 void bitmap_clear(unsigned long *map, int start, int nr);
+void bitmap_set_atomic(unsigned long *map, long start, long nr);
+bool bitmap_test_and_clear_atomic(unsigned long *map, long start, long nr);
+static inline unsigned long *bitmap_zero_extend(unsigned long *old,
+                                                long old_nbits, long new_nbits)
+{
+    long new_len = BITS_TO_LONGS(new_nbits) * sizeof(unsigned long);
+    unsigned long *new = g_realloc(old, new_len);
+    bitmap_clear(new, old_nbits, new_nbits - old_nbits);
+    return new;
+}
+
 unsigned long bitmap_find_next_zero_area(unsigned long *map,
 					 unsigned long size,
 					 unsigned long start,
@@ -354,6 +354,15 @@ bool qemu_cpu_has_work(CPUState *cpu);
  */
 bool qemu_cpu_is_self(CPUState *cpu);
 
+/**
+ * qemu_in_vcpu_thread:
+ *
+ * Checks whether the caller is executing guest code on a vCPU thread.
+ *
+ * Returns: %true if called from within a vCPU's execution loop.
+ */
+bool qemu_in_vcpu_thread(void);
+
 /**
  * qemu_cpu_kick:
  * @cpu: The vCPU to kick.
@@ -36,6 +36,7 @@
 #include "sysemu/char.h"
 #include "ui/qemu-spice.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
 #include "monitor/monitor.h"
 #include "monitor/readline.h"
 #include "ui/console.h"
@@ -941,6 +942,21 @@ static void do_info_jit(Monitor *mon, const QDict *qdict)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tlb_stats(Monitor *mon, const QDict *qdict)
+{
+    dump_tlb_stats((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_smc(Monitor *mon, const QDict *qdict)
+{
+    dump_smc_info((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_bql(Monitor *mon, const QDict *qdict)
+{
+    dump_bql_stats((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_history(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -2585,6 +2601,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.cmd = do_info_jit,
     },
+    {
+        .name       = "tlb-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show softmmu TLB statistics",
+        .mhandler.cmd = do_info_tlb_stats,
+    },
+    {
+        .name       = "smc",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show self-modifying code statistics",
+        .mhandler.cmd = do_info_smc,
+    },
+    {
+        .name       = "bql",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show global mutex wait and hold times",
+        .mhandler.cmd = do_info_bql,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -2764,6 +2801,27 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the TPM device",
         .mhandler.cmd = hmp_info_tpm,
     },
+    {
+        .name       = "nv2a",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show NV2A graphics statistics",
+        .mhandler.cmd = hmp_info_nv2a,
+    },
+    {
+        .name       = "apu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show MCPX APU voice processor statistics",
+        .mhandler.cmd = hmp_info_apu,
+    },
+    {
+        .name       = "guest-profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the hottest blocks of guest code",
+        .mhandler.cmd = hmp_info_guest_profile,
+    },
     {
         .name       = NULL,
     },
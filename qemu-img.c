@@ -1443,7 +1443,12 @@ static int img_convert(int argc, char **argv)
             qemu_progress_print(local_progress, 100);
         }
         /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        ret = bdrv_write_compressed(out_bs, 0, NULL, 0);
+        if (ret < 0) {
+            error_report("error while finishing compressed image: %s",
+                         strerror(-ret));
+            goto out;
+        }
     } else {
         int has_zero_init = bdrv_has_zero_init(out_bs);
 
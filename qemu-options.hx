@@ -2902,11 +2902,15 @@ Show cursor.
 ETEXI
 
 DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
-    "-tb-size n      set TB size\n", QEMU_ARCH_ALL)
+    "-tb-size n      set the translated code buffer size to n MB\n",
+    QEMU_ARCH_ALL)
 STEXI
 @item -tb-size @var{n}
 @findex -tb-size
-Set TB size.
+Set the size of the buffer holding translated code to @var{n} MB.  The
+buffer is split into up to 8 regions; when it is full the oldest region is
+discarded rather than all of the translated code.  Use @code{info jit} to
+see how full it is and how often regions are evicted.
 ETEXI
 
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
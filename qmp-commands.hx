@@ -3123,4 +3123,207 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-nv2a-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_nv2a_stats,
+    },
+
+SQMP
+query-nv2a-stats
+----------------
+
+Show emulator-side statistics of the NV2A graphics device.
+
+Return a json-object with the following information:
+
+- "frames": number of frames flipped (json-int)
+- "last-frame": statistics of the last complete frame (json-object)
+- "total": cumulative statistics (json-object)
+
+Each statistics object contains:
+
+- "methods": PGRAPH methods executed (json-int)
+- "pushed-words": command words fetched by the DMA pusher (json-int)
+- "draws": draw calls (json-int)
+- "texture-uploads": textures uploaded to GL (json-int)
+- "shader-compiles": shader cache misses (json-int)
+- "surface-uploads": surfaces copied into GL (json-int)
+- "surface-downloads": surfaces read back from GL (json-int)
+- "cache1-stalls": times the puller blocked on PGRAPH (json-int)
+- "gl-ms": host milliseconds spent in GL (json-number)
+
+Example:
+
+-> { "execute": "query-nv2a-stats" }
+<- { "return": {
+        "frames": 1803,
+        "last-frame": { "methods": 20411, "pushed-words": 20530,
+                        "draws": 212, "texture-uploads": 9,
+                        "shader-compiles": 0, "surface-uploads": 1,
+                        "surface-downloads": 1, "cache1-stalls": 0,
+                        "gl-ms": 4.21 },
+        "total": { "methods": 36123980, "pushed-words": 36301225,
+                   "draws": 371500, "texture-uploads": 22811,
+                   "shader-compiles": 57, "surface-uploads": 1950,
+                   "surface-downloads": 1811, "cache1-stalls": 412,
+                   "gl-ms": 8011.5 }
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-mcpx-apu-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_mcpx_apu_stats,
+    },
+
+SQMP
+query-mcpx-apu-stats
+--------------------
+
+Show statistics of the MCPX APU voice processor.
+
+Return a json-object with the following information:
+
+- "frames": 10ms frames mixed (json-int)
+- "voices": voices processed in the last frame (json-int)
+- "total-voices": voices processed over all frames (json-int)
+- "dsp-ms": host milliseconds taken by the last frame (json-number)
+- "total-dsp-ms": host milliseconds taken by all frames (json-number)
+- "late-frames": frames skipped while the previous was running (json-int)
+- "underruns": output queue underruns while playing (json-int)
+- "thread-load": APU thread busy percentage over the last second
+                 (json-number)
+
+Example:
+
+-> { "execute": "query-mcpx-apu-stats" }
+<- { "return": {
+        "frames": 6000, "voices": 12, "total-voices": 70211,
+        "dsp-ms": 0.31, "total-dsp-ms": 1905.2, "late-frames": 0,
+        "underruns": 0, "thread-load": 1.8
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "xbox-hdd-reset",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_xbox_hdd_reset,
+    },
+
+SQMP
+xbox-hdd-reset
+--------------
+
+Discard everything written to the Xbox HDD overlay and reset the
+machine. The overlay is replaced during the reset, so the guest never
+sees a mix of old and new contents.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "xbox-hdd-reset" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "guest-profile-start",
+        .args_type  = "interval:i?,perf-map:b?",
+        .mhandler.cmd_new = qmp_marshal_input_guest_profile_start,
+    },
+
+SQMP
+guest-profile-start
+-------------------
+
+Start sampling where the vCPUs spend host time.
+
+Arguments:
+
+- "interval": sampling interval in microseconds of vCPU thread CPU time,
+              1000 by default (json-int, optional)
+- "perf-map": write /tmp/perf-<pid>.map for host perf (json-bool, optional)
+
+Example:
+
+-> { "execute": "guest-profile-start", "arguments": { "perf-map": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "guest-profile-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_guest_profile_stop,
+    },
+
+SQMP
+guest-profile-stop
+------------------
+
+Stop sampling. The profile can still be queried.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "guest-profile-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-guest-profile",
+        .args_type  = "count:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_guest_profile,
+    },
+
+SQMP
+query-guest-profile
+-------------------
+
+Show the hottest blocks of guest code.
+
+Arguments:
+
+- "count": number of blocks to return, 20 by default (json-int, optional)
+
+Return a json-object with the following information:
+
+- "running": whether the profiler is sampling (json-bool)
+- "samples": samples taken (json-int)
+- "jit-samples": samples taken in translated code (json-int)
+- "cycles": estimated host cycles covered by the samples (json-int)
+- "entries": a json-array of json-objects, hottest first, each with:
+  - "address": guest address of the block (json-int)
+  - "samples": samples taken in the block (json-int)
+  - "cycles": estimated host cycles spent in the block (json-int)
+  - "executions": times the block was entered, for the hottest blocks
+                  (json-int, optional)
+  - "symbol": XBE section and offset of the address (json-string, optional)
+
+Example:
+
+-> { "execute": "query-guest-profile", "arguments": { "count": 2 } }
+<- { "return": {
+        "running": true, "samples": 30112, "jit-samples": 21907,
+        "cycles": 90336000000,
+        "entries": [
+           { "address": 251744, "samples": 2210, "cycles": 6630000000,
+             "executions": 18630211, "symbol": ".text+0x2c760" },
+           { "address": 2148037584, "samples": 1802,
+             "cycles": 5406000000, "executions": 990412,
+             "symbol": "xboxkrnl+0x773d0" }
+        ]
+      }
+   }
+
 EQMP
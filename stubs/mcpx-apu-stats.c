@@ -0,0 +1,9 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+MCPXAPUStatsInfo *qmp_query_mcpx_apu_stats(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
@@ -0,0 +1,8 @@
+#include "qemu-common.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
+
+void qmp_xbox_hdd_reset(Error **errp)
+{
+    error_set(errp, QERR_UNSUPPORTED);
+}
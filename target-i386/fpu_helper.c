@@ -23,6 +23,11 @@
 #include "qemu/aes.h"
 #include "qemu/host-utils.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#define USE_HOST_SSE
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -33,6 +38,10 @@
 #define FPU_RC_UP           0x800
 #define FPU_RC_CHOP         0xc00
 
+#define FPU_PC_MASK         0x300
+#define FPU_PC_24           0x000
+#define FPU_PC_53           0x200
+
 #define MAXTAN 9223372036854775808.0
 
 /* the following deal with x86 long double-precision numbers */
@@ -121,14 +130,263 @@ static void fpu_set_exception(CPUX86State *env, int mask)
     }
 }
 
+/*
+ * Host FPU fast path.  Direct3D switches the x87 to 53-bit (or 24-bit)
+ * precision with round to nearest and all exceptions masked, which is
+ * exactly how the host's double (float) arithmetic behaves.  If both
+ * operands are representable in the host format and the result is a
+ * normal number, the host result is bit-identical to what softfloat
+ * computes; anything else (extended operands, results that would
+ * overflow or underflow the host format but not floatx80, zero
+ * divisors) goes through softfloat as before.
+ *
+ * This relies on the compiler evaluating float and double expressions
+ * in their own precision, so it is disabled on i387-only hosts.
+ */
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define USE_HOST_FPU
+#endif
+
+enum {
+    FPU_HOST_ADD,
+    FPU_HOST_SUB,
+    FPU_HOST_MUL,
+    FPU_HOST_DIV,
+};
+
+/* precision to run in on the host, or -1 to use softfloat */
+static inline int fpu_host_prec(CPUX86State *env)
+{
+#ifdef USE_HOST_FPU
+    int cw = env->fpuc & (FPU_RC_MASK | FPU_PC_MASK | FPUC_EM);
+
+    if (cw == (FPU_RC_NEAR | FPU_PC_53 | FPUC_EM) ||
+        cw == (FPU_RC_NEAR | FPU_PC_24 | FPUC_EM)) {
+        return cw & FPU_PC_MASK;
+    }
+#endif
+    return -1;
+}
+
+static inline bool floatx80_to_host_double(floatx80 a, double *d)
+{
+    union {
+        double d;
+        uint64_t i;
+    } u;
+    int exp = a.high & 0x7fff;
+
+    u.i = (uint64_t)(a.high & 0x8000) << 48;
+    if (exp != 0 || a.low != 0) {
+        exp -= EXPBIAS - 1023;
+        if (exp <= 0 || exp >= 0x7ff ||
+            !(a.low >> 63) || (a.low & 0x7ff)) {
+            return false;
+        }
+        u.i |= ((uint64_t)exp << 52) | ((a.low << 1) >> 12);
+    }
+    *d = u.d;
+    return true;
+}
+
+static inline bool floatx80_to_host_float(floatx80 a, float *f)
+{
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    int exp = a.high & 0x7fff;
+
+    u.i = (uint32_t)(a.high & 0x8000) << 16;
+    if (exp != 0 || a.low != 0) {
+        exp -= EXPBIAS - 127;
+        if (exp <= 0 || exp >= 0xff ||
+            !(a.low >> 63) || (a.low & 0xffffffffffULL)) {
+            return false;
+        }
+        u.i |= (exp << 23) | (uint32_t)((a.low << 1) >> 41);
+    }
+    *f = u.f;
+    return true;
+}
+
+/* d must be zero or normal */
+static inline floatx80 host_double_to_floatx80(double d)
+{
+    union {
+        double d;
+        uint64_t i;
+    } u;
+    uint16_t sign;
+
+    u.d = d;
+    sign = (u.i >> 48) & 0x8000;
+    if (!(u.i << 1)) {
+        return make_floatx80(sign, 0);
+    }
+    return make_floatx80(sign | (((u.i >> 52) & 0x7ff) + EXPBIAS - 1023),
+                         (1ULL << 63) | (u.i << 11));
+}
+
+/* zero is only exact for add and sub, otherwise it is an underflow */
+#define FPU_HOST_RESULT_OK(op, r) \
+    (isnormal(r) || ((r) == 0 && ((op) == FPU_HOST_ADD || \
+                                  (op) == FPU_HOST_SUB)))
+
+static inline bool fpu_host_op(CPUX86State *env, int op,
+                               floatx80 a, floatx80 b, floatx80 *res)
+{
+    int prec = fpu_host_prec(env);
+
+    if (prec == FPU_PC_53) {
+        double x, y, r;
+
+        if (!floatx80_to_host_double(a, &x) ||
+            !floatx80_to_host_double(b, &y)) {
+            return false;
+        }
+        switch (op) {
+        case FPU_HOST_ADD:
+            r = x + y;
+            break;
+        case FPU_HOST_SUB:
+            r = x - y;
+            break;
+        case FPU_HOST_MUL:
+            r = x * y;
+            break;
+        default:
+            r = x / y;
+            break;
+        }
+        if (!FPU_HOST_RESULT_OK(op, r)) {
+            return false;
+        }
+        *res = host_double_to_floatx80(r);
+        return true;
+    } else if (prec == FPU_PC_24) {
+        float x, y, r;
+
+        if (!floatx80_to_host_float(a, &x) ||
+            !floatx80_to_host_float(b, &y)) {
+            return false;
+        }
+        switch (op) {
+        case FPU_HOST_ADD:
+            r = x + y;
+            break;
+        case FPU_HOST_SUB:
+            r = x - y;
+            break;
+        case FPU_HOST_MUL:
+            r = x * y;
+            break;
+        default:
+            r = x / y;
+            break;
+        }
+        if (!FPU_HOST_RESULT_OK(op, r)) {
+            return false;
+        }
+        *res = host_double_to_floatx80(r);
+        return true;
+    }
+    return false;
+}
+
+static inline floatx80 fpu_add(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (fpu_host_op(env, FPU_HOST_ADD, a, b, &r)) {
+        return r;
+    }
+    return floatx80_add(a, b, &env->fp_status);
+}
+
+static inline floatx80 fpu_sub(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (fpu_host_op(env, FPU_HOST_SUB, a, b, &r)) {
+        return r;
+    }
+    return floatx80_sub(a, b, &env->fp_status);
+}
+
+static inline floatx80 fpu_mul(CPUX86State *env, floatx80 a, floatx80 b)
+{
+    floatx80 r;
+
+    if (fpu_host_op(env, FPU_HOST_MUL, a, b, &r)) {
+        return r;
+    }
+    return floatx80_mul(a, b, &env->fp_status);
+}
+
 static inline floatx80 helper_fdiv(CPUX86State *env, floatx80 a, floatx80 b)
 {
+    floatx80 r;
+
+    /* a zero divisor never gives a normal result, so ZE is still set */
+    if (fpu_host_op(env, FPU_HOST_DIV, a, b, &r)) {
+        return r;
+    }
     if (floatx80_is_zero(b)) {
         fpu_set_exception(env, FPUS_ZE);
     }
     return floatx80_div(a, b, &env->fp_status);
 }
 
+/*
+ * Integer conversion of a value that is an exact double.  Fails for
+ * anything out of range so softfloat produces the integer indefinite.
+ */
+static inline bool fpu_host_to_int(CPUX86State *env, floatx80 a, bool chop,
+                                   double limit, int64_t *val)
+{
+#ifdef USE_HOST_FPU
+    double d;
+
+    if (!chop && (env->fpuc & FPU_RC_MASK) != FPU_RC_NEAR) {
+        return false;
+    }
+    if (!floatx80_to_host_double(a, &d)) {
+        return false;
+    }
+    d = chop ? trunc(d) : rint(d);
+    if (d < -limit || d >= limit) {
+        return false;
+    }
+    *val = (int64_t)d;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Ordered compare of two values that are exact doubles, in the same
+ * encoding as floatx80_compare().  Comparisons do not round, so this
+ * does not depend on the control word.
+ */
+static inline bool fpu_host_compare(floatx80 a, floatx80 b, int *ret)
+{
+#ifdef USE_HOST_FPU
+    double x, y;
+
+    if (!floatx80_to_host_double(a, &x) ||
+        !floatx80_to_host_double(b, &y)) {
+        return false;
+    }
+    *ret = x < y ? float_relation_less :
+           x == y ? float_relation_equal : float_relation_greater;
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void fpu_raise_exception(CPUX86State *env)
 {
     if (env->cr[0] & CR0_NE_MASK) {
@@ -222,9 +480,13 @@ uint32_t helper_fsts_ST0(CPUX86State *env)
 {
     union {
         float32 f;
+        float h;
         uint32_t i;
     } u;
 
+    if (floatx80_to_host_float(ST0, &u.h)) {
+        return u.i;
+    }
     u.f = floatx80_to_float32(ST0, &env->fp_status);
     return u.i;
 }
@@ -233,17 +495,25 @@ uint64_t helper_fstl_ST0(CPUX86State *env)
 {
     union {
         float64 f;
+        double h;
         uint64_t i;
     } u;
 
+    if (floatx80_to_host_double(ST0, &u.h)) {
+        return u.i;
+    }
     u.f = floatx80_to_float64(ST0, &env->fp_status);
     return u.i;
 }
 
 int32_t helper_fist_ST0(CPUX86State *env)
 {
+    int64_t v;
     int32_t val;
 
+    if (fpu_host_to_int(env, ST0, false, 32768.0, &v)) {
+        return v;
+    }
     val = floatx80_to_int32(ST0, &env->fp_status);
     if (val != (int16_t)val) {
         val = -32768;
@@ -253,8 +523,12 @@ int32_t helper_fist_ST0(CPUX86State *env)
 
 int32_t helper_fistl_ST0(CPUX86State *env)
 {
+    int64_t v;
     int32_t val;
 
+    if (fpu_host_to_int(env, ST0, false, 2147483648.0, &v)) {
+        return v;
+    }
     val = floatx80_to_int32(ST0, &env->fp_status);
     return val;
 }
@@ -263,14 +537,21 @@ int64_t helper_fistll_ST0(CPUX86State *env)
 {
     int64_t val;
 
+    if (fpu_host_to_int(env, ST0, false, 9223372036854775808.0, &val)) {
+        return val;
+    }
     val = floatx80_to_int64(ST0, &env->fp_status);
     return val;
 }
 
 int32_t helper_fistt_ST0(CPUX86State *env)
 {
+    int64_t v;
     int32_t val;
 
+    if (fpu_host_to_int(env, ST0, true, 32768.0, &v)) {
+        return v;
+    }
     val = floatx80_to_int32_round_to_zero(ST0, &env->fp_status);
     if (val != (int16_t)val) {
         val = -32768;
@@ -280,8 +561,12 @@ int32_t helper_fistt_ST0(CPUX86State *env)
 
 int32_t helper_fisttl_ST0(CPUX86State *env)
 {
+    int64_t v;
     int32_t val;
 
+    if (fpu_host_to_int(env, ST0, true, 2147483648.0, &v)) {
+        return v;
+    }
     val = floatx80_to_int32_round_to_zero(ST0, &env->fp_status);
     return val;
 }
@@ -290,6 +575,9 @@ int64_t helper_fisttll_ST0(CPUX86State *env)
 {
     int64_t val;
 
+    if (fpu_host_to_int(env, ST0, true, 9223372036854775808.0, &val)) {
+        return val;
+    }
     val = floatx80_to_int64_round_to_zero(ST0, &env->fp_status);
     return val;
 }
@@ -375,7 +663,9 @@ void helper_fcom_ST0_FT0(CPUX86State *env)
 {
     int ret;
 
-    ret = floatx80_compare(ST0, FT0, &env->fp_status);
+    if (!fpu_host_compare(ST0, FT0, &ret)) {
+        ret = floatx80_compare(ST0, FT0, &env->fp_status);
+    }
     env->fpus = (env->fpus & ~0x4500) | fcom_ccval[ret + 1];
 }
 
@@ -383,7 +673,9 @@ void helper_fucom_ST0_FT0(CPUX86State *env)
 {
     int ret;
 
-    ret = floatx80_compare_quiet(ST0, FT0, &env->fp_status);
+    if (!fpu_host_compare(ST0, FT0, &ret)) {
+        ret = floatx80_compare_quiet(ST0, FT0, &env->fp_status);
+    }
     env->fpus = (env->fpus & ~0x4500) | fcom_ccval[ret + 1];
 }
 
@@ -394,7 +686,9 @@ void helper_fcomi_ST0_FT0(CPUX86State *env)
     int eflags;
     int ret;
 
-    ret = floatx80_compare(ST0, FT0, &env->fp_status);
+    if (!fpu_host_compare(ST0, FT0, &ret)) {
+        ret = floatx80_compare(ST0, FT0, &env->fp_status);
+    }
     eflags = cpu_cc_compute_all(env, CC_OP);
     eflags = (eflags & ~(CC_Z | CC_P | CC_C)) | fcomi_ccval[ret + 1];
     CC_SRC = eflags;
@@ -405,7 +699,9 @@ void helper_fucomi_ST0_FT0(CPUX86State *env)
     int eflags;
     int ret;
 
-    ret = floatx80_compare_quiet(ST0, FT0, &env->fp_status);
+    if (!fpu_host_compare(ST0, FT0, &ret)) {
+        ret = floatx80_compare_quiet(ST0, FT0, &env->fp_status);
+    }
     eflags = cpu_cc_compute_all(env, CC_OP);
     eflags = (eflags & ~(CC_Z | CC_P | CC_C)) | fcomi_ccval[ret + 1];
     CC_SRC = eflags;
@@ -413,22 +709,22 @@ void helper_fucomi_ST0_FT0(CPUX86State *env)
 
 void helper_fadd_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_add(ST0, FT0, &env->fp_status);
+    ST0 = fpu_add(env, ST0, FT0);
 }
 
 void helper_fmul_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_mul(ST0, FT0, &env->fp_status);
+    ST0 = fpu_mul(env, ST0, FT0);
 }
 
 void helper_fsub_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_sub(ST0, FT0, &env->fp_status);
+    ST0 = fpu_sub(env, ST0, FT0);
 }
 
 void helper_fsubr_ST0_FT0(CPUX86State *env)
 {
-    ST0 = floatx80_sub(FT0, ST0, &env->fp_status);
+    ST0 = fpu_sub(env, FT0, ST0);
 }
 
 void helper_fdiv_ST0_FT0(CPUX86State *env)
@@ -445,22 +741,22 @@ void helper_fdivr_ST0_FT0(CPUX86State *env)
 
 void helper_fadd_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_add(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = fpu_add(env, ST(st_index), ST0);
 }
 
 void helper_fmul_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_mul(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = fpu_mul(env, ST(st_index), ST0);
 }
 
 void helper_fsub_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_sub(ST(st_index), ST0, &env->fp_status);
+    ST(st_index) = fpu_sub(env, ST(st_index), ST0);
 }
 
 void helper_fsubr_STN_ST0(CPUX86State *env, int st_index)
 {
-    ST(st_index) = floatx80_sub(ST0, ST(st_index), &env->fp_status);
+    ST(st_index) = fpu_sub(env, ST0, ST(st_index));
 }
 
 void helper_fdiv_STN_ST0(CPUX86State *env, int st_index)
@@ -225,6 +225,11 @@ void helper_invlpg(CPUX86State *env, target_ulong addr)
     tlb_flush_page(env, addr);
 }
 
+void *helper_lookup_tb_ptr(CPUX86State *env)
+{
+    return tb_lookup_code_ptr(env);
+}
+
 void helper_rdtsc(CPUX86State *env)
 {
     uint64_t val;
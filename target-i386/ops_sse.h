@@ -576,9 +576,93 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
 /* FPU ops */
 /* XXX: not accurate */
 
+#ifdef USE_HOST_SSE
+/* With MXCSR at its reset value (round to nearest, no DAZ or FZ, all
+ * exceptions masked) the host SSE unit computes exactly what softfloat
+ * does, except for the choice of NaN.  Run the operation natively and
+ * only go through softfloat if a lane came out as a NaN.
+ */
+#define SSE_MXCSR_DEFAULT 0x1f80
+
+static inline bool sse_host_default(CPUX86State *env)
+{
+    return (env->mxcsr & 0xffc0) == SSE_MXCSR_DEFAULT;
+}
+
+#define SSE_HOST_OP(name)                                               \
+    static inline __m128 sse_host_ ## name ## ps(__m128 a, __m128 b)    \
+    {                                                                   \
+        return _mm_ ## name ## _ps(a, b);                               \
+    }                                                                   \
+    static inline __m128 sse_host_ ## name ## ss(__m128 a, __m128 b)    \
+    {                                                                   \
+        return _mm_ ## name ## _ss(a, b);                               \
+    }                                                                   \
+    static inline __m128d sse_host_ ## name ## pd(__m128d a, __m128d b) \
+    {                                                                   \
+        return _mm_ ## name ## _pd(a, b);                               \
+    }                                                                   \
+    static inline __m128d sse_host_ ## name ## sd(__m128d a, __m128d b) \
+    {                                                                   \
+        return _mm_ ## name ## _sd(a, b);                               \
+    }
+
+SSE_HOST_OP(add)
+SSE_HOST_OP(sub)
+SSE_HOST_OP(mul)
+SSE_HOST_OP(div)
+SSE_HOST_OP(min)
+SSE_HOST_OP(max)
+
+/* sqrt only reads its second operand */
+static inline __m128 sse_host_sqrtps(__m128 a, __m128 b)
+{
+    return _mm_sqrt_ps(b);
+}
+
+static inline __m128 sse_host_sqrtss(__m128 a, __m128 b)
+{
+    return _mm_move_ss(a, _mm_sqrt_ss(b));
+}
+
+static inline __m128d sse_host_sqrtpd(__m128d a, __m128d b)
+{
+    return _mm_sqrt_pd(b);
+}
+
+static inline __m128d sse_host_sqrtsd(__m128d a, __m128d b)
+{
+    return _mm_sqrt_sd(a, b);
+}
+
+#define SSE_HOST_S(op, d, s, lanes)                                     \
+    if (sse_host_default(env)) {                                        \
+        __m128 r = sse_host_ ## op(_mm_loadu_ps((float *)(d)),          \
+                                   _mm_loadu_ps((float *)(s)));         \
+        if (!(_mm_movemask_ps(_mm_cmpunord_ps(r, r)) & (lanes))) {      \
+            _mm_storeu_ps((float *)(d), r);                             \
+            return;                                                     \
+        }                                                               \
+    }
+
+#define SSE_HOST_D(op, d, s, lanes)                                     \
+    if (sse_host_default(env)) {                                        \
+        __m128d r = sse_host_ ## op(_mm_loadu_pd((double *)(d)),        \
+                                    _mm_loadu_pd((double *)(s)));       \
+        if (!(_mm_movemask_pd(_mm_cmpunord_pd(r, r)) & (lanes))) {      \
+            _mm_storeu_pd((double *)(d), r);                            \
+            return;                                                     \
+        }                                                               \
+    }
+#else
+#define SSE_HOST_S(op, d, s, lanes)
+#define SSE_HOST_D(op, d, s, lanes)
+#endif
+
 #define SSE_HELPER_S(name, F)                                           \
     void helper_ ## name ## ps(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
+        SSE_HOST_S(name ## ps, d, s, 0xf)                               \
         d->XMM_S(0) = F(32, d->XMM_S(0), s->XMM_S(0));                  \
         d->XMM_S(1) = F(32, d->XMM_S(1), s->XMM_S(1));                  \
         d->XMM_S(2) = F(32, d->XMM_S(2), s->XMM_S(2));                  \
@@ -587,17 +671,20 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
                                                                         \
     void helper_ ## name ## ss(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
+        SSE_HOST_S(name ## ss, d, s, 0x1)                               \
         d->XMM_S(0) = F(32, d->XMM_S(0), s->XMM_S(0));                  \
     }                                                                   \
                                                                         \
     void helper_ ## name ## pd(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
+        SSE_HOST_D(name ## pd, d, s, 0x3)                               \
         d->XMM_D(0) = F(64, d->XMM_D(0), s->XMM_D(0));                  \
         d->XMM_D(1) = F(64, d->XMM_D(1), s->XMM_D(1));                  \
     }                                                                   \
                                                                         \
     void helper_ ## name ## sd(CPUX86State *env, Reg *d, Reg *s)        \
     {                                                                   \
+        SSE_HOST_D(name ## sd, d, s, 0x1)                               \
         d->XMM_D(0) = F(64, d->XMM_D(0), s->XMM_D(0));                  \
     }
 
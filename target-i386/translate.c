@@ -2824,6 +2824,25 @@ static void gen_eob(DisasContext *s)
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* end of block after an indirect jump within the same code segment:
+   jump straight to the target TB if it is in the jump cache */
+static void gen_jr(DisasContext *s)
+{
+    TCGv_ptr ptr;
+
+    if (!TCG_TARGET_HAS_goto_ptr || s->singlestep_enabled || s->tf ||
+        (s->tb->flags & (HF_INHIBIT_IRQ_MASK | HF_RF_MASK))) {
+        gen_eob(s);
+        return;
+    }
+    gen_update_cc_op(s);
+    ptr = tcg_temp_new_ptr();
+    gen_helper_lookup_tb_ptr(ptr, cpu_env);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+    s->is_jmp = DISAS_TB_JUMP;
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -3234,6 +3253,42 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* sqrt, add, mul, sub, min, div and max in their ps/pd/ss/sd forms are
+   encoded the same on the host.  When MXCSR is at its reset value, run
+   them directly on the XMM registers in env, and only call the helper
+   if a lane came out as a NaN (see SSE_HOST_S in ops_sse.h).  */
+static bool gen_sse_env(int b, int b1, int op1_offset, int op2_offset,
+                        SSEFunc_0_epp sse_fn_epp)
+{
+#if TCG_TARGET_HAS_sse_env
+    int label_slow, label_done;
+
+    switch (b) {
+    case 0x51:
+    case 0x58 ... 0x59:
+    case 0x5c ... 0x5f:
+        break;
+    default:
+        return false;
+    }
+    label_slow = gen_new_label();
+    label_done = gen_new_label();
+    tcg_gen_ld_i32(cpu_tmp2_i32, cpu_env, offsetof(CPUX86State, mxcsr));
+    tcg_gen_andi_i32(cpu_tmp2_i32, cpu_tmp2_i32, 0xffc0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, cpu_tmp2_i32, 0x1f80, label_slow);
+    tcg_gen_sse_env_i32(cpu_tmp2_i32, b | (b1 << 8), op1_offset, op2_offset);
+    tcg_gen_brcondi_i32(TCG_COND_EQ, cpu_tmp2_i32, 0, label_done);
+    gen_set_label(label_slow);
+    tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
+    tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
+    sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
+    gen_set_label(label_done);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4650,6 +4705,10 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (is_xmm &&
+                gen_sse_env(b, b1, op1_offset, op2_offset, sse_fn_epp)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -5213,7 +5272,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -5239,7 +5298,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -6740,7 +6799,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6748,7 +6807,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -252,6 +252,8 @@ static inline int tcg_target_const_match(tcg_target_long val,
 # define P_REXB_RM	0
 # define P_GS           0
 #endif
+#define P_SIMDF3        0x8000          /* 0xf3 opcode prefix */
+#define P_SIMDF2        0x10000         /* 0xf2 opcode prefix */
 
 #define OPC_ARITH_EvIz	(0x81)
 #define OPC_ARITH_EvIb	(0x83)
@@ -260,6 +262,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
+#define OPC_CMPPS       (0xc2 | P_EXT)
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
@@ -275,6 +278,10 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
 #define OPC_MOVB_EvIz   (0xc6)
+#define OPC_MOVAPS_VxWx (0x28 | P_EXT)
+#define OPC_MOVMSKPS    (0x50 | P_EXT)
+#define OPC_MOVUPS_VxWx (0x10 | P_EXT)
+#define OPC_MOVUPS_WxVx (0x11 | P_EXT)
 #define OPC_MOVL_EvIz	(0xc7)
 #define OPC_MOVL_Iv     (0xb8)
 #define OPC_MOVSBL	(0xbe | P_EXT)
@@ -377,6 +384,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) >> 8;		/* REX.W */
@@ -407,6 +419,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & P_EXT) {
         tcg_out8(s, 0x0f);
     }
@@ -975,15 +992,33 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 }
 #endif
 
+/* Load a host address.  With the persistent TB cache this is always a
+   movabs, whose immediate the cache can relocate.  */
+static void tcg_out_movi_ptr(TCGContext *s, TCGReg ret,
+                             tcg_target_long arg, bool branch)
+{
+#if TCG_TARGET_HAS_persist
+    if (s->persist && arg != 0) {
+        tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+        tcg_persist_reloc(s, s->code_ptr, true, branch, arg);
+        tcg_out32(s, arg);
+        tcg_out32(s, arg >> 31 >> 1);
+        return;
+    }
+#endif
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+}
+
 static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 {
     tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        tcg_persist_reloc(s, s->code_ptr, false, true, dest);
         tcg_out32(s, disp);
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
+        tcg_out_movi_ptr(s, TCG_REG_R10, dest, true);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
@@ -1662,6 +1697,42 @@ void tcg_out_tb_finalize(TCGContext *s)
 }
 #endif  /* CONFIG_SOFTMMU */
 
+#if TCG_TARGET_HAS_sse_env
+/* 'insn' is the guest SSE opcode byte, plus its mandatory prefix in
+   bits 8..9 (none, 0x66, 0xf3, 0xf2), which is also the host encoding.
+   Compute d = d OP s on the XMM registers at those offsets in env and
+   set ret to the mask of result lanes that are NaN.  d is only written
+   back if that mask is zero.  xmm0 and xmm1 are never allocated by TCG
+   and are clobbered by every helper call anyway.  */
+static void tcg_out_sse_env(TCGContext *s, TCGReg ret, int insn,
+                            tcg_target_long d, tcg_target_long src)
+{
+    static const int prefix[4] = { 0, P_DATA16, P_SIMDF3, P_SIMDF2 };
+    static const int lanes[4] = { 0xf, 0x3, 0x1, 0x1 };
+    int kind = (insn >> 8) & 3;
+    int pd = kind & 1 ? P_DATA16 : 0;
+    uint8_t *label_ptr;
+
+    tcg_out_modrm_offset(s, OPC_MOVUPS_VxWx, 0, TCG_AREG0, d);
+    tcg_out_modrm_offset(s, OPC_MOVUPS_VxWx, 1, TCG_AREG0, src);
+    tcg_out_modrm(s, (insn & 0xff) | P_EXT | prefix[kind], 0, 1);
+
+    /* cmpunordps/pd %xmm1, %xmm1 on a copy of the result */
+    tcg_out_modrm(s, OPC_MOVAPS_VxWx, 1, 0);
+    tcg_out_modrm(s, OPC_CMPPS | pd, 1, 1);
+    tcg_out8(s, 3);
+    tcg_out_modrm(s, OPC_MOVMSKPS | pd, ret, 1);
+    tcg_out_modrm(s, OPC_ARITH_EvIb, ARITH_AND, ret);
+    tcg_out8(s, lanes[kind]);
+
+    tcg_out8(s, OPC_JCC_short + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr++;
+    tcg_out_modrm_offset(s, OPC_MOVUPS_WxVx, 0, TCG_AREG0, d);
+    *label_ptr = s->code_ptr - label_ptr - 1;
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1679,9 +1750,18 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_ptr(s, TCG_REG_EAX, args[0], false);
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
+#if TCG_TARGET_HAS_sse_env
+    case INDEX_op_sse_env_i32:
+        tcg_out_sse_env(s, args[0], args[1], args[2], args[3]);
+        break;
+#endif
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
             /* direct jump method */
@@ -2033,6 +2113,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+#if TCG_TARGET_HAS_sse_env
+    { INDEX_op_sse_env_i32, { "r" } },
+#endif
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2253,6 +2337,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr: no TB to chain to.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -96,6 +96,10 @@ typedef enum {
 #define TCG_TARGET_HAS_sub2_i32         1
 #define TCG_TARGET_HAS_mulu2_i32        1
 #define TCG_TARGET_HAS_muls2_i32        1
+#define TCG_TARGET_HAS_goto_ptr        1
+/* SSE arithmetic on guest registers in env; x86_64 always has SSE2 */
+#define TCG_TARGET_HAS_sse_env         (TCG_TARGET_REG_BITS == 64)
+#define TCG_TARGET_HAS_persist         (TCG_TARGET_REG_BITS == 64)
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
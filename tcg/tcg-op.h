@@ -2616,6 +2616,31 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to host code at 'ptr', which is either the start of a TB or
+   tcg_ctx.code_gen_epilogue (returning 0 to cpu_exec).  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#else
+    tcg_gen_op1_i64(INDEX_op_goto_ptr, TCGV_PTR_TO_NAT(ptr));
+#endif
+}
+
+/* Run the SSE arithmetic instruction 'insn' (opcode byte, mandatory
+   prefix in bits 8..9) on the XMM registers at env offsets d and s.
+   ret is set to the mask of NaN result lanes; d is only updated if it
+   is zero.  Only for hosts with TCG_TARGET_HAS_sse_env.  */
+static inline void tcg_gen_sse_env_i32(TCGv_i32 ret, int insn,
+                                       tcg_target_long d, tcg_target_long s)
+{
+    *tcg_ctx.gen_opc_ptr++ = INDEX_op_sse_env_i32;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_I32(ret);
+    *tcg_ctx.gen_opparam_ptr++ = insn;
+    *tcg_ctx.gen_opparam_ptr++ = d;
+    *tcg_ctx.gen_opparam_ptr++ = s;
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -2397,6 +2397,61 @@ int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
     return tcg_gen_code_common(s, gen_code_buf, offset);
 }
 
+#ifdef CONFIG_LINUX
+/* provided by the linker */
+extern const char __executable_start[], etext[];
+#endif
+
+/* Called by the backend for each host address it embeds in a TB.
+   'field' is the immediate or displacement being emitted.  Addresses
+   that cannot be expressed relative to something that is known when
+   the TB is loaded again make the TB unsuitable for saving.  */
+void tcg_persist_reloc(TCGContext *s, uint8_t *field, bool abs64, bool branch,
+                       tcg_target_long value)
+{
+    uintptr_t v = value;
+    TCGPersistReloc *r;
+    uintptr_t base;
+    int kind;
+
+    if (!s->persist_record) {
+        return;
+    }
+    if (!abs64 && v >= (uintptr_t)s->code_buf && v <= (uintptr_t)s->code_ptr) {
+        /* pc-relative within the TB itself */
+        return;
+    }
+
+    if (v >= (uintptr_t)s->code_gen_prologue &&
+        v < (uintptr_t)s->code_gen_buffer + s->code_gen_buffer_size + 1024) {
+        kind = TCG_PERSIST_PROLOGUE;
+        base = (uintptr_t)s->code_gen_prologue;
+    } else if (v >= s->persist_tb && v <= s->persist_tb + TB_EXIT_MASK) {
+        kind = TCG_PERSIST_TB;
+        base = s->persist_tb;
+#ifdef CONFIG_LINUX
+    } else if (v >= (uintptr_t)__executable_start && v < (uintptr_t)etext) {
+        kind = TCG_PERSIST_TEXT;
+        base = (uintptr_t)__executable_start;
+#endif
+    } else {
+        s->persist_failed = true;
+        return;
+    }
+
+    if (s->nb_persist_relocs == s->max_persist_relocs) {
+        s->max_persist_relocs = MAX(64, s->max_persist_relocs * 2);
+        s->persist_relocs = g_renew(TCGPersistReloc, s->persist_relocs,
+                                    s->max_persist_relocs);
+    }
+    r = &s->persist_relocs[s->nb_persist_relocs++];
+    r->offset = field - s->code_buf;
+    r->base = kind;
+    r->abs64 = abs64;
+    r->branch = branch;
+    r->addend = v - base;
+}
+
 #ifdef CONFIG_PROFILER
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
@@ -398,6 +398,23 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* A host code address embedded in a TB, recorded while the TB is
+   generated so that the persistent TB cache can save it and load it
+   back at another address.  */
+typedef enum TCGPersistBase {
+    TCG_PERSIST_TEXT,       /* QEMU's own code, e.g. a helper */
+    TCG_PERSIST_PROLOGUE,   /* the prologue and epilogue */
+    TCG_PERSIST_TB,         /* the TranslationBlock, from exit_tb */
+} TCGPersistBase;
+
+typedef struct TCGPersistReloc {
+    uint32_t offset;        /* of the field from the start of the TB code */
+    uint8_t base;           /* TCGPersistBase */
+    uint8_t abs64;          /* 64 bit absolute, else 32 bit pc-relative */
+    uint8_t branch;         /* abs64 used because rel32 was out of range */
+    int64_t addend;         /* from base */
+} TCGPersistReloc;
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -415,6 +432,8 @@ struct TCGContext {
     uintptr_t *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
+    /* counter the TB increments on entry, or NULL */
+    uint64_t *tb_exec_count;
 
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
@@ -476,14 +495,27 @@ struct TCGContext {
     /* Code generation */
     int code_gen_max_blocks;
     uint8_t *code_gen_prologue;
+    /* entry to the prologue's exit path that returns 0, for goto_ptr */
+    uint8_t *code_gen_epilogue;
     uint8_t *code_gen_buffer;
     size_t code_gen_buffer_size;
-    /* threshold to flush the translated code buffer */
-    size_t code_gen_buffer_max_size;
     uint8_t *code_gen_ptr;
 
     TBContext tb_ctx;
 
+    /* persistent TB cache: only use encodings that do not depend on
+       where the code and the TB end up, so that a TB loaded from the
+       cache matches what a retranslation for search_pc produces.
+       Taken from TranslationBlock.persist for each TB.  */
+    bool persist;
+    /* record the relocations of the TB being generated */
+    bool persist_record;
+    bool persist_failed;
+    uintptr_t persist_tb;
+    TCGPersistReloc *persist_relocs;
+    int nb_persist_relocs;
+    int max_persist_relocs;
+
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* labels info for qemu_ld/st IRs
        The labels help to generate TLB miss case codes at the end of TB */
@@ -521,6 +553,8 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf);
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset);
+void tcg_persist_reloc(TCGContext *s, uint8_t *field, bool abs64, bool branch,
+                       tcg_target_long value);
 
 void tcg_set_frame(TCGContext *s, int reg,
                    tcg_target_long start, tcg_target_long size);
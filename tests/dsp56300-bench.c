@@ -0,0 +1,177 @@
+/*
+ * DSP56300 interpreter micro-benchmark
+ *
+ * Runs small DSP programs shaped like the MCPX GP's effect loops and
+ * reports host CPU cycles per emulated DSP cycle. Each program also
+ * checks its result so a broken interpreter does not look fast.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "hw/xbox/dsp56300.h"
+
+/* a GP frame is 32 samples at 48kHz with the DSP at 160MHz */
+#define FRAME_CYCLES (160000000 / (48000 / 32))
+
+typedef struct Program {
+    const char *name;
+    const uint32_t *code;
+    size_t len;
+    bool (*check)(DSPState *s);
+} Program;
+
+/*
+ * fir:
+ *     move #0,r0
+ *     move #0,r4
+ *     clr a      x:(r0)+,x0  y:(r4)+,y0
+ *     do #64,end
+ *     mac x0,y0,a x:(r0)+,x0 y:(r4)+,y0
+ * end:
+ *     move a,x:$100
+ *     jmp fir
+ */
+static const uint32_t fir_code[] = {
+    0x300000, 0x340000, 0xF09813, 0x064080, 0x000005,
+    0xF098D2, 0x567000, 0x000100, 0x0C0000,
+};
+
+static bool fir_check(DSPState *s)
+{
+    int64_t acc = 0;
+    int i;
+    for (i = 0; i < 64; i++) {
+        acc += (int64_t)((int32_t)(s->x[i] << 8) >> 8)
+               * ((int32_t)(s->y[i] << 8) >> 8) * 2;
+    }
+    return s->x[0x100] == ((acc >> 24) & 0xFFFFFF);
+}
+
+/*
+ * rectify:
+ *     move #0,r0
+ *     do #32,end
+ *     move x:(r0),a
+ *     asl a
+ *     jpl end
+ *     neg a
+ * end:
+ *     move a,x:(r0)+
+ *     jmp rectify
+ */
+static const uint32_t rectify_code[] = {
+    0x300000, 0x062080, 0x000007, 0x56E000, 0x200032,
+    0x0E3007, 0x200036, 0x565800, 0x0C0000,
+};
+
+static bool rectify_check(DSPState *s)
+{
+    int i;
+    /* after enough passes everything has saturated positive */
+    for (i = 0; i < 32; i++) {
+        if (s->x[i] != 0x7FFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * dot:
+ *     move #0,r0
+ *     move #0,r4
+ *     clr a      x:(r0)+,x0  y:(r4)+,y0
+ *     rep #63
+ *     mac x0,y0,a x:(r0)+,x0 y:(r4)+,y0
+ *     jmp dot
+ */
+static const uint32_t dot_code[] = {
+    0x300000, 0x340000, 0xF09813, 0x063FA0, 0xF098D2, 0x0C0000,
+};
+
+static bool dot_check(DSPState *s)
+{
+    int64_t acc = 0;
+    int i;
+    for (i = 0; i < 63; i++) {
+        acc += (int64_t)((int32_t)(s->x[i] << 8) >> 8)
+               * ((int32_t)(s->y[i] << 8) >> 8) * 2;
+    }
+    return s->a == acc;
+}
+
+static const Program programs[] = {
+    { "fir", fir_code, ARRAY_SIZE(fir_code), fir_check },
+    { "rectify", rectify_code, ARRAY_SIZE(rectify_code), rectify_check },
+    { "dot", dot_code, ARRAY_SIZE(dot_code), dot_check },
+};
+
+static bool run_program(DSPState *s, const Program *prog, int frames)
+{
+    int64_t ticks, ns;
+    uint64_t cycles = 0;
+    size_t i;
+    int f;
+
+    dsp56300_init(s);
+    srand(1);
+    for (i = 0; i < 64; i++) {
+        dsp56300_write_memory(s, DSP_SPACE_X, i, (rand() & 0xFFFF) - 0x8000);
+        dsp56300_write_memory(s, DSP_SPACE_Y, i, (rand() & 0xFFFF) - 0x8000);
+    }
+    for (i = 0; i < prog->len; i++) {
+        dsp56300_write_memory(s, DSP_SPACE_P, i, prog->code[i]);
+    }
+
+    ticks = cpu_get_real_ticks();
+    ns = get_clock();
+    for (f = 0; f < frames && !s->stopped; f++) {
+        cycles += dsp56300_run(s, FRAME_CYCLES);
+    }
+    ticks = cpu_get_real_ticks() - ticks;
+    ns = get_clock() - ns;
+
+    /* stop at a known point for the check */
+    while (s->pc != 0 && !s->stopped) {
+        dsp56300_run(s, 1);
+    }
+
+    if (s->stopped) {
+        printf("%-8s illegal instruction 0x%06x\n", prog->name,
+               s->illegal_opcode);
+        return false;
+    }
+    if (!prog->check(s)) {
+        printf("%-8s wrong result\n", prog->name);
+        return false;
+    }
+    printf("%-8s %10" PRIu64 " DSP cycles  %6.2f host cycles/DSP cycle"
+           "  %7.1f DSP MHz\n",
+           prog->name, cycles, (double)ticks / cycles,
+           cycles * 1000.0 / ns);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 150;
+    DSPState *s = g_malloc(sizeof(*s));
+    bool ok = true;
+    size_t i;
+
+    printf("%d frames of %d cycles (real time: 160.0 DSP MHz)\n",
+           frames, FRAME_CYCLES);
+    for (i = 0; i < ARRAY_SIZE(programs); i++) {
+        ok &= run_program(s, &programs[i], frames);
+    }
+
+    g_free(s);
+    return ok ? 0 : 1;
+}
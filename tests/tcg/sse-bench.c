@@ -0,0 +1,115 @@
+/*
+ * Packed single-precision SSE throughput test
+ *
+ * Transforms and skins a batch of vertices the way D3DX-style vertex
+ * code does (mulps/addps/shufps on 4x4 matrices) and prints the time
+ * taken and a checksum, so native and emulated runs can be compared.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <xmmintrin.h>
+
+#define NB_VERTS 4096
+#define NB_BONES 4
+
+typedef struct {
+    __m128 row[4];
+} Matrix;
+
+static float verts[NB_VERTS][4] __attribute__((aligned(16)));
+static float weights[NB_VERTS][4] __attribute__((aligned(16)));
+static float out[NB_VERTS][4] __attribute__((aligned(16)));
+static Matrix bones[NB_BONES];
+
+static inline __m128 transform(const Matrix *m, __m128 v)
+{
+    __m128 r;
+
+    r = _mm_mul_ps(_mm_shuffle_ps(v, v, 0x00), m->row[0]);
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, 0x55), m->row[1]));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, 0xaa), m->row[2]));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, 0xff), m->row[3]));
+    return r;
+}
+
+static void skin(void)
+{
+    int i;
+
+    for (i = 0; i < NB_VERTS; i++) {
+        __m128 v = _mm_load_ps(verts[i]);
+        __m128 w = _mm_load_ps(weights[i]);
+        __m128 r;
+
+        r = _mm_mul_ps(transform(&bones[0], v), _mm_shuffle_ps(w, w, 0x00));
+        r = _mm_add_ps(r, _mm_mul_ps(transform(&bones[1], v),
+                                     _mm_shuffle_ps(w, w, 0x55)));
+        r = _mm_add_ps(r, _mm_mul_ps(transform(&bones[2], v),
+                                     _mm_shuffle_ps(w, w, 0xaa)));
+        r = _mm_add_ps(r, _mm_mul_ps(transform(&bones[3], v),
+                                     _mm_shuffle_ps(w, w, 0xff)));
+        _mm_store_ps(out[i], r);
+    }
+}
+
+static int64_t get_clock(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+    int loops = argc > 1 ? atoi(argv[1]) : 200;
+    int64_t ti;
+    uint32_t sum = 0;
+    int i, j;
+
+    srand(1);
+    for (i = 0; i < NB_VERTS; i++) {
+        for (j = 0; j < 4; j++) {
+            verts[i][j] = (rand() & 0xffff) / 256.0f - 128.0f;
+            weights[i][j] = 0.25f;
+        }
+        verts[i][3] = 1.0f;
+    }
+    /* scale and translate */
+    for (i = 0; i < NB_BONES; i++) {
+        float s = 1.0f + i * 0.1f;
+
+        bones[i].row[0] = _mm_set_ps(0, 0, 0, s);
+        bones[i].row[1] = _mm_set_ps(0, 0, s, 0);
+        bones[i].row[2] = _mm_set_ps(0, s, 0, 0);
+        bones[i].row[3] = _mm_set_ps(1, i * 3.0f, i * 2.0f, i * 1.0f);
+    }
+
+    ti = get_clock();
+    for (i = 0; i < loops; i++) {
+        skin();
+    }
+    ti = get_clock() - ti;
+
+    for (i = 0; i < NB_VERTS; i++) {
+        for (j = 0; j < 4; j++) {
+            union {
+                float f;
+                uint32_t i;
+            } u;
+            u.f = out[i][j];
+            sum = sum * 31 + u.i;
+        }
+    }
+    printf("checksum %08x\n", sum);
+    printf("%d loops of %d vertices: %0.3f ms, %0.1f Mvertices/s\n",
+           loops, NB_VERTS, ti / 1000.0,
+           (double)loops * NB_VERTS / ti);
+    return 0;
+}
@@ -1002,6 +1002,106 @@ void test_fcmov(void)
     TEST_FCMOV(a, b, CC_P, "nu");
 }
 
+/* arithmetic with reduced precision control, as Direct3D sets it up.
+   Exception flags are cleared around the operation so that a control
+   word with unmasked exceptions never leaves one pending for fldcw. */
+#define TEST_FPREC(op, a, b, cw)\
+{\
+    uint16_t save_cw;\
+    long double r;\
+    asm volatile ("fnstcw %1\n"\
+                  "fnclex\n"\
+                  "fldcw %3\n"\
+                  op " %4\n"\
+                  "fnclex\n"\
+                  "fldcw %1\n"\
+                  : "=t" (r), "=m" (save_cw)\
+                  : "0" (a), "m" (cw), "m" (b));\
+    print_fprec(op, cw, a, b, r);\
+}
+
+#define TEST_FPREC_REG(name, op, a, b, cw)\
+{\
+    uint16_t save_cw;\
+    long double r, r1;\
+    asm volatile ("fnstcw %2\n"\
+                  "fnclex\n"\
+                  "fldcw %5\n"\
+                  op "\n"\
+                  "fnclex\n"\
+                  "fldcw %2\n"\
+                  : "=t" (r), "=u" (r1), "=m" (save_cw)\
+                  : "0" ((long double)(a)), "1" ((long double)(b)), "m" (cw));\
+    print_fprec(name, cw, a, b, r);\
+    print_fprec(name, cw, a, b, r1);\
+}
+
+union float80u {
+    long double d;
+    struct {
+        uint64_t mant;
+        uint16_t exp;
+    } l;
+};
+
+void print_fprec(const char *op, uint16_t cw, long double a, double b,
+                 long double r)
+{
+    union float80u u;
+
+    u.d = r;
+    printf("%-22s cw=%04x a=%Lg b=%g r=%04x" FMT64X "\n",
+           op, cw, a, b, u.l.exp, u.l.mant);
+}
+
+void test_fprec(void)
+{
+    static const uint16_t cws[] = { 0x027f, 0x007f, 0x037f, 0x0e7f, 0x0272 };
+    long double pi, third;
+    double b;
+    int i;
+
+    asm("fldpi" : "=t" (pi));
+    third = 1.0 / 3.0;
+    for (i = 0; i < sizeof(cws) / sizeof(cws[0]); i++) {
+        uint16_t cw = cws[i];
+
+        /* exact double operands */
+        b = 3.0;
+        TEST_FPREC("faddl", third, b, cw);
+        TEST_FPREC("fsubl", third, b, cw);
+        TEST_FPREC("fsubrl", third, b, cw);
+        TEST_FPREC("fmull", third, b, cw);
+        TEST_FPREC("fdivl", third, b, cw);
+        TEST_FPREC("fdivrl", third, b, cw);
+        b = 1.0 / 3.0;
+        TEST_FPREC("fsubl", third, b, cw);
+        b = 0.1;
+        TEST_FPREC_REG("fadd st1,st", "fadd %%st(1), %%st", third, b, cw);
+        TEST_FPREC_REG("fmul st,st1", "fmul %%st, %%st(1)", third, b, cw);
+        /* extended operand */
+        b = 7.0;
+        TEST_FPREC("faddl", pi, b, cw);
+        TEST_FPREC("fdivl", pi, b, cw);
+        /* results outside the double range; an unmasked overflow
+           delivers a rebiased result that we do not model */
+        if (cw & 0x08) {
+            b = 1e300;
+            TEST_FPREC("fmull", (long double)1e300, b, cw);
+        }
+        b = 1e-300;
+        TEST_FPREC("fmull", (long double)1e-300, b, cw);
+        b = 1e-310;
+        TEST_FPREC("faddl", (long double)1e-310, b, cw);
+        /* division by zero, which leaves the destination alone when
+           ZE is unmasked */
+        if (cw & 0x04) {
+            b = 0.0;
+            TEST_FPREC("fdivl", third, b, cw);
+        }
+    }
+}
+
 void test_floats(void)
 {
     test_fops(2, 3);
@@ -1026,6 +1126,7 @@ void test_floats(void)
     test_fbcd(1234567890123456.0);
     test_fbcd(-123451234567890.0);
     test_fenv();
+    test_fprec();
     if (TEST_CMOV) {
         test_fcmov();
     }
@@ -0,0 +1,108 @@
+/*
+ * Test bitmap range routines
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include "qemu/bitmap.h"
+
+#define BMAP_BITS   (BITS_PER_LONG * 5)
+
+typedef struct {
+    long start;
+    long nr;
+} RangeTest;
+
+/* unaligned heads and tails, single words, exact words and long runs */
+static const RangeTest test_ranges[] = {
+    { 0, 1 },
+    { 3, 5 },
+    { 0, BITS_PER_LONG },
+    { 1, BITS_PER_LONG - 1 },
+    { 1, BITS_PER_LONG },
+    { BITS_PER_LONG - 1, 2 },
+    { BITS_PER_LONG, BITS_PER_LONG * 2 },
+    { 7, BITS_PER_LONG * 3 },
+    { 7, BITS_PER_LONG * 4 - 9 },
+    { 0, BMAP_BITS },
+};
+
+/* check that exactly the bits in [start, start + nr) equal @inside */
+static void check_range(const unsigned long *map, long start, long nr,
+                        bool inside)
+{
+    long i;
+
+    for (i = 0; i < BMAP_BITS; i++) {
+        bool in_range = i >= start && i < start + nr;
+        g_assert_cmpint(test_bit(i, map), ==, in_range == inside);
+    }
+}
+
+static void test_set_atomic(void)
+{
+    unsigned long *map = bitmap_new(BMAP_BITS);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ranges); i++) {
+        const RangeTest *test = &test_ranges[i];
+
+        bitmap_zero(map, BMAP_BITS);
+        bitmap_set_atomic(map, test->start, test->nr);
+        check_range(map, test->start, test->nr, true);
+    }
+    g_free(map);
+}
+
+static void test_test_and_clear_atomic(void)
+{
+    unsigned long *map = bitmap_new(BMAP_BITS);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ranges); i++) {
+        const RangeTest *test = &test_ranges[i];
+
+        /* a clean range reports nothing and leaves the rest alone */
+        bitmap_fill(map, BMAP_BITS);
+        bitmap_clear(map, test->start, test->nr);
+        g_assert(!bitmap_test_and_clear_atomic(map, test->start, test->nr));
+        check_range(map, test->start, test->nr, false);
+
+        /* one dirty bit at either end of the range is found and cleared */
+        bitmap_set(map, test->start, 1);
+        g_assert(bitmap_test_and_clear_atomic(map, test->start, test->nr));
+        bitmap_set(map, test->start + test->nr - 1, 1);
+        g_assert(bitmap_test_and_clear_atomic(map, test->start, test->nr));
+        g_assert(!bitmap_test_and_clear_atomic(map, test->start, test->nr));
+
+        bitmap_zero(map, BMAP_BITS);
+        bitmap_set(map, test->start, test->nr);
+        g_assert(bitmap_test_and_clear_atomic(map, test->start, test->nr));
+        g_assert(bitmap_empty(map, BMAP_BITS));
+    }
+    g_free(map);
+}
+
+static void test_zero_extend(void)
+{
+    unsigned long *map = bitmap_new(BITS_PER_LONG + 3);
+
+    bitmap_fill(map, BITS_PER_LONG + 3);
+    map = bitmap_zero_extend(map, BITS_PER_LONG + 3, BMAP_BITS);
+    check_range(map, 0, BITS_PER_LONG + 3, true);
+    g_free(map);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/bitmap/set_atomic", test_set_atomic);
+    g_test_add_func("/bitmap/test_and_clear_atomic",
+                    test_test_and_clear_atomic);
+    g_test_add_func("/bitmap/zero_extend", test_zero_extend);
+    return g_test_run();
+}
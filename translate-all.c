@@ -54,11 +54,15 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "exec/memory-internal.h"
+#include "sysemu/sysemu.h"
 #endif
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
+#include "exec/guest-profile.h"
 #include "qemu/timer.h"
+#include "qemu/bitmap.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -72,11 +76,19 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* Self modifying code is tracked in 64 byte lines: a write to a code page
+   that falls in a line without code does not invalidate anything.  */
+#define SMC_LINE_BITS           6
+#define SMC_LINES_PER_PAGE      (TARGET_PAGE_SIZE >> SMC_LINE_BITS)
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
+    /* lines of the page holding code, built on the first write */
+    unsigned long code_lines[BITS_TO_LONGS(SMC_LINES_PER_PAGE)];
+    bool code_lines_valid;
     /* in order to optimize self modifying code, we count the number
-       of lookups we do to a given page to use a bitmap */
+       of writes that hit a code line to use a byte bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
 #if defined(CONFIG_USER_ONLY)
@@ -123,7 +135,6 @@ TCGContext tcg_ctx;
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
-static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
 void cpu_gen_init(void)
 {
@@ -151,6 +162,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->tb_exec_count = tb->exec_count;
 
     gen_intermediate_code(env, tb);
 
@@ -207,6 +219,8 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->tb_exec_count = tb->exec_count;
+    s->persist = tb->persist;
 
     gen_intermediate_code_pc(env, tb);
 
@@ -489,6 +503,11 @@ static inline size_t size_code_gen_buffer(size_t tb_size)
            static buffer, we could size this on RESERVED_VA, on the text
            segment size of the executable, or continue to use the default.  */
         tb_size = (unsigned long)(ram_size / 4);
+        /* pages of the buffer are only committed once a region gets
+           used, so don't go below the default on small guests */
+        if (tb_size < DEFAULT_CODE_GEN_BUFFER_SIZE) {
+            tb_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+        }
 #endif
     }
     if (tb_size < MIN_CODE_GEN_BUFFER_SIZE) {
@@ -555,6 +574,50 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+/* Room left at the end of a region for the largest possible TB */
+#define TB_REGION_SLACK     (TCG_MAX_OP_SIZE * OPC_BUF_SIZE)
+/* Keep the room lost to the slack small */
+#define TB_REGION_MIN_SIZE  (16 * TB_REGION_SLACK)
+
+static void tb_regions_reset(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        ctx->regions[i].ptr = ctx->regions[i].start;
+        ctx->regions[i].nb_tbs = 0;
+        ctx->regions[i].generation = 0;
+    }
+    ctx->nb_tbs = 0;
+    ctx->cur_region = 0;
+    ctx->regions[0].generation = ++ctx->tb_generation;
+    tcg_ctx.code_gen_ptr = ctx->regions[0].start;
+}
+
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    uint8_t *buf_end = tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size;
+    int i, n;
+
+    n = tcg_ctx.code_gen_buffer_size / TB_REGION_MIN_SIZE;
+    n = MAX(1, MIN(n, TB_REGIONS_MAX));
+    ctx->nb_regions = n;
+    ctx->region_size = (tcg_ctx.code_gen_buffer_size / n) &
+                       ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->region_max_blocks = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->limit = (i == n - 1 ? buf_end : r->start + ctx->region_size) -
+                   TB_REGION_SLACK;
+        r->first_tb = i * ctx->region_max_blocks;
+    }
+    tb_regions_reset();
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -576,12 +639,11 @@ static inline void code_gen_alloc(size_t tb_size)
             tcg_ctx.code_gen_buffer_size - 1024;
     tcg_ctx.code_gen_buffer_size -= 1024;
 
-    tcg_ctx.code_gen_buffer_max_size = tcg_ctx.code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
             CODE_GEN_AVG_BLOCK_SIZE;
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -606,42 +668,53 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region. Return NULL
+   if the region has too many translation blocks or too much generated
+   code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= ctx->region_max_blocks ||
+        tcg_ctx.code_gen_ptr >= r->limit) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &ctx->tbs[r->first_tb + r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->persist = false;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
-        tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+    if (r->nb_tbs > 0 && tb == &ctx->tbs[r->first_tb + r->nb_tbs - 1]) {
+        tcg_ctx.code_gen_ptr = r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
+/* The code maps are rebuilt from the TB list on the next write.
+   code_write_count survives so that pages which keep being retranslated
+   still get a byte bitmap.  */
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
     if (p->code_bitmap) {
         g_free(p->code_bitmap);
         p->code_bitmap = NULL;
     }
-    p->code_write_count = 0;
+    p->code_lines_valid = false;
 }
 
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
@@ -658,6 +731,7 @@ static void page_flush_tb_1(int level, void **lp)
         for (i = 0; i < L2_SIZE; ++i) {
             pd[i].first_tb = NULL;
             invalidate_page_bitmap(pd + i);
+            pd[i].code_write_count = 0;
         }
     } else {
         void **pp = *lp;
@@ -694,7 +768,7 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_regions_reset();
 
     for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
         CPUArchState *env = cpu->env_ptr;
@@ -706,12 +780,43 @@ void tb_flush(CPUArchState *env1)
             CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
 }
 
+/* Move on to the next region of the code buffer, which is the oldest,
+   and drop the TBs it holds.  tb_phys_invalidate() unchains the jumps
+   into and out of each of them.  */
+static void tb_region_advance(CPUArchState *env)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int i;
+
+    if (ctx->nb_regions == 1) {
+        tb_flush(env);
+        return;
+    }
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs) {
+        for (i = 0; i < r->nb_tbs; i++) {
+            TranslationBlock *tb = &ctx->tbs[r->first_tb + i];
+
+            if (!tb->invalid) {
+                tb_phys_invalidate(tb, -1);
+            }
+        }
+        ctx->nb_tbs -= r->nb_tbs;
+        r->nb_tbs = 0;
+        ctx->tb_region_evict_count++;
+    }
+    r->ptr = r->start;
+    r->generation = ++ctx->tb_generation;
+    tcg_ctx.code_gen_ptr = r->start;
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -877,6 +982,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    tb->invalid = true;
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
@@ -907,35 +1013,614 @@ static inline void set_bits(uint8_t *tab, int start, int len)
     }
 }
 
-static void build_page_bitmap(PageDesc *p)
+/* mark the bytes of page 'n' of 'tb' in whichever code maps p has */
+static void page_mark_code(PageDesc *p, TranslationBlock *tb, int n)
 {
-    int n, tb_start, tb_end;
-    TranslationBlock *tb;
+    int tb_start, tb_end;
+
+    /* NOTE: this is subtle as a TB may span two physical pages */
+    if (n == 0) {
+        tb_start = tb->pc & ~TARGET_PAGE_MASK;
+        tb_end = tb_start + tb->size;
+        if (tb_end > TARGET_PAGE_SIZE) {
+            tb_end = TARGET_PAGE_SIZE;
+        }
+    } else {
+        tb_start = 0;
+        tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+    }
+    if (tb_end <= tb_start) {
+        return;
+    }
+    if (p->code_lines_valid) {
+        bitmap_set(p->code_lines, tb_start >> SMC_LINE_BITS,
+                   ((tb_end - 1) >> SMC_LINE_BITS) -
+                   (tb_start >> SMC_LINE_BITS) + 1);
+    }
+    if (p->code_bitmap) {
+        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+    }
+}
 
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+static void page_mark_all_code(PageDesc *p)
+{
+    TranslationBlock *tb;
+    int n;
 
     tb = p->first_tb;
     while (tb != NULL) {
         n = (uintptr_t)tb & 3;
         tb = (TranslationBlock *)((uintptr_t)tb & ~3);
-        /* NOTE: this is subtle as a TB may span two physical pages */
-        if (n == 0) {
-            /* NOTE: tb_end may be after the end of the page, but
-               it is not a problem */
-            tb_start = tb->pc & ~TARGET_PAGE_MASK;
-            tb_end = tb_start + tb->size;
-            if (tb_end > TARGET_PAGE_SIZE) {
-                tb_end = TARGET_PAGE_SIZE;
+        page_mark_code(p, tb, n);
+        tb = tb->page_next[n];
+    }
+}
+
+static void build_page_lines(PageDesc *p)
+{
+    uint8_t *code_bitmap = p->code_bitmap;
+
+    bitmap_zero(p->code_lines, SMC_LINES_PER_PAGE);
+    p->code_lines_valid = true;
+    p->code_bitmap = NULL;
+    page_mark_all_code(p);
+    p->code_bitmap = code_bitmap;
+}
+
+static void build_page_bitmap(PageDesc *p)
+{
+    bool code_lines_valid = p->code_lines_valid;
+
+    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    p->code_lines_valid = false;
+    page_mark_all_code(p);
+    p->code_lines_valid = code_lines_valid;
+}
+
+/* Persistent TB cache
+ *
+ * TBs translated from guest code that is the same on every run (the
+ * firmware and the kernel it loads) are saved to a file on exit, with
+ * the guest bytes they were translated from and the relocations of the
+ * host addresses embedded in their code.  On the next run such a TB is
+ * copied in from the cache instead of being translated, provided the
+ * guest bytes still match.  A cache file is only good for the binary
+ * that wrote it; the header records a hash of that executable.  Since
+ * its host code is run as is, the file must live in a directory that
+ * nobody but the user can write to.
+ */
+#if TCG_TARGET_HAS_persist && defined(USE_DIRECT_JUMP) && \
+    defined(CONFIG_LINUX) && !defined(CONFIG_USER_ONLY)
+
+#define TB_CACHE_MAGIC          0x43425451 /* "QTBC" */
+#define TB_CACHE_VERSION        2
+#define TB_CACHE_HASH_BITS      12
+#define TB_CACHE_HASH_SIZE      (1 << TB_CACHE_HASH_BITS)
+#define TB_CACHE_MAX_REGIONS    8
+
+extern const char __executable_start[];
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t exe_size;
+    uint64_t exe_hash;
+    uint32_t env_size;
+    uint32_t fingerprint_len;
+    uint32_t nb_entries;
+    uint32_t reserved;
+} TBCacheHeader;
+
+/* What is written to the file for each TB, followed by the relocations,
+   the host code and the guest code */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t phys_pc;
+    uint32_t icount;
+    uint32_t code_size;
+    uint32_t nb_relocs;
+    uint16_t size;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t reserved;
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    struct TBCacheEntry *next;
+    TBCacheRecord r;
+    uint8_t data[];
+} TBCacheEntry;
+
+static struct {
+    bool enabled;
+    char *path;
+    char *fingerprint;
+    uint64_t exe_size, exe_hash;
+    Notifier exit_notifier;
+    struct {
+        ram_addr_t start, end;
+    } regions[TB_CACHE_MAX_REGIONS];
+    int nb_regions;
+    TBCacheEntry *hash[TB_CACHE_HASH_SIZE];
+    unsigned int nb_entries;
+    /* statistics */
+    unsigned int nb_read, nb_hits, nb_stale, nb_recorded;
+} tb_cache;
+
+static size_t tb_cache_data_size(const TBCacheRecord *r)
+{
+    return r->nb_relocs * sizeof(TCGPersistReloc) + r->code_size + r->size;
+}
+
+/* a goto_tb slot is unused when its tb_next_offset is 0xffff */
+static bool tb_cache_jump_ok(const TBCacheRecord *r, int n)
+{
+    return r->tb_next_offset[n] == 0xffff ||
+           (r->tb_next_offset[n] <= r->code_size &&
+            r->tb_jmp_offset[n] + 4 <= r->code_size);
+}
+
+static inline TCGPersistReloc *tb_cache_relocs(TBCacheEntry *e)
+{
+    return (TCGPersistReloc *)e->data;
+}
+
+static inline uint8_t *tb_cache_code(TBCacheEntry *e)
+{
+    return e->data + e->r.nb_relocs * sizeof(TCGPersistReloc);
+}
+
+static inline uint8_t *tb_cache_guest(TBCacheEntry *e)
+{
+    return tb_cache_code(e) + e->r.code_size;
+}
+
+static inline unsigned int tb_cache_hash(tb_page_addr_t phys_pc)
+{
+    return (phys_pc ^ (phys_pc >> TB_CACHE_HASH_BITS)) &
+           (TB_CACHE_HASH_SIZE - 1);
+}
+
+static TBCacheEntry **tb_cache_find(target_ulong pc, target_ulong cs_base,
+                                    uint64_t flags, tb_page_addr_t phys_pc)
+{
+    TBCacheEntry **pe = &tb_cache.hash[tb_cache_hash(phys_pc)];
+
+    for (; *pe; pe = &(*pe)->next) {
+        TBCacheRecord *r = &(*pe)->r;
+        if (r->phys_pc == phys_pc && r->pc == pc &&
+            r->cs_base == cs_base && r->flags == flags) {
+            break;
+        }
+    }
+    return pe;
+}
+
+/* Add an entry, replacing any entry for the same TB */
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    TBCacheEntry **pe = tb_cache_find(e->r.pc, e->r.cs_base, e->r.flags,
+                                      e->r.phys_pc);
+
+    if (*pe) {
+        e->next = (*pe)->next;
+        g_free(*pe);
+    } else {
+        e->next = NULL;
+        tb_cache.nb_entries++;
+    }
+    *pe = e;
+}
+
+static bool tb_cache_usable(CPUArchState *env, TranslationBlock *tb,
+                            tb_page_addr_t phys_pc)
+{
+    int i;
+
+    if (!tb_cache.enabled || tb->cflags || tb->exec_count ||
+        ENV_GET_CPU(env)->singlestep_enabled ||
+        !QTAILQ_EMPTY(&env->breakpoints)) {
+        return false;
+    }
+    for (i = 0; i < tb_cache.nb_regions; i++) {
+        if (phys_pc >= tb_cache.regions[i].start &&
+            phys_pc < tb_cache.regions[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fill in tb from the cache, at tb->tc_ptr */
+static bool tb_cache_fill(CPUArchState *env, TranslationBlock *tb,
+                          tb_page_addr_t phys_pc, int *code_size)
+{
+    uint8_t *code = tb->tc_ptr;
+    TCGPersistReloc *relocs;
+    TBCacheEntry *e;
+    uint32_t i;
+
+    if (!tb->persist) {
+        return false;
+    }
+    e = *tb_cache_find(tb->pc, tb->cs_base, tb->flags, phys_pc);
+    if (!e) {
+        return false;
+    }
+    /* entries never cross a page, so this is all in one RAM block */
+    if (memcmp(qemu_get_ram_ptr(phys_pc), tb_cache_guest(e), e->r.size)) {
+        tb_cache.nb_stale++;
+        return false;
+    }
+
+    memcpy(code, tb_cache_code(e), e->r.code_size);
+    relocs = tb_cache_relocs(e);
+    for (i = 0; i < e->r.nb_relocs; i++) {
+        TCGPersistReloc *r = &relocs[i];
+        uint8_t *field = code + r->offset;
+        tcg_target_long value, disp;
+        int32_t disp32;
+
+        if (r->offset + (r->abs64 ? 8 : 4) > e->r.code_size) {
+            return false;
+        }
+        switch (r->base) {
+        case TCG_PERSIST_TEXT:
+            value = (tcg_target_long)__executable_start + r->addend;
+            break;
+        case TCG_PERSIST_PROLOGUE:
+            value = (tcg_target_long)tcg_ctx.code_gen_prologue + r->addend;
+            break;
+        case TCG_PERSIST_TB:
+            value = (tcg_target_long)tb + r->addend;
+            break;
+        default:
+            return false;
+        }
+        /* Only accept the code if it is what translating it here would
+           have produced, or cpu_restore_state would get lost in it.  */
+        if (r->abs64) {
+            if (r->branch) {
+                /* "movabs imm64, %r10" has a two byte opcode */
+                disp = value - (tcg_target_long)(field - 2) - 5;
+                if (disp == (int32_t)disp) {
+                    return false;
+                }
             }
+            memcpy(field, &value, sizeof(value));
         } else {
-            tb_start = 0;
-            tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
+            disp = value - (tcg_target_long)(field + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            disp32 = disp;
+            memcpy(field, &disp32, sizeof(disp32));
         }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
-        tb = tb->page_next[n];
     }
+
+    tb->size = e->r.size;
+    tb->icount = e->r.icount;
+    tb->tb_next_offset[0] = e->r.tb_next_offset[0];
+    tb->tb_next_offset[1] = e->r.tb_next_offset[1];
+    tb->tb_jmp_offset[0] = e->r.tb_jmp_offset[0];
+    tb->tb_jmp_offset[1] = e->r.tb_jmp_offset[1];
+    flush_icache_range((uintptr_t)code, (uintptr_t)code + e->r.code_size);
+    *code_size = e->r.code_size;
+    tb_cache.nb_hits++;
+    return true;
+}
+
+static void tb_cache_record_start(CPUArchState *env, TranslationBlock *tb,
+                                  tb_page_addr_t phys_pc)
+{
+    tcg_ctx.persist_record = tb->persist;
+    tcg_ctx.persist_failed = false;
+    tcg_ctx.persist_tb = (uintptr_t)tb;
+    tcg_ctx.nb_persist_relocs = 0;
+}
+
+static void tb_cache_record_end(TranslationBlock *tb, tb_page_addr_t phys_pc,
+                                int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    size_t relocs_size;
+    TBCacheEntry *e;
+
+    if (!s->persist_record) {
+        return;
+    }
+    s->persist_record = false;
+    if (s->persist_failed ||
+        (tb->pc & ~TARGET_PAGE_MASK) + tb->size > TARGET_PAGE_SIZE) {
+        return;
+    }
+
+    relocs_size = s->nb_persist_relocs * sizeof(TCGPersistReloc);
+    e = g_malloc(sizeof(*e) + relocs_size + code_size + tb->size);
+    memset(&e->r, 0, sizeof(e->r));
+    e->r.pc = tb->pc;
+    e->r.cs_base = tb->cs_base;
+    e->r.flags = tb->flags;
+    e->r.phys_pc = phys_pc;
+    e->r.icount = tb->icount;
+    e->r.code_size = code_size;
+    e->r.nb_relocs = s->nb_persist_relocs;
+    e->r.size = tb->size;
+    e->r.tb_next_offset[0] = tb->tb_next_offset[0];
+    e->r.tb_next_offset[1] = tb->tb_next_offset[1];
+    e->r.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->r.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+    memcpy(tb_cache_relocs(e), s->persist_relocs, relocs_size);
+    memcpy(tb_cache_code(e), tb->tc_ptr, code_size);
+    memcpy(tb_cache_guest(e), qemu_get_ram_ptr(phys_pc), tb->size);
+    tb_cache_insert(e);
+    tb_cache.nb_recorded++;
+}
+
+/* Hash the running executable, so that a cache written by any other
+   build is rejected even if it has the same size and timestamp.  */
+static bool tb_cache_hash_exe(uint64_t *size, uint64_t *hash)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;     /* FNV-1a, a word at a time */
+    uint64_t tail = 0;
+    const uint64_t *words;
+    struct stat st;
+    size_t i, n;
+    void *map;
+    int fd;
+
+    fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    words = map;
+    n = st.st_size / sizeof(*words);
+    for (i = 0; i < n; i++) {
+        h = (h ^ words[i]) * 0x100000001b3ULL;
+    }
+    memcpy(&tail, words + n, st.st_size % sizeof(*words));
+    h = (h ^ tail) * 0x100000001b3ULL;
+    munmap(map, st.st_size);
+
+    *size = st.st_size;
+    *hash = h;
+    return true;
+}
+
+/* The cache holds host code that is run without further checks, so
+   refuse a directory that anybody else could drop a file into.  */
+static bool tb_cache_check_dir(const char *path)
+{
+    char *dir = g_path_get_dirname(path);
+    struct stat st;
+    bool ok = false;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "tb-cache: %s: %s\n", dir, strerror(errno));
+    } else if (stat(dir, &st) < 0) {
+        fprintf(stderr, "tb-cache: %s: %s\n", dir, strerror(errno));
+    } else if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+               (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "tb-cache: %s must be a directory owned by and "
+                "only writable by the user\n", dir);
+    } else {
+        ok = true;
+    }
+    g_free(dir);
+    return ok;
 }
 
+static void tb_cache_make_header(TBCacheHeader *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = TB_CACHE_MAGIC;
+    h->version = TB_CACHE_VERSION;
+    h->exe_size = tb_cache.exe_size;
+    h->exe_hash = tb_cache.exe_hash;
+    h->env_size = sizeof(CPUArchState);
+    h->fingerprint_len = strlen(tb_cache.fingerprint);
+}
+
+static void tb_cache_read(void)
+{
+    TBCacheHeader h, fh;
+    const uint8_t *p, *end;
+    GError *err = NULL;
+    gchar *buf;
+    gsize len;
+
+    if (!g_file_get_contents(tb_cache.path, &buf, &len, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            fprintf(stderr, "tb-cache: %s\n", err->message);
+        }
+        g_error_free(err);
+        return;
+    }
+
+    tb_cache_make_header(&h);
+    p = (uint8_t *)buf;
+    end = p + len;
+    if (len < sizeof(fh)) {
+        goto bad;
+    }
+    memcpy(&fh, p, sizeof(fh));
+    p += sizeof(fh);
+    fh.nb_entries = 0;
+    h.nb_entries = 0;
+    if (memcmp(&h, &fh, sizeof(h)) || end - p < (ptrdiff_t)h.fingerprint_len ||
+        memcmp(p, tb_cache.fingerprint, h.fingerprint_len)) {
+        fprintf(stderr, "tb-cache: %s was written by another build or "
+                "machine, starting afresh\n", tb_cache.path);
+        g_free(buf);
+        return;
+    }
+    p += h.fingerprint_len;
+
+    while (p < end) {
+        TBCacheRecord r;
+        TBCacheEntry *e;
+        size_t size;
+
+        if (end - p < (ptrdiff_t)sizeof(r)) {
+            goto bad;
+        }
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+        size = tb_cache_data_size(&r);
+        if (end - p < (ptrdiff_t)size || r.size == 0 ||
+            (r.pc & ~TARGET_PAGE_MASK) + r.size > TARGET_PAGE_SIZE ||
+            r.code_size > TCG_MAX_OP_SIZE * OPC_BUF_SIZE ||
+            !tb_cache_jump_ok(&r, 0) || !tb_cache_jump_ok(&r, 1)) {
+            goto bad;
+        }
+        e = g_malloc(sizeof(*e) + size);
+        e->r = r;
+        memcpy(e->data, p, size);
+        p += size;
+        tb_cache_insert(e);
+        tb_cache.nb_read++;
+    }
+    g_free(buf);
+    return;
+
+bad:
+    fprintf(stderr, "tb-cache: %s is truncated or corrupt\n", tb_cache.path);
+    g_free(buf);
+}
+
+static void tb_cache_write(Notifier *n, void *data)
+{
+    TBCacheHeader h;
+    char *tmp;
+    bool failed;
+    FILE *f;
+    int fd, i;
+
+    tb_cache_make_header(&h);
+    h.nb_entries = tb_cache.nb_entries;
+
+    /* write to a new file so that a crash cannot leave a torn cache */
+    tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    unlink(tmp);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (!f) {
+        fprintf(stderr, "tb-cache: %s: %s\n", tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_free(tmp);
+        return;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(tb_cache.fingerprint, h.fingerprint_len, 1, f);
+    for (i = 0; i < TB_CACHE_HASH_SIZE; i++) {
+        TBCacheEntry *e;
+        for (e = tb_cache.hash[i]; e; e = e->next) {
+            fwrite(&e->r, sizeof(e->r), 1, f);
+            fwrite(e->data, tb_cache_data_size(&e->r), 1, f);
+        }
+    }
+    failed = ferror(f);
+    if (fclose(f) || failed || rename(tmp, tb_cache.path)) {
+        fprintf(stderr, "tb-cache: could not write %s\n", tb_cache.path);
+        unlink(tmp);
+    }
+    g_free(tmp);
+}
+
+void tb_cache_init(const char *path, const char *fingerprint)
+{
+    if (use_icount || singlestep) {
+        fprintf(stderr, "tb-cache: not used with -icount or -singlestep\n");
+        return;
+    }
+    if (!tb_cache_check_dir(path)) {
+        return;
+    }
+    if (!tb_cache_hash_exe(&tb_cache.exe_size, &tb_cache.exe_hash)) {
+        fprintf(stderr, "tb-cache: cannot read /proc/self/exe\n");
+        return;
+    }
+    tb_cache.path = g_strdup(path);
+    tb_cache.fingerprint = g_strdup(fingerprint);
+    tb_cache_read();
+
+    tb_cache.enabled = true;
+    tb_cache.exit_notifier.notify = tb_cache_write;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+}
+
+void tb_cache_add_region(uint64_t start, uint64_t size)
+{
+    assert(tb_cache.nb_regions < TB_CACHE_MAX_REGIONS);
+    tb_cache.regions[tb_cache.nb_regions].start = start;
+    tb_cache.regions[tb_cache.nb_regions].end = start + size;
+    tb_cache.nb_regions++;
+}
+
+static void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache.enabled) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache entries    %u (%u read, %u new)\n",
+                tb_cache.nb_entries, tb_cache.nb_read, tb_cache.nb_recorded);
+    cpu_fprintf(f, "TB cache hits       %u (%u stale)\n",
+                tb_cache.nb_hits, tb_cache.nb_stale);
+}
+
+#else
+
+static inline bool tb_cache_usable(CPUArchState *env, TranslationBlock *tb,
+                                   tb_page_addr_t phys_pc)
+{
+    return false;
+}
+
+void tb_cache_init(const char *path, const char *fingerprint)
+{
+    fprintf(stderr, "tb-cache: not supported on this host\n");
+}
+
+void tb_cache_add_region(uint64_t start, uint64_t size)
+{
+}
+
+static inline bool tb_cache_fill(CPUArchState *env, TranslationBlock *tb,
+                                 tb_page_addr_t phys_pc, int *code_size)
+{
+    return false;
+}
+
+static inline void tb_cache_record_start(CPUArchState *env,
+                                         TranslationBlock *tb,
+                                         tb_page_addr_t phys_pc)
+{
+}
+
+static inline void tb_cache_record_end(TranslationBlock *tb,
+                                       tb_page_addr_t phys_pc, int code_size)
+{
+}
+
+static inline void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -945,25 +1630,41 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
+    int64_t ti;
 
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* evict the oldest region */
+        tb_region_advance(env);
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
         tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
+    ti = get_clock();
     tc_ptr = tcg_ctx.code_gen_ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
-    cpu_gen_code(env, tb, &code_gen_size);
+    tb->exec_count = guest_profile_exec_counter(pc);
+    /* only TBs that may go to the cache pay for relocatable code; the
+       choice sticks to the TB so that retranslating it matches */
+    tb->persist = tb_cache_usable(env, tb, phys_pc);
+    tcg_ctx.persist = tb->persist;
+    if (!tb_cache_fill(env, tb, phys_pc, &code_gen_size)) {
+        tb_cache_record_start(env, tb, phys_pc);
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_cache_record_end(tb, phys_pc, code_gen_size);
+    }
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region].ptr =
+        tcg_ctx.code_gen_ptr;
+    tcg_ctx.tb_ctx.tb_translations++;
+    tcg_ctx.tb_ctx.tb_translate_ns += get_clock() - ti;
+    guest_profile_tb_generated(tb, code_gen_size);
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1098,6 +1799,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
         invalidate_page_bitmap(p);
+        p->code_write_count = 0;
         if (is_cpu_write_access) {
             tlb_unprotect_code_phys(env, start, env->mem_io_vaddr);
         }
@@ -1115,35 +1817,84 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
 }
 
+/* Guest code that keeps invalidating TBs, keyed by the start of the TB
+   doing the writes.  Only updated on writes that really hit code.  */
+#define SMC_WRITERS_SIZE        256
+#define SMC_WRITERS_PROBE       8
+
+typedef struct SMCWriter {
+    target_ulong pc;
+    tb_page_addr_t last_addr;
+    uint64_t count;
+} SMCWriter;
+
+static SMCWriter smc_writers[SMC_WRITERS_SIZE];
+static uint64_t smc_writers_dropped;
+
+static void smc_record_writer(tb_page_addr_t addr)
+{
+    CPUArchState *env;
+    TranslationBlock *tb;
+    unsigned int h, i;
+
+    if (!current_cpu) {
+        return;
+    }
+    env = current_cpu->env_ptr;
+    tb = env->mem_io_pc ? tb_find_pc(env->mem_io_pc) : NULL;
+    if (!tb) {
+        smc_writers_dropped++;
+        return;
+    }
+    h = tb_jmp_cache_hash_func(tb->pc);
+    for (i = 0; i < SMC_WRITERS_PROBE; i++) {
+        SMCWriter *w = &smc_writers[(h + i) % SMC_WRITERS_SIZE];
+
+        if (w->count == 0 || w->pc == tb->pc) {
+            w->pc = tb->pc;
+            w->last_addr = addr;
+            w->count++;
+            return;
+        }
+    }
+    smc_writers_dropped++;
+}
+
 /* len must be <= 8 and start must be a multiple of len */
 void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
     PageDesc *p;
     int offset, b;
 
-#if 0
-    if (1) {
-        qemu_log("modifying code at 0x%x size=%d EIP=%x PC=%08x\n",
-                  cpu_single_env->mem_io_vaddr, len,
-                  cpu_single_env->eip,
-                  cpu_single_env->eip +
-                  (intptr_t)cpu_single_env->segs[R_CS].base);
-    }
-#endif
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
         return;
     }
+    tcg_ctx.tb_ctx.smc_writes++;
+    if (!p->first_tb) {
+        /* let the slow path drop the write protection */
+        tb_invalidate_phys_page_range(start, start + len, 1);
+        return;
+    }
+    if (!p->code_lines_valid) {
+        build_page_lines(p);
+    }
+    /* an aligned write of up to 8 bytes never crosses a line */
+    offset = start & ~TARGET_PAGE_MASK;
+    if (!test_bit(offset >> SMC_LINE_BITS, p->code_lines)) {
+        tcg_ctx.tb_ctx.smc_line_skips++;
+        return;
+    }
     if (p->code_bitmap) {
-        offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
+        if (!(b & ((1 << len) - 1))) {
+            tcg_ctx.tb_ctx.smc_byte_skips++;
+            return;
         }
-    } else {
-    do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tcg_ctx.tb_ctx.smc_invalidations++;
+    smc_record_writer(start);
+    tb_invalidate_phys_page_range(start, start + len, 1);
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1232,7 +1983,7 @@ static inline void tb_alloc_page(TranslationBlock *tb,
     page_already_protected = p->first_tb != NULL;
 #endif
     p->first_tb = (TranslationBlock *)((uintptr_t)tb | n);
-    invalidate_page_bitmap(p);
+    page_mark_code(p, tb, n);
 
 #if defined(TARGET_HAS_SMC) || 1
 
@@ -1332,25 +2083,35 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    TranslationBlock *tbs;
     int m_min, m_max, m;
+    size_t region;
     uintptr_t v;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    /* a TB never crosses into the next region */
+    region = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    r = &ctx->regions[MIN(region, (size_t)ctx->nb_regions - 1)];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)r->ptr) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    tbs = &ctx->tbs[r->first_tb];
+    if (tc_ptr < (uintptr_t)tbs[0].tc_ptr) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1360,7 +2121,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1503,8 +2264,12 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int64_t now = get_clock();
+    double secs = ctx->jit_info_time ? (now - ctx->jit_info_time) / 1e9 : 0;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -1512,27 +2277,45 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        code_size += r->ptr - r->start;
+        for (j = 0; j < r->nb_tbs; j++) {
+            tb = &ctx->tbs[r->first_tb + j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd (%d%%)\n",
+                code_size, tcg_ctx.code_gen_buffer_size,
+                (int)(code_size * 100 / tcg_ctx.code_gen_buffer_size));
+    cpu_fprintf(f, "regions             %d x %zd KB\n",
+                ctx->nb_regions, ctx->region_size / 1024);
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        if (!r->generation) {
+            continue;
+        }
+        cpu_fprintf(f, "  %c%d  generation %-6u %6td KB  %d TBs\n",
+                    i == ctx->cur_region ? '*' : ' ', i, r->generation,
+                    (r->ptr - r->start) / 1024, r->nb_tbs);
+    }
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1540,12 +2323,10 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
+            tcg_ctx.tb_ctx.nb_tbs ? (ptrdiff_t)code_size /
                                      tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+                target_code_size ? (double)code_size /
+                                   target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1558,12 +2339,98 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                         tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "region evictions    %d\n", ctx->tb_region_evict_count);
+    cpu_fprintf(f, "TBs generated       %" PRIu64 " in %" PRId64 " ms "
+                "(avg %" PRId64 " us)\n", ctx->tb_translations,
+                (int64_t)(ctx->tb_translate_ns / 1000000),
+                ctx->tb_translations ?
+                (int64_t)(ctx->tb_translate_ns / ctx->tb_translations / 1000)
+                : 0);
+    cpu_fprintf(f, "cpu_exec TB lookups %" PRIu64 "\n",
+                tcg_ctx.tb_ctx.tb_exec_lookups);
+    cpu_fprintf(f, "indirect jumps      %" PRIu64 " (%d%% found inline)\n",
+                tcg_ctx.tb_ctx.tb_indirect_lookups,
+                tcg_ctx.tb_ctx.tb_indirect_lookups ?
+                (int)(tcg_ctx.tb_ctx.tb_indirect_hits * 100 /
+                      tcg_ctx.tb_ctx.tb_indirect_lookups) : 0);
+    /* every indirect jump found inline is a trip through cpu_exec()
+       that TBs ending in exit_tb(0) would have made */
+    if (secs > 0) {
+        uint64_t exec = ctx->tb_exec_lookups - ctx->jit_info_exec_lookups;
+        uint64_t hits = ctx->tb_indirect_hits - ctx->jit_info_indirect_hits;
+
+        cpu_fprintf(f, "over the last %.1f s: %.0f cpu_exec lookups/s, "
+                    "%.0f/s without inline lookup\n", secs,
+                    exec / secs, (exec + hits) / secs);
+    }
+    ctx->jit_info_time = now;
+    ctx->jit_info_exec_lookups = ctx->tb_exec_lookups;
+    ctx->jit_info_indirect_hits = ctx->tb_indirect_hits;
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+static int smc_writer_cmp(const void *a, const void *b)
+{
+    const SMCWriter *wa = a, *wb = b;
+
+    return wa->count < wb->count ? 1 : wa->count > wb->count ? -1 : 0;
+}
+
+/* Rates are computed over the time since the previous call */
+void dump_smc_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    static int64_t last_time;
+    static uint64_t last_writes, last_invalidations;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    SMCWriter sorted[SMC_WRITERS_SIZE];
+    int64_t now = get_clock();
+    double secs = last_time ? (now - last_time) / 1e9 : 0;
+    int i, n;
+
+    cpu_fprintf(f, "writes to code pages  %" PRIu64 "\n", ctx->smc_writes);
+    cpu_fprintf(f, "  skipped (line)      %" PRIu64 "\n",
+                ctx->smc_line_skips);
+    cpu_fprintf(f, "  skipped (byte)      %" PRIu64 "\n",
+                ctx->smc_byte_skips);
+    cpu_fprintf(f, "  invalidating        %" PRIu64 "\n",
+                ctx->smc_invalidations);
+    if (secs > 0) {
+        cpu_fprintf(f, "over the last %.1f s: %.0f writes/s, "
+                    "%.0f invalidations/s\n", secs,
+                    (ctx->smc_writes - last_writes) / secs,
+                    (ctx->smc_invalidations - last_invalidations) / secs);
+    }
+    last_time = now;
+    last_writes = ctx->smc_writes;
+    last_invalidations = ctx->smc_invalidations;
+
+    n = 0;
+    for (i = 0; i < SMC_WRITERS_SIZE; i++) {
+        if (smc_writers[i].count) {
+            sorted[n++] = smc_writers[i];
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+    qsort(sorted, n, sizeof(sorted[0]), smc_writer_cmp);
+    cpu_fprintf(f, "\ninvalidating writers "
+                "(TB start, last address written, count):\n");
+    for (i = 0; i < n && i < 16; i++) {
+        cpu_fprintf(f, "  " TARGET_FMT_lx "  " TARGET_FMT_lx
+                    "  %" PRIu64 "\n", sorted[i].pc,
+                    (target_ulong)sorted[i].last_addr, sorted[i].count);
+    }
+    if (smc_writers_dropped) {
+        cpu_fprintf(f, "  (%" PRIu64 " writes not attributed)\n",
+                    smc_writers_dropped);
+    }
+}
+
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
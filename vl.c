@@ -439,6 +439,23 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mediaboard_filesystem",
             .type = QEMU_OPT_STRING,
             .help = "Chihiro mediaboard filesystem file",
+        },{
+            .name = "hdd_base",
+            .type = QEMU_OPT_STRING,
+            .help = "Xbox HDD base image, used read-only under an overlay",
+        },{
+            .name = "hdd_overlay_dir",
+            .type = QEMU_OPT_STRING,
+            .help = "Directory for the Xbox HDD overlay, e.g. on tmpfs",
+        },{
+            .name = "hdd_discard_cache",
+            .type = QEMU_OPT_BOOL,
+            .help = "Discard the Xbox HDD cache partitions on every boot",
+        },{
+            .name = "tb_cache",
+            .type = QEMU_OPT_STRING,
+            .help = "File to keep Xbox BIOS and kernel translations in, "
+                    "in a directory only the user can write to",
         },
         { /* End of list */ }
     },